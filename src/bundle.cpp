@@ -0,0 +1,438 @@
+#include "bundle.h"
+#include "util.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+/* 文件的修改时间，纳秒 */
+static uint64_t stat_mtime_ns(const struct stat &st)
+{
+    return (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+RtpBundle::RtpBundle()
+{
+    for (int i = 0; i < RTP_BUNDLE_FDS; i++)
+    {
+        cache_fd[i] = -1;
+    }
+    // 头在finish时填，先占个位置
+    manifest.resize(sizeof(RtpBundleHeader));
+}
+
+RtpBundle::~RtpBundle()
+{
+    for (int i = 0; i < RTP_BUNDLE_FDS; i++)
+    {
+        if (cache_fd[i] != -1)
+        {
+            close(cache_fd[i]);
+        }
+    }
+}
+
+/* 把path作为name加进清单，目录按文件名排序递归加入，符号链接等其他类型跳过 */
+int RtpBundle::add_entry(const string &path, const string &name)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) == -1)
+    {
+        LOG_DEBUG("RtpBundle lstat() failed for %s\n", path.c_str());
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+    {
+        LOG_DEBUG("RtpBundle skipping %s, not a regular file or directory\n", path.c_str());
+        return 0;
+    }
+    if (name.size() > RTP_BUNDLE_NAME_MAX)
+    {
+        LOG_DEBUG("RtpBundle name too long: %s\n", name.c_str());
+        return -1;
+    }
+    RtpBundleEntry entry;
+    entry.size = S_ISREG(st.st_mode) ? st.st_size : 0;
+    entry.mtime = stat_mtime_ns(st);
+    entry.mode = st.st_mode;
+    entry.name_len = name.size();
+    manifest.insert(manifest.end(), (char *)&entry, (char *)&entry + sizeof(entry));
+    manifest.insert(manifest.end(), name.begin(), name.end());
+    count++;
+    if (S_ISREG(st.st_mode))
+    {
+        if (entry.size > 0)
+        {
+            files.push_back({path, total, entry.size}); // 偏移先从清单末尾算起，finish时加上清单长度
+            total += entry.size;
+        }
+        return 0;
+    }
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr)
+    {
+        LOG_DEBUG("RtpBundle opendir() failed for %s\n", path.c_str());
+        return -1;
+    }
+    vector<string> children;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != nullptr)
+    {
+        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+        {
+            children.push_back(ent->d_name);
+        }
+    }
+    closedir(dir);
+    sort(children.begin(), children.end()); // 同样的目录得到同样的清单，续传时才对得上
+    for (const string &child : children)
+    {
+        if (add_entry(path + "/" + child, name + "/" + child) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int RtpBundle::add(const char *path)
+{
+    string p(path);
+    while (p.size() > 1 && p.back() == '/')
+    {
+        p.pop_back();
+    }
+    size_t slash = p.rfind('/');
+    string name = slash == string::npos ? p : p.substr(slash + 1);
+    if (name.empty() || name == "." || name == "..")
+    {
+        LOG_DEBUG("RtpBundle cannot name %s on the receiver\n", path);
+        return -1;
+    }
+    return add_entry(p, name);
+}
+
+void RtpBundle::finish()
+{
+    RtpBundleHeader header;
+    header.magic = RTP_BUNDLE_MAGIC;
+    header.count = count;
+    header.manifest_len = manifest.size();
+    memcpy(manifest.data(), &header, sizeof(header));
+    ends.clear();
+    for (File &file : files)
+    {
+        file.offset += manifest.size();
+        ends.push_back(file.offset + file.size);
+    }
+    total += manifest.size();
+}
+
+uint64_t RtpBundle::fingerprint() const
+{
+    // FNV-1a，清单里有每个文件的大小和修改时间
+    uint64_t hash = 0xcbf29ce484222325;
+    for (char c : manifest)
+    {
+        hash = (hash ^ (uint8_t)c) * 0x100000001b3;
+    }
+    return hash;
+}
+
+/* 第index个文件的fd，缓存最近用过的几个 */
+int RtpBundle::file_fd(size_t index)
+{
+    for (int i = 0; i < RTP_BUNDLE_FDS; i++)
+    {
+        if (cache_fd[i] != -1 && cache_file[i] == index)
+        {
+            return cache_fd[i];
+        }
+    }
+    int fd = open(files[index].path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        LOG_DEBUG("RtpBundle failed to open %s\n", files[index].path.c_str());
+        return -1;
+    }
+    int slot = cache_next;
+    cache_next = (cache_next + 1) % RTP_BUNDLE_FDS;
+    if (cache_fd[slot] != -1)
+    {
+        close(cache_fd[slot]);
+    }
+    cache_fd[slot] = fd;
+    cache_file[slot] = index;
+    return fd;
+}
+
+int RtpBundle::read(char *buf, uint32_t len, uint64_t offset)
+{
+    while (len > 0)
+    {
+        uint32_t n;
+        if (offset < manifest.size())
+        {
+            n = min<uint64_t>(len, manifest.size() - offset);
+            memcpy(buf, manifest.data() + offset, n);
+        }
+        else
+        {
+            size_t index = upper_bound(ends.begin(), ends.end(), offset) - ends.begin();
+            if (index == files.size())
+            {
+                return -1; // 超出数据流末尾
+            }
+            const File &file = files[index];
+            n = min<uint64_t>(len, file.offset + file.size - offset);
+            int fd = file_fd(index);
+            if (fd == -1 || pread(fd, buf, n, offset - file.offset) != n)
+            {
+                LOG_DEBUG("RtpBundle failed to read %s, changed while sending?\n", file.path.c_str());
+                return -1;
+            }
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* 清单里的相对路径只能落在输出目录里面 */
+static bool safe_name(const string &name)
+{
+    if (name.empty() || name[0] == '/')
+    {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= name.size())
+    {
+        size_t end = name.find('/', start);
+        if (end == string::npos)
+        {
+            end = name.size();
+        }
+        string part = name.substr(start, end - start);
+        if (part.empty() || part == "." || part == "..")
+        {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+/* 在目录root下按name一级一级往下走，每一级都不跟随符号链接，
+ * 成功返回最后一级所在目录的fd，leaf为最后一级的名字，失败返回-1
+ * 清单里先出现的目录已经建好，对方或者本地预先放好的符号链接不会把文件写到root外面 */
+static int open_parent(int root, const string &name, string &leaf)
+{
+    int cur = dup(root);
+    size_t start = 0;
+    size_t end;
+    while (cur != -1 && (end = name.find('/', start)) != string::npos)
+    {
+        int next = openat(cur, name.substr(start, end - start).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        close(cur);
+        cur = next;
+        start = end + 1;
+    }
+    leaf = name.substr(start);
+    return cur;
+}
+
+/* 把in从offset开始的size字节拷贝到out的开头，内核支持时不经过用户态 */
+static int copy_range(int in, uint64_t offset, int out, uint64_t size)
+{
+    loff_t off_in = offset, off_out = 0;
+    while (size > 0)
+    {
+        ssize_t n = copy_file_range(in, &off_in, out, &off_out, size, 0);
+        if (n > 0)
+        {
+            size -= n;
+            continue;
+        }
+        if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+        {
+            break; // 跨文件系统或者内核不支持，下面用pread/pwrite
+        }
+        return -1;
+    }
+    if (size == 0)
+    {
+        return 0;
+    }
+    static const size_t chunk = 1 << 20;
+    char *buf = (char *)malloc(chunk);
+    if (buf == nullptr)
+    {
+        return -1;
+    }
+    while (size > 0)
+    {
+        ssize_t n = pread(in, buf, min<uint64_t>(size, chunk), off_in);
+        if (n <= 0 || pwrite(out, buf, n, off_out) != n)
+        {
+            free(buf);
+            return -1;
+        }
+        off_in += n;
+        off_out += n;
+        size -= n;
+    }
+    free(buf);
+    return 0;
+}
+
+/* 按清单把spool里从manifest_len开始的内容拆到root下面，建好的目录记在dirs里，成功返回0失败返回-1 */
+static int extract_entries(int fd, uint64_t spool_size, const vector<char> &manifest, int root,
+                           vector<pair<string, mode_t>> &dirs, uint32_t &files, uint64_t &bytes)
+{
+    RtpBundleHeader header;
+    memcpy(&header, manifest.data(), sizeof(header));
+    size_t pos = sizeof(header);
+    uint64_t data = header.manifest_len;
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        RtpBundleEntry entry;
+        if (pos + sizeof(entry) > manifest.size())
+        {
+            break;
+        }
+        memcpy(&entry, manifest.data() + pos, sizeof(entry));
+        pos += sizeof(entry);
+        if (pos + entry.name_len > manifest.size())
+        {
+            break;
+        }
+        string name(manifest.data() + pos, entry.name_len);
+        pos += entry.name_len;
+        if (!safe_name(name) || data + entry.size > spool_size)
+        {
+            LOG_DEBUG("RtpBundle::extract bad entry %s\n", name.c_str());
+            return -1;
+        }
+        string leaf;
+        int parent = open_parent(root, name, leaf);
+        if (parent == -1)
+        {
+            LOG_DEBUG("RtpBundle::extract failed to open the directory of %s\n", name.c_str());
+            return -1;
+        }
+        if (S_ISDIR(entry.mode))
+        {
+            struct stat st;
+            if ((mkdirat(parent, leaf.c_str(), 0700) == -1 && errno != EEXIST) ||
+                fstatat(parent, leaf.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISDIR(st.st_mode))
+            {
+                LOG_DEBUG("RtpBundle::extract failed to create %s\n", name.c_str());
+                close(parent);
+                return -1;
+            }
+            close(parent);
+            dirs.emplace_back(name, entry.mode & 0777); // 不带setuid/setgid/sticky
+            continue; // 目录的修改时间会被里面的文件改掉，不恢复
+        }
+        int out = openat(parent, leaf.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, entry.mode & 0777);
+        close(parent);
+        if (out == -1 || copy_range(fd, data, out, entry.size) == -1)
+        {
+            LOG_DEBUG("RtpBundle::extract failed to write %s\n", name.c_str());
+            if (out != -1)
+            {
+                close(out);
+            }
+            return -1;
+        }
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = entry.mtime / 1000000000;
+        times[1].tv_nsec = entry.mtime % 1000000000;
+        futimens(out, times);
+        close(out);
+        data += entry.size;
+        bytes += entry.size;
+        files++;
+    }
+    if (pos != manifest.size())
+    {
+        LOG_DEBUG("RtpBundle::extract manifest is truncated\n");
+        return -1;
+    }
+    return 0;
+}
+
+int RtpBundle::extract(const char *spool, const char *dir)
+{
+    int fd = open(spool, O_RDONLY);
+    if (fd == -1)
+    {
+        LOG_DEBUG("RtpBundle::extract failed to open %s\n", spool);
+        return -1;
+    }
+    struct stat st;
+    RtpBundleHeader header;
+    if (fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != RTP_BUNDLE_MAGIC || header.manifest_len < sizeof(header) || header.manifest_len > (uint64_t)st.st_size)
+    {
+        LOG_DEBUG("RtpBundle::extract %s is not a bundle\n", spool);
+        close(fd);
+        return -1;
+    }
+    vector<char> manifest(header.manifest_len);
+    if (pread(fd, manifest.data(), manifest.size(), 0) != (ssize_t)manifest.size() ||
+        (mkdir(dir, 0755) == -1 && errno != EEXIST))
+    {
+        LOG_DEBUG("RtpBundle::extract failed to read manifest or create %s\n", dir);
+        close(fd);
+        return -1;
+    }
+    int root = open(dir, O_RDONLY | O_DIRECTORY);
+    if (root == -1)
+    {
+        LOG_DEBUG("RtpBundle::extract failed to open %s\n", dir);
+        close(fd);
+        return -1;
+    }
+    // 目录先用0700建，里面的文件都写完之后再设成清单里的权限，不然只读的目录里什么也建不了
+    vector<pair<string, mode_t>> dirs;
+    uint32_t files = 0;
+    uint64_t bytes = 0;
+    int ret = extract_entries(fd, st.st_size, manifest, root, dirs, files, bytes);
+    close(fd);
+    // 子目录在父目录后面，倒着设置，父目录变成只读时子目录已经设好了
+    for (auto it = dirs.rbegin(); it != dirs.rend(); ++it)
+    {
+        string leaf;
+        int parent = open_parent(root, it->first, leaf);
+        int sub = parent == -1 ? -1 : openat(parent, leaf.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (sub == -1 || fchmod(sub, it->second) == -1)
+        {
+            LOG_DEBUG("RtpBundle::extract failed to set the mode of %s\n", it->first.c_str());
+        }
+        if (sub != -1)
+        {
+            close(sub);
+        }
+        if (parent != -1)
+        {
+            close(parent);
+        }
+    }
+    close(root);
+    if (ret == -1)
+    {
+        return -1;
+    }
+    unlink(spool);
+    LOG_MSG("Extracted %u files (%lu Bytes) into %s\n", files, bytes, dir);
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef __BUNDLE_H
+#define __BUNDLE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define RTP_BUNDLE_MAGIC 0x42505452 // "RTPB"
+#define RTP_BUNDLE_SUFFIX ".rtpb"   // 接收方先把整个包收进输出目录名加上这个后缀的文件，再拆开
+#define RTP_BUNDLE_FDS 4            // 发送方同时打开的文件数，重传时不用反复open
+#define RTP_BUNDLE_NAME_MAX 4096    // 清单里一个相对路径的最大长度
+
+/* 一次传多个文件时数据流的开头，后面跟着count个RtpBundleEntry，
+ * 清单之后是各个文件的内容，按清单的顺序首尾相接，小文件挤在同一个包里 */
+typedef struct __attribute__((__packed__)) RtpBundleHeader
+{
+    uint32_t magic;
+    uint32_t count;        // 清单里的项数
+    uint64_t manifest_len; // 包括这个头在内的清单长度，也是第一个文件内容的偏移
+} rtp_bundle_header_t;
+
+/* 清单里的一项，后面跟着name_len字节的相对路径，不以0结尾
+ * 目录在它里面的文件之前出现 */
+typedef struct __attribute__((__packed__)) RtpBundleEntry
+{
+    uint64_t size;     // 文件大小，目录为0
+    uint64_t mtime;    // 修改时间(ns)
+    uint32_t mode;     // st_mode，只有目录和普通文件
+    uint16_t name_len;
+} rtp_bundle_entry_t;
+
+/* 发送方：把若干文件和目录拼成一个连续的数据流，
+ * 包里的数据按偏移从清单或者对应的文件里pread，不拷贝成临时文件 */
+class RtpBundle
+{
+private:
+    struct File
+    {
+        std::string path; // 发送方本地的路径
+        uint64_t offset;  // 内容在数据流里的偏移
+        uint64_t size;
+    };
+    std::vector<char> manifest;
+    uint32_t count = 0;
+    std::vector<File> files;  // 非空的普通文件，按偏移排列
+    std::vector<uint64_t> ends; // files里每个文件内容的结束偏移，用来二分查找
+    uint64_t total = 0;
+    int cache_fd[RTP_BUNDLE_FDS];
+    size_t cache_file[RTP_BUNDLE_FDS];
+    int cache_next = 0;
+
+    int add_entry(const std::string &path, const std::string &name);
+    int file_fd(size_t index);
+
+public:
+    RtpBundle();
+    ~RtpBundle();
+    RtpBundle(const RtpBundle &) = delete;
+    RtpBundle &operator=(const RtpBundle &) = delete;
+
+    /* 加入一个文件，或者递归加入一个目录，在接收方的路径为它的文件名，成功返回0失败返回-1 */
+    int add(const char *path);
+    /* 加完之后生成清单 */
+    void finish();
+    uint64_t size() const { return total; }  // 整个数据流的大小
+    uint32_t entries() const { return count; }
+    uint64_t fingerprint() const;            // 清单的散列，续传时当作修改时间，文件有变化时会不一样
+    /* 读数据流里从offset开始的len字节，文件变短了返回-1 */
+    int read(char *buf, uint32_t len, uint64_t offset);
+
+    /* 接收方：把收到的数据流spool拆到目录dir里，成功后删掉spool，成功返回0失败返回-1 */
+    static int extract(const char *spool, const char *dir);
+};
+
+#endif // __BUNDLE_H
@@ -0,0 +1,280 @@
+#include "cc.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+using namespace std;
+
+CongestionControl *cc_create(const char *name)
+{
+    if (name == nullptr || strcmp(name, "reno") == 0)
+    {
+        return new RenoCc();
+    }
+    if (strcmp(name, "cubic") == 0)
+    {
+        return new CubicCc();
+    }
+    if (strcmp(name, "bbr") == 0)
+    {
+        return new BbrCc();
+    }
+    return nullptr;
+}
+
+/* Reno */
+
+void RenoCc::on_ack(const CcAck &ack)
+{
+    if (ack.in_recovery)
+    {
+        return; // 退出快速恢复，窗口保持在ssthresh
+    }
+    if (cwnd < ssthresh)
+    {
+        // Slow Start，一个ACK确认了几个包就加几
+        cwnd = min(cwnd + ack.acked, max(ssthresh, cwnd + 1.0));
+    }
+    else
+    {
+        // linear growth
+        cwnd += ack.acked / cwnd;
+    }
+}
+
+void RenoCc::on_loss(int64_t now_us)
+{
+    ssthresh = max(cwnd / 2.0, RTP_CC_MIN_CWND);
+    cwnd = ssthresh;
+}
+
+void RenoCc::on_timeout(int64_t now_us)
+{
+    ssthresh = max(cwnd / 2.0, RTP_CC_MIN_CWND);
+    cwnd = 1.0;
+}
+
+/* CUBIC */
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+/* 每轮至少8个样本后，这一轮的最小RTT比上一轮大出[4ms, 16ms]范围内的1/8时
+ * 认为队列开始堆积，退出慢启动 */
+void CubicCc::hystart_update(const CcAck &ack)
+{
+    delivered += ack.acked;
+    if (ack.rtt_us > 0)
+    {
+        round_min_rtt = round_min_rtt == 0 ? ack.rtt_us : min(round_min_rtt, ack.rtt_us);
+        round_samples++;
+    }
+    if (round_samples >= 8 && last_round_min_rtt > 0)
+    {
+        int64_t thresh = min<int64_t>(max<int64_t>(last_round_min_rtt / 8, 4000), 16000);
+        if (round_min_rtt >= last_round_min_rtt + thresh)
+        {
+            ssthresh = cwnd;
+            return;
+        }
+    }
+    if (delivered >= round_end)
+    {
+        if (round_samples > 0)
+        {
+            last_round_min_rtt = round_min_rtt;
+        }
+        round_min_rtt = 0;
+        round_samples = 0;
+        round_end = delivered + ack.inflight;
+    }
+}
+
+void CubicCc::on_ack(const CcAck &ack)
+{
+    if (ack.in_recovery)
+    {
+        return;
+    }
+    if (cwnd < ssthresh)
+    {
+        cwnd += ack.acked;
+        hystart_update(ack);
+        return;
+    }
+    if (epoch_start == 0)
+    {
+        epoch_start = ack.now_us;
+        if (cwnd < w_max)
+        {
+            k = cbrt((w_max - cwnd) / CUBIC_C);
+            origin = w_max;
+        }
+        else
+        {
+            k = 0;
+            origin = cwnd;
+        }
+        w_est = cwnd;
+    }
+    // 用下一个RTT之后的目标窗口决定现在的增长速度
+    double t = (ack.now_us - epoch_start + ack.min_rtt_us) / 1e6;
+    double target = origin + CUBIC_C * (t - k) * (t - k) * (t - k);
+    target = min(target, cwnd * 1.5);
+    if (target > cwnd)
+    {
+        cwnd += (target - cwnd) / cwnd * ack.acked;
+    }
+    else
+    {
+        cwnd += 0.01 * ack.acked / cwnd;
+    }
+    // TCP友好区域
+    w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * ack.acked / cwnd;
+    cwnd = max(cwnd, w_est);
+}
+
+void CubicCc::on_loss(int64_t now_us)
+{
+    epoch_start = 0;
+    // fast convergence：窗口比上次丢包时还小，说明有新的流加入，多让出一些
+    w_max = cwnd < w_max ? cwnd * (1 + CUBIC_BETA) / 2 : cwnd;
+    cwnd = max(cwnd * CUBIC_BETA, RTP_CC_MIN_CWND);
+    ssthresh = cwnd;
+}
+
+void CubicCc::on_timeout(int64_t now_us)
+{
+    on_loss(now_us);
+    cwnd = 1.0;
+    round_min_rtt = last_round_min_rtt = 0;
+    round_samples = 0;
+    round_end = delivered;
+}
+
+/* BBR */
+
+#define BBR_HIGH_GAIN 2.885 // 2/ln2，STARTUP每轮翻倍
+static const double bbr_cycle_gain[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+#define BBR_CYCLE_LEN (sizeof(bbr_cycle_gain) / sizeof(bbr_cycle_gain[0]))
+
+BbrCc::BbrCc() : pacing_gain(BBR_HIGH_GAIN), cwnd_gain(BBR_HIGH_GAIN) {}
+
+void BbrCc::enter_probe_bw(int64_t now_us)
+{
+    mode = BBR_PROBE_BW;
+    cwnd_gain = 2.0;
+    cycle_index = 1; // 从0.75开始，先排掉STARTUP多出来的队列
+    cycle_stamp = now_us;
+    pacing_gain = bbr_cycle_gain[cycle_index];
+}
+
+void BbrCc::on_ack(const CcAck &ack)
+{
+    int64_t now = ack.now_us;
+    delivered += ack.acked;
+    bool round_start = false;
+    if (delivered >= round_end)
+    {
+        round_end = delivered + ack.inflight;
+        round_count++;
+        round_start = true;
+        bw_rounds[round_count % RTP_BBR_BW_ROUNDS] = 0;
+    }
+    // 瓶颈带宽：最近RTP_BBR_BW_ROUNDS轮投递速率的最大值
+    double &slot = bw_rounds[round_count % RTP_BBR_BW_ROUNDS];
+    slot = max(slot, ack.delivery_rate);
+    btl_bw = *max_element(bw_rounds, bw_rounds + RTP_BBR_BW_ROUNDS);
+    // 传播时延：有效期内的最小RTT
+    bool min_rtt_expired = min_rtt_stamp != 0 && now - min_rtt_stamp > RTP_BBR_MIN_RTT_WIN;
+    if (ack.rtt_us > 0 && (min_rtt == 0 || ack.rtt_us <= min_rtt || min_rtt_expired))
+    {
+        min_rtt = ack.rtt_us;
+        min_rtt_stamp = now;
+    }
+
+    // STARTUP：连续三轮带宽增长不到25%，认为管道已经填满
+    if (!filled_pipe && round_start && ack.delivery_rate > 0)
+    {
+        if (btl_bw >= full_bw * 1.25)
+        {
+            full_bw = btl_bw;
+            full_bw_rounds = 0;
+        }
+        else if (++full_bw_rounds >= 3)
+        {
+            filled_pipe = true;
+        }
+    }
+    if (mode == BBR_STARTUP && filled_pipe)
+    {
+        mode = BBR_DRAIN;
+        pacing_gain = 1 / BBR_HIGH_GAIN;
+        cwnd_gain = BBR_HIGH_GAIN;
+    }
+    if (mode == BBR_DRAIN && ack.inflight <= bdp())
+    {
+        enter_probe_bw(now);
+    }
+    if (mode == BBR_PROBE_BW && min_rtt > 0 && now - cycle_stamp > min_rtt)
+    {
+        // 每个最小RTT换一个增益
+        cycle_index = (cycle_index + 1) % BBR_CYCLE_LEN;
+        cycle_stamp = now;
+        pacing_gain = bbr_cycle_gain[cycle_index];
+    }
+    // PROBE_RTT：最小RTT过期后把窗口降到最小，重新测一次传播时延
+    if (mode != BBR_PROBE_RTT && min_rtt_expired)
+    {
+        mode = BBR_PROBE_RTT;
+        pacing_gain = 1;
+        prior_cwnd = max(prior_cwnd, cwnd);
+        probe_rtt_done = now + max<int64_t>(RTP_BBR_PROBE_RTT_TIME, min_rtt);
+        min_rtt_stamp = now;
+    }
+    if (mode == BBR_PROBE_RTT)
+    {
+        cwnd = RTP_BBR_MIN_CWND;
+        if (now >= probe_rtt_done)
+        {
+            cwnd = max(cwnd, prior_cwnd);
+            prior_cwnd = 0;
+            if (filled_pipe)
+            {
+                enter_probe_bw(now);
+            }
+            else
+            {
+                mode = BBR_STARTUP;
+                pacing_gain = cwnd_gain = BBR_HIGH_GAIN;
+            }
+        }
+        return;
+    }
+
+    // 窗口：有模型之前像慢启动一样增长，之后不超过cwnd_gain倍的BDP
+    double target = cwnd_gain * bdp();
+    if (target <= 0)
+    {
+        cwnd += ack.acked;
+    }
+    else if (filled_pipe)
+    {
+        cwnd = min(cwnd + ack.acked, target);
+    }
+    else if (cwnd < target || delivered < 10)
+    {
+        cwnd += ack.acked;
+    }
+    cwnd = max(cwnd, RTP_BBR_MIN_CWND);
+}
+
+/* BBR不把丢包当作拥塞信号，窗口由带宽和时延的模型决定 */
+void BbrCc::on_loss(int64_t now_us)
+{
+}
+
+/* 超时说明路上的包都丢了，从1重新开始，按模型很快涨回cwnd_gain倍的BDP */
+void BbrCc::on_timeout(int64_t now_us)
+{
+    cwnd = 1.0;
+}
@@ -0,0 +1,136 @@
+#ifndef __CC_H
+#define __CC_H
+
+#include <cstdint>
+
+#define RTP_CC_INIT_CWND 1.0       // 初始窗口，和原先的Reno一致
+#define RTP_CC_INIT_SSTHRESH 65536 // 初始慢启动阈值
+#define RTP_CC_MIN_CWND 2.0        // 丢包后窗口的下限
+
+/* 一个新的累积确认，窗口和包数的单位都是包，时间单位为微秒 */
+struct CcAck
+{
+    int64_t now_us;       // 收到ACK的时间
+    uint32_t acked;       // 这个ACK新确认的包数，延迟ACK时可能大于1
+    int64_t rtt_us;       // 这个ACK的RTT样本，重传过的包(Karn)没有样本，为0
+    int64_t min_rtt_us;   // 到目前为止的最小RTT，没有样本时为0
+    uint32_t inflight;    // 确认之后还在路上的包数
+    double delivery_rate; // 投递速率样本(包/秒)，没有时为0
+    bool in_recovery;     // 发送方正处于快速恢复，这个ACK结束了快速恢复
+};
+
+/* 拥塞控制算法接口
+ * 丢包检测（重复ACK、SACK、快速恢复期间的窗口膨胀）由发送方负责，
+ * 算法只决定窗口和发送速率 */
+class CongestionControl
+{
+public:
+    virtual ~CongestionControl() {}
+    virtual const char *name() const = 0;
+    virtual void on_ack(const CcAck &ack) = 0;  // 累积确认前进
+    virtual void on_loss(int64_t now_us) = 0;   // 三次重复ACK，进入快速恢复
+    virtual void on_timeout(int64_t now_us) = 0; // 重传超时
+    virtual double get_cwnd() const = 0;         // 拥塞窗口
+    virtual double get_ssthresh() const = 0;     // 慢启动阈值，没有这个概念的算法返回0
+    virtual double pacing_rate() const { return 0; } // 建议的发送速率(包/秒)，0表示只受窗口限制
+};
+
+/* 按名字创建算法，"reno"/"cubic"/"bbr"，不认识的名字返回nullptr */
+CongestionControl *cc_create(const char *name);
+
+/* 原先写在send_file_gbn里的Reno */
+class RenoCc : public CongestionControl
+{
+private:
+    double cwnd = RTP_CC_INIT_CWND;
+    double ssthresh = RTP_CC_INIT_SSTHRESH;
+
+public:
+    const char *name() const override { return "reno"; }
+    void on_ack(const CcAck &ack) override;
+    void on_loss(int64_t now_us) override;
+    void on_timeout(int64_t now_us) override;
+    double get_cwnd() const override { return cwnd; }
+    double get_ssthresh() const override { return ssthresh; }
+};
+
+/* CUBIC (RFC 8312)，慢启动用HyStart的延迟增长检测提前退出 */
+class CubicCc : public CongestionControl
+{
+private:
+    double cwnd = RTP_CC_INIT_CWND;
+    double ssthresh = RTP_CC_INIT_SSTHRESH;
+    double w_max = 0;        // 上次丢包时的窗口
+    double k = 0;            // 窗口回到w_max需要的时间(秒)
+    double origin = 0;       // 三次函数的中心
+    double w_est = 0;        // 同样条件下Reno的窗口，保证不比Reno慢
+    int64_t epoch_start = 0; // 这次拥塞避免开始的时间，0表示还没开始
+    /* HyStart：按轮比较最小RTT，一轮为确认完这一轮开始时在路上的包 */
+    uint64_t delivered = 0;          // 累计确认的包数
+    uint64_t round_end = 0;          // delivered到这里时这一轮结束
+    int64_t round_min_rtt = 0;       // 这一轮的最小RTT
+    int64_t last_round_min_rtt = 0;  // 上一轮的最小RTT
+    int round_samples = 0;           // 这一轮的RTT样本数
+
+    void hystart_update(const CcAck &ack);
+
+public:
+    const char *name() const override { return "cubic"; }
+    void on_ack(const CcAck &ack) override;
+    void on_loss(int64_t now_us) override;
+    void on_timeout(int64_t now_us) override;
+    double get_cwnd() const override { return cwnd; }
+    double get_ssthresh() const override { return ssthresh; }
+};
+
+#define RTP_BBR_BW_ROUNDS 10          // 瓶颈带宽取最近这么多轮的最大值
+#define RTP_BBR_MIN_RTT_WIN 10000000  // 最小RTT的有效期(us)，过期进入PROBE_RTT
+#define RTP_BBR_PROBE_RTT_TIME 200000 // PROBE_RTT至少持续的时间(us)
+#define RTP_BBR_MIN_CWND 4.0
+
+/* 仿照BBR v1：用投递速率的最大值估计瓶颈带宽，用最小RTT估计传播时延，
+ * 窗口为cwnd_gain倍的BDP，发送速率为pacing_gain倍的瓶颈带宽 */
+class BbrCc : public CongestionControl
+{
+private:
+    enum Mode
+    {
+        BBR_STARTUP,
+        BBR_DRAIN,
+        BBR_PROBE_BW,
+        BBR_PROBE_RTT,
+    };
+    Mode mode = BBR_STARTUP;
+    double cwnd = RTP_CC_INIT_CWND;
+    double pacing_gain;
+    double cwnd_gain;
+    double bw_rounds[RTP_BBR_BW_ROUNDS] = {}; // 每轮的最大投递速率(包/秒)
+    double btl_bw = 0;                        // 瓶颈带宽估计
+    int64_t min_rtt = 0;                      // 传播时延估计(us)
+    int64_t min_rtt_stamp = 0;                // min_rtt的更新时间
+    uint64_t delivered = 0;
+    uint64_t round_end = 0;
+    uint64_t round_count = 0;
+    double full_bw = 0;         // 判断带宽是否还在增长
+    int full_bw_rounds = 0;     // 带宽没有明显增长的轮数
+    bool filled_pipe = false;
+    int cycle_index = 0;        // PROBE_BW的增益循环位置
+    int64_t cycle_stamp = 0;
+    int64_t probe_rtt_done = 0; // PROBE_RTT结束的时间
+    double prior_cwnd = 0;      // 进入PROBE_RTT前的窗口
+
+    double bdp() const { return btl_bw * min_rtt / 1e6; }
+    void enter_probe_bw(int64_t now_us);
+
+public:
+    BbrCc();
+    const char *name() const override { return "bbr"; }
+    void on_ack(const CcAck &ack) override;
+    void on_loss(int64_t now_us) override;
+    void on_timeout(int64_t now_us) override;
+    double get_cwnd() const override { return cwnd; }
+    double get_ssthresh() const override { return 0; }
+    double pacing_rate() const override { return pacing_gain * btl_bw; }
+};
+
+#endif // __CC_H
@@ -0,0 +1,193 @@
+#include "cmp.h"
+#include "journal.h"
+#include "util.h"
+#include <algorithm>
+#include <cstring>
+using namespace std;
+
+/* Deflater */
+
+int Deflater::init()
+{
+    release();
+    memset(&strm, 0, sizeof(strm));
+    // raw deflate，不要zlib的头和adler32，包已经有CRC了
+    if (deflateInit2(&strm, RTP_CMP_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        LOG_DEBUG("Deflater deflateInit2() failed\n");
+        return -1;
+    }
+    ready = true;
+    skip = backoff = 0;
+    return 0;
+}
+
+void Deflater::release()
+{
+    if (ready)
+    {
+        deflateEnd(&strm);
+        ready = false;
+    }
+}
+
+uint32_t Deflater::compress(const char *src, uint32_t len, char *dst)
+{
+    if (!ready || len <= RTP_CMP_MIN_SAVE)
+    {
+        return 0;
+    }
+    if (skip > 0)
+    {
+        skip--;
+        return 0;
+    }
+    deflateReset(&strm);
+    strm.next_in = (Bytef *)src;
+    strm.avail_in = len;
+    strm.next_out = (Bytef *)dst;
+    strm.avail_out = len - RTP_CMP_MIN_SAVE; // 放不下说明不值得
+    if (deflate(&strm, Z_FINISH) == Z_STREAM_END)
+    {
+        backoff = 0;
+        return len - RTP_CMP_MIN_SAVE - strm.avail_out;
+    }
+    skip = backoff;
+    backoff = min(max(2 * backoff, 1), RTP_CMP_MAX_SKIP);
+    return 0;
+}
+
+/* Inflater */
+
+int Inflater::start(int fd, uint32_t size, RtpJournal *journal)
+{
+    stop();
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -15) != Z_OK)
+    {
+        LOG_DEBUG("Inflater inflateInit2() failed\n");
+        return -1;
+    }
+    if (data.init(max<uint32_t>(RTP_CMP_QUEUE_BYTES / size, RTP_CMP_QUEUE_MIN), size) == -1)
+    {
+        inflateEnd(&strm);
+        return -1;
+    }
+    slots = data.capacity();
+    offsets = (uint64_t *)malloc(slots * sizeof(uint64_t));
+    lengths = (uint32_t *)malloc(slots * sizeof(uint32_t));
+    out = (char *)malloc(size);
+    if (offsets == nullptr || lengths == nullptr || out == nullptr)
+    {
+        LOG_DEBUG("Inflater failed to allocate queue\n");
+        free(offsets);
+        free(lengths);
+        free(out);
+        offsets = nullptr;
+        lengths = nullptr;
+        out = nullptr;
+        data.release();
+        inflateEnd(&strm);
+        return -1;
+    }
+    this->fd = fd;
+    this->journal = journal;
+    slot_size = size;
+    head = tail = 0;
+    stopping = failed = false;
+    end = 0;
+    worker = thread(&Inflater::run, this);
+    ready = true;
+    return 0;
+}
+
+/* 后台线程：按放进队列的顺序解压，写进文件之后才腾出槽 */
+void Inflater::run()
+{
+    unique_lock<mutex> guard(lock);
+    while (true)
+    {
+        cond.wait(guard, [this] { return head != tail || stopping; });
+        if (head == tail)
+        {
+            break; // stop时队列已经空了
+        }
+        uint64_t i = head;
+        guard.unlock();
+        inflateReset(&strm);
+        strm.next_in = (Bytef *)data.at(i);
+        strm.avail_in = lengths[i & (slots - 1)];
+        strm.next_out = (Bytef *)out;
+        strm.avail_out = slot_size;
+        bool ok = inflate(&strm, Z_FINISH) == Z_STREAM_END;
+        ssize_t written = slot_size - strm.avail_out;
+        uint64_t offset = offsets[i & (slots - 1)];
+        ok = ok && pwrite(fd, out, written, offset) == written;
+        if (ok && journal != nullptr)
+        {
+            journal->mark(offset, written);
+        }
+        guard.lock();
+        if (!ok)
+        {
+            LOG_DEBUG("Inflater failed to inflate or write %u bytes at offset %lu\n", lengths[i & (slots - 1)], offset);
+            failed = true;
+        }
+        else
+        {
+            end = max<uint64_t>(end, offset + written);
+        }
+        head++;
+        cond.notify_all();
+    }
+}
+
+int Inflater::submit(uint64_t offset, const char *payload, uint32_t length)
+{
+    unique_lock<mutex> guard(lock);
+    if (failed || length > slot_size)
+    {
+        return -1;
+    }
+    cond.wait(guard, [this] { return tail - head < slots; });
+    guard.unlock();
+    // 只有收包线程写tail这个槽，后台线程只读[head, tail)
+    memcpy(data.at(tail), payload, length);
+    offsets[tail & (slots - 1)] = offset;
+    lengths[tail & (slots - 1)] = length;
+    guard.lock();
+    tail++;
+    cond.notify_all();
+    return 0;
+}
+
+int Inflater::drain()
+{
+    unique_lock<mutex> guard(lock);
+    cond.wait(guard, [this] { return head == tail; });
+    return failed ? -1 : 0;
+}
+
+int Inflater::stop()
+{
+    if (!ready)
+    {
+        return 0;
+    }
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    worker.join();
+    inflateEnd(&strm);
+    free(offsets);
+    free(lengths);
+    free(out);
+    offsets = nullptr;
+    lengths = nullptr;
+    out = nullptr;
+    data.release();
+    ready = false;
+    return failed ? -1 : 0;
+}
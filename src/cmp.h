@@ -0,0 +1,88 @@
+#ifndef __CMP_H
+#define __CMP_H
+
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <zlib.h>
+#include "ring.h"
+
+class RtpJournal;
+
+#define RTP_CMP_LEVEL 1              // deflate压缩级别，1最快，链路慢时也够用
+#define RTP_CMP_MIN_SAVE 8           // 至少省下这么多字节才发压缩后的数据，不然接收方白解压
+#define RTP_CMP_MAX_SKIP 64          // 连续压不小时最多跳过这么多个块再试
+#define RTP_CMP_QUEUE_BYTES (8 << 20) // 接收方解压队列最多占这么多内存
+#define RTP_CMP_QUEUE_MIN 32         // 解压队列至少这么多个槽
+
+/* 发送方逐块压缩，一个块就是一个包的数据，压缩后独立解压，包和文件偏移的对应关系不变
+ * 压不小的块（随机数据、已经压缩过的文件）照原样发，
+ * 连续压不小时跳过的块数翻倍，压小了一次就恢复每块都试 */
+class Deflater
+{
+private:
+    z_stream strm;
+    bool ready = false;
+    int skip = 0;    // 还要跳过的块数
+    int backoff = 0; // 下一次压不小时跳过的块数
+
+public:
+    Deflater() {}
+    ~Deflater() { release(); }
+    Deflater(const Deflater &) = delete;
+    Deflater &operator=(const Deflater &) = delete;
+
+    int init();
+    void release();
+    /* 把len字节的src压缩进dst，dst至少有len字节，
+     * 返回压缩后的长度，不值得压缩或者跳过时返回0 */
+    uint32_t compress(const char *src, uint32_t len, char *dst);
+};
+
+/* 接收方的解压流水线：收包循环只把压缩的包拷贝进队列，
+ * 后台线程按顺序解压并pwrite到文件里对应的偏移，收包循环不用等解压 */
+class Inflater
+{
+private:
+    z_stream strm;
+    bool ready = false;
+    int fd = -1;
+    uint32_t slot_size = 0; // 一个槽能放下的压缩数据，也是解压后的上限
+    ByteRing data;          // 压缩数据
+    uint64_t *offsets = nullptr; // 每个槽解压后写到的文件偏移
+    uint32_t *lengths = nullptr; // 每个槽的压缩数据长度
+    uint32_t slots = 0;
+    uint64_t head = 0; // 下一个要解压的槽，只有后台线程修改
+    uint64_t tail = 0; // 下一个空槽，只有收包线程修改
+    bool stopping = false;
+    bool failed = false;
+    uint64_t end = 0; // 解压写入的最大结束偏移
+    char *out = nullptr;
+    RtpJournal *journal = nullptr; // 写进文件之后记进续传日志
+    std::mutex lock;
+    std::condition_variable cond;
+    std::thread worker;
+
+    void run();
+
+public:
+    Inflater() {}
+    ~Inflater() { stop(); }
+    Inflater(const Inflater &) = delete;
+    Inflater &operator=(const Inflater &) = delete;
+
+    /* 开始往fd里写，每个包解压后最多size字节，journal不为nullptr时写完记进日志，成功返回0失败返回-1 */
+    int start(int fd, uint32_t size, RtpJournal *journal = nullptr);
+    /* 把一个压缩的包放进队列，解压后写到offset，队列满时等后台线程腾出槽
+     * 成功返回0，之前的解压或写入失败过返回-1 */
+    int submit(uint64_t offset, const char *payload, uint32_t length);
+    /* 等队列里的包都写进文件，失败过返回-1 */
+    int drain();
+    /* 写完队列里的包并结束后台线程，返回值同drain，没有start过时返回0 */
+    int stop();
+    bool running() const { return ready; }
+    uint64_t get_end() const { return end; } // stop之后有效
+};
+
+#endif // __CMP_H
@@ -0,0 +1,320 @@
+#include "crc32.h"
+#include <array>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL 1
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32_HAVE_ARMV8 1
+#endif
+
+/* 内部状态统一使用取反后的crc，对外接口在入口和出口各取反一次，
+ * 这样crc32_update(0, ...)与原先compute_checksum的结果逐位一致 */
+
+namespace
+{
+    typedef uint32_t (*crc32_kernel_t)(uint32_t c, const unsigned char *p, size_t n);
+
+    constexpr uint32_t CRC32_POLY = 0xEDB88320u;
+
+    /* 编译期生成slicing-by-16所需的16张表，table[0]即普通的按字节查表 */
+    constexpr std::array<std::array<uint32_t, 256>, 16> make_tables()
+    {
+        std::array<std::array<uint32_t, 256>, 16> t{};
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t r = i;
+            for (int j = 0; j < 8; j++)
+                r = (r & 1) ? (r >> 1) ^ CRC32_POLY : r >> 1;
+            t[0][i] = r;
+        }
+        for (int k = 1; k < 16; k++)
+            for (uint32_t i = 0; i < 256; i++)
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+        return t;
+    }
+
+    constexpr auto crc_tables = make_tables();
+    static_assert(crc_tables[0][1] == 0x77073096u, "crc32 table mismatch");
+
+    inline uint32_t load32(const unsigned char *p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    uint32_t crc32_bytewise(uint32_t c, const unsigned char *p, size_t n)
+    {
+        while (n--)
+            c = crc_tables[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+        return c;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* 每次处理8字节，8张表并行查 */
+    uint32_t crc32_slice8(uint32_t c, const unsigned char *p, size_t n)
+    {
+        const auto &t = crc_tables;
+        while (n >= 8)
+        {
+            uint32_t one = load32(p) ^ c;
+            uint32_t two = load32(p + 4);
+            c = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+                t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+                t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^
+                t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+            p += 8;
+            n -= 8;
+        }
+        return crc32_bytewise(c, p, n);
+    }
+
+    /* 每次处理16字节，16张表并行查 */
+    uint32_t crc32_slice16(uint32_t c, const unsigned char *p, size_t n)
+    {
+        const auto &t = crc_tables;
+        while (n >= 16)
+        {
+            uint32_t w0 = load32(p) ^ c;
+            uint32_t w1 = load32(p + 4);
+            uint32_t w2 = load32(p + 8);
+            uint32_t w3 = load32(p + 12);
+            c = t[15][w0 & 0xff] ^ t[14][(w0 >> 8) & 0xff] ^
+                t[13][(w0 >> 16) & 0xff] ^ t[12][w0 >> 24] ^
+                t[11][w1 & 0xff] ^ t[10][(w1 >> 8) & 0xff] ^
+                t[9][(w1 >> 16) & 0xff] ^ t[8][w1 >> 24] ^
+                t[7][w2 & 0xff] ^ t[6][(w2 >> 8) & 0xff] ^
+                t[5][(w2 >> 16) & 0xff] ^ t[4][w2 >> 24] ^
+                t[3][w3 & 0xff] ^ t[2][(w3 >> 8) & 0xff] ^
+                t[1][(w3 >> 16) & 0xff] ^ t[0][w3 >> 24];
+            p += 16;
+            n -= 16;
+        }
+        return crc32_slice8(c, p, n);
+    }
+#else
+    // 大端机器上slicing的表与读法都不同，直接退化为按字节
+    uint32_t crc32_slice8(uint32_t c, const unsigned char *p, size_t n)
+    {
+        return crc32_bytewise(c, p, n);
+    }
+    uint32_t crc32_slice16(uint32_t c, const unsigned char *p, size_t n)
+    {
+        return crc32_bytewise(c, p, n);
+    }
+#endif
+
+#ifdef CRC32_HAVE_PCLMUL
+    /* PCLMULQDQ折叠，参考Intel白皮书 "Fast CRC Computation for Generic
+     * Polynomials Using PCLMULQDQ Instruction"，常数为反射域下的k1~k5和Barrett常数
+     * 要求n >= 64且为16的倍数 */
+    __attribute__((target("pclmul,sse4.1")))
+    uint32_t crc32_pclmul_fold(uint32_t c, const unsigned char *p, size_t n)
+    {
+        alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+        alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+        alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+        alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+        __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+        x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+        x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+        x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+        x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+        x0 = _mm_load_si128((const __m128i *)k1k2);
+        p += 64;
+        n -= 64;
+
+        // 4路并行折叠，每次64字节
+        while (n >= 64)
+        {
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+            x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+            x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+            x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+            x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+            y5 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+            y6 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+            y7 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+            y8 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+            x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+            x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+            x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+            p += 64;
+            n -= 64;
+        }
+
+        // 4个128位合并为1个
+        x0 = _mm_load_si128((const __m128i *)k3k4);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+        // 剩余的16字节块逐个折叠
+        while (n >= 16)
+        {
+            x2 = _mm_loadu_si128((const __m128i *)p);
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+            p += 16;
+            n -= 16;
+        }
+
+        // 128位折叠到64位
+        x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+        x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+        x1 = _mm_srli_si128(x1, 8);
+        x1 = _mm_xor_si128(x1, x2);
+        x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, x3);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        // Barrett约减到32位
+        x0 = _mm_load_si128((const __m128i *)poly);
+        x2 = _mm_and_si128(x1, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+        x2 = _mm_and_si128(x2, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+        return (uint32_t)_mm_extract_epi32(x1, 1);
+    }
+
+    uint32_t crc32_pclmul(uint32_t c, const unsigned char *p, size_t n)
+    {
+        if (n >= 64)
+        {
+            size_t chunk = n & ~(size_t)15;
+            c = crc32_pclmul_fold(c, p, chunk);
+            p += chunk;
+            n -= chunk;
+        }
+        return crc32_slice16(c, p, n);
+    }
+#endif
+
+#ifdef CRC32_HAVE_ARMV8
+    /* ARMv8 CRC32指令，多项式与标准CRC-32相同 */
+    __attribute__((target("+crc")))
+    uint32_t crc32_armv8(uint32_t c, const unsigned char *p, size_t n)
+    {
+        while (n >= 8)
+        {
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            c = __crc32d(c, v);
+            p += 8;
+            n -= 8;
+        }
+        while (n--)
+            c = __crc32b(c, *p++);
+        return c;
+    }
+#endif
+
+    struct crc32_impl
+    {
+        const char *name;
+        crc32_kernel_t fn;
+    };
+
+    bool impl_supported(crc32_kernel_t fn)
+    {
+#ifdef CRC32_HAVE_PCLMUL
+        if (fn == crc32_pclmul)
+            return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+#ifdef CRC32_HAVE_ARMV8
+        if (fn == crc32_armv8)
+            return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+        (void)fn;
+        return true;
+    }
+
+    /* 按优先级排列，选第一个CPU支持的，
+     * 环境变量RTP_CRC32可以强制指定某个实现，便于测试和对比 */
+    const crc32_impl impls[] = {
+#ifdef CRC32_HAVE_PCLMUL
+        {"pclmul", crc32_pclmul},
+#endif
+#ifdef CRC32_HAVE_ARMV8
+        {"armv8", crc32_armv8},
+#endif
+        {"slice16", crc32_slice16},
+        {"slice8", crc32_slice8},
+        {"bytewise", crc32_bytewise},
+    };
+
+    // 按名字找CPU支持的实现，找不到返回nullptr
+    const crc32_impl *find_impl(const char *name)
+    {
+        for (const auto &impl : impls)
+            if (strcmp(impl.name, name) == 0 && impl_supported(impl.fn))
+                return &impl;
+        return nullptr;
+    }
+
+    const crc32_impl &select_impl()
+    {
+        const char *force = getenv("RTP_CRC32");
+        if (force != nullptr && find_impl(force) != nullptr)
+            return *find_impl(force);
+        for (const auto &impl : impls)
+            if (impl_supported(impl.fn))
+                return impl;
+        return impls[sizeof(impls) / sizeof(impls[0]) - 1];
+    }
+
+    // 函数内static的初始化是线程安全的，第一次调用时完成分派
+    const crc32_impl &active_impl()
+    {
+        static const crc32_impl &impl = select_impl();
+        return impl;
+    }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n_bytes)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    // 包头只有11字节，查一张表更快，不走分派
+    if (n_bytes < 16)
+        return ~crc32_bytewise(~crc, p, n_bytes);
+    return ~active_impl().fn(~crc, p, n_bytes);
+}
+
+const char *crc32_impl_name(void)
+{
+    return active_impl().name;
+}
+
+int crc32_update_impl(const char *name, uint32_t crc, const void *data, size_t n_bytes, uint32_t *out)
+{
+    const crc32_impl *impl = find_impl(name);
+    if (impl == nullptr)
+        return -1;
+    *out = ~impl->fn(~crc, (const unsigned char *)data, n_bytes);
+    return 0;
+}
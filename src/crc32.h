@@ -0,0 +1,26 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 标准CRC-32 (多项式0xEDB88320，与zlib的crc32()结果一致)
+ * crc为之前数据的结果，第一次调用传0，可以分段累加计算 */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n_bytes);
+
+/* 当前使用的实现名称，"bytewise"/"slice8"/"slice16"/"pclmul"/"armv8" */
+const char *crc32_impl_name(void);
+
+/* 不经分派、用名为name的实现计算，结果写进out，用于测试各个实现。
+ * 没有这个实现或CPU不支持时返回-1，成功返回0 */
+int crc32_update_impl(const char *name, uint32_t crc, const void *data, size_t n_bytes, uint32_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
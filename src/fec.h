@@ -0,0 +1,72 @@
+#ifndef __FEC_H
+#define __FEC_H
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#define RTP_FEC_MIN_GROUP 2  // 一组至少这么多个数据包，即校验包最多占1/3
+#define RTP_FEC_MAX_GROUP 32 // 一组最多这么多个数据包，没有丢包时的开销约3%
+#define RTP_FEC_EPOCH 64     // 每发这么多个新包更新一次丢包率
+#define RTP_FEC_TARGET 0.5   // 一组（包括校验包）里期望的丢包数，XOR只能恢复一个
+#define RTP_FEC_PENDING 64   // 接收方最多暂存这么多个还不能恢复的组
+
+/* dst ^= src，按8字节处理 */
+static inline void fec_xor(char *dst, const char *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < n; i++)
+    {
+        dst[i] ^= src[i];
+    }
+}
+
+/* 按测得的丢包率选择一组的数据包数k：让一组k+1个包里期望的丢包数(k+1)p约为RTP_FEC_TARGET，
+ * 丢包越多组越小、冗余越多；丢包数为发送方的重传数加上接收方报告的用校验包恢复的包数 */
+class FecRate
+{
+private:
+    double loss = 0;   // 平滑的丢包率
+    uint64_t sent = 0; // 这一轮发出的新包
+    uint64_t lost = 0; // 这一轮丢的包
+
+public:
+    void reset()
+    {
+        loss = 0;
+        sent = lost = 0;
+    }
+    void on_sent(uint32_t packets) { sent += packets; }
+    void on_lost(uint32_t packets) { lost += packets; }
+    /* 攒够RTP_FEC_EPOCH个样本后更新丢包率 */
+    void update()
+    {
+        if (sent < RTP_FEC_EPOCH)
+        {
+            return;
+        }
+        double sample = std::min(1.0, (double)lost / sent);
+        loss = loss == 0 ? sample : 0.75 * loss + 0.25 * sample;
+        sent = lost = 0;
+    }
+    int group() const
+    {
+        if (loss <= 0)
+        {
+            return RTP_FEC_MAX_GROUP;
+        }
+        double k = RTP_FEC_TARGET / loss - 1;
+        return (int)std::min<double>(std::max<double>(k, RTP_FEC_MIN_GROUP), RTP_FEC_MAX_GROUP);
+    }
+    double get_loss() const { return loss; }
+};
+
+#endif // __FEC_H
@@ -0,0 +1,335 @@
+#include "journal.h"
+#include "util.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace std;
+
+/* SkipMap */
+
+void SkipMap::add(int64_t from, int64_t to)
+{
+    seq_start.push_back(total);
+    grid_start.push_back(from);
+    total += to - from;
+}
+
+void SkipMap::build(uint64_t begin, uint64_t end, uint32_t size, const RtpResumeRun *have, int count)
+{
+    reset();
+    built = true;
+    if (end <= begin)
+    {
+        return;
+    }
+    int64_t n = (end - begin + size - 1) / size;
+    vector<pair<int64_t, int64_t>> skip; // 不用发的格子[first, second)
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t a = max<uint64_t>(begin, (uint64_t)have[i].start * RTP_JOURNAL_BLOCK);
+        uint64_t b = min<uint64_t>(end, (uint64_t)have[i].end * RTP_JOURNAL_BLOCK);
+        if (b <= a)
+        {
+            continue;
+        }
+        // 只跳过整个落在[a, b)里的格子，最后一个格子到end为止
+        int64_t g0 = (a - begin + size - 1) / size;
+        int64_t g1 = b >= end ? n : (int64_t)((b - begin) / size);
+        if (g1 > g0)
+        {
+            skip.push_back({g0, g1});
+        }
+    }
+    sort(skip.begin(), skip.end());
+    int64_t g = 0;
+    for (auto &s : skip)
+    {
+        if (s.first > g)
+        {
+            add(g, s.first);
+        }
+        g = max(g, s.second);
+    }
+    if (g < n)
+    {
+        add(g, n);
+    }
+}
+
+int64_t SkipMap::grid(int64_t index) const
+{
+    if (!built)
+    {
+        return index;
+    }
+    size_t r = upper_bound(seq_start.begin(), seq_start.end(), index) - seq_start.begin();
+    if (r == 0)
+    {
+        return index; // 不会发生，index总是>=0
+    }
+    r--;
+    return grid_start[r] + index - seq_start[r];
+}
+
+/* RtpJournal */
+
+/* 日志文件开头，后面跟着(blocks + 7) / 8字节的位图 */
+typedef struct __attribute__((__packed__)) RtpJournalHeader
+{
+    uint32_t magic;
+    uint32_t block;  // RTP_JOURNAL_BLOCK
+    uint32_t blocks; // 位图的位数
+    uint64_t file_size;
+    uint64_t file_mtime;
+} rtp_journal_header_t;
+
+void RtpJournal::close_file()
+{
+    if (fd != -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+    free(bits);
+    free(filled);
+    bits = nullptr;
+    filled = nullptr;
+    blocks = 0;
+    dirty = false;
+}
+
+uint64_t RtpJournal::block_len(uint32_t block) const
+{
+    uint64_t start = (uint64_t)block * RTP_JOURNAL_BLOCK;
+    return min<uint64_t>(RTP_JOURNAL_BLOCK, file_size - start);
+}
+
+bool RtpJournal::exists() const
+{
+    return access(path.c_str(), F_OK) == 0;
+}
+
+int RtpJournal::open(uint64_t file_size, uint64_t file_mtime)
+{
+    lock_guard<mutex> sync_guard(sync_lock); // 后台线程可能正在用fd落盘
+    lock_guard<mutex> guard(lock);
+    if (fd != -1 && this->file_size == file_size && this->file_mtime == file_mtime)
+    {
+        return 0; // 分段接收时后面的段直接用
+    }
+    close_file();
+    if ((file_size + RTP_JOURNAL_BLOCK - 1) / RTP_JOURNAL_BLOCK > UINT32_MAX)
+    {
+        LOG_DEBUG("RtpJournal file too large: %lu\n", file_size);
+        return -1;
+    }
+    this->file_size = file_size;
+    this->file_mtime = file_mtime;
+    blocks = (file_size + RTP_JOURNAL_BLOCK - 1) / RTP_JOURNAL_BLOCK;
+    size_t bytes = (blocks + 7) / 8;
+    bits = (uint8_t *)calloc(max<size_t>(bytes, 1), 1);
+    filled = (uint32_t *)calloc(max<uint32_t>(blocks, 1), sizeof(uint32_t));
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (bits == nullptr || filled == nullptr || fd == -1)
+    {
+        LOG_DEBUG("RtpJournal failed to open %s\n", path.c_str());
+        close_file();
+        return -1;
+    }
+
+    rtp_journal_header_t header;
+    bool match = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 header.magic == RTP_JOURNAL_MAGIC && header.block == RTP_JOURNAL_BLOCK &&
+                 header.blocks == blocks && header.file_size == file_size && header.file_mtime == file_mtime &&
+                 pread(fd, bits, bytes, sizeof(header)) == (ssize_t)bytes;
+    if (match)
+    {
+        uint32_t have = 0;
+        for (uint32_t i = 0; i < blocks; i++)
+        {
+            have += (bits[i / 8] >> (i % 8)) & 1;
+        }
+        LOG_MSG("Resuming with %u of %u blocks from %s\n", have, blocks, path.c_str());
+    }
+    else
+    {
+        // 没有日志或者对应的是别的文件，从头开始
+        memset(bits, 0, bytes);
+        header.magic = RTP_JOURNAL_MAGIC;
+        header.block = RTP_JOURNAL_BLOCK;
+        header.blocks = blocks;
+        header.file_size = file_size;
+        header.file_mtime = file_mtime;
+        if (ftruncate(fd, 0) == -1 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            pwrite(fd, bits, bytes, sizeof(header)) != (ssize_t)bytes)
+        {
+            LOG_DEBUG("RtpJournal failed to write %s\n", path.c_str());
+            close_file();
+            return -1;
+        }
+    }
+    dirty = false;
+    last_sync = chrono::steady_clock::now();
+    if (!started)
+    {
+        stopping = false;
+        worker = thread(&RtpJournal::run, this);
+        started = true;
+    }
+    return 0;
+}
+
+int RtpJournal::have_runs(uint64_t begin, uint64_t end, RtpResumeRun *runs, int max)
+{
+    lock_guard<mutex> guard(lock);
+    if (fd == -1 || end <= begin)
+    {
+        return 0;
+    }
+    uint32_t first = begin / RTP_JOURNAL_BLOCK;
+    uint32_t last = min<uint64_t>((end - 1) / RTP_JOURNAL_BLOCK + 1, blocks);
+    int count = 0;
+    for (uint32_t i = first; i < last && count < max;)
+    {
+        if (!((bits[i / 8] >> (i % 8)) & 1))
+        {
+            i++;
+            continue;
+        }
+        uint32_t j = i;
+        while (j < last && ((bits[j / 8] >> (j % 8)) & 1))
+        {
+            j++;
+        }
+        runs[count].start = i;
+        runs[count].end = j;
+        count++;
+        i = j;
+    }
+    return count;
+}
+
+void RtpJournal::mark(uint64_t offset, uint64_t length)
+{
+    lock_guard<mutex> guard(lock);
+    if (fd == -1 || length == 0)
+    {
+        return;
+    }
+    uint64_t end = min(offset + length, file_size);
+    for (uint64_t pos = offset; pos < end;)
+    {
+        uint32_t i = pos / RTP_JOURNAL_BLOCK;
+        uint64_t next = min<uint64_t>((uint64_t)(i + 1) * RTP_JOURNAL_BLOCK, end);
+        if (!((bits[i / 8] >> (i % 8)) & 1))
+        {
+            // 每个字节只会写一次（重复的包在这之前就丢掉了），累加够块大小就算写完
+            filled[i] += next - pos;
+            if (filled[i] >= block_len(i))
+            {
+                bits[i / 8] |= 1 << (i % 8);
+                dirty = true;
+            }
+        }
+        pos = next;
+    }
+}
+
+int RtpJournal::sync(int out_fd, bool force)
+{
+    if (force)
+    {
+        return write_back(out_fd);
+    }
+    lock_guard<mutex> guard(lock);
+    if (fd == -1 || !dirty || !started || pending_fd != -1)
+    {
+        return 0; // 后台线程还没做完上一次时不再交
+    }
+    auto now = chrono::steady_clock::now();
+    if (now - last_sync < chrono::milliseconds(RTP_JOURNAL_SYNC_MS))
+    {
+        return 0;
+    }
+    // 输出文件可能在后台线程落盘之前就被关掉，交一个dup出来的fd
+    pending_fd = dup(out_fd);
+    if (pending_fd == -1)
+    {
+        LOG_DEBUG("RtpJournal dup() failed\n");
+        return -1;
+    }
+    last_sync = now;
+    cond.notify_all();
+    return 0;
+}
+
+/* 后台线程：做收包线程交过来的落盘 */
+void RtpJournal::run()
+{
+    unique_lock<mutex> guard(lock);
+    while (true)
+    {
+        cond.wait(guard, [this] { return pending_fd != -1 || stopping; });
+        if (pending_fd == -1)
+        {
+            break; // stop时交过来的已经做完了
+        }
+        int out_fd = pending_fd;
+        guard.unlock();
+        write_back(out_fd);
+        close(out_fd);
+        guard.lock();
+        pending_fd = -1;
+    }
+}
+
+void RtpJournal::stop_worker()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        if (!started)
+        {
+            return;
+        }
+        stopping = true;
+        started = false;
+    }
+    cond.notify_all();
+    worker.join();
+}
+
+int RtpJournal::write_back(int out_fd)
+{
+    lock_guard<mutex> sync_guard(sync_lock);
+    vector<uint8_t> snapshot;
+    {
+        lock_guard<mutex> guard(lock);
+        if (fd == -1 || !dirty)
+        {
+            return 0;
+        }
+        snapshot.assign(bits, bits + (blocks + 7) / 8);
+        dirty = false;
+    }
+    // 先让数据落盘再写位图，崩溃之后位图里的块一定是完整的
+    if (fdatasync(out_fd) == -1 ||
+        pwrite(fd, snapshot.data(), snapshot.size(), sizeof(rtp_journal_header_t)) != (ssize_t)snapshot.size())
+    {
+        LOG_DEBUG("RtpJournal failed to sync %s\n", path.c_str());
+        lock_guard<mutex> guard(lock);
+        dirty = true;
+        return -1;
+    }
+    return 0;
+}
+
+void RtpJournal::remove()
+{
+    stop_worker();
+    lock_guard<mutex> guard(lock);
+    close_file();
+    unlink(path.c_str());
+}
@@ -0,0 +1,116 @@
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+
+#define RTP_JOURNAL_BLOCK (1 << 20)     // 日志里一位对应的字节数
+#define RTP_JOURNAL_SYNC_MS 1000        // 最多每隔这么久把日志写到磁盘上
+#define RTP_JOURNAL_MAGIC 0x4a505452    // "RTPJ"
+#define RTP_JOURNAL_SUFFIX ".rtpj"      // 日志文件名为输出文件名加上这个后缀
+#define RTP_RESUME_RUNS 8               // SYN&ACK里最多告诉对方这么多段已经收完的块
+
+/* SYN&ACK的RTP_OPT_RESUME选项里的一段已经收完的块，[start, end)，单位为RTP_JOURNAL_BLOCK */
+typedef struct __attribute__((__packed__)) RtpResumeRun
+{
+    uint32_t start;
+    uint32_t end;
+} rtp_resume_run_t;
+
+/* SYN的RTP_OPT_RESUME选项，发送方要发的文件，大小和修改时间都一样时认为是同一个文件 */
+typedef struct __attribute__((__packed__)) RtpResumeInfo
+{
+    uint64_t file_size;  // 整个文件的大小
+    uint64_t file_mtime; // 文件的修改时间(ns)
+    uint64_t range_end;  // 这条流发送[stripe_offset, range_end)
+} rtp_resume_info_t;
+
+/* 断点续传时实际发送的包：把[begin, end)按payload大小切成格子，
+ * 完全落在已经收完的段里的格子不发，其余的按顺序编号，两端用同样的参数算出同样的对应关系 */
+class SkipMap
+{
+private:
+    std::vector<int64_t> seq_start;  // 每一段连续要发的格子中第一个的编号
+    std::vector<int64_t> grid_start; // 对应的格子
+    int64_t total = 0;               // 要发的格子数
+    bool built = false;              // 没有build过时不跳过，第index个包就是第index个格子
+
+    void add(int64_t from, int64_t to);
+
+public:
+    void reset()
+    {
+        seq_start.clear();
+        grid_start.clear();
+        total = 0;
+        built = false;
+    }
+    /* have为count段已经收完的块，不需要排序 */
+    void build(uint64_t begin, uint64_t end, uint32_t size, const RtpResumeRun *have, int count);
+    bool active() const { return built; }
+    int64_t packets() const { return total; }
+    /* 第index个要发的包对应的格子 */
+    int64_t grid(int64_t index) const;
+};
+
+/* 接收方的续传日志：输出文件旁边的一个位图，每一位表示一个RTP_JOURNAL_BLOCK的块已经写完，
+ * 写入之后才记进位图，落盘时先fdatasync输出文件再写位图，位图里的块一定已经在磁盘上
+ * 定时的落盘在后台线程里做，fdatasync可能要等很久，不能挡着收包和发ACK
+ * 分段接收时各段共用一个日志 */
+class RtpJournal
+{
+private:
+    std::string path;
+    int fd = -1;
+    uint64_t file_size = 0;
+    uint64_t file_mtime = 0;
+    uint32_t blocks = 0;
+    uint8_t *bits = nullptr;    // 已经写完的块
+    uint32_t *filled = nullptr; // 这次运行里每个块写了的字节数
+    bool dirty = false;         // 有还没写到日志里的位
+    std::chrono::steady_clock::time_point last_sync;
+    std::mutex lock;      // 保护位图和下面给后台线程的请求
+    std::mutex sync_lock; // 同一时间只有一个线程在落盘，先拿sync_lock再拿lock
+    int pending_fd = -1;  // 要后台线程落盘的输出文件，dup出来的，后台线程用完关掉
+    bool started = false;
+    bool stopping = false;
+    std::condition_variable cond;
+    std::thread worker;
+
+    void close_file();
+    uint64_t block_len(uint32_t block) const;
+    int write_back(int out_fd); // fdatasync输出文件再写位图，成功返回0失败返回-1
+    void run();
+    void stop_worker();         // 做完已经交过去的落盘，结束后台线程
+
+public:
+    explicit RtpJournal(const char *output) : path(std::string(output) + RTP_JOURNAL_SUFFIX) {}
+    ~RtpJournal()
+    {
+        stop_worker();
+        close_file();
+    }
+    RtpJournal(const RtpJournal &) = delete;
+    RtpJournal &operator=(const RtpJournal &) = delete;
+
+    bool exists() const;
+    /* 打开对应file_size和file_mtime的日志，不存在或者对应的不是同一个文件时重新开始
+     * 已经打开过同一个文件时直接返回，成功返回0失败返回-1 */
+    int open(uint64_t file_size, uint64_t file_mtime);
+    /* 和[begin, end)有交集的已经收完的块，最多max段，返回段数 */
+    int have_runs(uint64_t begin, uint64_t end, RtpResumeRun *runs, int max);
+    /* [offset, offset + length)已经写进输出文件 */
+    void mark(uint64_t offset, uint64_t length);
+    /* force时在调用的线程里fdatasync输出文件out_fd并写位图，
+     * 否则到时间时交给后台线程，马上返回，失败了下次再试，成功返回0失败返回-1 */
+    int sync(int out_fd, bool force);
+    /* 整个文件收完之后删掉日志 */
+    void remove();
+};
+
+#endif // __JOURNAL_H
@@ -0,0 +1,121 @@
+#include "linger.h"
+#include "util.h"
+#include <algorithm>
+#include <poll.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using namespace std;
+
+/* 一直不析构，进程退出时后台线程可能还在运行 */
+RtpLinger &RtpLinger::instance()
+{
+    static RtpLinger *linger = new RtpLinger();
+    return *linger;
+}
+
+void RtpLinger::add(int sockfd, const struct sockaddr_in &peer, const RtpHeader &fin_ack)
+{
+    int fd = dup(sockfd);
+    if (fd == -1)
+    {
+        LOG_DEBUG("RtpLinger dup() failed, FIN&ACK will not be resent\n");
+        return;
+    }
+    // 不再收数据了，FIN和ACK要一个一个收，合并之后校验不过
+    int off = 0;
+    setsockopt(fd, IPPROTO_UDP, UDP_GRO, &off, sizeof(off));
+    RtpLinger &linger = instance();
+    lock_guard<mutex> guard(linger.lock);
+    linger.entries.push_back({fd, peer, fin_ack, chrono::steady_clock::now() + chrono::milliseconds(RTP_LINGER_MS)});
+    if (!linger.running)
+    {
+        linger.running = true;
+        thread(&RtpLinger::run, &linger).detach();
+    }
+}
+
+void RtpLinger::drain()
+{
+    RtpLinger &linger = instance();
+    unique_lock<mutex> guard(linger.lock);
+    linger.cond.wait(guard, [&linger] { return !linger.running; });
+}
+
+bool RtpLinger::serve(Entry &entry)
+{
+    while (true)
+    {
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = recvfrom(entry.fd, buf, RTP_DGRAM_MAX, MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+        if (n < 0)
+        {
+            return false; // 读完了
+        }
+        if (from.sin_addr.s_addr != entry.peer.sin_addr.s_addr || from.sin_port != entry.peer.sin_port ||
+            Rtp::verify_packet(buf, n) == 0)
+        {
+            continue;
+        }
+        RtpHeader *header = (RtpHeader *)buf;
+        if (header->seq_num != entry.fin_ack.seq_num)
+        {
+            continue;
+        }
+        if (header->flags == RTP_ACK)
+        {
+            LOG_DEBUG("RtpLinger FIN&ACK %u acknowledged\n", header->seq_num);
+            return true;
+        }
+        if (header->flags == RTP_FIN)
+        {
+            LOG_DEBUG("RtpLinger resent FIN&ACK %u\n", header->seq_num);
+            sendto(entry.fd, &entry.fin_ack, sizeof(RtpHeader), 0, (struct sockaddr *)&entry.peer, sizeof(entry.peer));
+        }
+    }
+}
+
+/* 后台线程：poll所有连接的socket，新加入的连接最多等RTP_LINGER_POLL_MS才开始应答 */
+void RtpLinger::run()
+{
+    if (buf == nullptr)
+    {
+        buf = (char *)malloc(RTP_DGRAM_MAX); // 同一时间只有一个后台线程
+    }
+    unique_lock<mutex> guard(lock);
+    while (!entries.empty() && buf != nullptr)
+    {
+        auto now = chrono::steady_clock::now();
+        vector<struct pollfd> fds(entries.size());
+        int64_t timeout = RTP_LINGER_POLL_MS;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            fds[i].fd = entries[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            timeout = min<int64_t>(timeout, chrono::duration_cast<chrono::milliseconds>(entries[i].deadline - now).count());
+        }
+        guard.unlock();
+        poll(fds.data(), fds.size(), max<int64_t>(timeout, 0));
+        guard.lock();
+        // 只会在末尾加入新的连接，前fds.size()个还是原来的
+        now = chrono::steady_clock::now();
+        for (size_t i = fds.size(); i-- > 0;)
+        {
+            bool done = (fds[i].revents & POLLIN) && serve(entries[i]);
+            if (done || now >= entries[i].deadline)
+            {
+                close(entries[i].fd);
+                entries.erase(entries.begin() + i);
+            }
+        }
+    }
+    for (Entry &entry : entries)
+    {
+        close(entry.fd); // 分配不到缓冲区时直接放弃
+    }
+    entries.clear();
+    running = false;
+    cond.notify_all();
+}
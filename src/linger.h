@@ -0,0 +1,47 @@
+#ifndef __LINGER_H
+#define __LINGER_H
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <netinet/in.h>
+#include "rtp.h"
+
+#define RTP_LINGER_MS 2000  // 回复FIN&ACK之后最多继续应答重发的FIN这么久
+#define RTP_LINGER_POLL_MS 20 // 后台线程最多隔这么久看一次有没有新加入的连接
+
+/* 接收方挥手后的LINGER状态：wait_close回复FIN&ACK后把socket交给这里就返回，
+ * 后台线程替它应答重发的FIN（FIN&ACK丢了），收到对方最后的ACK或者超时后结束，
+ * socket先dup一份，调用者可以直接关掉自己的fd，但这段时间里不要再用它收包 */
+class RtpLinger
+{
+private:
+    struct Entry
+    {
+        int fd;
+        struct sockaddr_in peer;
+        RtpHeader fin_ack;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    std::vector<Entry> entries;
+    std::mutex lock;
+    std::condition_variable cond;
+    bool running = false; // 后台线程在运行，没有连接时退出
+    char *buf = nullptr;
+
+    RtpLinger() {}
+    static RtpLinger &instance();
+    void run();
+    bool serve(Entry &entry); // 处理entry的socket里排队的包，对方确认了返回true
+
+public:
+    /* 开始替sockfd上到peer的连接应答FIN，fin_ack为已经发出的FIN&ACK */
+    static void add(int sockfd, const struct sockaddr_in &peer, const RtpHeader &fin_ack);
+    /* 等所有连接结束，进程退出之前调用，对方都确认了时不用等到超时 */
+    static void drain();
+};
+
+#endif // __LINGER_H
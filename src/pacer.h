@@ -0,0 +1,65 @@
+#ifndef __PACER_H
+#define __PACER_H
+
+#include <cstdint>
+#include <algorithm>
+
+#define RTP_PACE_BURST_NS 1000000 // 令牌桶最多攒1ms的量，够一次sendmmsg批量发出
+#define RTP_PACE_MIN_BURST 3      // 令牌桶至少能放下这么多个包，一个数据包加上紧跟的校验包要能一起发
+
+/* 令牌桶，速率单位为字节/秒，时间单位为纳秒(steady_clock)
+ * 速率为0时不限速；新包、重传和校验包都要等令牌，
+ * 实际的包比预留的大时会稍微透支，之后的包要等透支还清 */
+class Pacer
+{
+private:
+    double rate = 0;   // 字节/秒
+    double tokens = 0; // 当前可发的字节数
+    double burst = 0;  // 令牌上限
+    int64_t last_ns = 0;
+
+public:
+    /* 设置速率，pkt_bytes为一个满包的大小，用来确定令牌桶大小 */
+    void set_rate(double bytes_per_sec, uint32_t pkt_bytes, int64_t now_ns)
+    {
+        refill(now_ns);
+        rate = bytes_per_sec > 0 ? bytes_per_sec : 0;
+        burst = std::max<double>(RTP_PACE_MIN_BURST * pkt_bytes, rate * RTP_PACE_BURST_NS / 1e9);
+        tokens = std::min(tokens, burst);
+    }
+    void refill(int64_t now_ns)
+    {
+        if (rate > 0 && last_ns != 0 && now_ns > last_ns)
+        {
+            tokens = std::min(burst, tokens + rate * (now_ns - last_ns) / 1e9);
+        }
+        last_ns = now_ns;
+    }
+    /* 重置成满桶，每次传输开始时调用 */
+    void reset(int64_t now_ns)
+    {
+        tokens = burst;
+        last_ns = now_ns;
+    }
+    bool limited() const { return rate > 0; }
+    double get_rate() const { return rate; }
+    bool can_send(uint32_t bytes) const { return rate == 0 || tokens >= bytes; }
+    void consume(uint32_t bytes)
+    {
+        if (rate > 0)
+        {
+            tokens -= bytes;
+        }
+    }
+    /* 攒够bytes字节的令牌还要等多少纳秒 */
+    int64_t wait_ns(uint32_t bytes) const
+    {
+        if (rate == 0 || tokens >= bytes)
+        {
+            return 0;
+        }
+        return (int64_t)((bytes - tokens) * 1e9 / rate) + 1;
+    }
+};
+
+#endif // __PACER_H
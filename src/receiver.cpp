@@ -1,13 +1,143 @@
 #include "rtp.h"
+#include "server.h"
+#include "linger.h"
 #include "util.h"
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <string>
+#include <thread>
+#include <vector>
 
-void receiver_routine(char **argv)
+#define RECEIVER_USAGE "Usage: ./receiver [-j stripes] [-J stats.json] [listen port] [file path, or output dir if the sender sends several files]\n" \
+                       "       ./receiver -s [-n files] [listen port] [output dir]\n" \
+                       "       ./receiver -S [-J stats.json] [listen port] [output dir]    (one connection carrying many transfers, see sender -S)\n" \
+                       "       (-J: write the connection statistics as JSON when done, - for stdout)\n"
+
+/* 分段接收时每一段的结果 */
+struct StripeResult
+{
+    int ret;
+    uint64_t offset;  // 这一段在文件中的起始偏移
+    uint64_t end;     // 这一段在文件中的结束偏移
+    double seconds;   // recv_file用的时间
+    std::string stats; // 这一段连接的统计(JSON)
+};
+
+/* 第index段在port + index上接收，写进file_path的对应位置 */
+void stripe_routine(int port, int index, const char *file_path, RtpJournal *journal, StripeResult *result)
+{
+    result->ret = -1;
+    int sockfd;
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        LOG_DEBUG("stripe %d socket() failed\n", index);
+        return;
+    }
+    struct sockaddr_in receiver_addr;
+    receiver_addr.sin_family = AF_INET;
+    receiver_addr.sin_addr.s_addr = INADDR_ANY;
+    receiver_addr.sin_port = htons(port + index);
+    if (bind(sockfd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) < 0)
+    {
+        LOG_DEBUG("stripe %d bind() failed\n", index);
+        close(sockfd);
+        return;
+    }
+    Rtp rtp(sockfd);
+    rtp.set_journal(journal);
+    if (rtp.wait_connect() == -1 || !rtp.is_striped())
+    {
+        LOG_DEBUG("stripe %d wait_connect failed or peer is not sending stripes\n", index);
+        close(sockfd);
+        return;
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    result->ret = rtp.recv_file(file_path);
+    std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start_time;
+    result->seconds = elapsed_seconds.count();
+    result->offset = rtp.get_stripe_offset();
+    result->end = rtp.get_recv_end();
+    if (result->ret == 0 && rtp.wait_close() == -1)
+    {
+        LOG_DEBUG("stripe %d wait_close failed\n", index); // 数据已经收完了，不影响
+    }
+    result->stats = rtp.get_stats().to_json();
+    close(sockfd);
+}
+
+/* 分段接收：stripes个线程各自在一个端口上接收文件的一段，
+ * 全部收完后按最大的结束偏移截断文件，各段共用一个续传日志 */
+void striped_receiver_routine(char **argv, int stripes, const char *stats_path)
 {
-    int port = atoi(argv[1]);
-    char *file_path = argv[2];
+    int port = atoi(argv[0]);
+    char *file_path = argv[1];
+    RtpJournal journal(file_path);
+    // 各段不截断文件，先在这里清空，有日志时可能要续传，留着
+    int fd = open(file_path, journal.exists() ? O_WRONLY | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        LOG_FATAL("striped_receiver_routine failed to open file\n");
+    }
+    std::vector<StripeResult> results(stripes);
+    std::vector<std::thread> threads;
+    auto start_time = std::chrono::steady_clock::now();
+    for (int i = 0; i < stripes; i++)
+    {
+        threads.emplace_back(stripe_routine, port, i, file_path, &journal, &results[i]);
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start_time;
+    uint64_t file_size = 0, total = 0;
+    for (int i = 0; i < stripes; i++)
+    {
+        if (results[i].ret != 0)
+        {
+            close(fd);
+            LOG_FATAL("striped_receiver_routine stripe %d failed\n", i);
+        }
+        uint64_t bytes = results[i].end - results[i].offset;
+        LOG_MSG("Stripe %d: %lu Bytes at offset %lu in %.2f seconds, %.2f MB/s\n", i, bytes, results[i].offset,
+                results[i].seconds, results[i].seconds > 0 ? bytes / results[i].seconds / 1e6 : 0.0);
+        file_size = std::max(file_size, results[i].end);
+        total += bytes;
+    }
+    if (ftruncate(fd, file_size) == -1)
+    {
+        close(fd);
+        LOG_FATAL("striped_receiver_routine ftruncate() failed\n");
+    }
+    close(fd);
+    journal.remove(); // 收完了，下次从头开始
+    LOG_MSG("File size %lu Bytes received over %d stripes in %.2f seconds\n", total, stripes, elapsed_seconds.count());
+    if (stats_path != nullptr)
+    {
+        // 每段一个连接，按段的顺序放进一个数组
+        std::string json = "[";
+        for (int i = 0; i < stripes; i++)
+        {
+            json += (i > 0 ? "," : "") + results[i].stats;
+        }
+        json += "]";
+        if (rtp_write_json(stats_path, json) == -1)
+        {
+            LOG_FATAL("striped_receiver_routine failed to write stats to %s\n", stats_path);
+        }
+    }
+}
+
+/* server为true时file_path是保存文件的目录，同时接收多个发送方，
+ * 收完max_files个文件后退出（0为一直运行），这时没有统计输出 */
+void receiver_routine(char **argv, bool server, int max_files, const char *stats_path)
+{
+    int port = atoi(argv[0]);
+    char *file_path = argv[1];
     int sockfd;
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
     {
@@ -31,35 +161,179 @@ void receiver_routine(char **argv)
         close(sockfd);
     }
     LOG_DEBUG("RTP receiver is listening on port %d...\n", port);
+    if (server)
+    {
+        RtpServer rtp_server(sockfd, file_path);
+        if (rtp_server.run(max_files) == -1)
+        {
+            close(sockfd);
+            LOG_FATAL("receiver_routine server failed\n");
+        }
+        close(sockfd);
+        return;
+    }
+    RtpJournal journal(file_path); // 对方要续传时才用
     Rtp rtp(sockfd);
+    rtp.set_journal(&journal);
     if (rtp.wait_connect() == -1)
     {
         close(sockfd);
         LOG_FATAL("receiver_routine wait_connect failed\n");
     }
     LOG_DEBUG("RTP receiver connected\n");
-    if (rtp.recv_file(file_path) != 0)
+    // 对方发多个文件时file_path是输出目录，先收进旁边的一个文件
+    std::string spool = std::string(file_path) + RTP_BUNDLE_SUFFIX;
+    if (rtp.recv_file(rtp.is_bundle() ? spool.c_str() : file_path) != 0)
     {
         close(sockfd);
         LOG_FATAL("receiver_routine recv_file failed\n");
     }
+    journal.remove(); // 收完了，下次从头开始
     LOG_DEBUG("RTP receiver received file\n");
     if (rtp.wait_close() == -1)
     {
         close(sockfd);
         LOG_FATAL("receiver_routine wait_close failed\n");
     }
+    if (rtp.is_bundle() && RtpBundle::extract(spool.c_str(), file_path) == -1)
+    {
+        close(sockfd);
+        LOG_FATAL("receiver_routine failed to extract files into %s\n", file_path);
+    }
     close(sockfd);
+    if (stats_path != nullptr && rtp_write_json(stats_path, rtp.get_stats().to_json()) == -1)
+    {
+        LOG_FATAL("receiver_routine failed to write stats to %s\n", stats_path);
+    }
     return;
 }
 
+/* 会话里对方给的名字只能是输出目录里的一个文件名 */
+static bool session_name_ok(const char *name)
+{
+    return name[0] != '\0' && strchr(name, '/') == nullptr && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/* 会话：一个连接依次收多个文件或目录，都放在output dir里，对方发FIN或者空闲太久时结束 */
+void session_receiver_routine(char **argv, const char *stats_path)
+{
+    int port = atoi(argv[0]);
+    char *dir = argv[1];
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        LOG_FATAL("session_receiver_routine failed to create %s\n", dir);
+    }
+    int sockfd;
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        LOG_FATAL("socket() failed\n");
+    }
+    struct sockaddr_in receiver_addr;
+    receiver_addr.sin_family = AF_INET;
+    receiver_addr.sin_addr.s_addr = INADDR_ANY;
+    receiver_addr.sin_port = htons(port);
+    if (bind(sockfd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) < 0)
+    {
+        close(sockfd);
+        LOG_FATAL("bind() failed\n");
+    }
+    Rtp rtp(sockfd);
+    rtp.set_session(true);
+    if (rtp.wait_connect() == -1 || !rtp.is_session())
+    {
+        close(sockfd);
+        LOG_FATAL("session_receiver_routine wait_connect failed or peer did not ask for a session\n");
+    }
+    int count = 0;
+    RtpTransfer xfr;
+    int ret;
+    while ((ret = rtp.wait_transfer(&xfr)) == 0)
+    {
+        count++;
+        std::string name = session_name_ok(xfr.name) ? xfr.name : "transfer_" + std::to_string(count);
+        std::string path = std::string(dir) + "/" + name;
+        // 多个文件先收进一个暂存文件，收完拆到输出目录里
+        if (xfr.bundle)
+        {
+            path += RTP_BUNDLE_SUFFIX;
+        }
+        if (rtp.recv_transfer(path.c_str()) != 0)
+        {
+            close(sockfd);
+            LOG_FATAL("session_receiver_routine failed to receive %s\n", path.c_str());
+        }
+        if (xfr.bundle && RtpBundle::extract(path.c_str(), dir) == -1)
+        {
+            close(sockfd);
+            LOG_FATAL("session_receiver_routine failed to extract files into %s\n", dir);
+        }
+    }
+    if (ret == -1)
+    {
+        close(sockfd);
+        LOG_FATAL("session_receiver_routine wait_transfer failed\n");
+    }
+    LOG_MSG("Session received %d transfers\n", count);
+    if (rtp.wait_close() == -1)
+    {
+        LOG_DEBUG("session_receiver_routine wait_close failed\n"); // 空闲超时时对方不会再发FIN
+    }
+    close(sockfd);
+    if (stats_path != nullptr && rtp_write_json(stats_path, rtp.get_stats().to_json()) == -1)
+    {
+        LOG_FATAL("session_receiver_routine failed to write stats to %s\n", stats_path);
+    }
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 3)
+    bool server = false;
+    int max_files = 0;
+    int stripes = 1;
+    bool session = false;
+    const char *stats_path = nullptr; // 结束时把统计写成JSON
+    int opt;
+    while ((opt = getopt(argc, argv, "sn:j:SJ:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'J':
+            stats_path = optarg;
+            break;
+        case 'S':
+            session = true;
+            break;
+        case 'j':
+            stripes = atoi(optarg);
+            break;
+        case 's':
+            server = true;
+            break;
+        case 'n':
+            max_files = atoi(optarg);
+            break;
+        default:
+            LOG_FATAL(RECEIVER_USAGE);
+        }
+    }
+    if (argc - optind != 2 || stripes < 1 || (server && stripes > 1) || (session && (server || stripes > 1)) ||
+        (server && stats_path != nullptr))
+    {
+        LOG_FATAL(RECEIVER_USAGE);
+    }
+    if (session)
+    {
+        session_receiver_routine(argv + optind, stats_path);
+    }
+    else if (stripes > 1)
+    {
+        striped_receiver_routine(argv + optind, stripes, stats_path);
+    }
+    else
     {
-        LOG_FATAL("Usage: ./receiver [listen port] [file path]\n");
+        receiver_routine(argv + optind, server, max_files, stats_path);
     }
-    receiver_routine(argv);
+    RtpLinger::drain(); // 对方确认了FIN&ACK或者超时之后再退出
 
     LOG_DEBUG("Receiver: exiting...\n");
     return 0;
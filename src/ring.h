@@ -0,0 +1,179 @@
+#ifndef __RING_H
+#define __RING_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+/* 以seq & mask为下标的定长位图，表示窗口[base, base + capacity)内每个包的状态
+ * 使用者保证只访问当前窗口，窗口滑过的位要clear_range掉以便复用 */
+class SeqBitmap
+{
+private:
+    uint64_t *bits = nullptr;
+    uint32_t mask = 0;
+
+public:
+    SeqBitmap() {}
+    ~SeqBitmap() { free(bits); }
+    SeqBitmap(const SeqBitmap &) = delete;
+    SeqBitmap &operator=(const SeqBitmap &) = delete;
+
+    /* 容量向上取到2的幂且至少64，成功返回0失败返回-1 */
+    int init(uint32_t capacity)
+    {
+        uint32_t cap = 64;
+        while (cap < capacity)
+            cap <<= 1;
+        free(bits);
+        bits = (uint64_t *)calloc(cap / 64, sizeof(uint64_t));
+        mask = bits ? cap - 1 : 0;
+        return bits ? 0 : -1;
+    }
+    void reset()
+    {
+        if (bits)
+            memset(bits, 0, ((size_t)mask + 1) / 8);
+    }
+    uint32_t capacity() const { return mask + 1; }
+    bool test(int64_t seq) const
+    {
+        uint32_t i = (uint32_t)seq & mask;
+        return (bits[i >> 6] >> (i & 63)) & 1;
+    }
+    void set(int64_t seq)
+    {
+        uint32_t i = (uint32_t)seq & mask;
+        bits[i >> 6] |= (uint64_t)1 << (i & 63);
+    }
+    void clear(int64_t seq)
+    {
+        uint32_t i = (uint32_t)seq & mask;
+        bits[i >> 6] &= ~((uint64_t)1 << (i & 63));
+    }
+    /* 清掉[from, to)的位，按字处理 */
+    void clear_range(int64_t from, int64_t to)
+    {
+        if (to - from >= (int64_t)capacity())
+        {
+            reset();
+            return;
+        }
+        while (from < to)
+        {
+            uint32_t i = (uint32_t)from & mask;
+            uint32_t n = 64 - (i & 63);
+            if ((int64_t)n > to - from)
+                n = to - from;
+            uint64_t m = n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1) << (i & 63);
+            bits[i >> 6] &= ~m;
+            from += n;
+        }
+    }
+    /* [from, limit)里第一个为0的位对应的seq，全为1时返回limit
+     * 每次看一个64位字，用ctz找第一个0 */
+    int64_t first_zero(int64_t from, int64_t limit) const
+    {
+        while (from < limit)
+        {
+            uint32_t i = (uint32_t)from & mask;
+            uint64_t w = ~bits[i >> 6] >> (i & 63);
+            if (w != 0)
+            {
+                int64_t seq = from + __builtin_ctzll(w);
+                return seq < limit ? seq : limit;
+            }
+            from += 64 - (i & 63);
+        }
+        return limit;
+    }
+    /* [from, limit)里第一个为1的位对应的seq，全为0时返回limit */
+    int64_t first_one(int64_t from, int64_t limit) const
+    {
+        while (from < limit)
+        {
+            uint32_t i = (uint32_t)from & mask;
+            uint64_t w = bits[i >> 6] >> (i & 63);
+            if (w != 0)
+            {
+                int64_t seq = from + __builtin_ctzll(w);
+                return seq < limit ? seq : limit;
+            }
+            from += 64 - (i & 63);
+        }
+        return limit;
+    }
+};
+
+/* 连续分配的定长包槽，seq对应的槽为slots[seq & mask]，
+ * 容量为2的幂，窗口大小不能超过容量 */
+template <typename Slot>
+class SlotRing
+{
+private:
+    Slot *slots = nullptr;
+    uint32_t mask = 0;
+
+public:
+    SlotRing() {}
+    ~SlotRing() { free(slots); }
+    SlotRing(const SlotRing &) = delete;
+    SlotRing &operator=(const SlotRing &) = delete;
+
+    int init(uint32_t capacity)
+    {
+        uint32_t cap = 1;
+        while (cap < capacity)
+            cap <<= 1;
+        free(slots);
+        slots = (Slot *)malloc((size_t)cap * sizeof(Slot));
+        mask = slots ? cap - 1 : 0;
+        return slots ? 0 : -1;
+    }
+    void release()
+    {
+        free(slots);
+        slots = nullptr;
+        mask = 0;
+    }
+    uint32_t capacity() const { return slots ? mask + 1 : 0; }
+    Slot *at(int64_t seq) { return &slots[(uint32_t)seq & mask]; }
+};
+
+/* 和SlotRing一样，但槽的大小在运行时决定，用于按协商出的payload大小存数据 */
+class ByteRing
+{
+private:
+    char *buf = nullptr;
+    uint32_t mask = 0;
+    uint32_t slot_size = 0;
+
+public:
+    ByteRing() {}
+    ~ByteRing() { free(buf); }
+    ByteRing(const ByteRing &) = delete;
+    ByteRing &operator=(const ByteRing &) = delete;
+
+    int init(uint32_t capacity, uint32_t size)
+    {
+        uint32_t cap = 1;
+        while (cap < capacity)
+            cap <<= 1;
+        free(buf);
+        buf = (char *)malloc((size_t)cap * size);
+        mask = buf ? cap - 1 : 0;
+        slot_size = buf ? size : 0;
+        return buf ? 0 : -1;
+    }
+    void release()
+    {
+        free(buf);
+        buf = nullptr;
+        mask = 0;
+        slot_size = 0;
+    }
+    uint32_t capacity() const { return buf ? mask + 1 : 0; }
+    char *at(int64_t seq) { return buf + (size_t)((uint32_t)seq & mask) * slot_size; }
+};
+
+#endif // __RING_H
@@ -1,5 +1,6 @@
 #include "rtp.h"
 #include "util.h"
+#include "trace.h"
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -12,6 +13,16 @@
 #include <fstream>
 #include <queue>
 #include <set>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <ctime>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/udp.h>
+#include "crc32.h"
+#include "linger.h"
 using namespace std;
 
 /* seq_num相关helper function */
@@ -38,6 +49,23 @@ inline uint32_t Rtp::dec_seq32(const uint32_t seq_num)
     }
 }
 
+#ifdef LDEBUG
+/* 测试代码，模拟丢包，丢包率为loss_rate%，返回true表示这个包当作丢了 */
+static bool simulate_loss(const RtpPacket *pkt)
+{
+    static random_device rd;
+    static mt19937 gen(rd());
+    uniform_int_distribution<> dist(0, 99); // [0~99]
+    int loss_rate = 0;
+    if (loss_rate > 0 && dist(gen) < loss_rate)
+    {
+        TRACE_PKT("send_packet simulated packet loss, seq_num %u, flags 0x%x\n", pkt->header.seq_num, pkt->header.flags);
+        return true;
+    }
+    return false;
+}
+#endif
+
 /* 接受一个RtpPacket或者RtpHeader并发送，取决于length字段
  * 仅在发送完整的情况下返回发送的包大小表示发送成功，
  * -1表示sendto失败或发送不完整 */
@@ -50,19 +78,8 @@ int Rtp::send_packet(void *buffer)
     }
     int ret;
 #ifdef LDEBUG
-    // 添加测试代码，模拟丢包，丢包率为loss_rate%
-    random_device rd;
-    mt19937 gen(rd());
-    uniform_int_distribution<> dist(0, 99); // [0~99]
-    int loss_rate = 0;
-    if (dist(gen) < loss_rate)
-    {
-        LOG_DEBUG("send_packet simulated packet loss, seqnum: %u, type: %s%s%s%s\n",
-                  pkt->header.seq_num,
-                  pkt->header.flags & RTP_SYN ? "SYN" : "",
-                  pkt->header.flags & RTP_ACK ? "ACK" : "",
-                  pkt->header.flags & RTP_FIN ? "FIN" : "",
-                  pkt->header.flags == RTP_DAT ? "DAT" : "");
+    if (simulate_loss(pkt))
+    {
         return pkt->header.length + sizeof(RtpHeader);
     }
 #endif
@@ -83,19 +100,464 @@ int Rtp::send_packet(void *buffer)
     }
     else
     {
-        LOG_DEBUG("send_packet Sent %s with seq_num %u\n",
-                  pkt->header.length > 0 ? "RtpPacket" : "Rtpheader", pkt->header.seq_num);
+        TRACE_PKT("send_packet Sent flags 0x%x, %d bytes with seq_num %u\n", pkt->header.flags, ret, pkt->header.seq_num);
+        this->stats.packets_sent.fetch_add(1, memory_order_relaxed);
+        this->stats.bytes_sent.fetch_add(ret, memory_order_relaxed);
         return ret; // success
     }
 }
 
-/* 接受一个至少为sizeof(RtpPacket)大小的buffer，
+/* 创建epoll和timerfd，sockfd和timerfd都注册为可读事件，
+ * 只在第一次用到时创建，成功返回0失败返回-1 */
+int Rtp::init_events()
+{
+    if (this->epfd != -1)
+    {
+        return 0;
+    }
+    this->epfd = epoll_create1(EPOLL_CLOEXEC);
+    this->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (this->epfd == -1 || this->timerfd == -1)
+    {
+        LOG_DEBUG("init_events epoll_create1()/timerfd_create() failed\n");
+        close_events();
+        return -1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = RTP_EV_SOCK;
+    if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1)
+    {
+        LOG_DEBUG("init_events epoll_ctl(sockfd) failed\n");
+        close_events();
+        return -1;
+    }
+    ev.data.u32 = RTP_EV_TIMER;
+    if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, this->timerfd, &ev) == -1)
+    {
+        LOG_DEBUG("init_events epoll_ctl(timerfd) failed\n");
+        close_events();
+        return -1;
+    }
+    this->timer_deadline = chrono::steady_clock::time_point();
+    return 0;
+}
+
+void Rtp::close_events()
+{
+    if (this->epfd != -1)
+    {
+        ::close(this->epfd);
+        this->epfd = -1;
+    }
+    if (this->timerfd != -1)
+    {
+        ::close(this->timerfd);
+        this->timerfd = -1;
+    }
+}
+
+/* 让timerfd在deadline时触发，deadline没变时不做系统调用，
+ * deadline为time_point()时关掉定时器 */
+void Rtp::arm_timer(chrono::steady_clock::time_point deadline)
+{
+    if (deadline == this->timer_deadline)
+    {
+        return;
+    }
+    this->timer_deadline = deadline;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (deadline != chrono::steady_clock::time_point())
+    {
+        int64_t ns = chrono::duration_cast<chrono::nanoseconds>(deadline - chrono::steady_clock::now()).count();
+        ns = max<int64_t>(ns, 1); // it_value全为0会关掉定时器
+        its.it_value.tv_sec = ns / 1000000000;
+        its.it_value.tv_nsec = ns % 1000000000;
+    }
+    timerfd_settime(this->timerfd, 0, &its, nullptr);
+}
+
+/* 等待socket可读或者定时器触发，至多等待timeout毫秒(-1为一直等)，
+ * 返回RTP_EV_SOCK/RTP_EV_TIMER的组合，超时返回0，epoll错误返回-1 */
+int Rtp::wait_events(int timeout)
+{
+    struct epoll_event evs[2];
+    int n = epoll_wait(this->epfd, evs, 2, timeout);
+    if (n == -1)
+    {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
+        LOG_DEBUG("wait_events epoll_wait() failed\n");
+        return -1;
+    }
+    int ret = 0;
+    for (int i = 0; i < n; i++)
+    {
+        ret |= evs[i].data.u32;
+        if (evs[i].data.u32 == RTP_EV_TIMER)
+        {
+            uint64_t expirations;
+            if (read(this->timerfd, &expirations, sizeof(expirations)) == -1)
+            {
+                LOG_DEBUG("wait_events read(timerfd) failed, ignored\n");
+            }
+            this->timer_deadline = chrono::steady_clock::time_point(); // 单次定时器，触发后就失效了
+        }
+    }
+    return ret;
+}
+
+/* steady_clock纳秒，用于定时器和令牌桶 */
+static int64_t steady_ns(chrono::steady_clock::time_point t)
+{
+    return chrono::duration_cast<chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+/* CLOCK_REALTIME纳秒，和SO_TIMESTAMPNS给出的内核时间戳是同一个时钟 */
+int64_t Rtp::now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 批量收发的缓冲区在第一次用到时分配 */
+RtpIoBatch *Rtp::get_io()
+{
+    if (this->io == nullptr)
+    {
+        this->io = alloc_io();
+    }
+    return this->io;
+}
+
+/* 收包缓冲区先按PAYLOAD_MAX分配，握手协商出更大的payload后再用size_rx换大 */
+RtpIoBatch *Rtp::alloc_io()
+{
+    RtpIoBatch *io = (RtpIoBatch *)calloc(1, sizeof(RtpIoBatch));
+    if (io != nullptr && size_rx(io, sizeof(RtpPacket), RTP_BATCH) == -1)
+    {
+        free(io);
+        return nullptr;
+    }
+    return io;
+}
+
+/* 把收包缓冲区换成batch个slot大小的槽，已经是这么大时什么都不做
+ * 成功返回0，失败返回-1，失败时原来的缓冲区保持不变 */
+int Rtp::size_rx(RtpIoBatch *io, int slot, int batch)
+{
+    if (io->rx_buf != nullptr && io->rx_slot == slot && io->rx_batch == batch)
+    {
+        return 0;
+    }
+    char *buf = (char *)malloc((size_t)slot * batch);
+    if (buf == nullptr)
+    {
+        return -1;
+    }
+    free(io->rx_buf);
+    io->rx_buf = buf;
+    io->rx_slot = slot;
+    io->rx_batch = batch;
+    return 0;
+}
+
+void Rtp::free_io(RtpIoBatch *io)
+{
+    if (io != nullptr)
+    {
+        free(io->rx_buf);
+        free(io);
+    }
+}
+
+/* 开启UDP_GRO，内核会把同一条流连续到达的同样大小的数据报合并成一个，
+ * 收包缓冲区要换成RTP_GRO_MSGS个RTP_GRO_BUF大小的槽，recv_raw再按gso_size拆开
+ * 成功返回0，内核不支持时返回-1，继续按单个数据报收 */
+int Rtp::enable_gro(int sockfd, RtpIoBatch *io)
+{
+    if (io->gro)
+    {
+        return 0;
+    }
+    if (size_rx(io, RTP_GRO_BUF, RTP_GRO_MSGS) == -1)
+    {
+        return -1;
+    }
+    int on = 1;
+    if (setsockopt(sockfd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) == -1)
+    {
+        LOG_DEBUG("enable_gro() UDP_GRO not supported\n");
+        return -1;
+    }
+    io->gro = true;
+    LOG_DEBUG("enable_gro() UDP_GRO enabled\n");
+    return 0;
+}
+
+/* 把一个RtpPacket放进发送队列，不拷贝，flush_packets之前buffer必须保持有效
+ * 队列满了会先flush，成功返回0，失败返回-1 */
+int Rtp::queue_packet(void *buffer)
+{
+    RtpPacket *pkt = (RtpPacket *)buffer;
+    if (pkt == nullptr)
+    {
+        return -1;
+    }
+    return queue_iov(&pkt->header, pkt->payload);
+}
+
+/* 把header和header->length字节的payload作为两个iovec放进发送队列，都不拷贝，
+ * flush_packets之前两者都必须保持有效，成功返回0，失败返回-1 */
+int Rtp::queue_iov(const RtpHeader *header, const char *payload)
+{
+    RtpIoBatch *io = get_io();
+    if (io == nullptr)
+    {
+        return -1;
+    }
+#ifdef LDEBUG
+    if (simulate_loss((const RtpPacket *)header)) // 只看header
+    {
+        return 0;
+    }
+#endif
+    if (io->tx_count == RTP_BATCH && flush_packets() == -1)
+    {
+        return -1;
+    }
+    int i = io->tx_count++;
+    io->tx_iov[2 * i].iov_base = (void *)header;
+    io->tx_iov[2 * i].iov_len = sizeof(RtpHeader);
+    io->tx_iov[2 * i + 1].iov_base = (void *)payload;
+    io->tx_iov[2 * i + 1].iov_len = header->length;
+    io->tx_len[i] = sizeof(RtpHeader) + header->length;
+    return 0;
+}
+
+/* 把一个控制包（header加不超过RTP_CTRL_MAX的选项）拷贝进发送队列，
+ * 用于栈上临时构造的ACK */
+int Rtp::queue_copy(const void *buffer)
+{
+    const RtpPacket *pkt = (const RtpPacket *)buffer;
+    RtpIoBatch *io = get_io();
+    if (io == nullptr || pkt->header.length > RTP_CTRL_MAX)
+    {
+        return -1;
+    }
+    if (io->tx_count == RTP_BATCH && flush_packets() == -1)
+    {
+        return -1;
+    }
+    char *copy = io->tx_ctrl[io->tx_count]; // 每个队列位置对应一个控制包存储
+    memcpy(copy, pkt, sizeof(RtpHeader) + pkt->header.length);
+    return queue_packet(copy);
+}
+
+/* 把第first个包开始的包组装成tx_msgs，返回msg个数
+ * 开启offload时连续的满包（最后一个可以不满，但不能比满包大，比如校验包）合成一个msg，
+ * 带上UDP_SEGMENT让内核按packet_bytes()切开，一次走完协议栈
+ * 合起来不能超过一个UDP数据报的大小，payload很大时就不合并了 */
+int Rtp::build_tx_msgs(int first)
+{
+    RtpIoBatch *io = this->io;
+    int msgs = 0;
+    int max_segs = min<int>(RTP_GSO_SEGS, RTP_DGRAM_MAX / packet_bytes());
+    for (int i = first; i < io->tx_count; msgs++)
+    {
+        int segs = 1;
+        while (this->offload && i + segs < io->tx_count && segs < max_segs &&
+               io->tx_len[i + segs - 1] == (int)packet_bytes() && io->tx_len[i + segs] <= (int)packet_bytes())
+        {
+            segs++;
+        }
+        struct msghdr *msg = &io->tx_msgs[msgs].msg_hdr;
+        memset(&io->tx_msgs[msgs], 0, sizeof(struct mmsghdr));
+        msg->msg_name = &this->dest_addr;
+        msg->msg_namelen = this->addrlen;
+        msg->msg_iov = &io->tx_iov[2 * i];
+        msg->msg_iovlen = 2 * segs;
+        if (segs > 1)
+        {
+            msg->msg_control = io->tx_gso_ctrl[msgs];
+            msg->msg_controllen = sizeof(io->tx_gso_ctrl[msgs]);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gso_size = packet_bytes();
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+        io->tx_first[msgs] = i;
+        i += segs;
+    }
+    return msgs;
+}
+
+/* 用一次sendmmsg发出队列里的所有包，成功返回0，失败返回-1
+ * 内核或网卡不支持UDP_SEGMENT时关掉offload，剩下的包按单个数据报重发 */
+int Rtp::flush_packets()
+{
+    RtpIoBatch *io = this->io;
+    if (io == nullptr || io->tx_count == 0)
+    {
+        return 0;
+    }
+    int first = 0; // 第一个还没发出去的包
+    while (first < io->tx_count)
+    {
+        int msgs = build_tx_msgs(first);
+        int ret = sendmmsg(sockfd, io->tx_msgs, msgs, 0);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (io->tx_msgs[0].msg_hdr.msg_control != nullptr &&
+                (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+            {
+                LOG_DEBUG("flush_packets UDP_SEGMENT not supported, offload disabled\n");
+                this->offload = false;
+                continue;
+            }
+            LOG_DEBUG("sendmmsg() failed\n");
+            io->tx_count = 0;
+            return -1;
+        }
+        first = ret < msgs ? io->tx_first[ret] : io->tx_count;
+    }
+    TRACE_PKT("flush_packets Sent %d packets with one sendmmsg\n", io->tx_count);
+    uint64_t bytes = 0;
+    for (int i = 0; i < io->tx_count; i++)
+    {
+        bytes += io->tx_len[i];
+    }
+    this->stats.packets_sent.fetch_add(io->tx_count, memory_order_relaxed);
+    this->stats.bytes_sent.fetch_add(bytes, memory_order_relaxed);
+    io->tx_count = 0;
+    return 0;
+}
+
+/* 非阻塞，用recvmmsg从sockfd一次取出最多io->rx_batch个数据报放进io->rx_buf，
+ * 开启UDP_GRO时每个槽可能是合并的多个数据报，再按gso_size拆成单个数据报，
+ * 不做校验，拆出的数据报放在io->rx_dgrams里，
+ * 返回拆出的个数（同时记在io->rx_raw），没有数据报时返回0，错误返回-1 */
+int Rtp::recv_raw(int sockfd, RtpIoBatch *io)
+{
+    int batch = io->rx_batch;
+    for (int i = 0; i < batch; i++)
+    {
+        io->rx_iov[i].iov_base = io->rx_buf + (size_t)i * io->rx_slot;
+        io->rx_iov[i].iov_len = io->rx_slot;
+        memset(&io->rx_msgs[i], 0, sizeof(struct mmsghdr));
+        io->rx_msgs[i].msg_hdr.msg_name = &io->rx_addrs[i];
+        io->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        io->rx_msgs[i].msg_hdr.msg_iov = &io->rx_iov[i];
+        io->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        io->rx_msgs[i].msg_hdr.msg_control = io->rx_ctrl[i];
+        io->rx_msgs[i].msg_hdr.msg_controllen = sizeof(io->rx_ctrl[i]);
+    }
+    io->rx_raw = 0;
+    io->rx_drained = true;
+    int ret = recvmmsg(sockfd, io->rx_msgs, batch, MSG_DONTWAIT, nullptr);
+    if (ret == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return 0;
+        }
+        LOG_DEBUG("recvmmsg() failed\n");
+        return -1;
+    }
+    io->rx_drained = ret < batch;
+    int count = 0;
+    for (int i = 0; i < ret; i++)
+    {
+        struct msghdr *msg = &io->rx_msgs[i].msg_hdr;
+        int len = io->rx_msgs[i].msg_len;
+        int seg = len; // 没有被合并时整个就是一个数据报
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+            {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                seg = gso_size > 0 ? gso_size : len;
+            }
+        }
+        char *buf = (char *)io->rx_iov[i].iov_base;
+        int off = 0;
+        do
+        {
+            if (count == RTP_RX_MAX) // 很小的包也可能被合并，放不下的当作丢了
+            {
+                LOG_DEBUG("recv_raw too many coalesced datagrams, dropped\n");
+                break;
+            }
+            io->rx_dgrams[count] = (RtpPacket *)(buf + off);
+            io->rx_lens[count] = min(seg, len - off);
+            io->rx_src[count] = i;
+            count++;
+            off += seg;
+        } while (off < len);
+    }
+    io->rx_raw = count;
+    return count;
+}
+
+/* 非阻塞，用recv_raw取一批数据报，
+ * 校验通过的包放在io->rx_pkts里，返回校验通过的个数，没有数据报时返回0，
+ * recvmmsg错误返回-1，io->rx_raw为实际取到的数据报个数 */
+int Rtp::recv_batch()
+{
+    RtpIoBatch *io = get_io();
+    if (io == nullptr)
+    {
+        return -1;
+    }
+    int ret = recv_raw(sockfd, io);
+    if (ret <= 0)
+    {
+        return ret;
+    }
+    int valid = 0;
+    for (int i = 0; i < ret; i++)
+    {
+        int src = io->rx_src[i];
+        if (check_packet(io->rx_dgrams[i], io->rx_lens[i],
+                         io->rx_addrs[src], io->rx_msgs[src].msg_hdr.msg_namelen) > 0)
+        {
+            io->rx_ns[valid] = 0;
+            struct msghdr *msg = &io->rx_msgs[src].msg_hdr;
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(msg, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+                {
+                    struct timespec ts;
+                    memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                    io->rx_ns[valid] = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+                }
+            }
+            io->rx_pkts[valid++] = io->rx_dgrams[i];
+        }
+    }
+    TRACE_PKT("recv_batch Received %d datagrams, %d valid\n", ret, valid);
+    return valid;
+}
+
+/* 接受一个大小为size的buffer，默认为sizeof(RtpPacket)，更大的包会被截断然后当作大小不正确，
  * **非阻塞**
  * 没收到包/CRC错误/大小不正确/不是来自目标主机返回0，
  * recvfrom错误/buffer为nullptr返回-1，
  * 成功接受完整的包且CRC校验通过时返回包大小
  * 第一次收到RTP_SYN的正确报文会记录Rtp类的dest_addr和addrlen */
-int Rtp::recv_packet(void *buffer)
+int Rtp::recv_packet(void *buffer, size_t size)
 {
     if (buffer == nullptr)
     {
@@ -103,79 +565,88 @@ int Rtp::recv_packet(void *buffer)
     }
     int ret;
     struct sockaddr_in dest_addr;
-    socklen_t addrlen;
-    ret = recvfrom(sockfd, buffer, sizeof(RtpPacket),
+    socklen_t addrlen = sizeof(dest_addr); // recvfrom要求传入缓冲区大小
+    ret = recvfrom(sockfd, buffer, size,
                    MSG_DONTWAIT, (struct sockaddr *)&dest_addr, &addrlen); // 非阻塞
     if (ret == -1)
     {
         LOG_DEBUG("recvfrom() failed\n");
         return -1; // recvfrom错误
     }
-    else if ((uint32_t)ret >= sizeof(RtpHeader) && (uint32_t)ret <= sizeof(RtpPacket))
-    {
-        RtpPacket *pkt = (RtpPacket *)buffer;
-        uint32_t checksum = pkt->header.checksum;
-        pkt->header.checksum = 0; // 先清零再计算checksum
-        if (pkt->header.length > PAYLOAD_MAX || compute_checksum(pkt, pkt->header.length + sizeof(RtpHeader)) != checksum)
-        {
-            LOG_DEBUG("recv_packet Received %s with seq_num %u, checksum error\n",
-                      ret == sizeof(RtpPacket) ? "RtpPacket" : "RtpHeader",
-                      pkt->header.seq_num);
-            return 0; // checksum 错误
-        }
-        LOG_DEBUG("recv_packet successfully Received %s %s%s%s%s with seq_num %u\n",
-                  pkt->header.length > 0 ? "RtpPacket" : "RtpHeader",
-                  pkt->header.flags & RTP_SYN ? "SYN" : "",
-                  pkt->header.flags & RTP_ACK ? "ACK" : "",
-                  pkt->header.flags & RTP_FIN ? "FIN" : "",
-                  pkt->header.flags == RTP_DAT ? "DAT" : "",
-                  pkt->header.seq_num);
-        pkt->header.checksum = checksum;
-        if (this->addrlen != 0) // 已经有连接，需要检查是否来自对方
-        {
-            if (dest_addr.sin_addr.s_addr != this->dest_addr.sin_addr.s_addr ||
-                dest_addr.sin_port != this->dest_addr.sin_port)
-            {
-                char ip_str[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &(this->dest_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
-                LOG_DEBUG("recv_packet Received %s , from %s %d, not from dest_addr\n",
-                          ret == sizeof(RtpPacket) ? "RtpPacket" : "RtpHeader",
-                          ip_str, ntohs(this->dest_addr.sin_port));
-                return 0; // 不是来自目标主机
-            }
-            // 如果是fin，记录一下，方便收方知晓数据传输完成
-            if (pkt->header.flags == RTP_FIN)
-            {
-                if (this->fin_received == false)
-                {
-                    LOG_DEBUG("recv_packet Received FIN for the first time with seq_num %u\n", pkt->header.seq_num);
-                    this->fin_seq = seq32to64(pkt->header.seq_num);
-                    this->fin_received = true;
-                }
-            }
+    return check_packet(buffer, ret, dest_addr, addrlen);
+}
+
+/* 只检查大小和CRC，不看来源，正确时返回包大小，否则返回0
+ * 服务端在还没有连接对象时用它过滤SYN */
+int Rtp::verify_packet(void *buffer, int ret)
+{
+    if ((uint32_t)ret < sizeof(RtpHeader) || (uint32_t)ret > RTP_DGRAM_MAX)
+    {
+        TRACE_PKT("verify_packet Received %d bytes, dissatisfying RtpPacket neither RtpHeader\n", ret);
+        return 0; // 大小错误
+    }
+    RtpPacket *pkt = (RtpPacket *)buffer;
+    uint32_t checksum = pkt->header.checksum;
+    pkt->header.checksum = 0; // 先清零再计算checksum
+    if (pkt->header.length + sizeof(RtpHeader) != (uint32_t)ret ||
+        compute_checksum(pkt, pkt->header.length + sizeof(RtpHeader)) != checksum)
+    {
+        TRACE_PKT("verify_packet Received %d bytes with seq_num %u, checksum error\n", ret, pkt->header.seq_num);
+        return 0; // checksum 错误
+    }
+    TRACE_PKT("verify_packet Received flags 0x%x, %d bytes with seq_num %u\n", pkt->header.flags, ret, pkt->header.seq_num);
+    pkt->header.checksum = checksum;
+    return ret;
+}
+
+/* 检查一个已经收到的大小为ret的包，返回值同recv_packet，
+ * CRC错误/大小不正确/不是来自目标主机返回0，正确时返回包大小 */
+int Rtp::check_packet(void *buffer, int ret, const struct sockaddr_in &dest_addr, socklen_t addrlen)
+{
+    if (verify_packet(buffer, ret) == 0)
+    {
+        this->stats.checksum_failures.fetch_add(1, memory_order_relaxed);
+        return 0;
+    }
+    RtpPacket *pkt = (RtpPacket *)buffer;
+    if (this->addrlen != 0) // 已经有连接，需要检查是否来自对方
+    {
+        if (dest_addr.sin_addr.s_addr != this->dest_addr.sin_addr.s_addr ||
+            dest_addr.sin_port != this->dest_addr.sin_port)
+        {
+            TRACE_PKT("check_packet Received %d bytes from %08x:%u, not from dest_addr\n",
+                      ret, ntohl(dest_addr.sin_addr.s_addr), ntohs(dest_addr.sin_port));
+            return 0; // 不是来自目标主机
         }
-        if (pkt->header.flags == RTP_SYN && this->addrlen == 0) // 包正确，是SYN包且未记录过addrlen
+        // 如果是fin，记录一下，方便收方知晓数据传输完成
+        if (pkt->header.flags == RTP_FIN)
         {
-            this->dest_addr = dest_addr;
-            this->addrlen = addrlen;
-            char ip_str[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &(this->dest_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
-            LOG_DEBUG("recv_packet Recorded dest_addr and addrlen: %s %d\n", ip_str, ntohs(this->dest_addr.sin_port));
+            if (this->fin_received == false)
+            {
+                TRACE_EVT("check_packet Received FIN for the first time with seq_num %u\n", pkt->header.seq_num);
+                this->fin_seq = seq32to64(pkt->header.seq_num);
+                this->fin_received = true;
+            }
         }
-        this->last_recv_time = chrono::steady_clock::now(); // 更新最后接收时间
-        return ret;                                         // success
     }
-    else
+    if (pkt->header.flags == RTP_SYN && this->addrlen == 0) // 包正确，是SYN包且未记录过addrlen
     {
-        LOG_DEBUG("recvfrom() received %d bytes\n, dissatisfying RtpPacket neither RtpHeader", ret);
-        return 0; // 大小错误
+        this->dest_addr = dest_addr;
+        this->addrlen = addrlen;
+        char ip_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(this->dest_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
+        LOG_DEBUG("recv_packet Recorded dest_addr and addrlen: %s %d\n", ip_str, ntohs(this->dest_addr.sin_port));
     }
+    this->last_recv_time = chrono::steady_clock::now(); // 更新最后接收时间
+    this->stats.packets_received.fetch_add(1, memory_order_relaxed);
+    this->stats.bytes_received.fetch_add(ret, memory_order_relaxed);
+    return ret;                                         // success
 }
 
 /* 打包RtpPacket到pkt并计算checksum */
 void Rtp::packet_wrapper(RtpPacket *pkt, uint32_t seq_num, uint16_t length, /*uint16_t advertised_window,*/ void *payload)
 {
-    memset(pkt, 0, sizeof(RtpPacket));
+    memset(&pkt->header, 0, sizeof(RtpHeader)); // payload马上被覆盖，只发length个字节，不用清零
     pkt->header.seq_num = seq_num;
     pkt->header.length = length;
     pkt->header.checksum = 0; // 先清零再计算checksum
@@ -200,65 +671,124 @@ void Rtp::header_wrapper(RtpHeader *header, uint32_t seq_num, /*uint16_t adverti
     header->checksum = compute_checksum(header, sizeof(RtpHeader));
 }
 
-/* 等待一个类型为flag的包，至多等待timeout毫秒，
- * 0表示收到类型正确且完整的包，
- * 1表示超时，
- * -1表示recv_packet或者poll错误 */
-int Rtp::waitfor(void *buffer, int flag, int timeout)
+/* 打包一个带选项的控制包（SYN/ACK等）并计算checksum，length为0时和header_wrapper相同 */
+void Rtp::option_wrapper(RtpPacket *pkt, uint32_t seq_num, uint8_t flags, const void *options, uint16_t length)
 {
-    if (buffer == nullptr)
+    memset(&pkt->header, 0, sizeof(RtpHeader));
+    pkt->header.seq_num = seq_num;
+    pkt->header.length = length;
+    pkt->header.flags = flags;
+    if (length > 0)
+    {
+        memcpy(pkt->payload, options, length);
+    }
+    pkt->header.checksum = compute_checksum(pkt, pkt->header.length + sizeof(RtpHeader));
+}
+
+/* 在options的offset处追加一个选项，返回新的长度，放不下返回-1 */
+int Rtp::opt_put(char *options, int offset, uint8_t kind, const void *value, uint8_t len)
+{
+    if (offset < 0 || offset + 2 + len > RTP_CTRL_MAX)
     {
         return -1;
     }
-    chrono::time_point<chrono::steady_clock> end = chrono::steady_clock::now() + chrono::milliseconds(timeout);
-    RtpPacket *pkt = (RtpPacket *)malloc(sizeof(RtpPacket)); // 没收到正确的包时不希望改变buffer
-    pollfd fds[1];
-    fds[0].fd = sockfd;
-    fds[0].events = POLLIN; // 监听可读事件
-    int64_t millisec_left;
-    while (chrono::steady_clock::now() < end)
+    options[offset] = kind;
+    options[offset + 1] = len;
+    if (len > 0)
     {
-        millisec_left = chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now()).count();
-        int poll_ret = poll(fds, 1, millisec_left);
-        if (poll_ret > 0 && (fds[0].revents & POLLIN))
-        {
-            int recv_ret = recv_packet(pkt);
+        memcpy(options + offset + 2, value, len);
+    }
+    return offset + 2 + len;
+}
+
+/* 在包的payload里找类型为kind的选项，找到返回value的指针并把长度写到len，
+ * 找不到或者格式错误返回nullptr */
+const char *Rtp::opt_find(const RtpPacket *pkt, uint8_t kind, uint8_t *len)
+{
+    const char *p = pkt->payload;
+    int left = pkt->header.length;
+    while (left >= 2)
+    {
+        uint8_t k = p[0], l = p[1];
+        if (l + 2 > left)
+        {
+            return nullptr; // 长度越界
+        }
+        if (k == kind)
+        {
+            *len = l;
+            return p + 2;
+        }
+        p += l + 2;
+        left -= l + 2;
+    }
+    return nullptr;
+}
+
+/* 等待一个类型为flag的包，至多等待timeout毫秒，buffer至少为sizeof(RtpPacket)大小，
+ * 等待期间收到的PMTU探测包直接确认，比sizeof(RtpPacket)大的其他包忽略，
+ * 0表示收到类型正确且完整的包，
+ * 1表示超时，
+ * -1表示recv_packet或者poll错误 */
+int Rtp::waitfor(void *buffer, int flag, int timeout)
+{
+    if (buffer == nullptr)
+    {
+        return -1;
+    }
+    chrono::time_point<chrono::steady_clock> end = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+    if (this->ctrl_buf == nullptr)
+    {
+        // 没收到正确的包时不希望改变buffer，先收在ctrl_buf里，要能放下最大的探测包
+        this->ctrl_buf = (char *)malloc(RTP_DGRAM_MAX);
+        if (this->ctrl_buf == nullptr)
+        {
+            return -1;
+        }
+    }
+    RtpPacket *pkt = (RtpPacket *)this->ctrl_buf;
+    pollfd fds[1];
+    fds[0].fd = sockfd;
+    fds[0].events = POLLIN; // 监听可读事件
+    int64_t millisec_left;
+    while (chrono::steady_clock::now() < end)
+    {
+        millisec_left = chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now()).count();
+        int poll_ret = poll(fds, 1, millisec_left);
+        if (poll_ret > 0 && (fds[0].revents & POLLIN))
+        {
+            int recv_ret = recv_packet(pkt, RTP_DGRAM_MAX);
             if (recv_ret == 0)
             {
                 continue; // 没收到包/CRC错误/大小不正确，继续等待
             }
+            else if (recv_ret > 0 && pkt->header.flags == RTP_PRB)
+            {
+                answer_probe(pkt);
+                continue;
+            }
             else if (recv_ret == -1)
             {
-                free(pkt);
                 LOG_DEBUG("waitfor recv_packet() failed\n");
                 return -1; // recv_packet错误
             }
             else
             {
-                if (pkt->header.flags == flag)
+                if (pkt->header.flags == flag && (uint32_t)recv_ret <= sizeof(RtpPacket))
                 {
                     memcpy(buffer, pkt, recv_ret); // 根据实际包大小拷贝
-                    LOG_DEBUG("waitfor %s%s%s%s Received %s with seq_num %u\n",
-                              flag & RTP_SYN ? "SYN" : "",
-                              flag & RTP_ACK ? "ACK" : "",
-                              flag & RTP_FIN ? "FIN" : "",
-                              flag == RTP_DAT ? "DAT" : "",
-                              (uint32_t)recv_ret > sizeof(RtpHeader) ? "RtpPacket" : "RtpHeader",
-                              pkt->header.seq_num);
-                    free(pkt);
+                    TRACE_PKT("waitfor flags 0x%x Received %d bytes with seq_num %u\n", flag, recv_ret, pkt->header.seq_num);
                     return 0; // success
                 }
             }
         }
         else if (poll_ret == 0)
         {
-            free(pkt);
-            LOG_DEBUG("waitfor timeout\n");
+            TRACE_PKT("waitfor timeout\n");
             return 1; // 超时
         }
         else
         {
-            free(pkt);
             LOG_DEBUG("waitfor poll() failed\n");
             return -1; // poll错误
         }
@@ -280,13 +810,47 @@ int Rtp::connect(const struct sockaddr *addr, socklen_t addrlen)
     // 第一次握手，发送SYN
     this->dest_addr = *(struct sockaddr_in *)addr;
     this->addrlen = addrlen;
-    RtpHeader send_syn;
-    header_wrapper(&send_syn, seq_num, RTP_SYN);
+    char options[RTP_CTRL_MAX];
+    int options_len = opt_put(options, 0, RTP_OPT_SACK_PERM, nullptr, 0); // 告诉对方可以发SACK
+    if (this->striped)
+    {
+        options_len = opt_put(options, options_len, RTP_OPT_STRIPE, &this->stripe_offset, sizeof(uint64_t));
+    }
+    if (this->delack_max > 1)
+    {
+        uint8_t delack = this->delack_max; // 告诉对方一个ACK最多可以确认几个包
+        options_len = opt_put(options, options_len, RTP_OPT_DELACK, &delack, 1);
+    }
+    uint16_t mss_opt = this->mss_limit; // 告诉对方自己能收发的最大payload
+    options_len = opt_put(options, options_len, RTP_OPT_MSS, &mss_opt, sizeof(mss_opt));
+    if (this->fec_enabled)
+    {
+        options_len = opt_put(options, options_len, RTP_OPT_FEC, nullptr, 0); // 告诉对方会发校验包
+    }
+    if (this->cmp_enabled)
+    {
+        options_len = opt_put(options, options_len, RTP_OPT_CMP, nullptr, 0); // 问对方能不能解压
+    }
+    if (this->resume_enabled)
+    {
+        options_len = opt_put(options, options_len, RTP_OPT_RESUME, &this->resume_info, sizeof(RtpResumeInfo)); // 问对方收完了哪些块
+    }
+    if (this->bundled)
+    {
+        options_len = opt_put(options, options_len, RTP_OPT_BUNDLE, nullptr, 0); // 发的是多个文件
+    }
+    if (this->session)
+    {
+        options_len = opt_put(options, options_len, RTP_OPT_SESSION, nullptr, 0); // 要传多次
+    }
+    RtpPacket send_syn;
+    option_wrapper(&send_syn, seq_num, RTP_SYN, options, options_len);
     if (send_packet((void *)&send_syn) == -1)
     {
         LOG_DEBUG("connect send syn failed\n");
         return -1;
     }
+    int64_t syn_sent_ns = now_ns(); // 没重传过的SYN可以得到第一个RTT样本
     LOG_DEBUG("connect Sent SYN with seq_num %u\n", seq_num);
     // 第二次握手，接受SYN&ACK
     RtpHeader *recv_ack = (RtpHeader *)malloc(sizeof(RtpPacket)); // recv_packet要求预留sizeof(RtpPacket)
@@ -301,6 +865,10 @@ int Rtp::connect(const struct sockaddr *addr, socklen_t addrlen)
             if (recv_ack->seq_num == inc_seq32(seq_num)) // seq_num正确,x+1
             {
                 LOG_DEBUG("connect Received SYN&ACK with correct seq_num %u\n", recv_ack->seq_num);
+                if (retry == 0)
+                {
+                    this->rtt.sample((now_ns() - syn_sent_ns) / 1000);
+                }
                 break;
             }
             else // seq_num错误
@@ -340,54 +908,325 @@ int Rtp::connect(const struct sockaddr *addr, socklen_t addrlen)
     seq_num = inc_seq32(seq_num); // x+1
     // this->seq_num不增长，发文件的时候第一个包是x+1
 
-    // 第三次握手
-    RtpHeader send_ack;
-    header_wrapper(&send_ack, seq_num, RTP_ACK);
-    if (send_packet((void *)&send_ack) == -1)
+    // SYN&ACK里是双方都能接受的最大payload，对方不认识这个选项时只用默认大小
+    uint8_t opt_len;
+    const char *peer_mss = opt_find((RtpPacket *)recv_ack, RTP_OPT_MSS, &opt_len);
+    this->mss_ceiling = min<uint32_t>(PAYLOAD_MAX, this->mss_limit);
+    if (peer_mss != nullptr && opt_len == sizeof(uint16_t))
+    {
+        memcpy(&mss_opt, peer_mss, sizeof(mss_opt));
+        this->mss_ceiling = min<uint32_t>(max<uint32_t>(mss_opt, RTP_MSS_MIN), this->mss_limit);
+    }
+    // 对方在SYN&ACK里同意了才压缩
+    this->cmp_enabled = this->cmp_enabled && opt_find((RtpPacket *)recv_ack, RTP_OPT_CMP, &opt_len) != nullptr;
+    LOG_DEBUG("connect compression %s\n", this->cmp_enabled ? "on" : "off");
+    this->session = this->session && opt_find((RtpPacket *)recv_ack, RTP_OPT_SESSION, &opt_len) != nullptr;
+    // 对方有这个文件的日志时带回已经收完的块（可能一段都没有），没带时从头发
+    const char *runs = opt_find((RtpPacket *)recv_ack, RTP_OPT_RESUME, &opt_len);
+    this->resuming = this->resume_enabled && runs != nullptr && opt_len % sizeof(RtpResumeRun) == 0;
+    this->resume_count = 0;
+    if (this->resuming)
+    {
+        this->resume_count = min<int>(opt_len / sizeof(RtpResumeRun), RTP_RESUME_RUNS);
+        memcpy(this->resume_runs, runs, this->resume_count * sizeof(RtpResumeRun));
+        LOG_DEBUG("connect peer has %d runs of blocks\n", this->resume_count);
+    }
+    this->mss = probe_mss(this->mss_ceiling);
+    if (this->fec_enabled)
+    {
+        // 校验包比满的数据包多一个RtpFecInfo，也要能走通
+        // payload已经到了最小值时留不出这么多，这个连接不发校验包
+        if (this->mss >= RTP_MSS_MIN + sizeof(RtpFecInfo))
+        {
+            this->mss -= sizeof(RtpFecInfo);
+        }
+        else
+        {
+            LOG_MSG("Payload size %u leaves no room for parity, sending without FEC\n", this->mss);
+            this->fec_enabled = false;
+        }
+    }
+    LOG_DEBUG("connect payload size %u, negotiated ceiling %u\n", this->mss, this->mss_ceiling);
+
+    // 第三次握手，带上探测出的payload大小
+    // 发出后不等待，数据紧跟着发出去，对方的ACK就是确认；
+    // ACK丢了时对方会重发SYN&ACK，send_file_gbn和close里补发
+    mss_opt = this->mss;
+    options_len = opt_put(options, 0, RTP_OPT_MSS, &mss_opt, sizeof(mss_opt));
+    option_wrapper(&this->hs_ack, seq_num, RTP_ACK, options, options_len);
+    this->hs_confirmed = false;
+    if (send_packet((void *)&this->hs_ack) == -1)
     {
         LOG_DEBUG("connect send ack failed\n");
         free(recv_ack);
         return -1;
     }
     LOG_DEBUG("connect Sent ACK with seq_num %u\n", seq_num);
-    chrono::time_point<chrono::steady_clock> end =
-        chrono::steady_clock::now() + chrono::milliseconds(2000); // 等待两秒，没收到SYN&ACK代表ACK送达
-    while (chrono::steady_clock::now() < end)
+    LOG_DEBUG("connect() success\n");
+    free(recv_ack);
+    return 0;
+}
+
+/* 收到SYN后记录对端的初始序号和选项，并打包要回复的SYN&ACK，
+ * 返回SYN&ACK的seq_num，即x+1 */
+uint32_t Rtp::on_syn(const RtpPacket *syn, RtpPacket *syn_ack)
+{
+    uint8_t opt_len;
+    this->fin_received = false;
+    this->sack_enabled = opt_find(syn, RTP_OPT_SACK_PERM, &opt_len) != nullptr;
+    LOG_DEBUG("on_syn peer %s SACK\n", this->sack_enabled ? "supports" : "does not support");
+    // 双方都允许时才延迟ACK，取两边较小的包数
+    const char *delack = opt_find(syn, RTP_OPT_DELACK, &opt_len);
+    this->delack_max = delack != nullptr && opt_len == 1 ? min<int>(this->delack_max, (uint8_t)delack[0]) : 1;
+    LOG_DEBUG("on_syn ACK every %d packets\n", this->delack_max);
+    const char *stripe = opt_find(syn, RTP_OPT_STRIPE, &opt_len);
+    this->striped = stripe != nullptr && opt_len == sizeof(uint64_t);
+    this->stripe_offset = 0;
+    if (this->striped)
     {
-        int64_t millisec_left =
-            chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now()).count();
-        int waitfor_ret = waitfor(recv_ack, RTP_ACK | RTP_SYN, millisec_left);
-        if (waitfor_ret == 0) // 收到类型正确且完整的包
+        memcpy(&this->stripe_offset, stripe, sizeof(uint64_t));
+        LOG_DEBUG("on_syn stripe starting at offset %lu\n", this->stripe_offset);
+    }
+    // 对方带了MSS时上限取两边较小的，实际大小由对方探测后在第三次握手里告诉我们
+    const char *peer_mss = opt_find(syn, RTP_OPT_MSS, &opt_len);
+    this->mss_ceiling = min<uint32_t>(PAYLOAD_MAX, this->mss_limit);
+    if (peer_mss != nullptr && opt_len == sizeof(uint16_t))
+    {
+        uint16_t value;
+        memcpy(&value, peer_mss, sizeof(value));
+        this->mss_ceiling = min<uint32_t>(max<uint32_t>(value, RTP_MSS_MIN), this->mss_limit);
+    }
+    this->fec_enabled = opt_find(syn, RTP_OPT_FEC, &opt_len) != nullptr;
+    LOG_DEBUG("on_syn peer %s parity packets\n", this->fec_enabled ? "sends" : "does not send");
+    this->cmp_enabled = opt_find(syn, RTP_OPT_CMP, &opt_len) != nullptr;
+    LOG_DEBUG("on_syn peer %s compress\n", this->cmp_enabled ? "wants to" : "does not");
+    this->bundled = opt_find(syn, RTP_OPT_BUNDLE, &opt_len) != nullptr;
+    // 本端接受会话并且对方要求时才按XFR分次接收，否则还是一个FIN结束的文件
+    this->session = this->session && opt_find(syn, RTP_OPT_SESSION, &opt_len) != nullptr;
+    LOG_DEBUG("on_syn session %s\n", this->session ? "on" : "off");
+    // 对方要续传且有日志时，告诉对方这一段里已经收完的块
+    const char *resume = opt_find(syn, RTP_OPT_RESUME, &opt_len);
+    this->resuming = false;
+    this->resume_count = 0;
+    if (resume != nullptr && opt_len == sizeof(RtpResumeInfo) && this->journal != nullptr)
+    {
+        memcpy(&this->resume_info, resume, sizeof(RtpResumeInfo));
+        if (this->resume_info.range_end >= this->stripe_offset && this->resume_info.range_end <= this->resume_info.file_size &&
+            this->journal->open(this->resume_info.file_size, this->resume_info.file_mtime) == 0)
+        {
+            this->resuming = true;
+            this->resume_count = this->journal->have_runs(this->stripe_offset, this->resume_info.range_end,
+                                                          this->resume_runs, RTP_RESUME_RUNS);
+            LOG_DEBUG("on_syn resuming with %d runs of blocks\n", this->resume_count);
+        }
+    }
+    else if (this->journal != nullptr)
+    {
+        this->journal->remove(); // 对方从头发，旧的日志对不上了
+    }
+    this->mss = min<uint32_t>(PAYLOAD_MAX, this->mss_ceiling);
+    uint32_t seq_num = syn->header.seq_num; // x
+    this->seq_base = seq32to64(seq_num);    // 记录seq_base
+    this->seq_num = seq32to64(seq_num);     // 记录seq_num
+    seq_num = inc_seq32(seq_num);           // x+1
+    // this->seq_num不增长，发文件的时候第一个包是x+1
+    char options[RTP_CTRL_MAX];
+    uint16_t mss_opt = this->mss_ceiling;
+    int options_len = opt_put(options, 0, RTP_OPT_MSS, &mss_opt, sizeof(mss_opt));
+    if (this->cmp_enabled)
+    {
+        options_len = opt_put(options, options_len, RTP_OPT_CMP, nullptr, 0); // 同意压缩
+    }
+    if (this->resuming)
+    {
+        options_len = opt_put(options, options_len, RTP_OPT_RESUME, this->resume_runs, this->resume_count * sizeof(RtpResumeRun));
+    }
+    if (this->session)
+    {
+        options_len = opt_put(options, options_len, RTP_OPT_SESSION, nullptr, 0); // 同意会话
+    }
+    option_wrapper(syn_ack, seq_num, RTP_SYN | RTP_ACK, options, options_len);
+    return seq_num;
+}
+
+/* 常见的链路MTU（RFC 1191），探测时在默认大小和上限之间只试这些 */
+static const int rtp_mtu_plateaus[] = {65535, 32000, 17914, 9000, 8166, 4352, 2002};
+
+/* 内核路由表里到addr的MTU，用一个临时的connected socket查，失败返回0 */
+int Rtp::route_mtu(const struct sockaddr_in &addr)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+    if (::connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) == -1)
+    {
+        mtu = 0;
+    }
+    ::close(fd);
+    return mtu;
+}
+
+/* 发送方在第三次握手之前探测路径上能走通的最大payload，仿照DPLPMTUD：
+ * 上限为协商出的ceiling和路由MTU换算出的payload中较小的，
+ * 上限和中间的常见MTU对应的大小一起发出去，对方逐个确认，最多发RTP_PROBE_ROUNDS轮，
+ * 探测时用IP_PMTUDISC_PROBE设置DF，不分片也不受内核缓存的PMTU限制，本地就放不下的直接算失败，
+ * 返回确认了的最大的大小，都没确认时返回默认大小 */
+uint32_t Rtp::probe_mss(uint32_t ceiling)
+{
+    const uint32_t overhead = 28 + sizeof(RtpHeader); // IPv4和UDP头
+    uint32_t top = ceiling;
+    int mtu = route_mtu(this->dest_addr);
+    if (mtu > (int)overhead)
+    {
+        top = min<uint32_t>(top, max<uint32_t>(mtu - overhead, RTP_MSS_MIN));
+    }
+    uint32_t best = min<uint32_t>(PAYLOAD_MAX, top); // 默认大小不用探测
+    if (top <= best)
+    {
+        return top;
+    }
+    uint32_t sizes[1 + sizeof(rtp_mtu_plateaus) / sizeof(rtp_mtu_plateaus[0])];
+    int count = 0;
+    sizes[count++] = top;
+    for (int plateau : rtp_mtu_plateaus)
+    {
+        if (plateau - overhead > best && plateau - overhead < top)
+        {
+            sizes[count++] = plateau - overhead;
+        }
+    }
+    RtpPacket *prb = (RtpPacket *)calloc(1, sizeof(RtpHeader) + top); // payload全为0
+    if (prb == nullptr)
+    {
+        return best;
+    }
+    int old_pmtu;
+    socklen_t len = sizeof(old_pmtu);
+    bool restore = getsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &old_pmtu, &len) == 0;
+    int pmtu = IP_PMTUDISC_PROBE;
+    if (setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu)) == -1)
+    {
+        LOG_DEBUG("probe_mss IP_PMTUDISC_PROBE not supported, probes may be fragmented\n");
+    }
+    int64_t wait_ms = this->rtt.valid() ? max<int64_t>(3 * this->rtt.get_srtt() / 1000, 10) : RTP_PROBE_WAIT_MS;
+    pollfd fds[1];
+    fds[0].fd = sockfd;
+    fds[0].events = POLLIN;
+    for (int round = 0; round < RTP_PROBE_ROUNDS; round++)
+    {
+        int outstanding = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (sizes[i] <= best)
+            {
+                continue; // 已经确认了更大的
+            }
+            memset(&prb->header, 0, sizeof(RtpHeader));
+            prb->header.seq_num = sizes[i];
+            prb->header.length = sizes[i];
+            prb->header.flags = RTP_PRB;
+            prb->header.checksum = compute_checksum(prb, sizeof(RtpHeader) + sizes[i]);
+            if (sendto(sockfd, prb, sizeof(RtpHeader) + sizes[i], 0, (struct sockaddr *)&dest_addr, addrlen) == -1)
+            {
+                LOG_DEBUG("probe_mss probe of %u bytes failed: %s\n", sizes[i], strerror(errno));
+                sizes[i] = 0; // EMSGSIZE说明本地的链路就放不下，不再试
+                continue;
+            }
+            this->stats.packets_sent.fetch_add(1, memory_order_relaxed);
+            this->stats.bytes_sent.fetch_add(sizeof(RtpHeader) + sizes[i], memory_order_relaxed);
+            outstanding++;
+        }
+        chrono::steady_clock::time_point end = chrono::steady_clock::now() + chrono::milliseconds(wait_ms);
+        while (outstanding > 0 && chrono::steady_clock::now() < end)
         {
-            if (recv_ack->seq_num == seq_num) // seq_num正确，即x+1，说明第三次握手没送达
+            int64_t millisec_left = chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now()).count();
+            int poll_ret = poll(fds, 1, millisec_left);
+            if (poll_ret <= 0)
+            {
+                break; // 超时或者出错都按这一轮结束处理
+            }
+            RtpPacket reply;
+            if (recv_packet(&reply) <= 0 || reply.header.flags != (RTP_PRB | RTP_ACK) || reply.header.seq_num <= best)
             {
-                LOG_DEBUG("connect Received SYN&ACK with correct seq_num %u after ACK sent\n", recv_ack->seq_num);
-                if (send_packet((void *)&send_ack) == -1)
+                continue;
+            }
+            outstanding = 0;
+            for (int i = 0; i < count; i++)
+            {
+                if (sizes[i] == reply.header.seq_num)
                 {
-                    LOG_DEBUG("connect resend ack failed\n");
-                    free(recv_ack);
-                    return -1;
+                    best = sizes[i];
                 }
-                LOG_DEBUG("connect Resent ACK with seq_num %u\n", seq_num);
-                continue; // 重新等待
             }
-            else // seq_num错误，无视掉
+            for (int i = 0; i < count; i++)
             {
-                LOG_DEBUG("connect Received ACK with wrong seq_num %u, ignored\n", recv_ack->seq_num);
-                continue;
+                outstanding += sizes[i] > best;
             }
         }
-        else if (waitfor_ret == -1) // waitfor错误
+        if (outstanding == 0)
         {
-            free(recv_ack);
-            LOG_DEBUG("waitfor() failed in connect\n");
-            return -1;
+            break;
         }
     }
-    // 超时说明没再收到SYN&ACK，连接成功
-    LOG_DEBUG("connect() success\n");
-    free(recv_ack);
-    return 0;
+    if (restore)
+    {
+        setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &old_pmtu, sizeof(old_pmtu));
+    }
+    free(prb);
+    LOG_DEBUG("probe_mss route MTU %d, largest payload %u\n", mtu, best);
+    return best;
+}
+
+/* 原样确认一个探测包，seq_num和length相同且不超过协商的上限才确认 */
+void Rtp::answer_probe(const RtpPacket *prb)
+{
+    uint32_t size = prb->header.length;
+    if (prb->header.seq_num != size || size > this->mss_ceiling)
+    {
+        return;
+    }
+    RtpHeader ack;
+    header_wrapper(&ack, size, RTP_PRB | RTP_ACK);
+    if (send_packet((void *)&ack) == -1)
+    {
+        LOG_DEBUG("answer_probe send failed\n"); // 对方会按没走通处理
+    }
+}
+
+/* 第三次握手的ACK里是对方探测后决定的payload大小，
+ * 对方不认识这个选项或者没探测时用默认大小，和对方一样，发校验包时要留出RtpFecInfo
+ * ACK丢了时对方发来的数据不能用来建立连接，payload大小只有ACK里有，等对方补发ACK */
+void Rtp::on_mss(const RtpPacket *ack)
+{
+    uint8_t opt_len;
+    const char *value = opt_find(ack, RTP_OPT_MSS, &opt_len);
+    if (value != nullptr && opt_len == sizeof(uint16_t))
+    {
+        uint16_t mss_opt;
+        memcpy(&mss_opt, value, sizeof(mss_opt));
+        this->mss = min<uint32_t>(max<uint32_t>(mss_opt, RTP_MSS_MIN), this->mss_ceiling);
+    }
+    else
+    {
+        this->mss = min<uint32_t>(PAYLOAD_MAX, this->mss_ceiling);
+        if (this->fec_enabled && this->mss >= RTP_MSS_MIN + sizeof(RtpFecInfo)) // 和对方connect里一样
+        {
+            this->mss -= sizeof(RtpFecInfo);
+        }
+    }
+    LOG_DEBUG("on_mss payload size %u\n", this->mss);
+}
+
+/* 收到的数据都在FIN之前，seq_num前进到FIN，并打包要回复的FIN&ACK */
+void Rtp::on_fin(RtpHeader *fin_ack)
+{
+    this->seq_num += 1;
+    header_wrapper(fin_ack, seq64to32(this->seq_num), RTP_FIN | RTP_ACK);
 }
 
 /* 等待发送方发起连接，
@@ -426,22 +1265,18 @@ int Rtp::wait_connect()
         free(recv_syn);
         return -1;
     }
-    uint32_t seq_num = recv_syn->seq_num; // x
-    this->seq_base = seq32to64(seq_num);  // 记录seq_base
-    this->seq_num = seq32to64(seq_num);   // 记录seq_num
-    seq_num = inc_seq32(seq_num);         // x+1
-    // this->seq_num不增长，发文件的时候第一个包是x+1
-
+    RtpPacket send_syn_ack;
+    uint32_t seq_num = on_syn((RtpPacket *)recv_syn, &send_syn_ack); // x+1
     free(recv_syn);
     // 第二次握手，发送SYN&ACK
-    RtpHeader send_syn_ack;
-    header_wrapper(&send_syn_ack, seq_num, RTP_SYN | RTP_ACK);
     if (send_packet((void *)&send_syn_ack) == -1)
     {
         LOG_DEBUG("wait_connect send syn_ack failed\n");
         return -1;
     }
     LOG_DEBUG("wait_connect Sent SYN&ACK with seq_num %u\n", seq_num);
+    int64_t syn_ack_sent_ns = now_ns(); // 没重传过的SYN&ACK可以得到第一个RTT样本
+    bool syn_ack_resent = false;
     // 第三次握手，等待ACK
     end = chrono::steady_clock::now() + chrono::milliseconds(5000); // 等待五秒
     RtpHeader *recv_ack = (RtpHeader *)malloc(sizeof(RtpPacket));   // recv_packet要求预留sizeof(RtpPacket)
@@ -455,6 +1290,11 @@ int Rtp::wait_connect()
             if (recv_ack->seq_num == seq_num) // seq_num正确，即x+1
             {
                 LOG_DEBUG("wait_connect Received ACK with correct seq_num %u\n", recv_ack->seq_num);
+                if (!syn_ack_resent)
+                {
+                    this->rtt.sample((now_ns() - syn_ack_sent_ns) / 1000);
+                }
+                on_mss((RtpPacket *)recv_ack);
                 connected = true;
                 break;
             }
@@ -473,6 +1313,7 @@ int Rtp::wait_connect()
                 return -1;
             }
             LOG_DEBUG("wait_connect Resent SYN&ACK with seq_num %u\n", seq_num);
+            syn_ack_resent = true;
         }
         else // waitfor错误
         {
@@ -506,6 +1347,11 @@ int Rtp::close()
         return -1;
     }
     LOG_DEBUG("close Sent FIN with seq_num %u\n", seq_num);
+    if (!this->hs_confirmed && send_packet((void *)&this->hs_ack) == -1) // 空文件时对方可能还在等第三次握手
+    {
+        LOG_DEBUG("close resend handshake ack failed\n");
+        return -1;
+    }
     chrono::time_point<chrono::steady_clock> end =
         chrono::steady_clock::now() + chrono::milliseconds(5000);    // 等待五秒
     RtpHeader *recv_finack = (RtpHeader *)malloc(sizeof(RtpPacket)); // recv_packet要求预留sizeof(RtpPacket)
@@ -520,6 +1366,13 @@ int Rtp::close()
             {
                 LOG_DEBUG("close Received FIN&ACK with correct seq_num %u\n", recv_finack->seq_num);
                 finack_received = true;
+                // 告诉对方不用再等重发的FIN了，丢了的话对方等到超时
+                RtpHeader last_ack;
+                header_wrapper(&last_ack, seq_num, RTP_ACK);
+                if (send_packet((void *)&last_ack) == -1)
+                {
+                    LOG_DEBUG("close send last ack failed\n");
+                }
                 break;
             }
             else // seq_num错误
@@ -530,7 +1383,8 @@ int Rtp::close()
         }
         else if (waitfor_ret == 1) // 超时，重发FIN
         {
-            if (send_packet((void *)&send_fin) == -1)
+            if (send_packet((void *)&send_fin) == -1 ||
+                (!this->hs_confirmed && send_packet((void *)&this->hs_ack) == -1))
             {
                 LOG_DEBUG("close resend fin failed\n");
                 free(recv_finack);
@@ -557,7 +1411,9 @@ int Rtp::close()
     return 0;
 }
 
-/* 等待关闭，成功返回0失败返回-1 */
+/* 等待关闭，成功返回0失败返回-1
+ * 回复FIN&ACK后马上返回，重发的FIN由RtpLinger在后台应答，
+ * 之后这个socket在RTP_LINGER_MS内不要再用来收包，进程退出前调用RtpLinger::drain */
 int Rtp::wait_close()
 {
     this->seq_num += 1;
@@ -573,6 +1429,8 @@ int Rtp::wait_close()
             return -1;
         }
         LOG_DEBUG("wait_close Sent FIN&ACK with seq_num %u before waiting\n", seq_num);
+        RtpLinger::add(sockfd, this->dest_addr, send_fin_ack);
+        this->addrlen = 0; // 清零addrlen
         return 0;
     }
     // 第一次挥手，等待FIN
@@ -624,360 +1482,1707 @@ int Rtp::wait_close()
         return -1;
     }
     LOG_DEBUG("wait_close Sent FIN&ACK with seq_num %u\n", seq_num);
-    end = chrono::steady_clock::now() + chrono::milliseconds(2000); // 等待两秒，没收到FIN代表FIN&ACK送达
-    while (chrono::steady_clock::now() < end)
+    RtpLinger::add(sockfd, this->dest_addr, send_fin_ack); // 后台应答重发的FIN
+    LOG_DEBUG("wait_close() succeed\n");
+    this->addrlen = 0; // 清零addrlen
+    free(recv_fin);
+    return 0;
+}
+
+// 没有seqnum限制版的
+int Rtp::waitfor_ack(int64_t *seq_num_p, int timeout)
+{
+    RtpHeader *recv_ack = (RtpHeader *)malloc(sizeof(RtpPacket));
+    int waitfor_ret = waitfor(recv_ack, RTP_ACK, timeout);
+    if (waitfor_ret == 0)
     {
-        int64_t millisec_left =
-            chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now()).count();
-        int waitfor_ret = waitfor(recv_fin, RTP_FIN, millisec_left);
-        if (waitfor_ret == 0) // 收到类型正确且完整的包
+        *seq_num_p = seq32to64(recv_ack->seq_num);
+        free(recv_ack);
+        return 0;
+    }
+    free(recv_ack);
+    return waitfor_ret; // 1 for timeout, -1 for error
+}
+
+int Rtp::waitfor_dat(void *buffer, int timeout)
+{
+    return waitfor(buffer, RTP_DAT, timeout);
+}
+
+/* 为seq对应的那一段数据生成header，放在send_ring中seq对应的槽里
+ * payload直接指向mmap的内存，没有mmap时用pread读进send_copy，
+ * 压缩时压缩后的数据放在send_copy里，raw和raw_len返回压缩前的数据
+ * CRC先算header再接着算payload，和连续存放时的结果一样 */
+RtpTxSlot *Rtp::build_packet(int64_t seq, const char **raw, uint16_t *raw_len)
+{
+    uint64_t offset = (uint64_t)grid_index(seq, this->file_first_seq) * this->mss;
+    uint16_t length = (uint16_t)min<uint64_t>(this->mss, this->file_size - offset);
+    RtpTxSlot *slot = this->send_ring.at(seq); // 槽在窗口滑过之后复用
+    char *copy = this->send_copy.at(seq);      // 压缩时放压缩后的数据
+    if (this->file_map != nullptr)
+    {
+        *raw = this->file_map + this->file_skew + offset;
+    }
+    else
+    {
+        char *buf = this->cmp_enabled ? this->cmp_raw : copy;
+        if (this->bundle != nullptr ? this->bundle->read(buf, length, offset) == -1
+                                    : pread(this->file_fd, buf, length, this->file_offset + offset) != length)
         {
-            if (recv_fin->seq_num == seq64to32(this->seq_num)) // seq_num正确
-            {
-                LOG_DEBUG("wait_close Received FIN with correct seq_num %u after FIN&ACK sent\n", recv_fin->seq_num);
-                if (send_packet((void *)&send_fin_ack) == -1)
-                {
-                    LOG_DEBUG("wait_close resend fin_ack failed\n");
-                    free(recv_fin);
-                    return -1;
-                }
-                LOG_DEBUG("wait_close Resent FIN&ACK with seq_num %u\n", seq_num);
-                continue; // 重新等待
-            }
-            else // seq_num错误，无视掉
-            {
-                LOG_DEBUG("wait_close Received FIN with wrong seq_num %u, ignored\n", recv_fin->seq_num);
-                continue;
-            }
+            LOG_DEBUG("build_packet pread() failed at offset %lu\n", offset);
+            return nullptr;
         }
-        else if (waitfor_ret == -1) // waitfor错误
+        *raw = buf;
+    }
+    *raw_len = length;
+    slot->payload = *raw;
+    slot->header.length = length;
+    slot->header.flags = RTP_DAT;
+    if (this->cmp_enabled)
+    {
+        uint32_t packed = this->deflater.compress(*raw, length, copy);
+        if (packed > 0)
         {
-            LOG_DEBUG("wait_close waitfor() failed \n");
-            free(recv_fin);
-            return -1;
+            slot->payload = copy;
+            slot->header.length = packed;
+            slot->header.flags = RTP_CMP;
+            this->cmp_saved += length - packed;
+        }
+        else if (*raw == this->cmp_raw)
+        {
+            memcpy(copy, *raw, length); // 重传时还要用，cmp_raw下一个包就覆盖了
+            slot->payload = copy;
+        }
+    }
+    slot->header.seq_num = seq64to32(seq);
+    slot->header.checksum = 0; // 先清零再计算checksum
+    uint32_t crc = crc32_update(0, &slot->header, sizeof(RtpHeader));
+    slot->header.checksum = crc32_update(crc, slot->payload, slot->header.length);
+    return slot;
+}
+
+/* 一个ACK新确认了[from, to)，其中有重传过的包时分不清ACK对应哪一次发送，不能采样RTT */
+bool Rtp::karn_ok(SlotRing<RtpTxMeta> &meta, int64_t from, int64_t to)
+{
+    for (int64_t seq = from; seq < to; seq++)
+    {
+        if (meta.at(seq)->retransmitted)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* base之前的包都已确认，槽可以直接复用，
+ * 对应的文件页告诉内核可以回收，常驻内存只和窗口大小有关
+ * 只advise上次之后新确认的部分，攒够RTP_RELEASE_STEP才做一次，不然每个ACK都要从头走一遍页表 */
+void Rtp::release_acked(int64_t base)
+{
+    if (this->file_map != nullptr)
+    {
+        static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+        uint64_t done = min<uint64_t>((uint64_t)grid_index(base, this->file_first_seq) * this->mss, this->file_size);
+        done += this->file_skew;
+        done -= done % page_size;
+        if (done >= this->file_released + RTP_RELEASE_STEP ||
+            (done > this->file_released && done + page_size > this->file_skew + this->file_size))
+        {
+            madvise((void *)(this->file_map + this->file_released), done - this->file_released, MADV_DONTNEED);
+            this->file_released = done;
+        }
+    }
+}
+
+/* 文件的修改时间，纳秒 */
+static uint64_t file_mtime_ns(const struct stat &st)
+{
+    return (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/* 发送方：要续传filename里从stripe_offset开始的length字节，connect时在SYN里带上文件大小和修改时间，
+ * 对方的日志对得上时跳过已经收完的块，成功返回0失败返回-1 */
+int Rtp::set_resume(const char *filename, uint64_t length)
+{
+    struct stat st;
+    if (stat(filename, &st) == -1)
+    {
+        LOG_DEBUG("set_resume() stat() failed\n");
+        return -1;
+    }
+    this->resume_info.file_size = st.st_size;
+    this->resume_info.file_mtime = file_mtime_ns(st);
+    uint64_t begin = min<uint64_t>(this->stripe_offset, st.st_size);
+    this->resume_info.range_end = begin + min<uint64_t>(length, st.st_size - begin);
+    this->resume_enabled = true;
+    return 0;
+}
+
+/* 发送方：续传set_bundle设置的多个文件，清单里有每个文件的大小和修改时间，它的散列当作修改时间 */
+int Rtp::set_resume(const RtpBundle &bundle)
+{
+    this->resume_info.file_size = bundle.size();
+    this->resume_info.file_mtime = bundle.fingerprint();
+    this->resume_info.range_end = bundle.size();
+    this->resume_enabled = true;
+    return 0;
+}
+
+/* 发送整个文件，见send_file_range */
+int Rtp::send_file(const char *filename)
+{
+    return send_file_range(filename, 0, UINT64_MAX);
+}
+
+/* 接受文件名，发送从offset开始的length字节（超出文件末尾的部分忽略），gbn
+ * 成功返回0，超时返回1，失败返回-1
+ * 文件mmap后按需打包，只有窗口内的包放在send_ring里
+ * 结束时释放send_ring */
+int Rtp::send_file_range(const char *filename, uint64_t offset, uint64_t length)
+{
+    this->file_fd = open(filename, O_RDONLY);
+    if (this->file_fd == -1)
+    {
+        LOG_FATAL("send_file() failed to open file\n");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(this->file_fd, &st) == -1)
+    {
+        LOG_DEBUG("send_file() fstat() failed\n");
+        ::close(this->file_fd);
+        this->file_fd = -1;
+        return -1;
+    }
+    this->file_offset = min<uint64_t>(offset, st.st_size);
+    this->file_size = min<uint64_t>(length, st.st_size - this->file_offset);
+    this->file_skew = this->file_offset % sysconf(_SC_PAGESIZE); // mmap的偏移要按页对齐
+    this->file_released = 0;
+    this->file_map = nullptr;
+    if (this->resuming && ((uint64_t)st.st_size != this->resume_info.file_size || file_mtime_ns(st) != this->resume_info.file_mtime ||
+                           this->file_offset + this->file_size != this->resume_info.range_end))
+    {
+        // 对方按握手时的文件跳过了块，文件变了就对不上了
+        LOG_DEBUG("send_file() file changed since connect\n");
+        ::close(this->file_fd);
+        this->file_fd = -1;
+        return -1;
+    }
+    if (this->session && this->file_size != this->xfr_size)
+    {
+        // 对方按XFR里的大小接收
+        LOG_DEBUG("send_file() file size changed since offered\n");
+        ::close(this->file_fd);
+        this->file_fd = -1;
+        return -1;
+    }
+    if (this->file_size > 0)
+    {
+        void *map = mmap(nullptr, this->file_skew + this->file_size, PROT_READ, MAP_PRIVATE, this->file_fd,
+                         this->file_offset - this->file_skew);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, this->file_skew + this->file_size, MADV_SEQUENTIAL);
+            this->file_map = (const char *)map;
+        }
+        else
+        {
+            LOG_DEBUG("send_file() mmap() failed, falling back to pread\n");
+        }
+    }
+    return send_data();
+}
+
+/* 发送set_bundle设置的多个文件，返回值同send_file_range
+ * 数据流里的包从清单和各个文件里pread，小文件挤在同一个包里 */
+int Rtp::send_bundle()
+{
+    if (this->bundle == nullptr)
+    {
+        LOG_DEBUG("send_bundle() no bundle set\n");
+        return -1;
+    }
+    if (this->resuming && (this->bundle->size() != this->resume_info.file_size || this->bundle->fingerprint() != this->resume_info.file_mtime))
+    {
+        LOG_DEBUG("send_bundle() bundle changed since connect\n");
+        return -1;
+    }
+    this->file_fd = -1;
+    this->file_map = nullptr;
+    this->file_offset = 0;
+    this->file_skew = 0;
+    this->file_size = this->bundle->size();
+    LOG_DEBUG("send_bundle() %u entries, %lu Bytes\n", this->bundle->entries(), this->file_size);
+    return send_data();
+}
+
+/* 会话里每次传输之前发XFR，带上大小和名字，对方打开文件后回复同一个seq_num的XFR&ACK，
+ * 和close一样每100ms重发一次，5秒没有回复返回-1，成功返回0
+ * 名字太长时不带名字，对方自己起一个 */
+int Rtp::offer_transfer(const char *name, uint64_t size, bool bundle)
+{
+    if (!this->session)
+    {
+        LOG_DEBUG("offer_transfer() peer did not agree to a session\n");
+        return -1;
+    }
+    size_t name_len = strlen(name);
+    if (name_len > RTP_XFR_NAME_MAX)
+    {
+        LOG_DEBUG("offer_transfer() name too long, sending without it: %s\n", name);
+        name_len = 0;
+    }
+    this->seq_num += 1; // XFR占一个序号，数据从下一个开始
+    uint32_t seq_num = seq64to32(this->seq_num);
+    RtpTransferInfo info;
+    info.size = size;
+    info.bundle = bundle;
+    char options[RTP_CTRL_MAX];
+    int options_len = opt_put(options, 0, RTP_OPT_XFR, &info, sizeof(info));
+    if (name_len > 0)
+    {
+        options_len = opt_put(options, options_len, RTP_OPT_NAME, name, name_len);
+    }
+    RtpPacket send_xfr;
+    option_wrapper(&send_xfr, seq_num, RTP_XFR, options, options_len);
+    this->xfr_size = size;
+    // 第一次传输时第三次握手可能丢了，对方还在等，和XFR一起补发
+    if (send_packet((void *)&send_xfr) == -1 || (!this->hs_confirmed && send_packet((void *)&this->hs_ack) == -1))
+    {
+        LOG_DEBUG("offer_transfer send xfr failed\n");
+        return -1;
+    }
+    LOG_DEBUG("offer_transfer Sent XFR with seq_num %u, %lu Bytes\n", seq_num, size);
+    int64_t xfr_sent_ns = now_ns(); // 没重传过的XFR也是一个RTT样本
+    bool xfr_resent = false;
+    chrono::time_point<chrono::steady_clock> end =
+        chrono::steady_clock::now() + chrono::milliseconds(5000);  // 等待五秒
+    RtpHeader *recv_ack = (RtpHeader *)malloc(sizeof(RtpPacket)); // recv_packet要求预留sizeof(RtpPacket)
+    while (chrono::steady_clock::now() < end)
+    {
+        int waitfor_ret = waitfor(recv_ack, RTP_XFR | RTP_ACK, 100);
+        if (waitfor_ret == 0) // 收到类型正确且完整的包
+        {
+            if (recv_ack->seq_num != seq_num) // seq_num错误
+            {
+                LOG_DEBUG("offer_transfer Received XFR&ACK with wrong seq_num %u, ignored\n", recv_ack->seq_num);
+                continue;
+            }
+            if (!xfr_resent)
+            {
+                this->rtt.sample((now_ns() - xfr_sent_ns) / 1000);
+            }
+            this->hs_confirmed = true;
+            LOG_DEBUG("offer_transfer() success\n");
+            free(recv_ack);
+            return 0;
+        }
+        else if (waitfor_ret == 1) // 超时，重发XFR
+        {
+            if (send_packet((void *)&send_xfr) == -1 ||
+                (!this->hs_confirmed && send_packet((void *)&this->hs_ack) == -1))
+            {
+                LOG_DEBUG("offer_transfer resend xfr failed\n");
+                free(recv_ack);
+                return -1;
+            }
+            xfr_resent = true;
+            LOG_DEBUG("offer_transfer Resent XFR with seq_num %u\n", seq_num);
+        }
+        else // waitfor错误
+        {
+            LOG_DEBUG("waitfor() failed in offer_transfer\n");
+            free(recv_ack);
+            return -1;
+        }
+    }
+    LOG_DEBUG("offer_transfer() timeout\n");
+    free(recv_ack);
+    return -1;
+}
+
+/* 会话里发送一个文件，对方保存为name，返回值同send_file */
+int Rtp::send_transfer(const char *filename, const char *name)
+{
+    struct stat st;
+    if (stat(filename, &st) == -1)
+    {
+        LOG_DEBUG("send_transfer() stat() failed\n");
+        return -1;
+    }
+    set_bundle(nullptr); // 上一次传输的bundle可能已经不在了
+    if (offer_transfer(name, st.st_size, false) == -1)
+    {
+        return -1;
+    }
+    return send_file(filename);
+}
+
+/* 会话里发送一个RtpBundle，对方收完之后拆到它的输出目录里，name为暂存的文件名，返回值同send_bundle */
+int Rtp::send_transfer(RtpBundle *bundle, const char *name)
+{
+    set_bundle(bundle);
+    if (offer_transfer(name, bundle->size(), true) == -1)
+    {
+        return -1;
+    }
+    return send_bundle();
+}
+
+/* 发送方：会话空闲时发一个seq_num为上一个序号的XFR，对方只用它刷新空闲计时，丢了也没关系 */
+int Rtp::keepalive()
+{
+    RtpHeader xfr;
+    header_wrapper(&xfr, seq64to32(this->seq_num), RTP_XFR);
+    return send_packet((void *)&xfr);
+}
+
+/* send_file_range和send_bundle共用：文件或者bundle已经准备好，按file_size分包发送
+ * 结束时释放send_ring，关闭文件 */
+int Rtp::send_data()
+{
+    if (this->kernel_ts)
+    {
+        // 用内核收到ACK的时间计算RTT，不受用户态调度延迟影响
+        int on = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1)
+        {
+            LOG_DEBUG("send_file() SO_TIMESTAMPNS not supported, using user space time\n");
+        }
+    }
+    if (this->rate_cap > 0)
+    {
+        // 有fq qdisc时内核也按这个速率限速，没有时只靠令牌桶
+        uint64_t max_rate = this->rate_cap;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &max_rate, sizeof(max_rate)) == -1)
+        {
+            LOG_DEBUG("send_file() SO_MAX_PACING_RATE not supported\n");
+        }
+    }
+    // 包很大时一个窗口的数据不超过socket缓冲区的上限，pread的拷贝也不会占太多内存
+    uint32_t slots = min<uint32_t>(RTP_SEND_RING, max<uint32_t>(RTP_SOCKBUF_MAX / this->mss, RTP_BATCH));
+    if (this->cmp_enabled && this->file_map == nullptr)
+    {
+        this->cmp_raw = (char *)malloc(this->mss); // pread进来压缩前的数据
+    }
+    if (this->send_ring.init(slots) == -1 || this->sacked.init(slots) == -1 || this->send_meta.init(slots) == -1 ||
+        ((this->file_map == nullptr || this->cmp_enabled) && this->send_copy.init(slots, this->mss) == -1) ||
+        (this->cmp_enabled && (this->deflater.init() == -1 || (this->file_map == nullptr && this->cmp_raw == nullptr))) ||
+        (this->fec_enabled && this->fec_tx.init(2 * RTP_BATCH, sizeof(RtpHeader) + sizeof(RtpFecInfo) + this->mss) == -1))
+    {
+        LOG_FATAL("send_file() failed to allocate send ring\n");
+        if (this->file_map != nullptr)
+        {
+            munmap((void *)this->file_map, this->file_skew + this->file_size);
+            this->file_map = nullptr;
+        }
+        if (this->file_fd != -1)
+        {
+            ::close(this->file_fd);
+            this->file_fd = -1;
+        }
+        return -1;
+    }
+    this->file_first_seq = this->seq_num + 1;
+    // 计算文件总包数
+    uint32_t total_packets = (this->file_size + this->mss - 1) / this->mss;
+    if (this->resuming)
+    {
+        this->skip_map.build(this->file_offset, this->file_offset + this->file_size, this->mss, this->resume_runs, this->resume_count);
+        LOG_MSG("Resuming: skipping %ld of %u packets\n", total_packets - this->skip_map.packets(), total_packets);
+        total_packets = this->skip_map.packets();
+    }
+    // 发送
+    LOG_DEBUG("send_file() using gbn with Congestion Control\n");
+    // 记录开始时间
+    auto start_time = std::chrono::steady_clock::now();
+    int ret = send_file_gbn(total_packets);
+    if (this->io != nullptr)
+    {
+        this->io->tx_count = 0; // 没发出去的重传指向send_ring和file_map，马上要释放了，直接丢掉
+    }
+    // 记录结束时间
+    auto end_time = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end_time - start_time;
+    LOG_MSG("File size %lu Bytes sent successfully in %.2f seconds\n", this->file_size, elapsed_seconds.count());
+    // 会话里是这个连接到现在为止的累计值，完整的统计用get_stats
+    LOG_MSG("Retransmitted %lu packets (timeout %lu, fast %lu, sack %lu), RTT p50 %lu us, p99 %lu us\n",
+            this->stats.retransmits_total(), this->stats.retransmits[RTP_RTX_TIMEOUT].load(),
+            this->stats.retransmits[RTP_RTX_FAST].load(), this->stats.retransmits[RTP_RTX_SACK].load(),
+            this->stats.rtt.percentile(50), this->stats.rtt.percentile(99));
+    this->send_ring.release();
+    this->send_copy.release();
+    this->send_meta.release();
+    this->fec_tx.release();
+    if (this->cmp_enabled)
+    {
+        LOG_MSG("Compression saved %lu of %lu Bytes\n", this->cmp_saved, this->file_size);
+        this->deflater.release();
+        free(this->cmp_raw);
+        this->cmp_raw = nullptr;
+    }
+    if (this->file_map != nullptr)
+    {
+        munmap((void *)this->file_map, this->file_skew + this->file_size);
+        this->file_map = nullptr;
+    }
+    if (this->file_fd != -1)
+    {
+        ::close(this->file_fd);
+        this->file_fd = -1;
+    }
+    this->seq_num += total_packets; // 加上文件总字节数的包和文件数据包
+    return ret;
+}
+
+/* 把flush_iov里的连续数据用一次pwritev写到文件里 */
+int Rtp::flush_inorder()
+{
+    if (this->flush_len == 0)
+    {
+        return 0;
+    }
+    if (pwritev(this->out_fd, this->flush_iov, this->flush_iovcnt, this->flush_offset) != (ssize_t)this->flush_len)
+    {
+        LOG_DEBUG("flush_inorder pwrite() failed at offset %lu\n", this->flush_offset);
+        return -1;
+    }
+    TRACE_PKT("flush_inorder wrote %lu bytes at offset %lu\n", this->flush_len, this->flush_offset);
+    if (this->resuming)
+    {
+        this->journal->mark(this->flush_offset, this->flush_len);
+    }
+    this->flush_offset += this->flush_len;
+    this->flush_len = 0;
+    this->flush_iovcnt = 0;
+    return 0;
+}
+
+/* 把第seq个包的数据写到文件里它最终的位置
+ * 按序到达的包只在flush_iov里记下payload在收包缓冲区里的位置，不拷贝，
+ * 不再连续或者这一批包处理完时用pwritev一起写，乱序到达的包直接pwrite到对应偏移 */
+int Rtp::store_payload(int64_t seq, const char *payload, uint16_t length, bool in_order)
+{
+    uint64_t offset = out_offset(seq);
+    this->out_size = max<uint64_t>(this->out_size, offset + length);
+    // 预分配接收窗口覆盖的范围，减少碎片，KEEP_SIZE保证文件大小由实际写入决定
+    uint64_t window_end = offset + min<uint64_t>((uint64_t)this->reorder_window * this->mss, RTP_PREALLOC_MAX);
+    if (window_end > this->out_alloc_end)
+    {
+        uint64_t alloc_len = max<uint64_t>(window_end - this->out_alloc_end, 8 << 20);
+        if (fallocate(this->out_fd, FALLOC_FL_KEEP_SIZE, this->out_alloc_end, alloc_len) == -1)
+        {
+            LOG_DEBUG("store_payload fallocate() failed, ignored\n");
+        }
+        this->out_alloc_end += alloc_len;
+    }
+    if (!in_order)
+    {
+        if (pwrite(this->out_fd, payload, length, offset) != length)
+        {
+            LOG_DEBUG("store_payload pwrite() failed at offset %lu\n", offset);
+            return -1;
+        }
+        if (this->resuming)
+        {
+            this->journal->mark(offset, length);
+        }
+        return 0;
+    }
+    if (this->flush_len > 0 &&
+        (offset != this->flush_offset + this->flush_len || this->flush_iovcnt == RTP_RX_MAX))
+    {
+        if (flush_inorder() == -1)
+        {
+            return -1;
+        }
+    }
+    if (this->flush_len == 0)
+    {
+        this->flush_offset = offset;
+    }
+    this->flush_iov[this->flush_iovcnt].iov_base = (void *)payload;
+    this->flush_iov[this->flush_iovcnt].iov_len = length;
+    this->flush_iovcnt++;
+    this->flush_len += length;
+    return 0;
+}
+
+/* 打开要写的文件并准备接收缓冲区，seq_num之后的包依次写进去
+ * 成功返回0失败返回-1，失败时不需要调用end_recv */
+int Rtp::begin_recv(const char *filename)
+{
+    LOG_DEBUG("begin_recv() writing to file %s\n", filename);
+    // 分段传输时其他流在同时写同一个文件，由调用者负责截断
+    // 用校验包恢复时要读回已经写进去的包，续传时保留已经收完的块
+    this->out_fd = open(filename, this->striped || this->resuming ? O_RDWR | O_CREAT : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (this->out_fd == -1)
+    {
+        LOG_DEBUG("begin_recv() failed to open file %s\n", filename);
+        return -1;
+    }
+    this->flush_iov = (struct iovec *)malloc(RTP_RX_MAX * sizeof(struct iovec));
+    if (this->fec_enabled)
+    {
+        this->fec_scratch = (char *)malloc(2 * this->mss);
+    }
+    if (this->flush_iov == nullptr || this->recv_bitmap.init(this->reorder_window) == -1 ||
+        (this->fec_enabled && (this->fec_scratch == nullptr || this->fec_parity.init(RTP_FEC_PENDING, this->mss) == -1)) ||
+        (this->cmp_enabled && this->inflater.start(this->out_fd, this->mss, this->resuming ? this->journal : nullptr) == -1))
+    {
+        LOG_DEBUG("begin_recv() failed to allocate receive buffers\n");
+        free(this->flush_iov);
+        this->flush_iov = nullptr;
+        free(this->fec_scratch);
+        this->fec_scratch = nullptr;
+        ::close(this->out_fd);
+        this->out_fd = -1;
+        return -1;
+    }
+    this->flush_iovcnt = 0;
+    this->flush_len = 0;
+    this->flush_offset = 0;
+    this->out_size = this->stripe_offset;
+    this->out_alloc_end = this->stripe_offset;
+    if (this->resuming)
+    {
+        // 和发送方用同样的参数，跳过的块已经在文件里了
+        this->skip_map.build(this->stripe_offset, this->resume_info.range_end, this->mss, this->resume_runs, this->resume_count);
+        this->out_size = this->resume_info.range_end;
+    }
+    this->out_first_seq = this->seq_num + 1;
+    this->recv_end = this->session ? this->out_first_seq + (int64_t)((this->xfr_size + this->mss - 1) / this->mss) : INT64_MAX;
+    this->recv_base = this->seq_num + 1; // 这是我们期望收到的下一个包的序号
+    this->recv_high = this->seq_num + 1;
+    this->ack_pending = 0;
+    this->fec_repaired = 0;
+    this->fec_pending = 0;
+    for (RtpFecGroup &group : this->fec_groups)
+    {
+        group.used = false;
+    }
+    this->rcv_space_seq = this->recv_base;
+    this->rcv_space_time = chrono::steady_clock::now();
+    grow_sockbuf(SO_RCVBUF, 0); // 读出当前的缓冲区大小作为初始的接收窗口
+    return 0;
+}
+
+/* 结束接收，ret为接收的结果，为0时写完剩下的数据并截掉预分配的部分
+ * 返回最终结果，收尾失败时返回-1 */
+int Rtp::end_recv(int ret)
+{
+    if (this->inflater.running())
+    {
+        // 等后台线程解压完，最后一个包解压后多长只有它知道
+        if (this->inflater.stop() == -1 && ret == 0)
+        {
+            LOG_DEBUG("end_recv() failed to inflate\n");
+            ret = -1;
+        }
+        this->out_size = max(this->out_size, this->inflater.get_end());
+    }
+    // 失败时也写完剩下的连续数据，续传时这些块不用再发
+    // 成功时去掉预分配多出来的部分，分段传输时由调用者按总大小截断
+    if (flush_inorder() == -1 || (ret == 0 && !this->striped && ftruncate(this->out_fd, this->out_size) == -1))
+    {
+        LOG_DEBUG("end_recv() failed to finish file\n");
+        ret = -1;
+    }
+    if (this->resuming)
+    {
+        this->journal->sync(this->out_fd, true);
+    }
+    free(this->flush_iov);
+    this->flush_iov = nullptr;
+    if (this->fec_enabled)
+    {
+        LOG_MSG("Recovered %u packets from parity\n", this->fec_repaired);
+        free(this->fec_scratch);
+        this->fec_scratch = nullptr;
+        this->fec_parity.release();
+    }
+    ::close(this->out_fd);
+    this->out_fd = -1;
+    this->seq_num = this->recv_base - 1;
+    return ret;
+}
+
+/* 接受文件名，接收，gbn
+ * 成功返回0，超时返回1，失败返回-1
+ * 收到的数据在recv_file_gbn里边收边写进文件，
+ * 内存占用只和乱序窗口有关 */
+int Rtp::recv_file(const char *filename)
+{
+    if (begin_recv(filename) == -1)
+    {
+        LOG_FATAL("recv_file() failed to open file\n");
+        return -1;
+    }
+    if (get_io() == nullptr)
+    {
+        LOG_FATAL("recv_file() failed to allocate io batch\n");
+        end_recv(-1);
+        return -1;
+    }
+    // 不支持UDP_GRO时照常一个一个收，收包缓冲区换成协商出的包大小
+    // 校验包比满的数据包多一个RtpFecInfo
+    uint32_t rx_slot = packet_bytes() + (this->fec_enabled ? sizeof(RtpFecInfo) : 0);
+    if ((!this->offload || enable_gro(sockfd, this->io) == -1) && size_rx(this->io, rx_slot, RTP_BATCH) == -1)
+    {
+        LOG_FATAL("recv_file() failed to allocate receive buffers\n");
+        end_recv(-1);
+        return -1;
+    }
+    if (this->session && send_packet((void *)&this->xfr_ack) == -1) // 准备好了，对方收到后开始发数据
+    {
+        LOG_FATAL("recv_file() failed to send XFR&ACK\n");
+        end_recv(-1);
+        return -1;
+    }
+    LOG_DEBUG("recv_file() using gbn\n");
+    // 记录开始时间
+    auto start_time = std::chrono::steady_clock::now();
+    int ret = end_recv(recv_file_gbn());
+    // 记录结束时间
+    auto end_time = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end_time - start_time;
+    if (ret == 0)
+    {
+        LOG_MSG("File received successfully in %.2f seconds\n", elapsed_seconds.count());
+    }
+    else
+    {
+        LOG_DEBUG("recv_file() failed with code %d\n", ret);
+    }
+    return ret;
+}
+
+/* 接收方：会话里等下一次传输的XFR，期间对方重传的上一次传输的包再ACK一次（最后的ACK丢了），
+ * 收到XFR返回0并填写xfr，对方发了FIN或者RTP_SESSION_IDLE_MS没有任何包返回1，失败返回-1
+ * 返回0之后用recv_transfer接收，返回1之后用wait_close回复FIN */
+int Rtp::wait_transfer(RtpTransfer *xfr)
+{
+    if (!this->session || init_events() == -1 || get_io() == nullptr)
+    {
+        LOG_DEBUG("wait_transfer() not in a session\n");
+        return -1;
+    }
+    uint32_t next_seq = seq64to32(this->seq_num + 1); // 保活包的seq_num是上一个序号
+    arm_timer(chrono::steady_clock::time_point());
+    while (!this->fin_received)
+    {
+        int64_t idle_ms = RTP_SESSION_IDLE_MS - chrono::duration_cast<chrono::milliseconds>(
+                                                    chrono::steady_clock::now() - this->last_recv_time)
+                                                    .count();
+        if (idle_ms <= 0)
+        {
+            LOG_MSG("Session idle for %d seconds, closing\n", RTP_SESSION_IDLE_MS / 1000);
+            return 1;
+        }
+        int events = wait_events(idle_ms + 1);
+        if (events == -1)
+        {
+            return -1;
+        }
+        bool readable = (events & RTP_EV_SOCK) != 0;
+        while (readable)
+        {
+            int n = recv_batch();
+            if (n == -1)
+            {
+                LOG_DEBUG("wait_transfer: recv_batch() failed\n");
+                return -1;
+            }
+            for (int i = 0; i < n; i++)
+            {
+                RtpPacket *pkt = this->io->rx_pkts[i];
+                if (is_dat(pkt->header.flags) && seq32to64(pkt->header.seq_num) < this->recv_base)
+                {
+                    this->stats.duplicate_data.fetch_add(1, memory_order_relaxed);
+                    if (queue_ack() == -1)
+                    {
+                        return -1;
+                    }
+                    continue;
+                }
+                if (pkt->header.flags == RTP_XFR && pkt->header.length > 0 && pkt->header.seq_num == this->xfr_ack.seq_num)
+                {
+                    // 空文件不用等数据，上一次的XFR&ACK丢了时对方还在重发XFR
+                    if (queue_copy(&this->xfr_ack) == -1)
+                    {
+                        return -1;
+                    }
+                    continue;
+                }
+                uint8_t opt_len;
+                const char *value = opt_find(pkt, RTP_OPT_XFR, &opt_len);
+                if (pkt->header.flags != RTP_XFR || pkt->header.seq_num != next_seq ||
+                    value == nullptr || opt_len != sizeof(RtpTransferInfo))
+                {
+                    continue;
+                }
+                RtpTransferInfo info;
+                memcpy(&info, value, sizeof(info));
+                xfr->size = info.size;
+                xfr->bundle = info.bundle != 0;
+                const char *name = opt_find(pkt, RTP_OPT_NAME, &opt_len);
+                size_t name_len = 0;
+                if (name != nullptr)
+                {
+                    name_len = min<size_t>(opt_len, RTP_XFR_NAME_MAX);
+                    memcpy(xfr->name, name, name_len);
+                }
+                xfr->name[name_len] = '\0';
+                this->xfr_size = info.size;
+                this->bundled = xfr->bundle;
+                LOG_DEBUG("wait_transfer Received XFR with seq_num %u, %lu Bytes\n", next_seq, xfr->size);
+                return flush_packets();
+            }
+            if (flush_packets() == -1)
+            {
+                return -1;
+            }
+            if (this->io->rx_drained)
+            {
+                break; // socket里已经没有排队的包了
+            }
+        }
+    }
+    LOG_DEBUG("wait_transfer: peer closed the session\n");
+    return 1;
+}
+
+/* 接收方：接收wait_transfer等到的传输，XFR占一个序号，打开文件后回复XFR&ACK，
+ * 收满XFR里的大小就返回，返回值同recv_file */
+int Rtp::recv_transfer(const char *filename)
+{
+    this->seq_num += 1;
+    header_wrapper(&this->xfr_ack, seq64to32(this->seq_num), RTP_XFR | RTP_ACK);
+    return recv_file(filename);
+}
+
+/* 把ACK里的SACK块记进记分板，只记[base, next_seq_num)之内的部分，格式不对的整个忽略 */
+void Rtp::on_sack(const RtpPacket *ack, int64_t base, int64_t next_seq_num)
+{
+    RtpSackBlock blocks[RTP_SACK_MAX];
+    int count = parse_sack(ack, blocks);
+    if (count == -1)
+    {
+        LOG_DEBUG("on_sack: malformed SACK option ignored\n");
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        int64_t start = max(seq32to64(blocks[i].start), base);
+        int64_t end = min(seq32to64(blocks[i].end), next_seq_num);
+        for (int64_t seq = start; seq < end; seq++)
+        {
+            this->sacked.set(seq);
+        }
+        if (end > this->sack_high)
+        {
+            this->sack_high = end;
+        }
+        TRACE_PKT("on_sack: SACK block [%ld, %ld)\n", start, end);
+    }
+}
+
+/* 记录seq的发送时间，重传过的包之后不再用来采样RTT */
+void Rtp::mark_sent(int64_t seq, bool retransmit)
+{
+    RtpTxMeta *meta = this->send_meta.at(seq);
+    meta->sent_ns = now_ns();
+    meta->retransmitted = retransmit;
+    meta->delivered = this->delivered;
+    meta->delivered_ns = this->delivered_ns;
+    meta->rtx_queued = false;
+}
+
+/* 按拥塞控制算法给出的速率设置令牌桶，算法不给速率时用cwnd/srtt，
+ * 慢启动时乘2、拥塞避免时乘1.2，留出窗口增长的余量，最后不超过rate_cap */
+void Rtp::update_pacing_rate(int64_t now)
+{
+    double rate = 0; // 包/秒
+    if (this->pacing)
+    {
+        rate = cc->pacing_rate();
+        if (rate == 0 && this->rtt.valid())
+        {
+            double gain = cc->get_cwnd() < cc->get_ssthresh() ? 2.0 : 1.2;
+            rate = gain * (cc->get_cwnd() + this->recovery_inflate) * 1e6 / max<int64_t>(this->rtt.get_srtt(), 1);
+        }
+    }
+    double bytes_per_sec = rate * packet_bytes();
+    if (this->rate_cap > 0)
+    {
+        bytes_per_sec = bytes_per_sec > 0 ? min(bytes_per_sec, this->rate_cap) : this->rate_cap;
+    }
+    this->pacer.set_rate(bytes_per_sec, packet_bytes(), now);
+}
+
+int Rtp::set_congestion_control(const char *name)
+{
+    CongestionControl *cc = cc_create(name);
+    if (cc == nullptr)
+    {
+        LOG_DEBUG("set_congestion_control unknown algorithm %s\n", name);
+        return -1;
+    }
+    delete this->cc;
+    this->cc = cc;
+    return 0;
+}
+
+/* 把[from, to)里没有被SACK确认、也不在队列里的包放进重传队列，返回放进去的个数
+ * 重传和新包一样要等令牌，丢包时也不会超过限速 */
+int Rtp::retransmit_holes(int64_t from, int64_t to)
+{
+    int count = 0;
+    for (int64_t seq = from; seq < to; seq++)
+    {
+        RtpTxMeta *meta = this->send_meta.at(seq);
+        if (this->sacked.test(seq) || meta->rtx_queued)
+        {
+            continue;
+        }
+        meta->rtx_queued = true;
+        this->rtx_queue.push_back(seq);
+        count++;
+    }
+    this->fec_rate.on_lost(count);
+    return count;
+}
+
+/* 按令牌把重传队列里的包放进发送队列，已经被确认的跳过
+ * 全部发完返回0，令牌不够返回1，失败返回-1 */
+int Rtp::send_retransmits(int64_t base)
+{
+    while (!this->rtx_queue.empty())
+    {
+        int64_t seq = this->rtx_queue.front();
+        if (seq < base || this->sacked.test(seq))
+        {
+            // 小于base的槽可能已经给了新包，不动它的记录
+            if (seq >= base)
+            {
+                this->send_meta.at(seq)->rtx_queued = false;
+            }
+            this->rtx_queue.pop_front();
+            continue;
+        }
+        RtpTxSlot *slot = this->send_ring.at(seq);
+        uint32_t bytes = slot->header.length + sizeof(RtpHeader);
+        if (!this->pacer.can_send(bytes))
+        {
+            return 1;
+        }
+        if (queue_iov(&slot->header, slot->payload) == -1)
+        {
+            return -1;
+        }
+        this->pacer.consume(bytes);
+        mark_sent(seq, true);
+        this->rtx_queue.pop_front();
+    }
+    return 0;
+}
+
+/* 把第seq个包压缩前的数据累加进正在生成的校验包，这一组够了fec_group个包或者last时把校验包放进发送队列
+ * 一组开始时按丢包率重新选择组的大小，发送循环在这一组的最后一个包之前已经为校验包留好了令牌
+ * 成功返回0，失败返回-1 */
+int Rtp::fec_add(int64_t seq, const char *raw, uint16_t length, bool last)
+{
+    if (!this->fec_enabled)
+    {
+        return 0;
+    }
+    char *fec = this->fec_tx.at(this->fec_slot);
+    char *parity = fec + sizeof(RtpHeader) + sizeof(RtpFecInfo);
+    if (this->fec_count == 0)
+    {
+        this->fec_rate.update();
+        this->fec_group = this->fec_rate.group();
+        this->fec_first = seq;
+        this->fec_len = 0;
+        memset(parity, 0, this->mss);
+    }
+    fec_xor(parity, raw, length);
+    this->fec_len = max(this->fec_len, length);
+    this->fec_count++;
+    this->fec_rate.on_sent(1);
+    if (this->fec_count < this->fec_group && !last)
+    {
+        return 0;
+    }
+    RtpFecInfo info;
+    info.count = this->fec_count;
+    info.tail_len = length;
+    memcpy(fec + sizeof(RtpHeader), &info, sizeof(info));
+    RtpHeader *header = (RtpHeader *)fec;
+    header->seq_num = seq64to32(this->fec_first);
+    header->length = sizeof(RtpFecInfo) + this->fec_len;
+    header->checksum = 0; // 先清零再计算checksum
+    header->flags = RTP_FEC;
+    header->checksum = compute_checksum(fec, sizeof(RtpHeader) + header->length);
+    TRACE_PKT("fec_add parity for [%ld, %ld), loss %.4f\n", this->fec_first, seq + 1, this->fec_rate.get_loss());
+    this->fec_count = 0;
+    this->fec_slot++; // 放进队列的校验包在flush_packets之前不能被覆盖
+    if (queue_packet(fec) == -1)
+    {
+        return -1;
+    }
+    this->pacer.consume(sizeof(RtpHeader) + header->length);
+    return 0;
+}
+
+/* gbn方式发送数量为total_packets的包，进入窗口时打包放进send_ring
+ * 成功返回0，超时（5秒没收到任何包）返回1，失败返回-1
+ * 累积确认的滑动窗口协议 (类似GBN/TCP)
+ * ACK为累积确认，确认收到的连续包的最大编号。
+ * ACK带SACK块时记进记分板，超时和快速恢复都只重传空洞。
+ */
+int Rtp::send_file_gbn(uint32_t total_packets)
+{
+    if (total_packets == 0)
+    {
+        TRACE_EVT("send_file_gbn: No packets to send for empty file.\n");
+        return 0;
+    }
+
+    int64_t base = this->seq_num + 1;
+    int64_t next_seq_num = this->seq_num + 1;
+    int64_t highest_seq = this->seq_num + total_packets;
+    TRACE_EVT("send_file_gbn: Starting to send %u packets from seq %ld to %ld\n", total_packets, base, highest_seq);
+
+    chrono::steady_clock::time_point base_send_time; // 计时器只针对base
+    int64_t high_rxt = base;                         // 本轮快速恢复已经重传到的位置
+    this->sacked.reset();
+    this->sack_high = base;
+    this->delivered_ns = now_ns();
+    this->recovery_inflate = 0;
+    this->dup_ack_count = 0; // 会话里上一次传输可能停在快速恢复里
+    this->in_fast_recovery = false;
+    this->rtx_queue.clear();
+    this->peer_wnd_end = INT64_MAX; // 收到第一个ACK之前只受拥塞窗口限制
+    this->fec_rate.reset();
+    this->fec_count = 0;
+    this->cmp_saved = 0;
+    this->fec_repaired = 0;
+    update_pacing_rate(steady_ns(chrono::steady_clock::now()));
+    this->pacer.reset(steady_ns(chrono::steady_clock::now()));
+    if (init_events() == -1)
+    {
+        return -1;
+    }
+
+    this->last_recv_time = chrono::steady_clock::now();
+
+    while (base <= highest_seq)
+    {
+        if (chrono::steady_clock::now() - this->last_recv_time > chrono::seconds(5))
+        {
+            LOG_FATAL("send_file_gbn: Connection timed out (5s no ACK).\n");
+            return 1;
+        }
+
+        // 发送窗口内的包，包在第一次进入窗口时才打包，窗口不能超过包槽数量和对方的接收窗口
+        // 令牌不够时停下来，等定时器到了再发，窗口就被均匀地分散在一个RTT里
+        double window = min(cc->get_cwnd() + this->recovery_inflate, (double)this->send_ring.capacity());
+        window = min(window, (double)(this->peer_wnd_end - base));
+        grow_sockbuf(SO_SNDBUF, 2 * (int64_t)window * skb_truesize()); // 一个窗口的包可能一次排进发送队列
+        chrono::steady_clock::time_point pace_deadline; // 为time_point()时不需要等令牌
+        update_pacing_rate(steady_ns(chrono::steady_clock::now()));
+        this->pacer.refill(steady_ns(chrono::steady_clock::now()));
+        // 重传优先，不受窗口限制，但和新包一样要等令牌
+        int rtx_ret = send_retransmits(base);
+        if (rtx_ret == -1)
+        {
+            return -1;
+        }
+        while (rtx_ret == 0 && next_seq_num < base + window && next_seq_num <= highest_seq)
+        {
+            // 这个包会凑满一组时，紧跟着的校验包也要算进令牌里，组的大小至少为RTP_FEC_MIN_GROUP
+            bool parity_due = this->fec_enabled &&
+                              (next_seq_num == highest_seq || (this->fec_count > 0 && this->fec_count + 1 >= this->fec_group));
+            uint32_t need = packet_bytes() + (parity_due ? packet_bytes() + sizeof(RtpFecInfo) : 0);
+            if (!this->pacer.can_send(need))
+            {
+                pace_deadline = chrono::steady_clock::now() + chrono::nanoseconds(this->pacer.wait_ns(need));
+                break;
+            }
+            const char *raw;
+            uint16_t raw_len;
+            RtpTxSlot *slot = build_packet(next_seq_num, &raw, &raw_len);
+            if (slot == nullptr)
+            {
+                LOG_DEBUG("send_file_gbn: Failed to build packet %ld\n", next_seq_num);
+                return -1;
+            }
+            if (queue_iov(&slot->header, slot->payload) == -1)
+            {
+                LOG_DEBUG("send_file_gbn: Failed to send packet %ld\n", next_seq_num);
+                return -1;
+            }
+            mark_sent(next_seq_num, false);
+            this->stats.data_packets_sent.fetch_add(1, memory_order_relaxed);
+            this->pacer.consume(slot->header.length + sizeof(RtpHeader));
+            if (fec_add(next_seq_num, raw, raw_len, next_seq_num == highest_seq) == -1)
+            {
+                LOG_DEBUG("send_file_gbn: Failed to send parity after packet %ld\n", next_seq_num);
+                return -1;
+            }
+
+            if (next_seq_num == base)
+            {
+                base_send_time = chrono::steady_clock::now();
+            }
+
+            TRACE_PKT("send_file_gbn: Sent packet %ld. cwnd=%.1f\n", next_seq_num, window);
+            next_seq_num++;
+        }
+        TRACE_PKT("send_file_gbn: Window [%ld, %ld), cwnd=%.1f, ssthresh=%.1f\n", base, next_seq_num,
+                  cc->get_cwnd(), cc->get_ssthresh());
+
+        // 超时重传为重传整个窗口里没被SACK的包，RTO由测得的RTT算出
+        if (base < next_seq_num && chrono::steady_clock::now() - base_send_time >= chrono::microseconds(this->rtt.get_rto()))
+        {
+            this->rtt.on_timeout(); // RTO指数退避
+            cc->on_timeout(now_ns() / 1000);
+            this->stats.timeouts.fetch_add(1, memory_order_relaxed);
+            this->stats.sample_cc(cc->get_cwnd(), cc->get_ssthresh(), true);
+            dup_ack_count = 0;
+            in_fast_recovery = false;
+            this->recovery_inflate = 0;
+            TRACE_EVT("send_file_gbn: TIMEOUT on base %ld. Retransmitting holes in window [%ld, %ld).\n", base, base, next_seq_num);
+            TRACE_EVT("send_file_gbn: After timeout, ssthresh=%.1f, cwnd=%.1f, rto=%.1fms\n",
+                      cc->get_ssthresh(), cc->get_cwnd(), get_rto_ms());
+            // 重传之前窗口内的包，应对高丢包率
+            int rtx = retransmit_holes(base, next_seq_num);
+            if (rtx == -1)
+            {
+                return -1;
+            }
+            this->stats.retransmits[RTP_RTX_TIMEOUT].fetch_add(rtx, memory_order_relaxed);
+            high_rxt = next_seq_num;
+            // 重置base的计时器
+            base_send_time = chrono::steady_clock::now();
+            rtx_ret = send_retransmits(base);
+            if (rtx_ret == -1)
+            {
+                return -1;
+            }
+        }
+        if (rtx_ret == 1 && pace_deadline == chrono::steady_clock::time_point())
+        {
+            // 重传队列在等令牌
+            uint32_t bytes = this->send_ring.at(this->rtx_queue.front())->header.length + sizeof(RtpHeader);
+            pace_deadline = chrono::steady_clock::now() + chrono::nanoseconds(this->pacer.wait_ns(bytes));
+        }
+
+        if (flush_packets() == -1)
+        {
+            LOG_DEBUG("send_file_gbn: Failed to flush packets\n");
+            return -1;
+        }
+
+        // 等待ACK、RTO定时器或者令牌，醒来后把socket里排队的ACK全部处理完再决定发什么
+        chrono::steady_clock::time_point deadline = pace_deadline;
+        if (base < next_seq_num)
+        {
+            chrono::steady_clock::time_point rto_deadline = base_send_time + chrono::microseconds(this->rtt.get_rto());
+            deadline = deadline == chrono::steady_clock::time_point() ? rto_deadline : min(deadline, rto_deadline);
+        }
+        arm_timer(deadline);
+        int64_t idle_ms = 5000 - chrono::duration_cast<chrono::milliseconds>(
+                                     chrono::steady_clock::now() - this->last_recv_time)
+                                     .count();
+        int events = wait_events(max<int64_t>(idle_ms, 0) + 1);
+        if (events == -1)
+        {
+            return -1;
+        }
+        bool readable = (events & RTP_EV_SOCK) != 0;
+        while (readable)
+        {
+            int n = recv_batch();
+            if (n == -1)
+            {
+                LOG_DEBUG("send_file_gbn: recv_batch() failed\n");
+                return -1;
+            }
+            for (int i = 0; i < n; i++)
+            {
+                RtpPacket *ack_pkt = this->io->rx_pkts[i];
+                if (ack_pkt->header.flags == (RTP_SYN | RTP_ACK) && !this->hs_confirmed &&
+                    ack_pkt->header.seq_num == this->hs_ack.header.seq_num)
+                {
+                    // 第三次握手丢了，对方还在重发SYN&ACK，数据包它不会收
+                    TRACE_EVT("send_file_gbn: Received SYN&ACK, resending handshake ACK\n");
+                    if (queue_copy(&this->hs_ack) == -1)
+                    {
+                        return -1;
+                    }
+                    continue;
+                }
+                if (ack_pkt->header.flags != RTP_ACK)
+                {
+                    continue;
+                }
+                this->hs_confirmed = true;
+                int64_t ack_ns = this->io->rx_ns[i] != 0 ? this->io->rx_ns[i] : now_ns();
+                this->last_recv_time = chrono::steady_clock::now();
+                int64_t ack_seq = seq32to64(ack_pkt->header.seq_num);
+                on_sack(ack_pkt, base, next_seq_num);
+                uint8_t rwnd_len;
+                const char *rwnd = opt_find(ack_pkt, RTP_OPT_RWND, &rwnd_len);
+                if (rwnd != nullptr && rwnd_len == sizeof(uint32_t) && ack_seq + 1 >= base)
+                {
+                    // 窗口右边界只前进不后退，乱序到达的旧ACK不会让已经发出的包超出窗口
+                    uint32_t rwnd_pkts;
+                    memcpy(&rwnd_pkts, rwnd, sizeof(rwnd_pkts));
+                    int64_t wnd_end = ack_seq + 1 + rwnd_pkts;
+                    this->peer_wnd_end = this->peer_wnd_end == INT64_MAX ? wnd_end : max(this->peer_wnd_end, wnd_end);
+                }
+                uint8_t fec_len;
+                const char *fec = opt_find(ack_pkt, RTP_OPT_FEC, &fec_len);
+                if (fec != nullptr && fec_len == sizeof(uint32_t))
+                {
+                    // 对方用校验包恢复的包也是丢了的，只是不用重传
+                    uint32_t repaired;
+                    memcpy(&repaired, fec, sizeof(repaired));
+                    if (repaired > this->fec_repaired)
+                    {
+                        this->fec_rate.on_lost(repaired - this->fec_repaired);
+                        this->fec_repaired = repaired;
+                    }
+                }
+
+                // ack_seq 是接收方已经收到的连续包的最大序号
+                // 所以我们期望的下一个包是 ack_seq + 1
+                if (ack_seq + 1 > base)
+                {
+                    // 这是个新的有效ACK，可以滑动窗口
+                    TRACE_PKT("send_file_gbn: Received new cumulative ACK for %ld. Window base was %ld\n", ack_seq, base);
+                    int64_t old_base = base;
+                    base = min(ack_seq + 1, next_seq_num); // 滑动窗口
+                    last_ack_seq = ack_seq;
+                    // 用新确认的最后一个包采样RTT，这次确认的包里有重传过的就不采样(Karn)
+                    bool can_sample = karn_ok(this->send_meta, old_base, base);
+                    RtpTxMeta *meta = this->send_meta.at(base - 1);
+                    CcAck cc_ack;
+                    cc_ack.now_us = ack_ns / 1000;
+                    cc_ack.acked = base - old_base;
+                    cc_ack.rtt_us = can_sample ? (ack_ns - meta->sent_ns) / 1000 : 0;
+                    cc_ack.inflight = next_seq_num - base;
+                    cc_ack.in_recovery = in_fast_recovery;
+                    // 投递速率：这个包发出之后到现在新确认的包数 / 经过的时间
+                    this->delivered += base - old_base;
+                    this->delivered_ns = ack_ns;
+                    cc_ack.delivery_rate = ack_ns > meta->delivered_ns
+                                               ? (this->delivered - meta->delivered) * 1e9 / (ack_ns - meta->delivered_ns)
+                                               : 0;
+                    if (can_sample)
+                    {
+                        this->rtt.sample(cc_ack.rtt_us);
+                        this->stats.rtt.record(cc_ack.rtt_us);
+                        TRACE_PKT("send_file_gbn: RTT sample %.3fms, srtt=%.3fms, rto=%.1fms\n",
+                                  this->rtt.get_latest() / 1000.0, get_srtt_ms(), get_rto_ms());
+                    }
+                    else
+                    {
+                        this->rtt.on_progress();
+                    }
+                    release_acked(base); // 已确认的包不会再重传
+                    this->sacked.clear_range(old_base, base);
+                    high_rxt = max(high_rxt, base);
+
+                    if (base < next_seq_num)
+                    {
+                        // 如果窗口中还有未确认的包，重置base的计时器
+                        base_send_time = chrono::steady_clock::now();
+                    }
+
+                    // 窗口怎么涨由拥塞控制算法决定，一个ACK可能确认了多个包
+                    cc_ack.min_rtt_us = this->rtt.get_min_rtt();
+                    cc->on_ack(cc_ack);
+                    this->stats.sample_cc(cc->get_cwnd(), cc->get_ssthresh());
+                    if (in_fast_recovery)
+                    {
+                        // 收到新ACK，退出快速恢复，去掉重复ACK带来的膨胀
+                        in_fast_recovery = false;
+                        this->recovery_inflate = 0;
+                        TRACE_EVT("send_file_gbn: Exiting Fast Recovery. cwnd set to %.1f\n", cc->get_cwnd());
+                    }
+                    TRACE_PKT("send_file_gbn: acked %u, cwnd is now %.1f\n", cc_ack.acked, cc->get_cwnd());
+                    dup_ack_count = 0; // 重置重复ACK计数
+                }
+                else if (ack_seq + 1 == base)
+                {
+                    // 重复ACK
+                    if (!in_fast_recovery)
+                    {
+                        dup_ack_count++;
+                    }
+                    this->stats.dup_acks.fetch_add(1, memory_order_relaxed);
+                    TRACE_PKT("send_file_gbn: Received duplicate ACK for %ld (count=%d)\n", ack_seq, dup_ack_count);
+
+                    if (dup_ack_count == 3)
+                    {
+                        // 触发快速重传
+                        TRACE_EVT("send_file_gbn: 3 duplicate ACKs for %ld. Triggering Fast Retransmit for %ld.\n", ack_seq, base);
+                        if (base < next_seq_num) // 重传base，有SACK信息时重传最高SACK之前所有的空洞
+                        {
+                            high_rxt = max(this->sack_high, base + 1);
+                            int rtx = retransmit_holes(base, high_rxt);
+                            if (rtx == -1)
+                            {
+                                return -1;
+                            }
+                            this->stats.retransmits[RTP_RTX_FAST].fetch_add(rtx, memory_order_relaxed);
+                            base_send_time = chrono::steady_clock::now();
+
+                            // 进入快速恢复
+                            in_fast_recovery = true;
+                            cc->on_loss(ack_ns / 1000);
+                            this->stats.sample_cc(cc->get_cwnd(), cc->get_ssthresh(), true);
+                            this->recovery_inflate = 3; // 窗口膨胀
+                            TRACE_EVT("send_file_gbn: Entering Fast Recovery. ssthresh=%.1f, cwnd=%.1f\n",
+                                      cc->get_ssthresh(), cc->get_cwnd());
+                        }
+                    }
+                    else if (in_fast_recovery)
+                    {
+                        // 在快速恢复状态下，每个重复ACK表示一个包离开了网络
+                        this->recovery_inflate += 1.0;
+                        TRACE_PKT("send_file_gbn: In Fast Recovery, inflating cwnd to %.1f\n",
+                                  cc->get_cwnd() + this->recovery_inflate);
+                        // 新的SACK块暴露出来的空洞也重传
+                        if (this->sack_high > high_rxt)
+                        {
+                            int rtx = retransmit_holes(high_rxt, this->sack_high);
+                            if (rtx == -1)
+                            {
+                                return -1;
+                            }
+                            this->stats.retransmits[RTP_RTX_SACK].fetch_add(rtx, memory_order_relaxed);
+                            high_rxt = this->sack_high;
+                        }
+                    }
+                }
+                else
+                {
+                    // ack_seq + 1 < base, 过时ACK忽略
+                    TRACE_PKT("send_file_gbn: Received old cumulative ACK for %ld, ignoring.\n", ack_seq);
+                }
+
+                TRACE_PKT("send_file_gbn: Window base is now %ld\n", base);
+            }
+            if (this->io->rx_drained)
+            {
+                break; // socket里已经没有排队的包了
+            }
         }
     }
-    // 超时说明没再收到FIN，关闭成功
-    LOG_DEBUG("wait_close() succeed\n");
-    this->addrlen = 0; // 清零addrlen
-    free(recv_fin);
+    TRACE_EVT("send_file_gbn() success\n");
     return 0;
 }
 
-// 没有seqnum限制版的
-int Rtp::waitfor_ack(int64_t *seq_num_p, int timeout)
+/* 从bitmap里找出[from, to)之内已经收到的连续段，
+ * 最多RTP_SACK_MAX段，写成一个SACK选项，返回选项长度，没有乱序包时返回0 */
+int Rtp::build_sack(const SeqBitmap &bitmap, int64_t from, int64_t to, char *options)
 {
-    RtpHeader *recv_ack = (RtpHeader *)malloc(sizeof(RtpPacket));
-    int waitfor_ret = waitfor(recv_ack, RTP_ACK, timeout);
-    if (waitfor_ret == 0)
+    RtpSackBlock blocks[RTP_SACK_MAX];
+    int count = 0;
+    int64_t pos = from;
+    while (count < RTP_SACK_MAX && pos < to)
+    {
+        int64_t start = bitmap.first_one(pos, to);
+        if (start >= to)
+        {
+            break;
+        }
+        int64_t end = bitmap.first_zero(start, to);
+        blocks[count].start = seq64to32(start);
+        blocks[count].end = seq64to32(end);
+        count++;
+        pos = end;
+    }
+    if (count == 0)
     {
-        *seq_num_p = seq32to64(recv_ack->seq_num);
-        free(recv_ack);
         return 0;
     }
-    free(recv_ack);
-    return waitfor_ret; // 1 for timeout, -1 for error
+    return opt_put(options, 0, RTP_OPT_SACK, blocks, count * sizeof(RtpSackBlock));
 }
 
-int Rtp::waitfor_dat(void *buffer, int timeout)
+/* 取出ACK里的SACK块，blocks至少RTP_SACK_MAX个，返回块数，没有SACK选项返回0，
+ * 长度不是整数个块或者块数超过RTP_SACK_MAX时返回-1 */
+int Rtp::parse_sack(const RtpPacket *ack, RtpSackBlock *blocks)
 {
-    return waitfor(buffer, RTP_DAT, timeout);
+    uint8_t len;
+    const char *value = opt_find(ack, RTP_OPT_SACK, &len);
+    if (value == nullptr)
+    {
+        return 0;
+    }
+    if (len % sizeof(RtpSackBlock) != 0 || len / sizeof(RtpSackBlock) > RTP_SACK_MAX)
+    {
+        return -1;
+    }
+    memcpy(blocks, value, len);
+    return len / sizeof(RtpSackBlock);
 }
 
-/* 接受文件名，发送，gbn
- * 成功返回0，超时返回1，失败返回-1
- * 负责读取文件，打包放在data_map里
- * 结束时清空data_map */
-int Rtp::send_file(const char *filename)
+/* 把第seq个包交给接收窗口：还没收到过的窗口内的包写进文件并移动recv_base
+ * copied为true时payload之后就会被覆盖，不能等到这一批处理完再写，
+ * compressed为true时交给后台线程解压后再写
+ * 存下了返回1，重复或者超出窗口返回0，失败返回-1 */
+int Rtp::accept_packet(int64_t seq, const char *payload, uint16_t length, bool copied, bool compressed)
 {
-    ifstream file(filename, ios::binary | ios::ate);
-    if (!file.is_open())
+    int64_t &recv_base = this->recv_base;
+    if (seq >= recv_base + this->reorder_window)
+    {
+        TRACE_PKT("recv_file_gbn: Packet %ld beyond reorder window, dropped.\n", seq);
+        return 0;
+    }
+    if (seq < recv_base || this->recv_bitmap.test(seq))
+    {
+        this->stats.duplicate_data.fetch_add(1, memory_order_relaxed);
+        return 0;
+    }
+    bool in_order = seq == recv_base;
+    if (compressed)
+    {
+        if (!this->inflater.running() || this->inflater.submit(out_offset(seq), payload, length) == -1)
+        {
+            LOG_DEBUG("recv_file_gbn: Failed to inflate packet %ld\n", seq);
+            return -1;
+        }
+    }
+    else if (store_payload(seq, payload, length, in_order && !copied) == -1)
     {
-        LOG_FATAL("send_file() failed to open file\n");
         return -1;
     }
-    uint32_t file_size = file.tellg();
-    file.seekg(0, ios::beg);
-    char *file_buffer = (char *)malloc(file_size);
-    if (!file_buffer)
+    if (in_order)
+    {
+        recv_base++;
+        // 之前乱序收到的包已经在文件里了，按位找第一个没收到的包作为新的recv_base
+        int64_t next_base = this->recv_bitmap.first_zero(recv_base, recv_base + this->recv_bitmap.capacity());
+        this->recv_bitmap.clear_range(recv_base, next_base);
+        recv_base = next_base;
+    }
+    else
+    {
+        this->recv_bitmap.set(seq);
+    }
+    this->recv_high = max(this->recv_high, seq + 1);
+    TRACE_PKT("recv_file_gbn: Packet %ld stored.\n", seq);
+    return 1;
+}
+
+/* 处理一个收到的DAT包：写进文件、移动recv_base，并把累积ACK放进发送队列
+ * 成功返回0，失败返回-1 */
+int Rtp::handle_dat(RtpPacket *recv_pkt)
+{
+    int64_t &recv_base = this->recv_base;
+    int64_t pkt_seq = seq32to64(recv_pkt->header.seq_num);
+    TRACE_PKT("recv_file_gbn: Received DAT with seq %ld. Expecting base %ld.\n", pkt_seq, recv_base);
+    if (recv_pkt->header.length > this->mss)
+    {
+        TRACE_PKT("recv_file_gbn: Packet %ld longer than payload size %u, dropped.\n", pkt_seq, this->mss);
+        return 0; // 偏移按mss算，放不下
+    }
+
+    // 如果收到的包是期望的或窗口内未来的包，并且还没有被存储过，则写进文件
+    int stored = accept_packet(pkt_seq, recv_pkt->payload, recv_pkt->header.length, false, recv_pkt->header.flags == RTP_CMP);
+    if (stored == -1)
     {
-        LOG_FATAL("Failed to allocate buffer for file\n");
-        file.close();
         return -1;
     }
-    file.read(file_buffer, file_size);
-    file.close();
-    // 计算文件总包数
-    uint32_t total_packets = (file_size + PAYLOAD_MAX - 1) / PAYLOAD_MAX;
-    // 对所有文件数据打包
-    for (uint32_t i = 0; i < total_packets; i++)
+    // 这个包可能补齐了一个暂存的组，组里剩下的一个包可以恢复
+    int repaired = stored == 1 && this->fec_pending > 0 ? fec_check(pkt_seq) : 0;
+    if (repaired == -1)
     {
-        RtpPacket *pkt = (RtpPacket *)malloc(sizeof(RtpPacket)); // 在data_map被销毁时统一free
-        uint16_t length = (i == total_packets - 1 && file_size % PAYLOAD_MAX != 0) ? file_size % PAYLOAD_MAX : PAYLOAD_MAX;
-        packet_wrapper(pkt, seq64to32(this->seq_num + 1 + i), length, file_buffer + i * PAYLOAD_MAX);
-        this->data_map.insert(pair<int64_t, RtpPacket *>(this->seq_num + 1 + i, pkt));
+        return -1;
     }
-    free(file_buffer);
-    // 发送
-    LOG_DEBUG("send_file() using gbn with Congestion Control\n");
-    // 记录开始时间
-    auto start_time = std::chrono::steady_clock::now();
-    int ret = send_file_gbn(total_packets);
-    // 记录结束时间
-    auto end_time = std::chrono::steady_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end_time - start_time;
-    LOG_MSG("File size %d Bytes sent successfully in %.2f seconds\n", file_size, elapsed_seconds.count());
-    // 清空data_map
+    TRACE_PKT("recv_file_gbn: Next expected packet is now %ld.\n", recv_base);
 
-    for (auto const &[key, val] : this->data_map)
+    auto now = chrono::steady_clock::now();
+    tune_rcvbuf(now);
+    // 按序到达且没有空洞时可以延迟ACK，攒够delack_max个包或者定时器到了再发
+    // 乱序、重复、有空洞时立即ACK，发送方靠重复ACK和SACK尽快发现丢包
+    // 重复的recv_base - 1也满足后面的条件，要看这次确实存下了
+    bool in_order = stored == 1 && pkt_seq == recv_base - 1 && this->recv_high <= recv_base && repaired == 0;
+    if (this->ack_pending++ == 0)
     {
-        free(val);
+        this->ack_deadline = now + chrono::microseconds(RTP_DELACK_TIMEOUT_US);
     }
-    this->data_map.clear();
-    this->seq_num += total_packets; // 加上文件总字节数的包和文件数据包
-    return ret;
+    if (this->delack_max <= 1 || !in_order || this->ack_pending >= this->delack_max || recv_base >= this->recv_end)
+    {
+        return queue_ack();
+    }
+    TRACE_PKT("recv_file_gbn: Delayed ACK for %ld, %d packets pending\n", recv_base - 1, this->ack_pending);
+    return 0;
 }
 
-/* 接受文件名，接收，gbn
- * 成功返回0，超时返回1，失败返回-1
- * 负责从data_map里读取并写入文件
- * 结束时清空data_map */
-int Rtp::recv_file(const char *filename)
+/* 组里还没收到的包数，只有一个时记在lost里
+ * 组的一部分超出接收窗口时不知道收没收到，返回-1 */
+int Rtp::fec_missing(const RtpFecGroup &group, int64_t *lost)
 {
-    LOG_DEBUG("recv_file() using gbn\n");
-    // 记录开始时间
-    auto start_time = std::chrono::steady_clock::now();
-    int ret = recv_file_gbn();
-    // 记录结束时间
-    auto end_time = std::chrono::steady_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end_time - start_time;
-    LOG_MSG("File received successfully in %.2f seconds\n", elapsed_seconds.count());
-    if (ret != 0)
+    int missing = 0;
+    for (int64_t seq = max(group.first, this->recv_base); seq < group.first + group.count; seq++)
     {
-        LOG_DEBUG("recv_file() failed with code %d\n", ret);
-        // 清空data_map
-        for (auto const &[key, val] : this->data_map)
+        if (seq >= this->recv_base + this->reorder_window)
+        {
+            return -1;
+        }
+        if (!this->recv_bitmap.test(seq))
         {
-            free(val);
+            missing++;
+            *lost = seq;
         }
-        this->data_map.clear();
-        return ret;
     }
-    // 写入文件
-    LOG_DEBUG("recv_file() writing to file %s\n", filename);
-    ofstream file(filename, ios::binary);
-    if (!file.is_open())
+    return missing;
+}
+
+/* 组里只缺lost一个包时，从文件里读回其他包和校验数据异或得到它，再交给接收窗口
+ * 除了最后一个包都是满的，按序收到的包可能还在flush_iov里或者还在等着解压，先写进文件
+ * 成功返回0，失败返回-1 */
+int Rtp::fec_recover(const RtpFecGroup &group, const char *parity, int64_t lost)
+{
+    if (flush_inorder() == -1 || (this->inflater.running() && this->inflater.drain() == -1))
     {
-        LOG_FATAL("recv_file() failed to open file\n");
-        // 清空data_map
-        for (auto const &[key, val] : this->data_map)
-        {
-            free(val);
-        }
-        this->data_map.clear();
         return -1;
     }
-
-    // 从data_map里读取并写入文件
-
-    for (auto const &[key, val] : this->data_map)
+    char *buf = this->fec_scratch;
+    char *out = this->fec_scratch + this->mss;
+    memcpy(out, parity, group.len);
+    memset(out + group.len, 0, this->mss - group.len);
+    int64_t last = group.first + group.count - 1;
+    for (int64_t seq = group.first; seq <= last; seq++)
     {
-        file.write(val->payload, val->header.length);
+        if (seq == lost)
+        {
+            continue;
+        }
+        uint16_t length = seq == last ? group.tail_len : this->mss;
+        uint64_t offset = out_offset(seq);
+        if (pread(this->out_fd, buf, length, offset) != length)
+        {
+            LOG_DEBUG("fec_recover pread() failed at offset %lu\n", offset);
+            return -1;
+        }
+        fec_xor(out, buf, length);
     }
-    file.close();
-    this->seq_num += this->data_map.size();
-    // 清空data_map
-    for (auto const &[key, val] : this->data_map)
+    uint16_t length = lost == last ? group.tail_len : this->mss;
+    if (accept_packet(lost, out, length, true, false) == -1)
     {
-        free(val);
+        return -1;
     }
-    this->data_map.clear();
+    this->fec_repaired++;
+    TRACE_PKT("fec_recover Recovered packet %ld from group [%ld, %ld]\n", lost, group.first, last);
     return 0;
 }
 
-/* gbn方式发送数量为total_packets的包，从data_map里取
- * 成功返回0，超时（5秒没收到任何包）返回1，失败返回-1
- * 累积确认的滑动窗口协议 (类似GBN/TCP)
- * ACK为累积确认，确认收到的连续包的最大编号。
- */
-int Rtp::send_file_gbn(uint32_t total_packets)
+/* 处理一个校验包：组里只丢了一个包时马上恢复并ACK，
+ * 丢了不止一个时暂存起来，等重传补上之后由fec_check恢复，暂存满了换掉最旧的组
+ * 成功返回0，失败返回-1 */
+int Rtp::handle_fec(const RtpPacket *pkt)
 {
-    if (total_packets == 0)
+    RtpFecInfo info;
+    if (pkt->header.length < sizeof(RtpFecInfo) || this->fec_scratch == nullptr)
     {
-        LOG_DEBUG("send_file_gbn: No packets to send for empty file.\n");
         return 0;
     }
-
-    int64_t base = this->seq_num + 1;
-    int64_t next_seq_num = this->seq_num + 1;
-    int64_t highest_seq = this->seq_num + total_packets;
-    LOG_DEBUG("send_file_gbn: Starting to send %u packets from seq %ld to %ld\n", total_packets, base, highest_seq);
-
-    chrono::steady_clock::time_point base_send_time; // 计时器只针对base
-
-    this->last_recv_time = chrono::steady_clock::now();
-
-    while (base <= highest_seq)
+    memcpy(&info, pkt->payload, sizeof(info));
+    RtpFecGroup group;
+    group.first = seq32to64(pkt->header.seq_num);
+    group.count = info.count;
+    group.tail_len = info.tail_len;
+    group.len = pkt->header.length - sizeof(RtpFecInfo);
+    group.used = true;
+    // 校验数据和最长的包一样长，只有最后一个包可以不满
+    if (group.count == 0 || group.tail_len == 0 || group.tail_len > this->mss ||
+        group.len != (group.count > 1 ? this->mss : group.tail_len))
     {
-        if (chrono::steady_clock::now() - this->last_recv_time > chrono::seconds(5))
+        TRACE_PKT("handle_fec Malformed parity packet for %ld, dropped\n", group.first);
+        return 0;
+    }
+    const char *parity = pkt->payload + sizeof(RtpFecInfo);
+    int64_t lost = 0;
+    int missing = fec_missing(group, &lost);
+    TRACE_PKT("handle_fec Parity for [%ld, %ld), %d missing\n", group.first, group.first + group.count, missing);
+    if (missing == 0)
+    {
+        return 0;
+    }
+    if (missing == 1)
+    {
+        if (fec_recover(group, parity, lost) == -1)
         {
-            LOG_FATAL("send_file_gbn: Connection timed out (5s no ACK).\n");
-            return 1;
+            return -1;
         }
-
-        // 发送窗口内的包
-        while (next_seq_num < base + this->cwnd && next_seq_num <= highest_seq)
+        return queue_ack();
+    }
+    int slot = 0; // 空的槽，没有时为最旧的组
+    for (int i = 0; i < RTP_FEC_PENDING; i++)
+    {
+        const RtpFecGroup &other = this->fec_groups[i];
+        if (other.used && other.first == group.first)
         {
-            auto it = this->data_map.find(next_seq_num);
-            if (it != this->data_map.end())
-            {
-                if (send_packet(it->second) == -1)
-                {
-                    LOG_DEBUG("send_file_gbn: Failed to send packet %ld\n", next_seq_num);
-                    return -1;
-                }
-
-                if (next_seq_num == base)
-                {
-                    base_send_time = chrono::steady_clock::now();
-                }
-
-                LOG_DEBUG("send_file_gbn: Sent packet %ld. cwnd=%.1f, ssthresh=%.1f\n", next_seq_num, cwnd, ssthresh);
-                next_seq_num++;
-            }
+            return 0; // 已经存过了
+        }
+        if (this->fec_groups[slot].used && (!other.used || other.first < this->fec_groups[slot].first))
+        {
+            slot = i;
         }
-        LOG_DEBUG("send_file_gbn: Window [%ld, %ld), cwnd=%.1f, ssthresh=%.1f\n", base, next_seq_num, cwnd, ssthresh);
+    }
+    if (!this->fec_groups[slot].used)
+    {
+        this->fec_pending++;
+    }
+    this->fec_groups[slot] = group;
+    memcpy(this->fec_parity.at(slot), parity, group.len);
+    return 0;
+}
 
-        // 超时重传为重传整个窗口
-        if (base < next_seq_num && chrono::steady_clock::now() - base_send_time > chrono::milliseconds(200)) // 200ms RTO
+/* 第seq个包刚收到，恢复包含它的暂存组，顺便丢掉已经收齐的组
+ * 返回恢复的包数，失败返回-1 */
+int Rtp::fec_check(int64_t seq)
+{
+    int repaired = 0;
+    for (int i = 0; i < RTP_FEC_PENDING && this->fec_pending > 0; i++)
+    {
+        RtpFecGroup &group = this->fec_groups[i];
+        bool contains = seq >= group.first && seq < group.first + group.count;
+        if (!group.used || (!contains && group.first + group.count > this->recv_base))
         {
-            // TCP Reno-style timeout reaction
-            ssthresh = max(cwnd / 2.0, 2.0);
-            cwnd = 1.0;
-            dup_ack_count = 0;
-            in_fast_recovery = false;
-            LOG_DEBUG("send_file_gbn: TIMEOUT on base %ld. Retransmitting entire window [%ld, %ld).\n", base, base, next_seq_num);
-            LOG_DEBUG("send_file_gbn: After timeout, ssthresh=%.1f, cwnd=%.1f\n", ssthresh, cwnd);
-            // 重传之前窗口内的包，应对高丢包率
-            for (int64_t seq_to_resend = base; seq_to_resend < next_seq_num; ++seq_to_resend)
+            continue;
+        }
+        int64_t lost = 0;
+        int missing = fec_missing(group, &lost);
+        if (missing == 1)
+        {
+            if (fec_recover(group, this->fec_parity.at(i), lost) == -1)
             {
-                auto find_it = this->data_map.find(seq_to_resend);
-                if (find_it != this->data_map.end())
-                {
-                    if (send_packet(find_it->second) == -1)
-                    {
-                        return -1;
-                    }
-                }
+                return -1;
             }
-            // 重置base的计时器
-            base_send_time = chrono::steady_clock::now();
+            repaired++;
         }
+        if (missing <= 1)
+        {
+            group.used = false;
+            this->fec_pending--;
+        }
+    }
+    return repaired;
+}
 
-        // 等待ACK
-        RtpHeader ack_header;
-        int wait_ret = waitfor(&ack_header, RTP_ACK, 5); // 等待5ms，过长会阻塞发送，过短会增加CPU占用
-
-        if (wait_ret == 0)
-        { // 收到ACK
-            this->last_recv_time = chrono::steady_clock::now();
-            int64_t ack_seq = seq32to64(ack_header.seq_num);
-
-            // ack_seq 是接收方已经收到的连续包的最大序号
-            // 所以我们期望的下一个包是 ack_seq + 1
-            if (ack_seq + 1 > base)
-            {
-                // 这是个新的有效ACK，可以滑动窗口
-                LOG_DEBUG("send_file_gbn: Received new cumulative ACK for %ld. Window base was %ld\n", ack_seq, base);
-                base = ack_seq + 1; // 滑动窗口
-                last_ack_seq = ack_seq;
-
-                if (base < next_seq_num)
-                {
-                    // 如果窗口中还有未确认的包，重置base的计时器
-                    base_send_time = chrono::steady_clock::now();
-                }
-
-                if (in_fast_recovery)
-                {
-                    // 收到新ACK，退出快速恢复
-                    cwnd = ssthresh;
-                    in_fast_recovery = false;
-                    dup_ack_count = 0;
-                    LOG_DEBUG("send_file_gbn: Exiting Fast Recovery. cwnd set to ssthresh %.1f\n", cwnd);
-                }
-                else
-                {
-                    // 正常拥塞控制
-                    if (cwnd < ssthresh)
-                    {
-                        // Slow Start
-                        cwnd += 1.0;
-                        LOG_DEBUG("send_file_gbn: Slow Start, cwnd increased to %.1f\n", cwnd);
-                    }
-                    else
-                    {
-                        // linear growth
-                        cwnd += (1.0 / cwnd);
-                        LOG_DEBUG("send_file_gbn: Congestion Avoidance, cwnd increased to %.1f\n", cwnd);
-                    }
-                }
-                dup_ack_count = 0; // 重置重复ACK计数
-            }
-            else if (ack_seq + 1 == base)
-            {
-                // 重复ACK
-                if (!in_fast_recovery)
-                {
-                    dup_ack_count++;
-                }
-                LOG_DEBUG("send_file_gbn: Received duplicate ACK for %ld (count=%d)\n", ack_seq, dup_ack_count);
+/* 把socket缓冲区调大到至少bytes字节，只调大不调小，不超过RTP_SOCKBUF_MAX
+ * 有CAP_NET_ADMIN时用*BUFFORCE绕过rmem_max/wmem_max，否则受它们限制
+ * 服务端的连接共用socket，每次都重新读一遍，不会把别的连接调大的缓冲区改小
+ * 返回调整后内核实际给的大小 */
+int Rtp::grow_sockbuf(int optname, int64_t bytes)
+{
+    int &cached = optname == SO_SNDBUF ? this->sndbuf : this->rcvbuf;
+    bytes = min<int64_t>(bytes, RTP_SOCKBUF_MAX);
+    if (cached != 0 && bytes <= cached)
+    {
+        return cached;
+    }
+    socklen_t len = sizeof(cached);
+    getsockopt(sockfd, SOL_SOCKET, optname, &cached, &len);
+    if (bytes <= cached)
+    {
+        return cached;
+    }
+    int value = bytes / 2; // 内核会把设置的值翻倍，多出来的一半用于skb的记账开销
+    int force = optname == SO_SNDBUF ? SO_SNDBUFFORCE : SO_RCVBUFFORCE;
+    if (setsockopt(sockfd, SOL_SOCKET, force, &value, sizeof(value)) == -1 &&
+        setsockopt(sockfd, SOL_SOCKET, optname, &value, sizeof(value)) == -1)
+    {
+        LOG_DEBUG("grow_sockbuf() setsockopt failed\n");
+    }
+    len = sizeof(cached);
+    getsockopt(sockfd, SOL_SOCKET, optname, &cached, &len);
+    LOG_DEBUG("grow_sockbuf() %s is now %d bytes (wanted %ld)\n", optname == SO_SNDBUF ? "SO_SNDBUF" : "SO_RCVBUF", cached, bytes);
+    return cached;
+}
 
-                if (dup_ack_count == 3)
-                {
-                    // 触发快速重传
-                    LOG_DEBUG("send_file_gbn: 3 duplicate ACKs for %ld. Triggering Fast Retransmit for %ld.\n", ack_seq, base);
-                    auto it = this->data_map.find(base); // 重传 base
-                    if (it != this->data_map.end())
-                    {
-                        send_packet(it->second);
-                        base_send_time = chrono::steady_clock::now();
+/* 类似Linux的接收缓冲区自动调整：每过一个RTT，看这段时间按序收到了多少包，
+ * 按两倍的量调大SO_RCVBUF，发送方被接收窗口限制时窗口每个RTT可以翻倍 */
+void Rtp::tune_rcvbuf(chrono::steady_clock::time_point now)
+{
+    int64_t srtt_us = max<int64_t>(this->rtt.get_srtt(), 1000);
+    if (now - this->rcv_space_time < chrono::microseconds(srtt_us))
+    {
+        return;
+    }
+    int64_t packets = this->recv_base - this->rcv_space_seq;
+    grow_sockbuf(SO_RCVBUF, 2 * packets * skb_truesize() * this->sock_shares);
+    this->rcv_space_seq = this->recv_base;
+    this->rcv_space_time = now;
+}
 
-                        // 进入快速恢复
-                        in_fast_recovery = true;
-                        ssthresh = max(cwnd / 2.0, 2.0);
-                        cwnd = ssthresh + 3; // 窗口膨胀
-                        LOG_DEBUG("send_file_gbn: Entering Fast Recovery. ssthresh=%.1f, cwnd=%.1f\n", ssthresh, cwnd);
-                    }
-                }
-                else if (in_fast_recovery)
-                {
-                    // 在快速恢复状态下，每个重复ACK表示一个包离开了网络
-                    cwnd += 1.0;
-                    LOG_DEBUG("send_file_gbn: In Fast Recovery, inflating cwnd to %.1f\n", cwnd);
-                }
-            }
-            else
-            {
-                // ack_seq + 1 < base, 过时ACK忽略
-                LOG_DEBUG("send_file_gbn: Received old cumulative ACK for %ld, ignoring.\n", ack_seq);
-            }
+/* 接收窗口：乱序窗口之外的包会被丢掉，socket缓冲区放不下的包会被内核丢掉，
+ * 取两者的较小值，在路上的包全部堆在socket里也不会溢出。
+ * 乱序收到的包已经写进文件，不占用窗口。至少为1，发送方不会停住 */
+uint32_t Rtp::advertised_window()
+{
+    uint32_t sock_window = this->rcvbuf / skb_truesize() / max(this->sock_shares, 1);
+    return max<uint32_t>(min(this->reorder_window, sock_window), 1);
+}
 
-            LOG_DEBUG("send_file_gbn: Window base is now %ld\n", base);
-        }
+/* 把累积ACK放进发送队列，清掉延迟的计数，成功返回0，失败返回-1 */
+int Rtp::queue_ack()
+{
+    // 发送累积ACK
+    // ACK的序号是 recv_base - 1, 表示这个序号以及之前的所有包都已收到
+    // 对端支持SACK时，再带上recv_base之后已经收到的几段
+    // 然后带上接收窗口，旧版本的发送方会跳过这个选项，对方发校验包时最后带上恢复的包数
+    RtpPacket ack_pkt;
+    uint32_t ack_seq_32 = seq64to32(this->recv_base - 1);
+    char options[RTP_CTRL_MAX];
+    int64_t sack_end = min(this->recv_high, this->recv_base + (int64_t)this->reorder_window);
+    int options_len = this->sack_enabled ? build_sack(this->recv_bitmap, this->recv_base, sack_end, options) : 0;
+    uint32_t rwnd = advertised_window();
+    options_len = opt_put(options, options_len, RTP_OPT_RWND, &rwnd, sizeof(rwnd));
+    if (this->fec_enabled)
+    {
+        // 恢复的包数，发送方把它算进丢包率
+        options_len = opt_put(options, options_len, RTP_OPT_FEC, &this->fec_repaired, sizeof(this->fec_repaired));
+    }
+    option_wrapper(&ack_pkt, ack_seq_32, RTP_ACK, options, options_len);
+    if (queue_copy(&ack_pkt) == -1)
+    {
+        LOG_FATAL("recv_file_gbn() failed to send ACK\n");
+        return -1;
+    }
+    if (this->ack_pending > 0)
+    {
+        // 这一批里第一个包到达的时间是ack_deadline往前推RTP_DELACK_TIMEOUT_US
+        auto first = this->ack_deadline - chrono::microseconds(RTP_DELACK_TIMEOUT_US);
+        this->stats.ack_delay.record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - first).count());
     }
-    LOG_DEBUG("send_file_gbn() success\n");
+    this->stats.acks_sent.fetch_add(1, memory_order_relaxed);
+    this->ack_pending = 0;
+    TRACE_PKT("recv_file_gbn: Queued cumulative ACK for %ld. (i.e., expecting %ld)\n", this->recv_base - 1, this->recv_base);
     return 0;
 }
 
-/* 收包，放到data_map里
+/* 收包，边收边通过store_payload写进文件，乱序收到的包记在recv_bitmap里
  * 成功（收到fin）返回0，超时（5秒没收到任何包）返回1，失败返回-1
  * 实现累积确认的接收方逻辑
  * 只ACK连续收到的最大序号的包。
+ * 超出[recv_base, recv_base + reorder_window)的包直接丢掉
+ * 用epoll等包，每次醒来用recvmmsg把排队的包全部取出，对应的ACK用一次sendmmsg发出
  */
 int Rtp::recv_file_gbn()
 {
-    int64_t recv_base = this->seq_num + 1; // 这是我们期望收到的下一个包的序号
+    int64_t &recv_base = this->recv_base;
+    if (init_events() == -1)
+    {
+        return -1;
+    }
 
     this->last_recv_time = chrono::steady_clock::now();
 
@@ -987,64 +3192,101 @@ int Rtp::recv_file_gbn()
         {
             if (this->fin_received && this->fin_seq > recv_base)
             {
-                LOG_DEBUG("recv_file_gbn: FIN received and processed. Exiting successfully.\n");
+                TRACE_EVT("recv_file_gbn: FIN received and processed. Exiting successfully.\n");
                 break;
             }
-            LOG_FATAL("recv_file_gbn: Connection timed out (10s no data).\n");
+            // 返回给end_recv写完收到的数据，续传时日志也要记下来
+            LOG_DEBUG("recv_file_gbn: Connection timed out (10s no data).\n");
             return 1;
         }
 
         if (this->fin_received && recv_base >= this->fin_seq)
         {
-            LOG_DEBUG("recv_file_gbn: All packets before FIN (seq %ld) have been received.\n", this->fin_seq);
+            TRACE_EVT("recv_file_gbn: All packets before FIN (seq %ld) have been received.\n", this->fin_seq);
+            break;
+        }
+        if (recv_base >= this->recv_end)
+        {
+            TRACE_EVT("recv_file_gbn: All packets of the transfer (up to %ld) have been received.\n", this->recv_end);
             break;
         }
 
-        RtpPacket *recv_pkt = (RtpPacket *)malloc(sizeof(RtpPacket));
-        if (!recv_pkt)
+        // 有延迟的ACK时定时器在ack_deadline触发
+        arm_timer(this->ack_pending > 0 ? this->ack_deadline : chrono::steady_clock::time_point());
+        // 没有包时一直睡到连接超时，来包时立刻醒来
+        int64_t idle_ms = 10000 - chrono::duration_cast<chrono::milliseconds>(
+                                      chrono::steady_clock::now() - this->last_recv_time)
+                                      .count();
+        int events = wait_events(max<int64_t>(idle_ms, 0) + 1);
+        if (events == -1)
+        {
             return -1;
-
-        int ret = waitfor_dat(recv_pkt, 5);
-
-        if (ret == 0)
+        }
+        if (this->ack_pending > 0 && chrono::steady_clock::now() >= this->ack_deadline)
         {
-            this->last_recv_time = chrono::steady_clock::now();
-            int64_t pkt_seq = seq32to64(recv_pkt->header.seq_num);
-            LOG_DEBUG("recv_file_gbn: Received DAT with seq %ld. Expecting base %ld.\n", pkt_seq, recv_base);
-
-            // 如果收到的包是期望的或未来的包，并且还没有被存储过，则存起来
-            if (pkt_seq >= recv_base && this->data_map.find(pkt_seq) == this->data_map.end())
+            if (queue_ack() == -1 || flush_packets() == -1)
             {
-                RtpPacket *stored_pkt = (RtpPacket *)malloc(sizeof(RtpPacket));
-                memcpy(stored_pkt, recv_pkt, sizeof(RtpPacket));
-                this->data_map.insert({pkt_seq, stored_pkt});
-                LOG_DEBUG("recv_file_gbn: Packet %ld buffered.\n", pkt_seq);
+                return -1;
             }
-
-            // 如果收到了期望的包，就向前移动recv_base
-            while (this->data_map.count(recv_base))
+        }
+        bool readable = (events & RTP_EV_SOCK) != 0;
+        while (readable)
+        {
+            int n = recv_batch();
+            if (n == -1)
+            {
+                LOG_DEBUG("recv_file_gbn: recv_batch() failed\n");
+                return -1;
+            }
+            for (int i = 0; i < n; i++)
+            {
+                RtpPacket *recv_pkt = this->io->rx_pkts[i];
+                if (recv_pkt->header.flags == RTP_FEC)
+                {
+                    if (handle_fec(recv_pkt) == -1)
+                    {
+                        return -1;
+                    }
+                    continue;
+                }
+                if (recv_pkt->header.flags == RTP_XFR && this->session && recv_pkt->header.seq_num == this->xfr_ack.seq_num)
+                {
+                    // XFR&ACK丢了，对方还在重发XFR
+                    if (queue_copy(&this->xfr_ack) == -1)
+                    {
+                        return -1;
+                    }
+                    continue;
+                }
+                if (!is_dat(recv_pkt->header.flags))
+                {
+                    continue;
+                }
+                if (handle_dat(recv_pkt) == -1)
+                {
+                    return -1;
+                }
+            }
+            // flush_iov指向这一批的收包缓冲区，收下一批之前写进文件
+            if (flush_inorder() == -1)
+            {
+                return -1;
+            }
+            if (this->resuming)
             {
-                recv_base++;
+                this->journal->sync(this->out_fd, false); // 每隔RTP_JOURNAL_SYNC_MS落盘一次，失败了下次再试
             }
-            LOG_DEBUG("recv_file_gbn: Next expected packet is now %ld.\n", recv_base);
-
-            // 发送累积ACK
-            // ACK的序号是 recv_base - 1, 表示这个序号以及之前的所有包都已收到
-            RtpHeader ack_pkt;
-            // uint16_t available_window = UINT16_MAX;
-            uint32_t ack_seq_32 = seq64to32(recv_base - 1);
-            header_wrapper(&ack_pkt, ack_seq_32, RTP_ACK);
-            if (send_packet(&ack_pkt) == -1)
+            if (flush_packets() == -1)
             {
                 LOG_FATAL("recv_file_gbn() failed to send ACK\n");
-                free(recv_pkt);
                 return -1;
             }
-            LOG_DEBUG("recv_file_gbn: Sent cumulative ACK for %ld. (i.e., expecting %ld)\n", recv_base - 1, recv_base);
-
+            if (this->io->rx_drained)
+            {
+                break; // socket里已经没有排队的包了
+            }
         }
-        free(recv_pkt);
     }
-    LOG_DEBUG("recv_file_gbn() success\n");
+    TRACE_EVT("recv_file_gbn() success\n");
     return 0;
 }
@@ -8,16 +8,52 @@
 #include <random>
 #include <iostream>
 #include <poll.h>
+#include <sys/uio.h>
 #include <chrono>
 #include <map>
+#include <deque>
 #include <set>
+#include "ring.h"
+#include "rtt.h"
+#include "cc.h"
+#include "pacer.h"
+#include "fec.h"
+#include "cmp.h"
+#include "journal.h"
+#include "bundle.h"
+#include "stats.h"
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-#define PAYLOAD_MAX 1461
+#define PAYLOAD_MAX 1461                    // 默认的payload大小，1500字节的MTU一定能走通，也是控制包的缓冲区大小
+#define RTP_MSS_MIN 536                     // 可以设置的最小payload
+#define RTP_MSS_MAX (65507 - 11)            // IPv4下一个UDP数据报能放下的最大payload
+#define RTP_DGRAM_MAX (11 + RTP_MSS_MAX)    // 最大的数据报
+#define RTP_PROBE_ROUNDS 2                  // PMTU探测最多发几轮
+#define RTP_PROBE_WAIT_MS 100               // 没有RTT样本时每轮探测等待的时间
+#define RTP_PREALLOC_MAX (64 << 20)         // 接收方最多提前fallocate这么多字节
+#define RTP_REORDER_WINDOW 4096             // 接收方默认的乱序窗口，单位为包
+#define RTP_SEND_RING 4096                  // 发送方包槽数量，也是发送窗口的上限
+#define RTP_RELEASE_STEP (1 << 20)          // 发送方已确认的文件内容攒够这么多再madvise一次
+#define RTP_BATCH 32                        // 一次sendmmsg/recvmmsg最多处理的包数
+#define RTP_CTRL_MAX 128                    // SYN/ACK等控制包携带的选项最大长度
+#define RTP_SACK_MAX 8                      // 一个ACK最多携带的SACK块数
+#define RTP_DELACK_PACKETS 2                // 默认每两个按序到达的包回一个ACK
+#define RTP_DELACK_TIMEOUT_US 2000          // 延迟ACK最多等这么久，要远小于发送方的最小RTO
+#define RTP_SKB_OVERHEAD 832                // 内核给一个数据报额外记账的大小，1472字节的数据报truesize约为2304
+#define RTP_SOCKBUF_MAX (64 << 20)          // 自动调大socket缓冲区的上限(字节)
+#define RTP_GSO_SEGS 44                     // 一次UDP_SEGMENT发送最多合并的满包数，不超过64KB
+#define RTP_GRO_BUF 65536                   // 开启UDP_GRO后一个数据报可能合并到这么大
+#define RTP_GRO_MSGS 8                      // 开启UDP_GRO后一次recvmmsg收的数据报个数
+#define RTP_RX_MAX (RTP_GRO_MSGS * (RTP_GRO_BUF / (11 + RTP_MSS_MIN) + 1)) // 一批最多拆出的包数
+#define RTP_EV_SOCK 1                       // wait_events: socket可读
+#define RTP_EV_TIMER 2                      // wait_events: 定时器触发
+#define RTP_XFR_NAME_MAX 112                // 会话里一次传输的名字的最大长度，XFR的选项要放得进RTP_CTRL_MAX
+#define RTP_SESSION_IDLE_MS 60000           // 接收方：会话里两次传输之间最多等这么久
+#define RTP_SESSION_KEEPALIVE_MS 10000      // 发送方：会话空闲时隔这么久发一个保活包
 
     // flags in the rtp header
     typedef enum RtpHeaderFlag
@@ -25,9 +61,32 @@ extern "C"
         RTP_SYN = 0b0001,
         RTP_ACK = 0b0010,
         RTP_FIN = 0b0100,
+        RTP_PRB = 0b1000, // PMTU探测包，seq_num为探测的payload大小，payload为填充
+        RTP_FEC = 0b10000, // 校验包，seq_num为这一组的第一个包，payload为RtpFecInfo加上这一组payload的XOR
+        RTP_CMP = 0b100000, // 压缩过的数据包，payload为raw deflate，解压后和同一个seq_num的DAT一样
+        RTP_XFR = 0b1000000, // 会话里一次传输的开始，占一个序号，接收方准备好后回复同一个seq_num的XFR&ACK
         RTP_DAT = 0b0000,
     } rtp_header_flag_t;
 
+    /* SYN/ACK的payload里携带的扩展选项，每个选项为 kind(1) len(1) value(len)
+     * 不认识的选项直接跳过，旧版本的对端不会发也不会解析这些选项 */
+    typedef enum RtpOptKind
+    {
+        RTP_OPT_SACK_PERM = 1, // SYN: 发送方能处理SACK
+        RTP_OPT_SACK = 2,      // ACK: 若干个RtpSackBlock
+        RTP_OPT_STRIPE = 3,    // SYN: 分段传输，这条流的数据写在文件的这个偏移处(uint64_t)
+        RTP_OPT_DELACK = 4,    // SYN: 发送方允许一个ACK确认的最多包数(uint8_t)
+        RTP_OPT_RWND = 5,      // ACK: 接收窗口，从ACK的下一个包算起还能接收的包数(uint32_t)
+        RTP_OPT_MSS = 6,       // SYN/SYN&ACK: 能收发的最大payload；第三次握手的ACK: 数据包实际的payload(uint16_t)
+        RTP_OPT_FEC = 7,       // SYN: 发送方会发校验包；ACK: 接收方用校验包恢复的包数(uint32_t)
+        RTP_OPT_CMP = 8,       // SYN: 发送方想压缩数据包；SYN&ACK: 接收方能解压
+        RTP_OPT_RESUME = 9,    // SYN: 要发的文件(RtpResumeInfo)；SYN&ACK: 接收方已经收完的块，若干个RtpResumeRun
+        RTP_OPT_BUNDLE = 10,   // SYN: 数据是RtpBundle拼成的多个文件，接收方收完之后拆到目录里
+        RTP_OPT_SESSION = 11,  // SYN: 发送方要在这个连接里传多次；SYN&ACK: 接收方同意
+        RTP_OPT_XFR = 12,      // XFR: 这次传输的RtpTransferInfo
+        RTP_OPT_NAME = 13,     // XFR: 这次传输的名字，不以0结尾
+    } rtp_opt_kind_t;
+
     /* 根据文档，简便起见都采用小端法 */
     typedef struct __attribute__((__packed__)) RtpHeader
     {
@@ -38,6 +97,27 @@ extern "C"
         uint8_t flags; // See at `RtpHeaderFlag`
     } rtp_header_t;
 
+    /* 接收方已经收到的一段包，[start, end) */
+    typedef struct __attribute__((__packed__)) RtpSackBlock
+    {
+        uint32_t start; // 第一个收到的包的seq_num
+        uint32_t end;   // 最后一个收到的包的seq_num + 1
+    } rtp_sack_block_t;
+
+    /* 校验包payload开头的信息，后面是这一组payload的XOR，短的payload补0 */
+    typedef struct __attribute__((__packed__)) RtpFecInfo
+    {
+        uint8_t count;     // 这一组的包数，从header的seq_num开始连续
+        uint16_t tail_len; // 这一组最后一个包的payload长度，其余的包都是满的
+    } rtp_fec_info_t;
+
+    /* 会话里XFR包携带的这次传输的信息 */
+    typedef struct __attribute__((__packed__)) RtpTransferInfo
+    {
+        uint64_t size;  // 数据的字节数，接收方收满就结束这次传输，不用FIN
+        uint8_t bundle; // 数据是RtpBundle拼成的多个文件
+    } rtp_transfer_info_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -47,46 +127,281 @@ typedef struct __attribute__((__packed__)) RtpPacket
     char payload[PAYLOAD_MAX]; // data
 } rtp_packet_t;
 
+/* 接收方：会话里下一次传输，wait_transfer填写 */
+struct RtpTransfer
+{
+    uint64_t size;                    // 数据的字节数
+    bool bundle;                      // 收完之后用RtpBundle::extract拆开
+    char name[RTP_XFR_NAME_MAX + 1];  // 发送方给的名字，以0结尾，可能为空，使用前要检查
+};
+
+/* 发送方的包槽，header单独存放，payload直接指向mmap的文件内容，
+ * 发送时header和payload作为两个iovec交给内核，不拷贝数据 */
+struct RtpTxSlot
+{
+    RtpHeader header;
+    const char *payload; // 指向file_map，mmap失败时指向send_copy里的同一个槽
+};
+
+/* 发送方每个包槽的附加信息，用于RTT和投递速率采样 */
+struct RtpTxMeta
+{
+    int64_t sent_ns;      // 最近一次发送的时间(CLOCK_REALTIME)
+    bool retransmitted;   // 重传过的包不采样(Karn)
+    int64_t delivered;    // 发送时已经确认的包数
+    int64_t delivered_ns; // 发送时最近一次确认的时间
+    bool rtx_queued;      // 在重传队列里等令牌
+};
+
+/* 批量收发用的缓冲区，recvmmsg直接收进rx_buf，
+ * rx_buf按协商出的payload大小分配，开启UDP_GRO后每个槽为RTP_GRO_BUF */
+struct RtpIoBatch
+{
+    char *rx_buf;                       // rx_batch个rx_slot大小的槽
+    int rx_slot;                        // 每个槽的大小，至少能放下一个数据报
+    int rx_batch;                       // 一次recvmmsg收的数据报个数，不超过RTP_BATCH
+    bool gro;                           // 已经开启UDP_GRO
+    struct mmsghdr rx_msgs[RTP_BATCH];
+    struct iovec rx_iov[RTP_BATCH];
+    struct sockaddr_in rx_addrs[RTP_BATCH];
+    char rx_ctrl[RTP_BATCH][64];        // 收包时的控制信息(cmsg)
+    RtpPacket *rx_dgrams[RTP_RX_MAX];   // 拆开GRO合并之后的每个数据报，不做校验
+    int rx_lens[RTP_RX_MAX];            // rx_dgrams对应的长度
+    uint8_t rx_src[RTP_RX_MAX];         // rx_dgrams来自第几个msg，对应rx_addrs和rx_ctrl
+    int rx_raw;                         // 上次recv_raw拆出的数据报个数
+    bool rx_drained;                    // 上次recvmmsg没有取满，socket里已经没有排队的包了
+    RtpPacket *rx_pkts[RTP_RX_MAX];     // 校验通过的包
+    int64_t rx_ns[RTP_RX_MAX];          // rx_pkts对应的内核收包时间戳(CLOCK_REALTIME)，没有时为0
+    struct mmsghdr tx_msgs[RTP_BATCH];
+    struct iovec tx_iov[2 * RTP_BATCH]; // 第i个包的header和payload是tx_iov[2i]和tx_iov[2i+1]
+    int tx_len[RTP_BATCH];              // 每个包的总长度
+    int tx_first[RTP_BATCH];            // 每个tx_msgs的第一个包的下标
+    char tx_gso_ctrl[RTP_BATCH][CMSG_SPACE(sizeof(uint16_t))]; // UDP_SEGMENT的cmsg
+    char tx_ctrl[RTP_BATCH][sizeof(RtpHeader) + RTP_CTRL_MAX]; // queue_copy拷贝进来的控制包
+    int tx_count;                       // 发送队列里的包数
+};
+
+/* 接收方暂存的一组，组里缺不止一个包，等重传补上只缺一个时再恢复 */
+struct RtpFecGroup
+{
+    int64_t first;     // 第一个包
+    int count;         // 包数
+    uint16_t tail_len; // 最后一个包的长度
+    uint16_t len;      // 校验数据的长度
+    bool used;
+};
+
+class RtpServer;
+
 /* 一个类似TCP功能的类 */
 class Rtp
 {
+    friend class RtpServer; // 服务端直接驱动每个连接的握手和收包状态机
+    friend class RtpLinger; // 挥手后在后台应答重发的FIN
+
 private:
     int sockfd;                   // socket file descriptor
     struct sockaddr_in dest_addr; // destination address
     socklen_t addrlen = 0;        // length of dest_addr,连接关闭后记得清零
 
-    double cwnd;           // Congestion window size
-    double ssthresh;       // Slow start threshold
-    int dup_ack_count;     // Duplicate ACK counter for fast retransmit
-    int64_t last_ack_seq;  // Last received ACK seq number
-    bool in_fast_recovery; // Flag for fast recovery state
+    CongestionControl *cc;   // 拥塞控制算法，决定cwnd
+    double recovery_inflate; // 快速恢复期间因重复ACK膨胀的窗口
+    int dup_ack_count;       // Duplicate ACK counter for fast retransmit
+    int64_t last_ack_seq;    // Last received ACK seq number
+    bool in_fast_recovery;   // Flag for fast recovery state
 
     int64_t seq_num;                                          // 下一个功能模块发送/接收的第一个包的序号为这个值+1
     uint32_t seq_base;                                        // base of sequence number
     std::chrono::steady_clock::time_point last_recv_time;     // last time received a packet
     int send_packet(void *buffer);                            // send a packet or header depend on the length
-    int recv_packet(void *buffer);                            // receive a packet
+    int recv_packet(void *buffer, size_t size = sizeof(RtpPacket)); // receive a packet
+    int check_packet(void *buffer, int len,
+                     const struct sockaddr_in &from, socklen_t fromlen); // 检查收到的包
+    static int verify_packet(void *buffer, int len);          // 只检查大小和CRC
+    RtpIoBatch *io;                                           // 批量收发缓冲区
+    RtpIoBatch *get_io();                                     // 第一次用到时分配io
+    int queue_packet(void *buffer);                           // 放进发送队列
+    int queue_iov(const RtpHeader *header, const char *payload); // header和payload分开放进发送队列
+    int queue_copy(const void *buffer);                       // 拷贝一个控制包进发送队列
+    int flush_packets();                                      // 用sendmmsg发出发送队列
+    int recv_batch();                                         // 用recvmmsg收一批包
+    static int recv_raw(int sockfd, RtpIoBatch *io);          // recvmmsg收一批不校验的数据报
+    static RtpIoBatch *alloc_io();                            // 分配io，收包缓冲区按PAYLOAD_MAX
+    static int size_rx(RtpIoBatch *io, int slot, int batch);  // 重新分配收包缓冲区
+    static int enable_gro(int sockfd, RtpIoBatch *io);        // 开启UDP_GRO并换成大的收包缓冲区
+    static void free_io(RtpIoBatch *io);                      // 释放io和它的收包缓冲区
+    bool offload;                                             // 是否使用UDP_SEGMENT/UDP_GRO
+    int build_tx_msgs(int first);                             // 从tx_iov[first]开始组装tx_msgs
+    int epfd;                                                 // epoll，监听sockfd和timerfd
+    int timerfd;                                              // 重传等定时器
+    std::chrono::steady_clock::time_point timer_deadline;     // timerfd当前设置的触发时间
+    int init_events();                                        // 第一次用到时创建epfd和timerfd
+    void close_events();                                      // 关闭epfd和timerfd
+    void arm_timer(std::chrono::steady_clock::time_point deadline); // 设置定时器
+    int wait_events(int timeout);                             // 等待socket或定时器
     inline int64_t seq32to64(const uint32_t seq);             // get the 64-bit sequence number
-    inline uint32_t seq64to32(const int64_t seq);             // get the 32-bit sequence number
+    static inline uint32_t seq64to32(const int64_t seq);      // get the 32-bit sequence number
     static inline uint32_t inc_seq32(const uint32_t seq_num); // increase the sequence number
     static inline uint32_t dec_seq32(const uint32_t seq_num); // decrease the sequence number
     int waitfor(void *buffer, int flag, int timeout);         // wait for a desired packet
+    uint32_t on_syn(const RtpPacket *syn, RtpPacket *syn_ack); // 记录SYN里的序号和选项，打包SYN&ACK
+    void on_fin(RtpHeader *fin_ack);                          // 收完数据后打包回复FIN的FIN&ACK
     int send_file_gbn(uint32_t packet_num);                   // send a file using gbn
     int recv_file_gbn();                                      // receive a file using gbn
+    int handle_dat(RtpPacket *pkt);                           // 处理一个DAT包并按需排队ACK
+    int queue_ack();                                          // 把累积ACK和SACK放进发送队列
+    /* payload大小：SYN和SYN&ACK协商上限，发送方探测路径MTU后在第三次握手里告诉对方 */
+    uint32_t mss;                                             // 数据包的payload大小，除了最后一个包都是这么大
+    uint32_t mss_limit;                                       // 本端能收发的最大payload
+    uint32_t mss_ceiling;                                     // 协商出的上限，没协商时为PAYLOAD_MAX
+    char *ctrl_buf;                                           // waitfor收包用，能放下最大的探测包
+    RtpPacket hs_ack;                                         // 发送方：第三次握手的ACK，connect发出后不等，对方重发SYN&ACK时补发
+    bool hs_confirmed;                                        // 发送方：收到过数据的ACK，对方一定收到了第三次握手
+    uint32_t packet_bytes() const { return sizeof(RtpHeader) + mss; } // 一个满的数据包
+    int64_t skb_truesize() const { return packet_bytes() + RTP_SKB_OVERHEAD; } // 一个满包在socket缓冲区里占的大小
+    static int route_mtu(const struct sockaddr_in &addr);     // 内核路由表里到addr的MTU，失败返回0
+    uint32_t probe_mss(uint32_t ceiling);                     // 发送方：探测路径上能走通的最大payload
+    void answer_probe(const RtpPacket *prb);                  // 接收方：确认一个探测包
+    void on_mss(const RtpPacket *ack);                        // 接收方：从第三次握手的ACK里取出payload大小
+    /* 前向纠错：每组数据包后面跟一个XOR校验包，组里只丢了一个包时接收方不等重传直接恢复 */
+    bool fec_enabled;                                         // 发送方：发校验包；接收方：对方在SYN里声明了会发
+    FecRate fec_rate;                                         // 发送方：丢包率，决定组的大小
+    ByteRing fec_tx;                                          // 发送方：校验包，flush_packets之前保持有效
+    uint32_t fec_slot;                                        // 发送方：正在累加的校验包在fec_tx里的槽
+    int64_t fec_first;                                        // 发送方：这一组的第一个包
+    int fec_count;                                            // 发送方：这一组已经累加的包数
+    int fec_group;                                            // 发送方：这一组的目标包数
+    uint16_t fec_len;                                         // 发送方：这一组最长的payload
+    uint32_t fec_repaired;                                    // 接收方：用校验包恢复的包数；发送方：对方报告的值
+    RtpFecGroup fec_groups[RTP_FEC_PENDING];                  // 接收方：暂存的组
+    ByteRing fec_parity;                                      // 接收方：fec_groups对应的校验数据
+    char *fec_scratch;                                        // 接收方：恢复时读回其他包和拼出丢失的包，2*mss字节
+    int fec_pending;                                          // 接收方：fec_groups里在用的个数
+    int fec_add(int64_t seq, const char *raw, uint16_t length, bool last); // 发送方：把一个新包（压缩前）累加进校验包，组满时发出
+    int handle_fec(const RtpPacket *pkt);                     // 接收方：处理一个校验包
+    int fec_missing(const RtpFecGroup &group, int64_t *lost); // 接收方：组里还缺几个包，超出接收窗口时返回-1
+    int fec_recover(const RtpFecGroup &group, const char *parity, int64_t lost); // 接收方：恢复组里唯一缺的包
+    int fec_check(int64_t seq);                               // 接收方：seq到了之后恢复它所在的暂存组
+    int accept_packet(int64_t seq, const char *payload, uint16_t length, bool copied, bool compressed); // 接收方：把一个包交给接收窗口
+    /* 压缩：发送方逐包压缩，接收方在后台线程解压，校验包按压缩前的数据计算 */
+    bool cmp_enabled;                                         // 发送方：想压缩，握手后为对方是否同意；接收方：对方要压缩
+    Deflater deflater;                                        // 发送方
+    char *cmp_raw;                                            // 发送方：mmap失败时pread压缩前的数据，mss字节
+    uint64_t cmp_saved;                                       // 发送方：压缩省下的字节数
+    Inflater inflater;                                        // 接收方
+    static bool is_dat(uint8_t flags) { return flags == RTP_DAT || flags == RTP_CMP; } // 是不是数据包
+    /* 断点续传：接收方记录写完的块，重连时告诉发送方，两端都跳过这些块，包的序号只覆盖剩下的部分 */
+    bool resume_enabled;                                      // 发送方：SYN里带上文件信息
+    bool resuming;                                            // 这次传输按skip_map跳过已经收完的块
+    RtpResumeInfo resume_info;                                // 发送方：set_resume时的文件；接收方：SYN里的文件
+    RtpResumeRun resume_runs[RTP_RESUME_RUNS];                // 接收方已经收完的块
+    int resume_count;                                         // resume_runs里的段数
+    SkipMap skip_map;                                         // 第几个包对应这一段的第几个格子
+    RtpJournal *journal;                                      // 接收方：续传日志，不续传时为nullptr
+    RtpBundle *bundle;                                        // 发送方：send_bundle的数据来源
+    bool bundled;                                             // 发送方：set_bundle过；接收方：对方发的是RtpBundle
+    int64_t grid_index(int64_t seq, int64_t first) const { return this->resuming ? this->skip_map.grid(seq - first) : seq - first; } // seq在这一段里是第几个格子
+    int delack_max;                                           // 一个ACK最多确认的包数，1为不延迟
+    int ack_pending;                                          // 收到了但还没ACK的包数
+    std::chrono::steady_clock::time_point ack_deadline;       // 延迟的ACK最晚的发送时间
+    /* 流量控制：接收方通告窗口，两端按BDP调大socket缓冲区 */
+    int64_t peer_wnd_end;                                     // 发送方：对方通告的窗口右边界，这个序号及之后的包不能发
+    int sndbuf;                                               // 当前的SO_SNDBUF(字节)，0为还没读过
+    int rcvbuf;                                               // 当前的SO_RCVBUF(字节)，0为还没读过
+    int sock_shares;                                          // 共用这个socket的连接数，接收窗口和缓冲区按此分摊
+    int64_t rcv_space_seq;                                    // 接收方：这一轮测量开始时的recv_base
+    std::chrono::steady_clock::time_point rcv_space_time;     // 接收方：这一轮测量开始的时间
+    int grow_sockbuf(int optname, int64_t bytes);             // 把socket缓冲区调大到至少bytes，返回调整后的大小
+    void tune_rcvbuf(std::chrono::steady_clock::time_point now); // 每个RTT按收到的数据量调整SO_RCVBUF
+    uint32_t advertised_window();                             // 接收方：要通告的接收窗口(包)
     /* 以下函数是在connect和close写完之后才加的，故在这两个函数中没有使用 */
     // int waitfor_ack(int64_t *seqnum, int64_t begin, int64_t end, int timeout); // wait for an ACK
     // int waitfor_dat(void *buffer, int64_t begin, int64_t end, int timeout);    // wait for a DAT
     int waitfor_dat(void *buffer, int timeout);
     int waitfor_ack(int64_t *seq_num_p, int timeout);
-    std::map<int64_t, RtpPacket *> data_map; // 存放data的map
+    SlotRing<RtpTxSlot> send_ring;           // 发送方窗口内还没确认的包，下标为seq & mask
+    ByteRing send_copy;                      // mmap失败时和send_ring对应的数据，每个槽mss字节
+    SlotRing<RtpTxMeta> send_meta;           // 和send_ring一一对应的发送时间等信息
+    RttEstimator rtt;                        // RTT/RTO估计
+    bool kernel_ts;                          // 用SO_TIMESTAMPNS取内核收包时间戳
+    static int64_t now_ns();                 // 当前CLOCK_REALTIME时间，和内核时间戳同一时钟
+    void mark_sent(int64_t seq, bool retransmit); // 记录包的发送时间
+    int64_t delivered;                       // 已经累积确认的包数，用于投递速率采样
+    int64_t delivered_ns;                    // 最近一次累积确认前进的时间
+    Pacer pacer;                             // 发送方令牌桶
+    bool pacing;                             // 是否按拥塞窗口/RTT分散发送
+    double rate_cap;                         // 发送速率上限(字节/秒)，0为不限
+    void update_pacing_rate(int64_t now);    // 根据cc和RTT更新令牌桶速率
+    SeqBitmap sacked;                        // 发送方记分板，被SACK确认过的包
+    int64_t sack_high;                       // SACK确认过的最大seq + 1
+    void on_sack(const RtpPacket *ack, int64_t base, int64_t next_seq_num); // 把ACK里的SACK块记进记分板
+    int retransmit_holes(int64_t from, int64_t to);                         // 把[from, to)里没被SACK的包放进重传队列
+    std::deque<int64_t> rtx_queue;           // 等令牌的重传，和新包一样按令牌发，重传优先
+    int send_retransmits(int64_t base);      // 按令牌发出重传队列里的包
+    bool sack_enabled;                       // 对端在SYN里声明了可以处理SACK
+    /* 发送方流式读取文件，包在进入窗口时才从文件里打包 */
+    int file_fd;                             // 正在发送的文件
+    const char *file_map;                    // mmap的文件内容，mmap失败时为nullptr，改用pread
+    uint64_t file_size;                      // 文件大小
+    int64_t file_first_seq;                  // 文件第一个包的seq_num
+    uint64_t file_offset;                    // 发送的这一段在文件中的起始偏移
+    uint64_t file_skew;                      // file_map比file_offset多映射的字节数(按页对齐)
+    uint64_t file_released;                  // file_map开头已经MADV_DONTNEED过的字节数
+    RtpTxSlot *build_packet(int64_t seq, const char **raw, uint16_t *raw_len); // 为第seq个包生成header，payload指向文件内容或压缩后的数据
+    void release_acked(int64_t base);        // 回收base之前已确认的包对应的文件页
+    int send_data();                         // 发送已经打开的文件或者bundle里的file_size字节，结束时关闭
+    /* 接收方边收边写文件 */
+    int out_fd;                                                                       // 正在写的文件
+    int64_t out_first_seq;                                                            // 文件第一个包的seq_num
+    uint64_t out_size;                                                                // 目前收到的数据的最大结束偏移
+    uint64_t out_alloc_end;                                                           // fallocate预分配到的位置
+    struct iovec *flush_iov;                                                          // 按序到达、还没写的payload，指向收包缓冲区
+    int flush_iovcnt;                                                                 // flush_iov中的个数
+    size_t flush_len;                                                                 // flush_iov中的字节数
+    uint64_t flush_offset;                                                            // flush_iov对应的文件偏移
+    int64_t recv_base;                                                                // 期望收到的下一个包
+    uint32_t reorder_window;                                                          // 乱序窗口大小，单位为包
+    SeqBitmap recv_bitmap;                                                            // 乱序收到、已写入文件的包
+    int64_t recv_high;                                                                // 收到过的最大seq + 1
+    int store_payload(int64_t seq, const char *payload, uint16_t length, bool in_order); // 写入一个包的数据
+    int flush_inorder();                                                              // 写出暂存的连续数据，收下一批包之前必须调用
+    uint64_t out_offset(int64_t seq) const { return this->stripe_offset + (uint64_t)grid_index(seq, this->out_first_seq) * this->mss; } // 第seq个包在文件中的偏移
+    int begin_recv(const char *filename);                                             // 打开文件，准备接收
+    int end_recv(int ret);                                                            // 收尾并关闭文件
     bool fin_received;                       // 是否收到了FIN包
     int64_t fin_seq;                         // 收到的FIN包的seq_num
+    bool striped;                            // 这条流只传输文件的一段
+    uint64_t stripe_offset;                  // 这一段在文件中的起始偏移
+    /* 会话：一个连接依次传多次，每次先发XFR，收满XFR里的大小就结束，拥塞控制和RTT估计一直保留 */
+    bool session;                            // 发送方：SYN里要求会话，握手后为对方是否同意；接收方：是否接受会话，握手后为对方是否要求
+    uint64_t xfr_size;                       // 这次传输的字节数
+    RtpHeader xfr_ack;                       // 接收方：这次传输的XFR&ACK，对方重发XFR时重发
+    int64_t recv_end;                        // 接收方：这次传输最后一个包的下一个，用FIN结束的传输为INT64_MAX
+    int offer_transfer(const char *name, uint64_t size, bool bundle); // 发送方：发XFR并等对方准备好
+    RtpStats stats;                          // 这个连接的统计，get_stats在别的线程里也可以读
 
 public:
     Rtp(int sockfd)
-        : sockfd(sockfd), cwnd(1.0),
-          ssthresh(1 << 16), dup_ack_count(0), last_ack_seq(-1), in_fast_recovery(false) {}
-    ~Rtp() {}
+        : sockfd(sockfd), cc(cc_create("reno")), recovery_inflate(0), dup_ack_count(0), last_ack_seq(-1), in_fast_recovery(false), io(nullptr), offload(true), epfd(-1), timerfd(-1),
+          mss(PAYLOAD_MAX), mss_limit(RTP_MSS_MAX), mss_ceiling(PAYLOAD_MAX), ctrl_buf(nullptr), hs_confirmed(false),
+          fec_enabled(false), fec_slot(0), fec_first(0), fec_count(0), fec_group(RTP_FEC_MAX_GROUP), fec_len(0), fec_repaired(0), fec_groups(),
+          fec_scratch(nullptr), fec_pending(0), cmp_enabled(false), cmp_raw(nullptr), cmp_saved(0),
+          resume_enabled(false), resuming(false), resume_info(), resume_runs(), resume_count(0), journal(nullptr),
+          bundle(nullptr), bundled(false),
+          delack_max(RTP_DELACK_PACKETS), ack_pending(0), peer_wnd_end(INT64_MAX), sndbuf(0), rcvbuf(0), sock_shares(1), rcv_space_seq(0),
+          kernel_ts(true), delivered(0), delivered_ns(0), pacing(true), rate_cap(0), sack_high(0), sack_enabled(false), file_fd(-1), file_map(nullptr), file_size(0), file_first_seq(0),
+          file_offset(0), file_skew(0), file_released(0),
+          out_fd(-1), out_first_seq(0), out_size(0), out_alloc_end(0), flush_iov(nullptr),
+          flush_iovcnt(0), flush_len(0), flush_offset(0), recv_base(0), reorder_window(RTP_REORDER_WINDOW), recv_high(0),
+          striped(false), stripe_offset(0), session(false), xfr_size(0), xfr_ack(), recv_end(INT64_MAX) {}
+    ~Rtp()
+    {
+        free_io(io);
+        free(ctrl_buf);
+        free(cmp_raw);
+        close_events();
+        delete cc;
+    }
     int connect(const struct sockaddr *addr,
                 socklen_t addrlen); // connect to a remote host
     int wait_connect();             // listen for incoming connections and accept
@@ -96,8 +411,53 @@ public:
                                uint16_t length, /*uint16_t advertised_window,*/ void *payload); // wrap a packet
     static void header_wrapper(RtpHeader *header,
                                uint32_t seq_num, /*uint16_t advertised_window,*/ uint8_t flags); // wrap a header
+    static void option_wrapper(RtpPacket *pkt, uint32_t seq_num, uint8_t flags,
+                               const void *options, uint16_t length);                 // 打包带选项的控制包
+    static int opt_put(char *options, int offset, uint8_t kind, const void *value, uint8_t len); // 追加一个选项
+    static const char *opt_find(const RtpPacket *pkt, uint8_t kind, uint8_t *len);            // 查找一个选项
+    static bool karn_ok(SlotRing<RtpTxMeta> &meta, int64_t from, int64_t to);                 // [from, to)都没重传过时可以用to - 1采样RTT(Karn)
+    static int build_sack(const SeqBitmap &bitmap, int64_t from, int64_t to, char *options);  // 把[from, to)里收到的段写成SACK选项
+    static int parse_sack(const RtpPacket *ack, RtpSackBlock *blocks);                       // 取出ACK里的SACK块
     int send_file(const char *filename);                                                         // send a file
+    int send_file_range(const char *filename, uint64_t offset, uint64_t length);                 // 发送文件的一段
+    int send_bundle();                                                                           // 发送set_bundle设置的多个文件
     int recv_file(const char *filename);                                                         // receive a file
+    void set_reorder_window(uint32_t packets) { reorder_window = packets > 0 ? packets : 1; }     // 接收方乱序窗口
+    void set_rto_bounds(double min_ms, double max_ms) { rtt.set_bounds(min_ms * 1000, max_ms * 1000); } // RTO上下限
+    void set_kernel_timestamps(bool enable) { kernel_ts = enable; }                             // 是否使用内核时间戳
+    void set_stripe(uint64_t offset) { striped = true; stripe_offset = offset; }               // connect前设置，在SYN里告诉对方这一段的偏移
+    bool is_striped() const { return striped; }                                                 // 接收方：对方是否只发送文件的一段
+    uint64_t get_stripe_offset() const { return stripe_offset; }                                // 这一段在文件中的起始偏移
+    uint64_t get_recv_end() const { return out_size; }                                          // 接收方：收到的数据在文件中的结束偏移
+    double get_srtt_ms() const { return rtt.get_srtt() / 1000.0; }                             // 平滑RTT，没有样本时为0
+    double get_rttvar_ms() const { return rtt.get_rttvar() / 1000.0; }                         // RTT方差
+    double get_min_rtt_ms() const { return rtt.get_min_rtt() / 1000.0; }                       // 最小RTT
+    double get_rto_ms() const { return rtt.get_rto() / 1000.0; }                               // 当前RTO
+    int set_congestion_control(const char *name);                                               // 选择拥塞控制算法，不认识时返回-1
+    const char *get_congestion_control() const { return cc->name(); }                           // 当前拥塞控制算法
+    double get_cwnd() const { return cc->get_cwnd(); }                                          // 当前拥塞窗口(包)
+    const RtpStats &get_stats() const { return stats; }                                         // 包数、重传、RTT直方图等，传输过程中也可以读
+    void set_pacing(bool enable) { pacing = enable; }                                           // 是否平滑发送
+    void set_rate_limit(double bytes_per_sec) { rate_cap = bytes_per_sec > 0 ? bytes_per_sec : 0; } // 发送速率上限，0为不限
+    double get_pacing_rate() const { return pacer.get_rate(); }                                 // 当前令牌桶速率(字节/秒)，0为不限
+    void set_max_payload(uint32_t bytes) { mss_limit = std::min(std::max(bytes, (uint32_t)RTP_MSS_MIN), (uint32_t)RTP_MSS_MAX); } // 握手前设置，默认不限
+    uint32_t get_payload_size() const { return mss; }                                           // 握手后协商出的payload大小
+    void set_offload(bool enable) { offload = enable; }                                         // 是否使用UDP GSO/GRO，内核不支持时自动关闭
+    void set_fec(bool enable) { fec_enabled = enable; }                                         // 发送方connect前设置，是否发校验包
+    void set_compress(bool enable) { cmp_enabled = enable; }                                    // 发送方connect前设置，是否压缩，对方不支持时不压缩
+    int set_resume(const char *filename, uint64_t length);                                      // 发送方connect前设置，对方有日志时跳过已经收完的块，在set_stripe之后调用
+    int set_resume(const RtpBundle &bundle);                                                    // 同上，续传set_bundle设置的多个文件
+    void set_bundle(RtpBundle *bundle) { this->bundle = bundle; bundled = bundle != nullptr; } // 发送方connect前设置，之后用send_bundle发送
+    bool is_bundle() const { return bundled; }                                                  // 接收方：对方发的是多个文件，收完后用RtpBundle::extract拆开
+    void set_journal(RtpJournal *journal) { this->journal = journal; }                          // 接收方wait_connect前设置，对方要续传时用这个日志
+    void set_session(bool enable) { session = enable; }                                       // connect/wait_connect前设置，一个连接传多次
+    bool is_session() const { return session; }                                                // 握手后双方是否都同意了会话
+    int send_transfer(const char *filename, const char *name);                                  // 会话里发送一个文件，接收方保存为name，返回值同send_file
+    int send_transfer(RtpBundle *bundle, const char *name);                                     // 会话里发送一个RtpBundle
+    int keepalive();                                                                            // 发送方：会话空闲时发一个保活包，不用确认
+    int wait_transfer(RtpTransfer *xfr);                                                        // 接收方：等下一次传输，0为收到，1为对方结束了会话或者超时，-1为失败
+    int recv_transfer(const char *filename);                                                    // 接收方：接收wait_transfer等到的传输，返回值同recv_file
+    void set_delayed_ack(int packets) { delack_max = packets > 1 ? std::min(packets, 255) : 1; }// 一个ACK最多确认的包数，握手时和对方取较小值
 };
 
 #endif // __RTP_H
@@ -0,0 +1,87 @@
+#ifndef __RTT_H
+#define __RTT_H
+
+#include <cstdint>
+#include <algorithm>
+
+#define RTP_RTO_INIT_US 200000 // 还没有RTT样本时的RTO，和原先固定的200ms一致
+#define RTP_RTO_MIN_US 10000   // 默认最小RTO，不能比发送循环的轮询间隔小太多
+#define RTP_RTO_MAX_US 2000000 // 默认最大RTO，指数退避到这里为止
+#define RTP_RTO_GRANULARITY_US 5000 // 计时器粒度
+
+/* 按RFC 6298估计RTT和RTO，单位均为微秒
+ * 重传过的包不产生样本（Karn算法），由调用者保证 */
+class RttEstimator
+{
+private:
+    int64_t srtt = 0;   // smoothed RTT
+    int64_t rttvar = 0; // RTT variance
+    int64_t min_rtt = 0;
+    int64_t latest = 0;
+    int64_t rto = RTP_RTO_INIT_US;
+    int64_t rto_min = RTP_RTO_MIN_US;
+    int64_t rto_max = RTP_RTO_MAX_US;
+    int backoff = 0; // 连续超时次数
+    bool has_sample = false;
+
+    void update_rto()
+    {
+        int64_t base = has_sample ? srtt + std::max<int64_t>(RTP_RTO_GRANULARITY_US, 4 * rttvar) : RTP_RTO_INIT_US;
+        base = std::min(std::max(base, rto_min), rto_max);
+        rto = std::min(base << std::min(backoff, 16), rto_max);
+    }
+
+public:
+    /* 一个新的RTT样本，非正数的样本（时钟跳变等）直接丢掉 */
+    void sample(int64_t rtt_us)
+    {
+        if (rtt_us <= 0)
+            return;
+        latest = rtt_us;
+        if (!has_sample)
+        {
+            srtt = rtt_us;
+            rttvar = rtt_us / 2;
+            min_rtt = rtt_us;
+            has_sample = true;
+        }
+        else
+        {
+            int64_t err = rtt_us > srtt ? rtt_us - srtt : srtt - rtt_us;
+            rttvar = (3 * rttvar + err) / 4; // beta = 1/4
+            srtt = (7 * srtt + rtt_us) / 8;  // alpha = 1/8
+            min_rtt = std::min(min_rtt, rtt_us);
+        }
+        backoff = 0; // 有新样本说明路径恢复了
+        update_rto();
+    }
+    /* 累积确认前进了，说明路径已经恢复，即使按Karn算法没有样本也结束退避 */
+    void on_progress()
+    {
+        if (backoff > 0)
+        {
+            backoff = 0;
+            update_rto();
+        }
+    }
+    /* 发生超时，RTO指数退避 */
+    void on_timeout()
+    {
+        backoff++;
+        update_rto();
+    }
+    void set_bounds(int64_t min_us, int64_t max_us)
+    {
+        rto_min = std::max<int64_t>(min_us, 1);
+        rto_max = std::max(max_us, rto_min);
+        update_rto();
+    }
+    bool valid() const { return has_sample; }
+    int64_t get_srtt() const { return srtt; }
+    int64_t get_rttvar() const { return rttvar; }
+    int64_t get_min_rtt() const { return min_rtt; }
+    int64_t get_latest() const { return latest; }
+    int64_t get_rto() const { return rto; }
+};
+
+#endif // __RTT_H
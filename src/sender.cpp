@@ -4,13 +4,143 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <fstream>
+#include <getopt.h>
+#include <poll.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
 
-/* sender */
-void sender_routine(char **argv)
+#define SENDER_USAGE "Usage: ./sender [-j stripes] [-c reno|cubic|bbr] [-r Mbit/s] [-m max payload bytes] [-f] [-z] [-R] [-J stats.json] [receiver ip] [receiver port] [file or dir path]...\n" \
+                     "       ./sender -S [-c reno|cubic|bbr] [-r Mbit/s] [-m max payload bytes] [-f] [-z] [-J stats.json] [receiver ip] [receiver port] [file or dir path]...\n" \
+                     "       (-S: one transfer per path over a single connection, paths are read from stdin line by line if none given)\n" \
+                     "       (-J: write the connection statistics as JSON when done, - for stdout)\n"
+
+/* 分段发送时每一段的结果 */
+struct StripeResult
+{
+    int ret;
+    uint64_t bytes;  // 这一段的字节数
+    double seconds;  // send_file_range用的时间
+    std::string stats; // 这一段连接的统计(JSON)
+};
+
+/* 第index段：连接port + index，发送文件从offset开始的length字节 */
+void stripe_routine(const char *receiver_ip, int port, int index, const char *file_path,
+                    uint64_t offset, uint64_t length, const char *cc_name, double rate_limit, uint32_t max_payload,
+                    bool fec, bool compress, bool resume, StripeResult *result)
 {
-    char *receiver_ip = argv[1];
-    int port = atoi(argv[2]);
-    char *file_path = argv[3];
+    result->ret = -1;
+    result->bytes = length;
+    int sockfd;
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        LOG_DEBUG("stripe %d socket() failed\n", index);
+        return;
+    }
+    struct sockaddr_in receiver_addr;
+    receiver_addr.sin_family = AF_INET;
+    receiver_addr.sin_port = htons(port + index);
+    receiver_addr.sin_addr.s_addr = inet_addr(receiver_ip);
+    Rtp rtp(sockfd);
+    rtp.set_congestion_control(cc_name);
+    rtp.set_rate_limit(rate_limit);
+    rtp.set_stripe(offset);
+    rtp.set_max_payload(max_payload);
+    rtp.set_fec(fec);
+    rtp.set_compress(compress);
+    if (resume && rtp.set_resume(file_path, length) == -1)
+    {
+        LOG_DEBUG("stripe %d set_resume failed\n", index);
+        close(sockfd);
+        return;
+    }
+    if (rtp.connect((struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) == -1)
+    {
+        LOG_DEBUG("stripe %d connect failed\n", index);
+        close(sockfd);
+        return;
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    result->ret = rtp.send_file_range(file_path, offset, length);
+    std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start_time;
+    result->seconds = elapsed_seconds.count();
+    if (result->ret == 0 && rtp.close() == -1)
+    {
+        LOG_DEBUG("stripe %d close failed\n", index); // 不影响
+    }
+    result->stats = rtp.get_stats().to_json();
+    close(sockfd);
+}
+
+/* 分段发送：文件按包边界切成stripes段，每段一个线程、一个socket、一条流
+ * 速率上限rate_limit(字节/秒)由各段平分 */
+void striped_sender_routine(char **argv, int stripes, const char *cc_name, double rate_limit, uint32_t max_payload, bool fec, bool compress, bool resume,
+                            const char *stats_path)
+{
+    char *receiver_ip = argv[0];
+    int port = atoi(argv[1]);
+    char *file_path = argv[2];
+    struct stat st;
+    if (stat(file_path, &st) == -1)
+    {
+        LOG_FATAL("striped_sender_routine stat() failed\n");
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        LOG_FATAL("striped_sender_routine cannot send a directory in stripes\n");
+    }
+    uint64_t file_size = st.st_size;
+    uint64_t packets = (file_size + PAYLOAD_MAX - 1) / PAYLOAD_MAX;
+    uint64_t stripe_size = (packets + stripes - 1) / stripes * PAYLOAD_MAX; // 按默认的包大小对齐，每段的payload大小各自协商
+    std::vector<StripeResult> results(stripes);
+    std::vector<std::thread> threads;
+    auto start_time = std::chrono::steady_clock::now();
+    for (int i = 0; i < stripes; i++)
+    {
+        uint64_t offset = std::min(file_size, i * stripe_size);
+        uint64_t length = std::min(file_size - offset, stripe_size);
+        threads.emplace_back(stripe_routine, receiver_ip, port, i, file_path, offset, length, cc_name,
+                             rate_limit / stripes, max_payload, fec, compress, resume, &results[i]);
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start_time;
+    for (int i = 0; i < stripes; i++)
+    {
+        if (results[i].ret != 0)
+        {
+            LOG_FATAL("striped_sender_routine stripe %d failed\n", i);
+        }
+        LOG_MSG("Stripe %d: %lu Bytes in %.2f seconds, %.2f MB/s\n", i, results[i].bytes, results[i].seconds,
+                results[i].seconds > 0 ? results[i].bytes / results[i].seconds / 1e6 : 0.0);
+    }
+    LOG_MSG("File size %lu Bytes sent over %d stripes in %.2f seconds\n", file_size, stripes, elapsed_seconds.count());
+    if (stats_path != nullptr)
+    {
+        // 每段一个连接，按段的顺序放进一个数组
+        std::string json = "[";
+        for (int i = 0; i < stripes; i++)
+        {
+            json += (i > 0 ? "," : "") + results[i].stats;
+        }
+        json += "]";
+        if (rtp_write_json(stats_path, json) == -1)
+        {
+            LOG_FATAL("striped_sender_routine failed to write stats to %s\n", stats_path);
+        }
+    }
+}
+
+/* sender，paths个路径，不止一个或者是目录时打包成RtpBundle在一个连接里发送 */
+void sender_routine(char **argv, int paths, const char *cc_name, double rate_limit, uint32_t max_payload, bool fec, bool compress, bool resume,
+                    const char *stats_path)
+{
+    char *receiver_ip = argv[0];
+    int port = atoi(argv[1]);
+    char *file_path = argv[2];
     int sockfd;
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
     {
@@ -22,13 +152,40 @@ void sender_routine(char **argv)
     receiver_addr.sin_port = htons(port);
     receiver_addr.sin_addr.s_addr = inet_addr(receiver_ip);
     Rtp rtp(sockfd);
+    rtp.set_congestion_control(cc_name);
+    rtp.set_rate_limit(rate_limit);
+    rtp.set_max_payload(max_payload);
+    rtp.set_fec(fec);
+    rtp.set_compress(compress);
+    struct stat st;
+    RtpBundle bundle;
+    bool bundled = paths > 1 || (stat(file_path, &st) == 0 && S_ISDIR(st.st_mode));
+    if (bundled)
+    {
+        for (int i = 0; i < paths; i++)
+        {
+            if (bundle.add(argv[2 + i]) == -1)
+            {
+                close(sockfd);
+                LOG_FATAL("sender_routine failed to add %s\n", argv[2 + i]);
+            }
+        }
+        bundle.finish();
+        rtp.set_bundle(&bundle);
+    }
+    if (resume && (bundled ? rtp.set_resume(bundle) : rtp.set_resume(file_path, UINT64_MAX)) == -1)
+    {
+        close(sockfd);
+        LOG_FATAL("sender_routine set_resume failed\n");
+        return;
+    }
     if (rtp.connect((struct sockaddr *)&receiver_addr, sizeof(receiver_addr))==-1)
     {
         close(sockfd);
         LOG_FATAL("sender_routine connect failed\n");
         return;
     }
-    if (rtp.send_file(file_path) != 0)
+    if ((bundled ? rtp.send_bundle() : rtp.send_file(file_path)) != 0)
     {
         close(sockfd);
         LOG_FATAL("sender_routine send_file failed\n");
@@ -36,22 +193,216 @@ void sender_routine(char **argv)
     }
     if (rtp.close() == -1)
     {
-        close(sockfd);
         LOG_DEBUG("sender_routine close failed\n"); // 不影响
-        return;
     }
     close(sockfd);
+    if (stats_path != nullptr && rtp_write_json(stats_path, rtp.get_stats().to_json()) == -1)
+    {
+        LOG_FATAL("sender_routine failed to write stats to %s\n", stats_path);
+    }
+}
+
+/* 会话里发送一个路径，目录打包成RtpBundle，接收方保存为路径的最后一部分，失败时退出 */
+static void session_send_path(Rtp &rtp, const char *path)
+{
+    std::string name(path);
+    while (name.size() > 1 && name.back() == '/')
+    {
+        name.pop_back();
+    }
+    size_t slash = name.rfind('/');
+    if (slash != std::string::npos)
+    {
+        name = name.substr(slash + 1);
+    }
+    struct stat st;
+    if (stat(path, &st) == -1)
+    {
+        LOG_FATAL("session_sender_routine stat() failed for %s\n", path);
+    }
+    int ret;
+    if (S_ISDIR(st.st_mode))
+    {
+        RtpBundle bundle;
+        if (bundle.add(path) == -1)
+        {
+            LOG_FATAL("session_sender_routine failed to add %s\n", path);
+        }
+        bundle.finish();
+        ret = rtp.send_transfer(&bundle, name.c_str());
+    }
+    else
+    {
+        ret = rtp.send_transfer(path, name.c_str());
+    }
+    if (ret != 0)
+    {
+        LOG_FATAL("session_sender_routine failed to send %s\n", path);
+    }
+}
+
+/* 会话：一个连接依次发送多个文件或目录，每个路径一次传输，拥塞窗口和RTT估计接着上一次的用
+ * 命令行里没有路径时从标准输入一行一行地读，等待期间隔一会发一个保活包 */
+void session_sender_routine(char **argv, int paths, const char *cc_name, double rate_limit, uint32_t max_payload, bool fec, bool compress,
+                            const char *stats_path)
+{
+    char *receiver_ip = argv[0];
+    int port = atoi(argv[1]);
+    int sockfd;
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        LOG_FATAL("socket() failed\n");
+    }
+    struct sockaddr_in receiver_addr;
+    receiver_addr.sin_family = AF_INET;
+    receiver_addr.sin_port = htons(port);
+    receiver_addr.sin_addr.s_addr = inet_addr(receiver_ip);
+    Rtp rtp(sockfd);
+    rtp.set_congestion_control(cc_name);
+    rtp.set_rate_limit(rate_limit);
+    rtp.set_max_payload(max_payload);
+    rtp.set_fec(fec);
+    rtp.set_compress(compress);
+    rtp.set_session(true);
+    if (rtp.connect((struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) == -1)
+    {
+        close(sockfd);
+        LOG_FATAL("session_sender_routine connect failed\n");
+    }
+    if (!rtp.is_session())
+    {
+        close(sockfd);
+        LOG_FATAL("session_sender_routine receiver does not accept sessions, run it with -S\n");
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    int count = 0;
+    for (int i = 0; i < paths; i++)
+    {
+        session_send_path(rtp, argv[2 + i]);
+        count++;
+    }
+    std::string pending; // 标准输入里还没读完的一行
+    char buf[4096];
+    while (paths == 0)
+    {
+        size_t eol = pending.find('\n');
+        if (eol != std::string::npos)
+        {
+            std::string line = pending.substr(0, eol);
+            pending.erase(0, eol + 1);
+            if (!line.empty())
+            {
+                session_send_path(rtp, line.c_str());
+                count++;
+            }
+            continue;
+        }
+        struct pollfd fds[1];
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        int poll_ret = poll(fds, 1, RTP_SESSION_KEEPALIVE_MS);
+        if (poll_ret == 0)
+        {
+            rtp.keepalive(); // 丢了也没关系，下一个接着发
+            continue;
+        }
+        ssize_t n = poll_ret > 0 ? read(STDIN_FILENO, buf, sizeof(buf)) : -1;
+        if (n <= 0)
+        {
+            if (!pending.empty()) // 最后一行没有换行
+            {
+                session_send_path(rtp, pending.c_str());
+                count++;
+            }
+            break;
+        }
+        pending.append(buf, n);
+    }
+    std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start_time;
+    LOG_MSG("Session sent %d transfers in %.2f seconds\n", count, elapsed_seconds.count());
+    if (rtp.close() == -1)
+    {
+        LOG_DEBUG("session_sender_routine close failed\n"); // 不影响
+    }
+    close(sockfd);
+    if (stats_path != nullptr && rtp_write_json(stats_path, rtp.get_stats().to_json()) == -1)
+    {
+        LOG_FATAL("session_sender_routine failed to write stats to %s\n", stats_path);
+    }
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 4)
+    int stripes = 1;
+    const char *cc_name = "reno";
+    double rate_limit = 0; // 字节/秒
+    uint32_t max_payload = RTP_MSS_MAX; // 默认按探测结果，最大到一个UDP数据报
+    bool fec = false;                   // 发校验包，丢包多的链路上少等重传
+    bool compress = false;              // 逐包压缩，压不小的包照原样发
+    bool resume = false;                // 断点续传，跳过接收方已经收完的块
+    bool session = false;               // 一个连接传多次
+    const char *stats_path = nullptr;   // 结束时把统计写成JSON
+    int opt;
+    while ((opt = getopt(argc, argv, "j:c:r:m:fzRSJ:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'J':
+            stats_path = optarg;
+            break;
+        case 'S':
+            session = true;
+            break;
+        case 'R':
+            resume = true;
+            break;
+        case 'z':
+            compress = true;
+            break;
+        case 'f':
+            fec = true;
+            break;
+        case 'm':
+            max_payload = atoi(optarg);
+            break;
+        case 'r':
+            rate_limit = atof(optarg) * 1e6 / 8; // Mbit/s
+            break;
+        case 'c':
+            cc_name = optarg;
+            break;
+        case 'j':
+            stripes = atoi(optarg);
+            break;
+        default:
+            LOG_FATAL(SENDER_USAGE);
+        }
+    }
+    if (argc - optind < (session ? 2 : 3) || stripes < 1 || (stripes > 1 && argc - optind != 3) ||
+        (session && (stripes > 1 || resume)))
+    {
+        LOG_FATAL(SENDER_USAGE);
+    }
+    CongestionControl *cc = cc_create(cc_name); // 先检查一下算法名
+    if (cc == nullptr)
     {
-        LOG_FATAL("Usage: ./sender [receiver ip] [receiver port] [file path]\n");
+        LOG_FATAL(SENDER_USAGE);
     }
+    delete cc;
 
     // your code here
-    sender_routine(argv);
+    if (session)
+    {
+        session_sender_routine(argv + optind, argc - optind - 2, cc_name, rate_limit, max_payload, fec, compress, stats_path);
+    }
+    else if (stripes > 1)
+    {
+        striped_sender_routine(argv + optind, stripes, cc_name, rate_limit, max_payload, fec, compress, resume, stats_path);
+    }
+    else
+    {
+        sender_routine(argv + optind, argc - optind - 2, cc_name, rate_limit, max_payload, fec, compress, resume, stats_path);
+    }
 
     LOG_DEBUG("Sender: exiting...\n");
     return 0;
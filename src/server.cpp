@@ -0,0 +1,479 @@
+#include "server.h"
+#include "util.h"
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <cerrno>
+#include <vector>
+using namespace std;
+
+RtpServer::~RtpServer()
+{
+    while (!conns.empty())
+    {
+        drop(conns.begin()->first);
+    }
+    reap_extractions(true);
+    if (wake_fd != -1)
+    {
+        close(wake_fd);
+    }
+    Rtp::free_io(io);
+}
+
+/* IPv4地址和端口拼成连接表的键 */
+uint64_t RtpServer::conn_key(const struct sockaddr_in &addr)
+{
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+/* 删除一个连接，还在收的文件保留已经写入的部分 */
+void RtpServer::drop(uint64_t key)
+{
+    auto it = conns.find(key);
+    if (it == conns.end())
+    {
+        return;
+    }
+    Conn *conn = it->second;
+    if (conn->state == CONN_ESTABLISHED)
+    {
+        this->established--;
+    }
+    if (conn->rtp->out_fd != -1)
+    {
+        conn->rtp->end_recv(1);
+    }
+    delete conn->rtp;
+    delete conn;
+    conns.erase(it);
+}
+
+/* 第一次握手：为新的对端建立连接并回复SYN&ACK，失败返回nullptr */
+RtpServer::Conn *RtpServer::accept_conn(RtpPacket *syn, const struct sockaddr_in &from, socklen_t fromlen)
+{
+    Conn *conn = new Conn();
+    conn->rtp = new Rtp(sockfd);
+    Rtp *rtp = conn->rtp;
+    rtp->set_reorder_window(this->reorder_window);
+    rtp->set_delayed_ack(this->delack_max);
+    rtp->set_max_payload(this->mss_limit);
+    rtp->dest_addr = from;
+    rtp->addrlen = fromlen;
+    conn->syn_seq = syn->header.seq_num;
+    rtp->on_syn(syn, &conn->syn_ack);
+    if (rtp->send_packet((void *)&conn->syn_ack) == -1)
+    {
+        LOG_DEBUG("accept_conn send syn_ack failed\n");
+        delete rtp;
+        delete conn;
+        return nullptr;
+    }
+    auto now = chrono::steady_clock::now();
+    rtp->last_recv_time = now;
+    conn->state = CONN_SYN_RCVD;
+    conn->syn_ack_resent = false;
+    conn->syn_ack_sent_ns = Rtp::now_ns();
+    conn->deadline = now + chrono::milliseconds(RTP_SERVER_SYN_RTO);
+    conn->give_up = now + chrono::milliseconds(RTP_SERVER_SYN_WAIT);
+    conn->dirty = false;
+    conns[conn_key(from)] = conn;
+    char ip_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from.sin_addr, ip_str, INET_ADDRSTRLEN);
+    LOG_DEBUG("accept_conn SYN from %s %d, %lu connections\n", ip_str, ntohs(from.sin_port), conns.size());
+    return conn;
+}
+
+/* 第三次握手完成，打开文件开始收数据，成功返回0失败返回-1 */
+int RtpServer::establish(Conn *conn)
+{
+    Rtp *rtp = conn->rtp;
+    char ip_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &rtp->dest_addr.sin_addr, ip_str, INET_ADDRSTRLEN);
+    snprintf(conn->path, sizeof(conn->path), "%s/%s_%d_%lu",
+             this->out_dir.c_str(), ip_str, ntohs(rtp->dest_addr.sin_port), this->file_count++);
+    if (rtp->bundled)
+    {
+        // 多个文件先收进path加后缀，收完后拆到目录path里
+        strncat(conn->path, RTP_BUNDLE_SUFFIX, sizeof(conn->path) - strlen(conn->path) - 1);
+    }
+    if (rtp->begin_recv(conn->path) == -1)
+    {
+        LOG_DEBUG("establish failed to open %s\n", conn->path);
+        return -1;
+    }
+    conn->state = CONN_ESTABLISHED;
+    this->established++;
+    conn->start_time = chrono::steady_clock::now();
+    conn->deadline = rtp->last_recv_time + chrono::milliseconds(RTP_SERVER_IDLE);
+    LOG_DEBUG("establish connection from %s %d writing to %s\n", ip_str, ntohs(rtp->dest_addr.sin_port), conn->path);
+    return 0;
+}
+
+/* FIN之前的包都收到了：写完文件，回复FIN&ACK，进入LINGER */
+void RtpServer::finish(Conn *conn)
+{
+    Rtp *rtp = conn->rtp;
+    rtp->flush_packets(); // 先把排队的ACK发出去
+    int ret = rtp->end_recv(0);
+    chrono::duration<double> elapsed_seconds = chrono::steady_clock::now() - conn->start_time;
+    rtp->on_fin(&conn->fin_ack);
+    if (rtp->send_packet((void *)&conn->fin_ack) == -1)
+    {
+        LOG_DEBUG("finish send fin_ack failed\n"); // 对方会重发FIN
+    }
+    if (ret == 0 && rtp->bundled)
+    {
+        // 数据都收到了，先回FIN&ACK，拆完再算收完了一个文件
+        extract(conn);
+    }
+    else if (ret == 0)
+    {
+        LOG_MSG("File size %lu Bytes saved to %s in %.2f seconds\n", rtp->out_size, conn->path, elapsed_seconds.count());
+        this->done_count++;
+    }
+    else
+    {
+        LOG_DEBUG("finish failed to finish file %s\n", conn->path);
+    }
+    conn->state = CONN_LINGER;
+    this->established--;
+    conn->deadline = chrono::steady_clock::now() + chrono::milliseconds(RTP_SERVER_LINGER);
+}
+
+/* 把收完的bundle交给后台线程拆到同名的目录里，拆完由reap_extractions计数 */
+void RtpServer::extract(Conn *conn)
+{
+    Extraction *ext = new Extraction();
+    ext->spool = conn->path;
+    ext->dir = ext->spool.substr(0, ext->spool.size() - strlen(RTP_BUNDLE_SUFFIX));
+    ext->size = conn->rtp->out_size;
+    ext->start_time = conn->start_time;
+    int fd = this->wake_fd;
+    ext->worker = thread([ext, fd]() {
+        ext->ret = RtpBundle::extract(ext->spool.c_str(), ext->dir.c_str());
+        ext->done.store(true, memory_order_release);
+        uint64_t one = 1;
+        if (write(fd, &one, sizeof(one)) == -1)
+        {
+            LOG_DEBUG("extract failed to wake the event loop\n");
+        }
+    });
+    this->extractions.push_back(ext);
+}
+
+/* 回收拆完的bundle，wait为true时等所有的都拆完 */
+void RtpServer::reap_extractions(bool wait)
+{
+    size_t kept = 0;
+    for (Extraction *ext : this->extractions)
+    {
+        if (!wait && !ext->done.load(memory_order_acquire))
+        {
+            this->extractions[kept++] = ext;
+            continue;
+        }
+        ext->worker.join();
+        chrono::duration<double> elapsed_seconds = chrono::steady_clock::now() - ext->start_time;
+        if (ext->ret == 0)
+        {
+            LOG_MSG("File size %lu Bytes saved to %s in %.2f seconds\n", ext->size, ext->dir.c_str(), elapsed_seconds.count());
+            this->done_count++;
+        }
+        else
+        {
+            LOG_DEBUG("reap_extractions failed to extract %s\n", ext->spool.c_str());
+        }
+        delete ext;
+    }
+    this->extractions.resize(kept);
+}
+
+/* 按连接的状态处理一个校验过的包，返回-1表示这个连接要删掉 */
+int RtpServer::step(Conn *conn, RtpPacket *pkt)
+{
+    Rtp *rtp = conn->rtp;
+    if (pkt->header.flags == RTP_PRB && conn->state != CONN_LINGER) // 对方在第三次握手之前探测PMTU
+    {
+        rtp->answer_probe(pkt);
+        return 0;
+    }
+    switch (conn->state)
+    {
+    case CONN_SYN_RCVD:
+        if (pkt->header.flags == RTP_SYN) // SYN&ACK丢了，对方重发了SYN
+        {
+            if (pkt->header.seq_num == conn->syn_seq &&
+                rtp->send_packet((void *)&conn->syn_ack) != -1)
+            {
+                conn->syn_ack_resent = true;
+            }
+            return 0;
+        }
+        if (pkt->header.flags == RTP_ACK && pkt->header.seq_num == conn->syn_ack.header.seq_num)
+        {
+            if (!conn->syn_ack_resent)
+            {
+                rtp->rtt.sample((Rtp::now_ns() - conn->syn_ack_sent_ns) / 1000);
+            }
+            rtp->on_mss(pkt);
+            return establish(conn);
+        }
+        // 第三次握手丢了时对方的数据不收，payload大小只在ACK里，
+        // 定时重发的SYN&ACK会让对方补发ACK，之后数据由对方重传
+        return 0;
+    case CONN_ESTABLISHED:
+        if (Rtp::is_dat(pkt->header.flags) || pkt->header.flags == RTP_FEC)
+        {
+            rtp->sock_shares = this->established;
+            if ((pkt->header.flags == RTP_FEC ? rtp->handle_fec(pkt) : rtp->handle_dat(pkt)) == -1)
+            {
+                return -1;
+            }
+            if (rtp->ack_pending > 0) // ACK被延迟了，到时间由on_timer发出
+            {
+                conn->deadline = min(conn->deadline, rtp->ack_deadline);
+            }
+            if (!conn->dirty)
+            {
+                conn->dirty = true;
+                this->dirty.push_back(conn_key(rtp->dest_addr));
+            }
+        }
+        if (rtp->fin_received && rtp->recv_base >= rtp->fin_seq)
+        {
+            finish(conn);
+        }
+        return 0;
+    case CONN_LINGER:
+        if (pkt->header.flags == RTP_FIN && pkt->header.seq_num == conn->fin_ack.seq_num) // FIN&ACK丢了
+        {
+            rtp->send_packet((void *)&conn->fin_ack);
+        }
+        if (pkt->header.flags == RTP_ACK && pkt->header.seq_num == conn->fin_ack.seq_num) // 对方收到了FIN&ACK
+        {
+            return -1;
+        }
+        return 0;
+    }
+    return 0;
+}
+
+/* 把一个数据报交给对应的连接，没有连接时只接受SYN */
+void RtpServer::dispatch(RtpPacket *pkt, int len, const struct sockaddr_in &from, socklen_t fromlen)
+{
+    uint64_t key = conn_key(from);
+    auto it = conns.find(key);
+    Conn *conn = it == conns.end() ? nullptr : it->second;
+    if (conn != nullptr && conn->state != CONN_LINGER)
+    {
+        if (conn->rtp->check_packet(pkt, len, from, fromlen) > 0 && step(conn, pkt) == -1)
+        {
+            drop(key);
+        }
+        return;
+    }
+    // 新的对端，或者LINGER中的对端从同一个端口发起了新连接，只有SYN能建立连接
+    if (Rtp::verify_packet(pkt, len) == 0)
+    {
+        return;
+    }
+    if (pkt->header.flags != RTP_SYN)
+    {
+        if (conn != nullptr && step(conn, pkt) == -1)
+        {
+            drop(key);
+        }
+        return;
+    }
+    int active = this->extractions.size(); // 拆完之前还不算收完
+    for (auto &kv : conns)
+    {
+        active += kv.second->state != CONN_LINGER;
+    }
+    if (conns.size() >= RTP_SERVER_MAX_CONNS ||
+        (this->max_files > 0 && this->done_count + active >= this->max_files))
+    {
+        LOG_DEBUG("dispatch SYN refused, %lu connections\n", conns.size());
+        return;
+    }
+    drop(key);
+    accept_conn(pkt, from, fromlen);
+}
+
+/* 连接的定时事件：重发SYN&ACK、发出延迟的ACK、空闲超时、LINGER结束，返回-1表示这个连接要删掉 */
+int RtpServer::on_timer(Conn *conn, chrono::steady_clock::time_point now)
+{
+    Rtp *rtp = conn->rtp;
+    switch (conn->state)
+    {
+    case CONN_SYN_RCVD:
+        if (now >= conn->give_up)
+        {
+            LOG_DEBUG("on_timer handshake timeout\n");
+            return -1;
+        }
+        if (rtp->send_packet((void *)&conn->syn_ack) == -1)
+        {
+            return -1;
+        }
+        conn->syn_ack_resent = true;
+        conn->deadline = now + chrono::milliseconds(RTP_SERVER_SYN_RTO);
+        return 0;
+    case CONN_ESTABLISHED:
+        if (rtp->ack_pending > 0 && now >= rtp->ack_deadline)
+        {
+            if (rtp->queue_ack() == -1 || rtp->flush_packets() == -1)
+            {
+                return -1;
+            }
+        }
+        conn->deadline = rtp->last_recv_time + chrono::milliseconds(RTP_SERVER_IDLE);
+        if (now >= conn->deadline)
+        {
+            LOG_MSG("Connection timed out (10s no data), partial file kept at %s\n", conn->path);
+            return -1;
+        }
+        if (rtp->ack_pending > 0)
+        {
+            conn->deadline = min(conn->deadline, rtp->ack_deadline);
+        }
+        return 0;
+    case CONN_LINGER:
+        return -1;
+    }
+    return 0;
+}
+
+/* 事件循环：poll等socket可读或者最近的连接定时事件，
+ * 可读时用recvmmsg把排队的包全部取出分给各个连接，再把各连接的ACK用sendmmsg发出 */
+int RtpServer::run(int max_files)
+{
+    this->max_files = max_files;
+    if (this->io == nullptr)
+    {
+        this->io = Rtp::alloc_io();
+        if (this->io == nullptr)
+        {
+            LOG_DEBUG("run failed to allocate io batch\n");
+            return -1;
+        }
+        // 各连接的payload大小不同，不开GRO时每个槽按最大的来，还要放得下校验包
+        if ((!this->offload || Rtp::enable_gro(sockfd, this->io) == -1) &&
+            Rtp::size_rx(this->io, sizeof(RtpHeader) + sizeof(RtpFecInfo) + this->mss_limit, RTP_BATCH) == -1)
+        {
+            LOG_DEBUG("run failed to allocate receive buffers\n");
+            return -1;
+        }
+    }
+    if (this->wake_fd == -1)
+    {
+        this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (this->wake_fd == -1)
+        {
+            LOG_DEBUG("run eventfd() failed\n");
+            return -1;
+        }
+    }
+    pollfd fds[2];
+    fds[0].fd = sockfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = this->wake_fd;
+    fds[1].events = POLLIN;
+    vector<uint64_t> expired;
+    while (true)
+    {
+        if (max_files > 0 && this->done_count >= max_files && conns.empty() && this->extractions.empty())
+        {
+            return 0;
+        }
+        // 处理到期的定时事件，顺便算出下一次要醒来的时间
+        auto now = chrono::steady_clock::now();
+        auto next = chrono::steady_clock::time_point::max();
+        expired.clear();
+        for (auto &kv : conns)
+        {
+            if (kv.second->deadline <= now && on_timer(kv.second, now) == -1)
+            {
+                expired.push_back(kv.first);
+                continue;
+            }
+            next = min(next, kv.second->deadline);
+        }
+        for (uint64_t key : expired)
+        {
+            drop(key);
+        }
+        if (max_files > 0 && this->done_count >= max_files && conns.empty() && this->extractions.empty())
+        {
+            return 0;
+        }
+        int timeout = -1;
+        if (next != chrono::steady_clock::time_point::max())
+        {
+            timeout = max<int64_t>(chrono::duration_cast<chrono::milliseconds>(next - now).count(), 0) + 1;
+        }
+        int poll_ret = poll(fds, 2, timeout);
+        if (poll_ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG_DEBUG("run poll() failed\n");
+            return -1;
+        }
+        if (poll_ret > 0 && (fds[1].revents & POLLIN))
+        {
+            uint64_t count;
+            if (read(this->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+            {
+                LOG_DEBUG("run failed to read eventfd\n");
+            }
+            reap_extractions(false);
+        }
+        if (poll_ret == 0 || !(fds[0].revents & POLLIN))
+        {
+            continue;
+        }
+        while (true)
+        {
+            int n = Rtp::recv_raw(sockfd, this->io);
+            if (n == -1)
+            {
+                LOG_DEBUG("run recv_raw() failed\n");
+                return -1;
+            }
+            for (int i = 0; i < n; i++)
+            {
+                int src = this->io->rx_src[i];
+                dispatch(this->io->rx_dgrams[i], this->io->rx_lens[i],
+                         this->io->rx_addrs[src], this->io->rx_msgs[src].msg_hdr.msg_namelen);
+            }
+            // 每个连接这一批的数据写进文件、ACK一起发出，连接可能已经被删掉了
+            // 按序的数据还在io的收包缓冲区里，必须在下一次recv_raw之前写掉
+            for (uint64_t key : this->dirty)
+            {
+                auto it = conns.find(key);
+                if (it != conns.end() && it->second->dirty)
+                {
+                    it->second->dirty = false;
+                    if (it->second->rtp->flush_inorder() == -1)
+                    {
+                        LOG_DEBUG("run failed to write %s\n", it->second->path);
+                        drop(key);
+                        continue;
+                    }
+                    it->second->rtp->flush_packets();
+                }
+            }
+            this->dirty.clear();
+            if (this->io->rx_drained)
+            {
+                break; // socket里已经没有排队的包了
+            }
+        }
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include "rtp.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define RTP_SERVER_MAX_CONNS 1024 // 同时存在的连接上限，超过时新的SYN直接丢掉
+#define RTP_SERVER_SYN_RTO 100    // 没收到第三次握手时重发SYN&ACK的间隔(ms)
+#define RTP_SERVER_SYN_WAIT 5000  // 第三次握手最多等这么久(ms)
+#define RTP_SERVER_IDLE 10000     // 连接这么久没收到包就放弃(ms)
+#define RTP_SERVER_LINGER 2000    // 发出FIN&ACK后继续应答重发的FIN的时间(ms)
+
+/* 在一个UDP socket上同时接收多个发送方的文件
+ * 按对端地址把包分给各自的Rtp连接，每个连接独立地走握手、收数据、挥手，
+ * 收到的文件按 对端ip_端口_编号 存在out_dir下，对方一次发多个文件时为同名的目录
+ * 多个文件收完后在后台线程里拆开，拆的时候事件循环照常给别的连接回ACK */
+class RtpServer
+{
+private:
+    enum ConnState
+    {
+        CONN_SYN_RCVD,    // 已回复SYN&ACK，等待第三次握手
+        CONN_ESTABLISHED, // 正在收数据
+        CONN_LINGER,      // 已回复FIN&ACK，等对方的最后一个ACK或者不再重发FIN
+    };
+    struct Conn
+    {
+        Rtp *rtp;
+        ConnState state;
+        uint32_t syn_seq;                                // 对方SYN的seq_num
+        RtpPacket syn_ack;                               // 需要重发的SYN&ACK，带着MSS选项
+        RtpHeader fin_ack;                               // LINGER时需要重发的FIN&ACK
+        bool syn_ack_resent;                             // 重发过的SYN&ACK不产生RTT样本
+        int64_t syn_ack_sent_ns;                         // SYN&ACK第一次发出的时间
+        std::chrono::steady_clock::time_point deadline;  // 下一次需要处理定时事件的时间
+        std::chrono::steady_clock::time_point give_up;   // 握手阶段的超时时间
+        std::chrono::steady_clock::time_point start_time; // 开始收数据的时间
+        char path[512];                                  // 保存到的文件
+        bool dirty;                                      // 有还没写的数据或者还没flush的ACK
+    };
+    struct Extraction
+    {
+        std::string spool;                                // 收到的数据流
+        std::string dir;                                  // 拆到这个目录
+        uint64_t size;                                    // 数据流的大小
+        std::chrono::steady_clock::time_point start_time; // 连接开始收数据的时间
+        std::thread worker;
+        std::atomic<bool> done{false};                    // worker拆完了，ret有效
+        int ret = -1;
+    };
+
+    int sockfd;
+    std::string out_dir;
+    std::unordered_map<uint64_t, Conn *> conns; // 对端地址 -> 连接
+    RtpIoBatch *io;                             // 服务端共用的收包缓冲区
+    uint64_t file_count;                        // 已经开始接收的文件数，用于给文件编号
+    int done_count;                             // 成功收完的文件数
+    int established;                            // 正在收数据的连接数，它们分摊socket的接收缓冲区
+    uint32_t reorder_window;
+    int delack_max;                             // 每个连接一个ACK最多确认的包数
+    bool offload;                               // 是否开启UDP_GRO
+    uint32_t mss_limit;                         // 每个连接能接收的最大payload
+    int max_files;                              // 收完这么多文件后退出，0为不限
+    std::vector<uint64_t> dirty;                // 这一批包里收到了数据的连接
+    std::vector<Extraction *> extractions;      // 在后台拆的bundle
+    int wake_fd;                                // eventfd，拆完一个bundle时worker写它，叫醒poll
+
+    static uint64_t conn_key(const struct sockaddr_in &addr);
+    void dispatch(RtpPacket *pkt, int len, const struct sockaddr_in &from, socklen_t fromlen);
+    Conn *accept_conn(RtpPacket *syn, const struct sockaddr_in &from, socklen_t fromlen);
+    int establish(Conn *conn);
+    int step(Conn *conn, RtpPacket *pkt);
+    void finish(Conn *conn);
+    int on_timer(Conn *conn, std::chrono::steady_clock::time_point now);
+    void drop(uint64_t key);
+    void extract(Conn *conn);
+    void reap_extractions(bool wait);
+
+public:
+    RtpServer(int sockfd, const char *out_dir)
+        : sockfd(sockfd), out_dir(out_dir), io(nullptr), file_count(0), done_count(0), established(0),
+          reorder_window(RTP_REORDER_WINDOW), delack_max(RTP_DELACK_PACKETS), offload(true),
+          mss_limit(RTP_MSS_MAX), max_files(0), wake_fd(-1) {}
+    ~RtpServer();
+    /* 运行事件循环，成功收完max_files个文件并且所有连接都结束后返回0，
+     * max_files为0时一直运行，出错返回-1 */
+    int run(int max_files);
+    void set_reorder_window(uint32_t packets) { reorder_window = packets > 0 ? packets : 1; } // 每个连接的乱序窗口
+    void set_delayed_ack(int packets) { delack_max = packets; }                             // 见Rtp::set_delayed_ack
+    void set_offload(bool enable) { offload = enable; }                                     // run之前设置
+    void set_max_payload(uint32_t bytes) { mss_limit = std::min(std::max(bytes, (uint32_t)RTP_MSS_MIN), (uint32_t)RTP_MSS_MAX); } // 见Rtp::set_max_payload，run之前设置
+    size_t connection_count() const { return conns.size(); }                               // 当前连接数
+};
+
+#endif // __SERVER_H
@@ -0,0 +1,214 @@
+#include "stats.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+using namespace std;
+
+/* LatencyHistogram */
+
+int LatencyHistogram::index(uint64_t value)
+{
+    if (value < 2 * RTP_HIST_SUB)
+    {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= RTP_HIST_MAX_BITS)
+    {
+        return RTP_HIST_BUCKETS - 1;
+    }
+    int shift = msb - RTP_HIST_SUB_BITS;
+    return shift * RTP_HIST_SUB + (int)(value >> shift); // value >> shift在[RTP_HIST_SUB, 2 * RTP_HIST_SUB)
+}
+
+uint64_t LatencyHistogram::lowest(int index)
+{
+    if (index < 2 * RTP_HIST_SUB)
+    {
+        return index;
+    }
+    int shift = index / RTP_HIST_SUB - 1;
+    return (uint64_t)(index % RTP_HIST_SUB + RTP_HIST_SUB) << shift;
+}
+
+uint64_t LatencyHistogram::highest(int index)
+{
+    if (index < 2 * RTP_HIST_SUB)
+    {
+        return index;
+    }
+    if (index == RTP_HIST_BUCKETS - 1)
+    {
+        return UINT64_MAX; // 超出范围的值都在最后一格
+    }
+    int shift = index / RTP_HIST_SUB - 1;
+    return lowest(index) + ((uint64_t)1 << shift) - 1;
+}
+
+void LatencyHistogram::reset()
+{
+    for (int i = 0; i < RTP_HIST_BUCKETS; i++)
+    {
+        counts[i].store(0, memory_order_relaxed);
+    }
+    total.store(0, memory_order_relaxed);
+    sum.store(0, memory_order_relaxed);
+    min_value.store(UINT64_MAX, memory_order_relaxed);
+    max_value.store(0, memory_order_relaxed);
+}
+
+void LatencyHistogram::record(int64_t us)
+{
+    uint64_t value = us > 0 ? us : 0;
+    counts[index(value)].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(value, memory_order_relaxed);
+    // 只有记录的线程会改，读到旧值也只是少了最新的一个样本
+    if (value < min_value.load(memory_order_relaxed))
+    {
+        min_value.store(value, memory_order_relaxed);
+    }
+    if (value > max_value.load(memory_order_relaxed))
+    {
+        max_value.store(value, memory_order_relaxed);
+    }
+}
+
+uint64_t LatencyHistogram::min() const
+{
+    uint64_t value = min_value.load(memory_order_relaxed);
+    return value == UINT64_MAX ? 0 : value;
+}
+
+double LatencyHistogram::mean() const
+{
+    uint64_t n = count();
+    return n > 0 ? (double)sum.load(memory_order_relaxed) / n : 0;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    uint64_t n = count();
+    if (n == 0)
+    {
+        return 0;
+    }
+    // 第rank个样本所在的格子，和HDR一样返回格子里最大的值
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)(std::min(std::max(p, 0.0), 100.0) / 100 * n + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < RTP_HIST_BUCKETS; i++)
+    {
+        seen += counts[i].load(memory_order_relaxed);
+        if (seen >= rank)
+        {
+            return std::min(highest(i), max());
+        }
+    }
+    return max(); // 读的时候还在记录，格子里的总数比n少
+}
+
+void LatencyHistogram::append_json(string &out) const
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\"count\":%lu,\"min_us\":%lu,\"mean_us\":%.1f,\"p50_us\":%lu,\"p90_us\":%lu,"
+             "\"p99_us\":%lu,\"p999_us\":%lu,\"max_us\":%lu,\"buckets\":[",
+             count(), min(), mean(), percentile(50), percentile(90), percentile(99), percentile(99.9), max());
+    out += buf;
+    bool first = true;
+    for (int i = 0; i < RTP_HIST_BUCKETS; i++)
+    {
+        uint64_t c = counts[i].load(memory_order_relaxed);
+        if (c == 0)
+        {
+            continue;
+        }
+        // [格子里最大的值, 个数]，最后一格没有上界，用记录过的最大值
+        uint64_t high = i == RTP_HIST_BUCKETS - 1 ? max() : highest(i);
+        snprintf(buf, sizeof(buf), "%s[%lu,%lu]", first ? "" : ",", high, c);
+        out += buf;
+        first = false;
+    }
+    out += "]}";
+}
+
+/* RtpStats */
+
+void RtpStats::sample_cc(double cwnd, double ssthresh, bool force)
+{
+    int64_t now = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    if (!force && now - cc_last_us < RTP_STATS_CC_INTERVAL_US)
+    {
+        return;
+    }
+    lock_guard<mutex> guard(cc_lock);
+    cc_last_us = now;
+    CcSample &sample = cc_samples[cc_count % RTP_STATS_CC_SAMPLES];
+    sample.us = now;
+    sample.cwnd = cwnd;
+    sample.ssthresh = ssthresh;
+    cc_count++;
+}
+
+uint64_t RtpStats::retransmits_total() const
+{
+    uint64_t total = 0;
+    for (int i = 0; i < RTP_RTX_CAUSES; i++)
+    {
+        total += retransmits[i].load(memory_order_relaxed);
+    }
+    return total;
+}
+
+string RtpStats::to_json() const
+{
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "{\"packets_sent\":%lu,\"bytes_sent\":%lu,\"packets_received\":%lu,\"bytes_received\":%lu,"
+             "\"checksum_failures\":%lu,\"data_packets_sent\":%lu,"
+             "\"retransmits\":{\"total\":%lu,\"timeout\":%lu,\"fast\":%lu,\"sack\":%lu},"
+             "\"dup_acks\":%lu,\"timeouts\":%lu,\"acks_sent\":%lu,\"duplicate_data\":%lu,",
+             packets_sent.load(), bytes_sent.load(), packets_received.load(), bytes_received.load(),
+             checksum_failures.load(), data_packets_sent.load(),
+             retransmits_total(), retransmits[RTP_RTX_TIMEOUT].load(), retransmits[RTP_RTX_FAST].load(), retransmits[RTP_RTX_SACK].load(),
+             dup_acks.load(), timeouts.load(), acks_sent.load(), duplicate_data.load());
+    string out = buf;
+    out += "\"rtt\":";
+    rtt.append_json(out);
+    out += ",\"ack_delay\":";
+    ack_delay.append_json(out);
+    // [时间(us), cwnd, ssthresh]，按时间顺序，只有最近的RTP_STATS_CC_SAMPLES个
+    out += ",\"cc\":[";
+    {
+        lock_guard<mutex> guard(cc_lock);
+        uint64_t first = cc_count > RTP_STATS_CC_SAMPLES ? cc_count - RTP_STATS_CC_SAMPLES : 0;
+        for (uint64_t i = first; i < cc_count; i++)
+        {
+            const CcSample &sample = cc_samples[i % RTP_STATS_CC_SAMPLES];
+            snprintf(buf, sizeof(buf), "%s[%ld,%.1f,%.1f]", i == first ? "" : ",", sample.us, sample.cwnd, sample.ssthresh);
+            out += buf;
+        }
+    }
+    out += "]}";
+    return out;
+}
+
+int rtp_write_json(const char *path, const std::string &json)
+{
+    bool to_stdout = strcmp(path, "-") == 0;
+    FILE *fp = to_stdout ? stdout : fopen(path, "w");
+    if (fp == nullptr)
+    {
+        return -1;
+    }
+    bool ok = fwrite(json.data(), 1, json.size(), fp) == json.size() && fputc('\n', fp) != EOF;
+    if (to_stdout)
+    {
+        ok = fflush(fp) == 0 && ok;
+    }
+    else
+    {
+        ok = fclose(fp) == 0 && ok;
+    }
+    return ok ? 0 : -1;
+}
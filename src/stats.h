@@ -0,0 +1,98 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <chrono>
+
+#define RTP_HIST_SUB_BITS 5                                         // 每个2的幂区间分成2^5个格子，相对误差不超过1/32
+#define RTP_HIST_SUB (1 << RTP_HIST_SUB_BITS)
+#define RTP_HIST_MAX_BITS 40                                        // 能记录的最大值约为2^40us（12天），更大的记在最后一格
+#define RTP_HIST_BUCKETS ((RTP_HIST_MAX_BITS - RTP_HIST_SUB_BITS + 1) * RTP_HIST_SUB)
+#define RTP_STATS_CC_SAMPLES 1024                                   // 保留最近这么多个cwnd/ssthresh样本
+#define RTP_STATS_CC_INTERVAL_US 10000                              // cwnd/ssthresh最多每10ms采样一次
+
+/* HDR风格的直方图，单位为微秒：小于2^6的值每个一格，之后每个2的幂区间等分成RTP_HIST_SUB格，
+ * 只用原子计数，可以一边记录一边在别的线程里读 */
+class LatencyHistogram
+{
+private:
+    std::atomic<uint64_t> counts[RTP_HIST_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> min_value;
+    std::atomic<uint64_t> max_value;
+
+    static int index(uint64_t value);       // value所在的格子
+    static uint64_t lowest(int index);      // 格子里最小的值
+    static uint64_t highest(int index);     // 格子里最大的值
+
+public:
+    LatencyHistogram() { reset(); }
+    LatencyHistogram(const LatencyHistogram &) = delete;
+    LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+    void record(int64_t us);                // 记录一个值，负数当作0
+    void reset();
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t min() const;                   // 没有样本时为0
+    uint64_t max() const { return max_value.load(std::memory_order_relaxed); }
+    double mean() const;
+    uint64_t percentile(double p) const;    // p在[0, 100]，返回的值不小于真实值，误差在格子宽度以内
+    void append_json(std::string &out) const; // 统计量和非空的格子
+};
+
+/* 重传的原因 */
+enum RtpRtxCause
+{
+    RTP_RTX_TIMEOUT = 0, // RTO超时，重传整个窗口里没被SACK的包
+    RTP_RTX_FAST,        // 三个重复ACK触发的快速重传
+    RTP_RTX_SACK,        // 快速恢复期间新的SACK块暴露出来的空洞
+    RTP_RTX_CAUSES,
+};
+
+/* 一个连接的统计，计数都是原子的，传输过程中可以在别的线程里读或者导出
+ * 包数和字节数包括header和控制包，不包括模拟丢掉的包 */
+struct RtpStats
+{
+    std::atomic<uint64_t> packets_sent{0};
+    std::atomic<uint64_t> bytes_sent{0};
+    std::atomic<uint64_t> packets_received{0};   // 校验通过、来自对方的包
+    std::atomic<uint64_t> bytes_received{0};
+    std::atomic<uint64_t> checksum_failures{0};  // CRC或者大小不对的数据报
+    std::atomic<uint64_t> data_packets_sent{0};  // 第一次发送的数据包，不含重传和校验包
+    std::atomic<uint64_t> retransmits[RTP_RTX_CAUSES] = {};
+    std::atomic<uint64_t> dup_acks{0};           // 发送方收到的重复ACK
+    std::atomic<uint64_t> timeouts{0};           // 发送方的RTO超时次数
+    std::atomic<uint64_t> acks_sent{0};          // 接收方发出的累积ACK
+    std::atomic<uint64_t> duplicate_data{0};     // 接收方收到的重复数据包
+    LatencyHistogram rtt;                        // 发送方的RTT样本(us)
+    LatencyHistogram ack_delay;                  // 接收方：包到达到ACK发出的时间(us)，延迟ACK的代价
+
+    RtpStats() : start(std::chrono::steady_clock::now()) {}
+    /* 记录一个cwnd/ssthresh样本，距离上一个不到RTP_STATS_CC_INTERVAL_US时跳过，force为true时总是记录 */
+    void sample_cc(double cwnd, double ssthresh, bool force = false);
+    uint64_t retransmits_total() const;
+    /* 导出为一个JSON对象，可以在传输过程中调用 */
+    std::string to_json() const;
+
+private:
+    struct CcSample
+    {
+        int64_t us; // 从创建开始经过的时间
+        float cwnd;
+        float ssthresh;
+    };
+    std::chrono::steady_clock::time_point start;
+    mutable std::mutex cc_lock;
+    CcSample cc_samples[RTP_STATS_CC_SAMPLES]; // 环形，cc_count为总共记录过的个数
+    uint64_t cc_count = 0;
+    int64_t cc_last_us = -RTP_STATS_CC_INTERVAL_US;
+};
+
+/* 把json写进path，path为"-"时写到标准输出，成功返回0，失败返回-1 */
+int rtp_write_json(const char *path, const std::string &json);
+
+#endif // __STATS_H
@@ -4,14 +4,32 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <string>
 #include <thread>
+#include <vector>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include "bundle.h"
+#include "cc.h"
+#include "crc32.h"
+#include "journal.h"
+#include "pacer.h"
+#include "ring.h"
+#include "rtp.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
-#define ORIGIN SOURCE_DIR "/build/testdata"
-#define RESULT SOURCE_DIR "/build/recvfile"
+// the build directory, where the normal sender and receiver are
+#ifndef BINARY_DIR
+#define BINARY_DIR SOURCE_DIR "/build"
+#endif
+
+#define ORIGIN BINARY_DIR "/testdata"
+#define RESULT BINARY_DIR "/recvfile"
 
 static int port = 49152;
 static char origin[100];
@@ -89,7 +107,7 @@ int wait_or_timeout(pid_t sender, pid_t receiver) {
 
 void exe_name(char* name, size_t maxlen, bool is_sender, bool normal) {
     const char* prefix =
-        normal ? SOURCE_DIR "/build/" : SOURCE_DIR "/test/test_";
+        normal ? BINARY_DIR "/" : SOURCE_DIR "/test/test_";
     const char* body = is_sender ? "sender" : "receiver";
 
     std::snprintf(name, maxlen, "%s%s", prefix, body);
@@ -143,6 +161,41 @@ int run_tests(const char* window_size, const char* err, const char* prob,
     return diff_file(origin, result);
 }
 
+// run the sender and receiver built with this tree, args without the program
+// name; returns 0 when both exit with 0
+pid_t spawn(bool is_sender, std::vector<const char*> args) {
+    char name[200];
+    std::snprintf(name, 200, "%s/%s", BINARY_DIR,
+                  is_sender ? "sender" : "receiver");
+    args.insert(args.begin(), name);
+    args.push_back(nullptr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(name, (char* const*)args.data());
+        LOG_FATAL("Failed to execute %s\n", name);
+    }
+    return pid;
+}
+
+int run_cli(std::vector<const char*> sender_args,
+            std::vector<const char*> receiver_args) {
+    pid_t receiver = spawn(false, receiver_args);
+    pid_t sender = spawn(true, sender_args);
+    return wait_or_timeout(sender, receiver);
+}
+
+const char* next_port() {
+    static char port_s[10];
+    port++;
+    std::snprintf(port_s, 10, "%d", port);
+    return port_s;
+}
+
+bool file_exists(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
 void create_random(int megabytes) {
     char cmd[200];
     std::snprintf(cmd, 200, "head -c %d < /dev/urandom > %s",
@@ -263,3 +316,1177 @@ TEST_F(RTP, OPT_SENDER_MIXED_2) {
     ASSERT_EQ(run_tests("16", "15", "30", true, true), 1);
 }
 
+
+/* ------------------------- command line mode tests ------------------------ */
+TEST_F(RTP, RESUME) {
+    // kill both ends halfway through a rate-capped transfer, then resume
+    const char* p = next_port();
+    pid_t receiver = spawn(false, {p, result});
+    pid_t sender = spawn(true, {"-R", "-r", "8", "127.0.0.1", p, origin});
+    usleep(1500 * 1000);
+    kill(sender, SIGKILL);
+    kill(receiver, SIGKILL);
+    waitpid(sender, nullptr, 0);
+    waitpid(receiver, nullptr, 0);
+
+    char journal[120];
+    std::snprintf(journal, 120, "%s%s", result, RTP_JOURNAL_SUFFIX);
+    p = next_port();
+    ASSERT_EQ(run_cli({"-R", "127.0.0.1", p, origin}, {p, result}), 0);
+    ASSERT_EQ(diff_file(origin, result), 1);
+    ASSERT_FALSE(file_exists(journal));
+}
+
+TEST_F(RTP, BUNDLE_DIR) {
+    // a directory with nested, empty and ordinary files
+    std::string src = std::string(origin) + ".d";
+    std::string out = std::string(result) + ".d";
+    std::string cmd = "mkdir -p " + src + "/sub/deep " + src + "/empty && " +
+                      "cp " + origin + " " + src + "/sub/deep/data && " +
+                      "echo small > " + src + "/small && touch " + src + "/sub/zero";
+    ASSERT_EQ(system(cmd.c_str()), 0);
+    const char* p = next_port();
+    int ret = run_cli({"127.0.0.1", p, src.c_str()}, {p, out.c_str()});
+    cmd = "diff -r " + src + " " + out + "/" + src.substr(src.rfind('/') + 1);
+    int same = system(cmd.c_str());
+    cmd = "rm -rf " + src + " " + out;
+    system(cmd.c_str());
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(same, 0);
+}
+
+TEST_F(RTP, STRIPES) {
+    const char* p = next_port();
+    ASSERT_EQ(run_cli({"-j", "4", "127.0.0.1", p, origin}, {"-j", "4", p, result}), 0);
+    ASSERT_EQ(diff_file(origin, result), 1);
+}
+
+TEST_F(RTP, FEC) {
+    const char* p = next_port();
+    ASSERT_EQ(run_cli({"-f", "127.0.0.1", p, origin}, {p, result}), 0);
+    ASSERT_EQ(diff_file(origin, result), 1);
+    // with a rate cap, parity packets wait for tokens like data packets
+    p = next_port();
+    ASSERT_EQ(run_cli({"-f", "-r", "50", "127.0.0.1", p, origin}, {p, result}), 0);
+    ASSERT_EQ(diff_file(origin, result), 1);
+}
+
+TEST_F(RTP, COMPRESS) {
+    // random data is sent as is, the text appended to it is deflated
+    std::string cmd = std::string("yes 'reliable transport over udp' | head -c 2097152 >> ") + origin;
+    ASSERT_EQ(system(cmd.c_str()), 0);
+    const char* p = next_port();
+    ASSERT_EQ(run_cli({"-z", "127.0.0.1", p, origin}, {p, result}), 0);
+    ASSERT_EQ(diff_file(origin, result), 1);
+}
+
+TEST_F(RTP, SESSION) {
+    // several transfers over one connection: the test file, an empty file,
+    // a small file and a directory
+    std::string in = std::string(origin) + ".in";
+    std::string out = std::string(result) + ".d";
+    std::string cmd = "mkdir -p " + in + "/dir/sub && touch " + in + "/empty && " +
+                      "echo small > " + in + "/small && cp " + origin + " " + in + "/dir/sub/data";
+    ASSERT_EQ(system(cmd.c_str()), 0);
+    std::string empty = in + "/empty", small = in + "/small", dir = in + "/dir";
+    const char* p = next_port();
+    int ret = run_cli({"-S", "127.0.0.1", p, origin, empty.c_str(), small.c_str(), dir.c_str()},
+                      {"-S", p, out.c_str()});
+    std::string name = std::string(origin).substr(std::string(origin).rfind('/') + 1);
+    int first = diff_file(origin, (out + "/" + name).c_str());
+    cmd = "cmp " + empty + " " + out + "/empty && cmp " + small + " " + out + "/small && " +
+          "diff -r " + dir + " " + out + "/dir";
+    int rest = system(cmd.c_str());
+    cmd = "rm -rf " + in + " " + out;
+    system(cmd.c_str());
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(first, 1);
+    ASSERT_EQ(rest, 0);
+}
+
+/* ------------------------------- crc32 tests ------------------------------ */
+// one bit at a time, straight from the definition
+static uint32_t crc32_bitwise(uint32_t crc, const unsigned char* p, size_t n) {
+    crc = ~crc;
+    while (n--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+static const char* crc32_names[] = {"pclmul", "armv8", "slice16", "slice8",
+                                    "bytewise"};
+
+static void fill_random(unsigned char* buf, size_t n, unsigned seed) {
+    srand(seed);
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = rand() & 0xff;
+    }
+}
+
+TEST(CRC32, CHECK_VALUE) {
+    const char* s = "123456789";
+    ASSERT_EQ(crc32_update(0, s, 9), 0xCBF43926u);
+    ASSERT_EQ(compute_checksum(s, 9), 0xCBF43926u);
+    ASSERT_EQ(crc32_update(0, s, 0), 0u);
+}
+
+// every kernel the CPU supports, at every alignment and at the lengths
+// where the folding and slicing loops hand over to their tails
+TEST(CRC32, KERNELS) {
+    static unsigned char buf[8192 + 16];
+    fill_random(buf, sizeof(buf), 1);
+    int tested = 0;
+    for (const char* name : crc32_names) {
+        uint32_t out;
+        if (crc32_update_impl(name, 0, buf, 0, &out) == -1) {
+            continue;
+        }
+        tested++;
+        for (size_t offset = 0; offset < 16; offset++) {
+            for (size_t len = 0; len <= 8192; len = len < 300 ? len + 1 : len * 2 + 1) {
+                uint32_t seed = len * 2654435761u;
+                ASSERT_EQ(crc32_update_impl(name, seed, buf + offset, len, &out), 0);
+                ASSERT_EQ(out, crc32_bitwise(seed, buf + offset, len))
+                    << name << " offset " << offset << " length " << len;
+            }
+        }
+    }
+    // the portable ones are always there
+    ASSERT_GE(tested, 3);
+    uint32_t out;
+    ASSERT_EQ(crc32_update_impl("no-such-kernel", 0, buf, 16, &out), -1);
+}
+
+// the dispatched entry point, including the short-packet shortcut, and
+// feeding the data in pieces
+TEST(CRC32, DISPATCH) {
+    static unsigned char buf[4096 + 16];
+    fill_random(buf, sizeof(buf), 2);
+    for (size_t offset = 0; offset < 16; offset += 3) {
+        for (size_t len = 0; len <= 4096; len = len < 200 ? len + 1 : len * 2 + 7) {
+            uint32_t whole = crc32_bitwise(0, buf + offset, len);
+            ASSERT_EQ(crc32_update(0, buf + offset, len), whole)
+                << crc32_impl_name() << " offset " << offset << " length " << len;
+            size_t half = len / 3;
+            uint32_t crc = crc32_update(0, buf + offset, half);
+            ASSERT_EQ(crc32_update(crc, buf + offset + half, len - half), whole);
+        }
+    }
+}
+
+/* ----------------------------- skip map tests ----------------------------- */
+// a cell is skipped when it lies entirely inside one finished run
+static std::vector<int64_t> skip_reference(uint64_t begin, uint64_t end,
+                                           uint32_t size,
+                                           const RtpResumeRun* have,
+                                           int count) {
+    std::vector<int64_t> grids;
+    int64_t g = 0;
+    for (uint64_t off = begin; off < end; off += size, g++) {
+        uint64_t cell_end = std::min<uint64_t>(end, off + size);
+        bool done = false;
+        for (int i = 0; i < count; i++) {
+            if ((uint64_t)have[i].start * RTP_JOURNAL_BLOCK <= off &&
+                cell_end <= (uint64_t)have[i].end * RTP_JOURNAL_BLOCK) {
+                done = true;
+            }
+        }
+        if (!done) {
+            grids.push_back(g);
+        }
+    }
+    return grids;
+}
+
+static void check_skip_map(uint64_t begin, uint64_t end, uint32_t size,
+                           std::vector<RtpResumeRun> have) {
+    SkipMap map;
+    map.build(begin, end, size, have.data(), have.size());
+    std::vector<int64_t> expect =
+        skip_reference(begin, end, size, have.data(), have.size());
+    ASSERT_TRUE(map.active());
+    ASSERT_EQ(map.packets(), (int64_t)expect.size());
+    for (size_t i = 0; i < expect.size(); i++) {
+        ASSERT_EQ(map.grid(i), expect[i]) << "packet " << i;
+    }
+}
+
+#define BLOCK ((uint64_t)RTP_JOURNAL_BLOCK)
+
+TEST(SKIP_MAP, NOT_BUILT) {
+    SkipMap map;
+    ASSERT_FALSE(map.active());
+    ASSERT_EQ(map.grid(12345), 12345);
+}
+
+TEST(SKIP_MAP, NOTHING_DONE) {
+    check_skip_map(0, 3 * BLOCK + 5, 1400, {});
+    check_skip_map(100, 100, 1400, {{0, 1}});
+}
+
+TEST(SKIP_MAP, MIDDLE) {
+    check_skip_map(0, 8 * BLOCK, 1400, {{2, 3}, {5, 7}});
+    // a stripe that starts and ends inside a block
+    check_skip_map(BLOCK / 2 + 3, 5 * BLOCK + 11, 1400, {{0, 2}, {3, 4}});
+}
+
+TEST(SKIP_MAP, TAIL) {
+    // the last cell is short and ends at the end of the file
+    uint64_t end = 3 * BLOCK + 777;
+    check_skip_map(0, end, 1400, {{3, 4}});
+    check_skip_map(0, end, 1400, {{2, 4}});
+    check_skip_map(0, end, 1400, {{0, 4}});
+    // a run that stops short of the tail keeps the last cell
+    check_skip_map(0, end, 1400, {{1, 3}});
+    // stripe ends inside a finished block
+    check_skip_map(BLOCK, 2 * BLOCK + 1000, 1400, {{2, 3}});
+}
+
+TEST(SKIP_MAP, OVERLAPPING) {
+    uint64_t end = 6 * BLOCK + 99;
+    check_skip_map(0, end, 1400, {{1, 3}, {0, 2}});
+    check_skip_map(0, end, 1400, {{0, 5}, {1, 2}});
+    check_skip_map(0, end, 1400, {{2, 4}, {2, 4}, {3, 7}});
+    // adjacent runs: the cell across the boundary is sent again
+    check_skip_map(0, end, 1400, {{0, 2}, {2, 4}});
+}
+
+TEST(SKIP_MAP, RANDOM) {
+    srand(3);
+    for (int round = 0; round < 200; round++) {
+        uint64_t begin = rand() % (2 * BLOCK);
+        uint64_t end = begin + rand() % (6 * BLOCK);
+        uint32_t size = 500 + rand() % 9000;
+        std::vector<RtpResumeRun> have(rand() % (RTP_RESUME_RUNS + 1));
+        for (auto& run : have) {
+            run.start = rand() % 9;
+            run.end = run.start + rand() % 4;
+        }
+        check_skip_map(begin, end, size, have);
+    }
+}
+
+/* ------------------------------ bundle tests ------------------------------ */
+struct SpoolEntry {
+    std::string name;
+    uint32_t mode;
+    std::string data;
+};
+
+// write a bundle stream by hand, the way a (possibly hostile) sender would
+static void write_spool(const char* path, const std::vector<SpoolEntry>& entries) {
+    std::string manifest(sizeof(RtpBundleHeader), '\0');
+    std::string data;
+    for (const SpoolEntry& e : entries) {
+        RtpBundleEntry entry;
+        entry.size = e.data.size();
+        entry.mtime = 0;
+        entry.mode = e.mode;
+        entry.name_len = e.name.size();
+        manifest.append((const char*)&entry, sizeof(entry));
+        manifest += e.name;
+        data += e.data;
+    }
+    RtpBundleHeader header;
+    header.magic = RTP_BUNDLE_MAGIC;
+    header.count = entries.size();
+    header.manifest_len = manifest.size();
+    memcpy(&manifest[0], &header, sizeof(header));
+    FILE* fp = fopen(path, "wb");
+    ASSERT_NE(fp, nullptr);
+    fwrite(manifest.data(), 1, manifest.size(), fp);
+    fwrite(data.data(), 1, data.size(), fp);
+    fclose(fp);
+}
+
+class BUNDLE : public ::testing::Test {
+   protected:
+    char dir[120];
+    std::string spool, out;
+
+    void SetUp() override {
+        std::snprintf(dir, 120, "%s/bundleXXXXXX", BINARY_DIR);
+        ASSERT_NE(mkdtemp(dir), nullptr);
+        spool = std::string(dir) + "/spool" RTP_BUNDLE_SUFFIX;
+        out = std::string(dir) + "/out";
+    }
+
+    void TearDown() override {
+        std::string cmd = std::string("chmod -R u+rwx ") + dir + " && rm -rf " + dir;
+        system(cmd.c_str());
+    }
+
+    std::string path(const char* name) { return std::string(dir) + "/" + name; }
+};
+
+TEST_F(BUNDLE, ROUND_TRIP) {
+    std::string src = path("src");
+    std::string cmd = "mkdir -p " + src + "/a/b " + src + "/empty && " +
+                      "head -c 100000 < /dev/urandom > " + src + "/a/b/data && " +
+                      "echo hello > " + src + "/top && touch " + src + "/zero";
+    ASSERT_EQ(system(cmd.c_str()), 0);
+
+    RtpBundle bundle;
+    ASSERT_EQ(bundle.add(src.c_str()), 0);
+    bundle.finish();
+    std::vector<char> stream(bundle.size());
+    for (uint64_t off = 0; off < stream.size(); off += 4096) {
+        uint32_t len = std::min<uint64_t>(4096, stream.size() - off);
+        ASSERT_EQ(bundle.read(stream.data() + off, len, off), 0);
+    }
+    FILE* fp = fopen(spool.c_str(), "wb");
+    ASSERT_NE(fp, nullptr);
+    fwrite(stream.data(), 1, stream.size(), fp);
+    fclose(fp);
+
+    ASSERT_EQ(RtpBundle::extract(spool.c_str(), out.c_str()), 0);
+    ASSERT_FALSE(file_exists(spool.c_str()));
+    cmd = "diff -r " + src + " " + out + "/src";
+    ASSERT_EQ(system(cmd.c_str()), 0);
+}
+
+TEST_F(BUNDLE, UNSAFE_NAMES) {
+    std::string evil = path("evil");
+    const char* names[] = {"../evil", "a/../../evil", "a/../evil", "./evil",
+                           "a/./evil", "a//evil", "a/", "/evil", ""};
+    for (const char* name : names) {
+        write_spool(spool.c_str(), {{"a", S_IFDIR | 0755, ""},
+                                    {name, S_IFREG | 0644, "x"}});
+        ASSERT_EQ(RtpBundle::extract(spool.c_str(), out.c_str()), -1) << name;
+        ASSERT_FALSE(file_exists(evil.c_str())) << name;
+    }
+    // an absolute path that points back inside the test directory
+    write_spool(spool.c_str(), {{evil, S_IFREG | 0644, "x"}});
+    ASSERT_EQ(RtpBundle::extract(spool.c_str(), out.c_str()), -1);
+    ASSERT_FALSE(file_exists(evil.c_str()));
+}
+
+TEST_F(BUNDLE, SHORT_SPOOL) {
+    // the manifest promises more data than the spool holds
+    write_spool(spool.c_str(), {{"f", S_IFREG | 0644, "abc"}});
+    ASSERT_EQ(truncate(spool.c_str(), sizeof(RtpBundleHeader) +
+                                          sizeof(RtpBundleEntry) + 1 + 2), 0);
+    ASSERT_EQ(RtpBundle::extract(spool.c_str(), out.c_str()), -1);
+}
+
+TEST_F(BUNDLE, MODES) {
+    // setuid and friends are dropped, a read-only directory still gets
+    // its files and ends up read-only
+    write_spool(spool.c_str(), {{"ro", S_IFDIR | 0555, ""},
+                                {"ro/sub", S_IFDIR | 01777, ""},
+                                {"ro/sub/f", S_IFREG | 06755, "x"},
+                                {"ro/g", S_IFREG | 0444, "y"}});
+    ASSERT_EQ(RtpBundle::extract(spool.c_str(), out.c_str()), 0);
+    struct stat st;
+    ASSERT_EQ(stat((out + "/ro").c_str(), &st), 0);
+    ASSERT_EQ(st.st_mode & 07777, 0555u);
+    ASSERT_EQ(stat((out + "/ro/sub").c_str(), &st), 0);
+    ASSERT_EQ(st.st_mode & 07777, 0777u);
+    ASSERT_EQ(stat((out + "/ro/sub/f").c_str(), &st), 0);
+    ASSERT_EQ(st.st_mode & 07777, 0755u);
+    ASSERT_EQ(stat((out + "/ro/g").c_str(), &st), 0);
+    ASSERT_EQ(st.st_mode & 07777, 0444u);
+}
+
+TEST_F(BUNDLE, SYMLINKS) {
+    std::string outside = path("outside");
+    ASSERT_EQ(mkdir(out.c_str(), 0755), 0);
+    ASSERT_EQ(mkdir(outside.c_str(), 0755), 0);
+    ASSERT_EQ(symlink(outside.c_str(), (out + "/link").c_str()), 0);
+    ASSERT_EQ(symlink((outside + "/target").c_str(), (out + "/file").c_str()), 0);
+
+    // through a symlinked directory
+    write_spool(spool.c_str(), {{"link/x", S_IFREG | 0644, "x"}});
+    ASSERT_EQ(RtpBundle::extract(spool.c_str(), out.c_str()), -1);
+    ASSERT_FALSE(file_exists((outside + "/x").c_str()));
+    // a directory entry on top of a symlink
+    write_spool(spool.c_str(), {{"link", S_IFDIR | 0755, ""},
+                                {"link/x", S_IFREG | 0644, "x"}});
+    ASSERT_EQ(RtpBundle::extract(spool.c_str(), out.c_str()), -1);
+    ASSERT_FALSE(file_exists((outside + "/x").c_str()));
+    // a file entry on top of a symlink
+    write_spool(spool.c_str(), {{"file", S_IFREG | 0644, "x"}});
+    ASSERT_EQ(RtpBundle::extract(spool.c_str(), out.c_str()), -1);
+    ASSERT_FALSE(file_exists((outside + "/target").c_str()));
+}
+
+/* ------------------------------- pacer tests ------------------------------ */
+#define MS 1000000
+
+TEST(PACER, UNLIMITED) {
+    Pacer pacer;
+    pacer.set_rate(0, 1500, 1 * MS);
+    pacer.reset(1 * MS);
+    ASSERT_FALSE(pacer.limited());
+    for (int i = 0; i < 1000; i++) {
+        ASSERT_TRUE(pacer.can_send(65536));
+        pacer.consume(65536);
+    }
+    ASSERT_EQ(pacer.wait_ns(65536), 0);
+}
+
+TEST(PACER, BURST) {
+    // 1MB/s only gathers 1000 bytes in 1ms, the bucket still holds three
+    // full packets so a data packet and its parity go out together
+    Pacer pacer;
+    pacer.set_rate(1e6, 1500, 1 * MS);
+    pacer.reset(1 * MS);
+    ASSERT_TRUE(pacer.can_send(RTP_PACE_MIN_BURST * 1500));
+    ASSERT_FALSE(pacer.can_send(RTP_PACE_MIN_BURST * 1500 + 1));
+    // idle time does not grow the bucket past the burst
+    pacer.refill(1000 * MS);
+    ASSERT_FALSE(pacer.can_send(RTP_PACE_MIN_BURST * 1500 + 1));
+    // a fast rate allows 1ms worth of data
+    pacer.set_rate(1e9, 1500, 1000 * MS);
+    pacer.reset(1000 * MS);
+    ASSERT_TRUE(pacer.can_send(1000000));
+    ASSERT_FALSE(pacer.can_send(1000001));
+}
+
+TEST(PACER, DEBT) {
+    // sending past the tokens is paid back in full before anything else
+    // goes out, however deep the debt
+    Pacer pacer;
+    pacer.set_rate(1e6, 1500, 1 * MS);
+    pacer.reset(1 * MS);
+    for (int i = 0; i < 10; i++) {
+        pacer.consume(1500);
+    }
+    // 4500 - 15000 tokens, 12ms until another 1500 bytes may go
+    int64_t wait = pacer.wait_ns(1500);
+    ASSERT_NEAR(wait, 12 * MS, 1000);
+    pacer.refill(1 * MS + wait - 1000);
+    ASSERT_FALSE(pacer.can_send(1500));
+    pacer.refill(1 * MS + wait);
+    ASSERT_TRUE(pacer.can_send(1500));
+}
+
+TEST(PACER, RATE) {
+    // a sender polling every 10us for a second stays at the rate
+    Pacer pacer;
+    double rate = 5e6;
+    pacer.set_rate(rate, 1500, 1 * MS);
+    pacer.reset(1 * MS);
+    uint64_t sent = 0;
+    for (int64_t now = 1 * MS; now <= 1001 * MS; now += 10000) {
+        pacer.refill(now);
+        while (pacer.can_send(1500)) {
+            pacer.consume(1500);
+            sent += 1500;
+        }
+    }
+    ASSERT_LE(sent, rate + RTP_PACE_MIN_BURST * 1500);
+    ASSERT_GE(sent, rate - 1500);
+}
+
+/* ------------------------------- ring tests ------------------------------- */
+TEST(SEQ_BITMAP, CAPACITY) {
+    SeqBitmap bitmap;
+    ASSERT_EQ(bitmap.init(1), 0);
+    ASSERT_EQ(bitmap.capacity(), 64u);
+    ASSERT_EQ(bitmap.init(100), 0);
+    ASSERT_EQ(bitmap.capacity(), 128u);
+    ASSERT_EQ(bitmap.init(4096), 0);
+    ASSERT_EQ(bitmap.capacity(), 4096u);
+}
+
+// a window sliding over the wrap point many times, checked against a plain
+// array of the window's bits
+TEST(SEQ_BITMAP, SLIDING_WINDOW) {
+    const uint32_t cap = 256;
+    SeqBitmap bitmap;
+    ASSERT_EQ(bitmap.init(cap), 0);
+    std::vector<bool> expect(cap);  // expect[i] is seq base + i
+    // start just below a multiple of 2^32 so the seq -> index cast wraps too
+    int64_t base = ((int64_t)1 << 32) - 3 * cap - 7;
+    srand(4);
+    for (int round = 0; round < 20000; round++) {
+        int op = rand() % 8;
+        int64_t seq = base + rand() % cap;
+        if (op < 4) {
+            bitmap.set(seq);
+            expect[seq - base] = true;
+        } else if (op == 4) {
+            bitmap.clear(seq);
+            expect[seq - base] = false;
+        } else {
+            // move the base, bits that slide out are cleared for reuse
+            int64_t step = rand() % (op == 7 ? cap : 70);
+            bitmap.clear_range(base, base + step);
+            expect.erase(expect.begin(), expect.begin() + step);
+            expect.resize(cap);
+            base += step;
+        }
+        for (uint32_t i = 0; i < cap; i++) {
+            ASSERT_EQ(bitmap.test(base + i), expect[i]) << "round " << round << " offset " << i;
+        }
+        int64_t from = base + rand() % cap;
+        int64_t limit = from + rand() % (base + cap - from + 1);
+        int64_t zero = limit, one = limit;
+        for (int64_t s = limit - 1; s >= from; s--) {
+            (expect[s - base] ? one : zero) = s;
+        }
+        ASSERT_EQ(bitmap.first_zero(from, limit), zero) << "round " << round;
+        ASSERT_EQ(bitmap.first_one(from, limit), one) << "round " << round;
+    }
+}
+
+TEST(SEQ_BITMAP, CLEAR_WHOLE_WINDOW) {
+    SeqBitmap bitmap;
+    ASSERT_EQ(bitmap.init(128), 0);
+    for (int64_t seq = 1000; seq < 1128; seq++) {
+        bitmap.set(seq);
+    }
+    ASSERT_EQ(bitmap.first_zero(1000, 1128), 1128);
+    // a range longer than the bitmap clears everything
+    bitmap.clear_range(1000, 1000 + 500);
+    ASSERT_EQ(bitmap.first_one(1500, 1628), 1628);
+    // a range ending in the middle of a word, across the wrap point
+    for (int64_t seq = 1500; seq < 1628; seq++) {
+        bitmap.set(seq);
+    }
+    bitmap.clear_range(1590, 1600);
+    ASSERT_EQ(bitmap.first_zero(1500, 1628), 1590);
+    ASSERT_EQ(bitmap.first_one(1590, 1628), 1600);
+    ASSERT_TRUE(bitmap.test(1589));
+}
+
+TEST(SLOT_RING, WRAP) {
+    SlotRing<int64_t> ring;
+    ASSERT_EQ(ring.init(100), 0);
+    ASSERT_EQ(ring.capacity(), 128u);
+    // a window of 128 slots advancing in uneven steps keeps every seq in
+    // its own slot until the window has moved past it
+    int64_t base = ((int64_t)1 << 32) - 300;
+    for (int64_t seq = base; seq < base + 128; seq++) {
+        *ring.at(seq) = seq;
+    }
+    for (int step = 1; step < 40; step++) {
+        for (int64_t seq = base + 128; seq < base + 128 + step; seq++) {
+            *ring.at(seq) = seq;
+        }
+        base += step;
+        for (int64_t seq = base; seq < base + 128; seq++) {
+            ASSERT_EQ(*ring.at(seq), seq);
+        }
+    }
+    ASSERT_EQ(ring.at(base), ring.at(base + 128));
+    ring.release();
+    ASSERT_EQ(ring.capacity(), 0u);
+}
+
+TEST(BYTE_RING, SLOTS) {
+    ByteRing ring;
+    ASSERT_EQ(ring.init(5, 1000), 0);
+    ASSERT_EQ(ring.capacity(), 8u);
+    for (int64_t seq = 6; seq < 14; seq++) {
+        memset(ring.at(seq), (int)seq, 1000);
+    }
+    for (int64_t seq = 6; seq < 14; seq++) {
+        ASSERT_EQ(ring.at(seq + 8), ring.at(seq));
+        for (int k = 0; k < 1000; k++) {
+            ASSERT_EQ(ring.at(seq)[k], (char)seq);
+        }
+    }
+    ASSERT_EQ(ring.at(7) - ring.at(6), 1000);
+}
+
+/* -------------------------------- rtt tests ------------------------------- */
+TEST(RTT, RFC6298_UPDATE) {
+    RttEstimator rtt;
+    ASSERT_FALSE(rtt.valid());
+    ASSERT_EQ(rtt.get_rto(), RTP_RTO_INIT_US);
+    // first sample: srtt = r, rttvar = r / 2, rto = srtt + 4 * rttvar
+    rtt.sample(100000);
+    ASSERT_TRUE(rtt.valid());
+    ASSERT_EQ(rtt.get_srtt(), 100000);
+    ASSERT_EQ(rtt.get_rttvar(), 50000);
+    ASSERT_EQ(rtt.get_rto(), 300000);
+    // then rttvar = 3/4 rttvar + 1/4 |srtt - r|, srtt = 7/8 srtt + 1/8 r
+    rtt.sample(60000);
+    ASSERT_EQ(rtt.get_rttvar(), (3 * 50000 + 40000) / 4);
+    ASSERT_EQ(rtt.get_srtt(), (7 * 100000 + 60000) / 8);
+    ASSERT_EQ(rtt.get_rto(), rtt.get_srtt() + 4 * rtt.get_rttvar());
+    ASSERT_EQ(rtt.get_min_rtt(), 60000);
+    ASSERT_EQ(rtt.get_latest(), 60000);
+    // samples that are not positive are dropped
+    rtt.sample(0);
+    rtt.sample(-5);
+    ASSERT_EQ(rtt.get_latest(), 60000);
+}
+
+TEST(RTT, CLAMP) {
+    // a fast path: 4 * rttvar falls below the clock granularity, then the
+    // whole RTO below the 10ms floor
+    RttEstimator fast;
+    for (int i = 0; i < 50; i++) {
+        fast.sample(1000);
+    }
+    ASSERT_EQ(fast.get_rto(), RTP_RTO_MIN_US);
+    // a slow one is capped at 2s
+    RttEstimator slow;
+    slow.sample(3000000);
+    ASSERT_EQ(slow.get_rto(), RTP_RTO_MAX_US);
+    // the bounds can be changed
+    fast.set_bounds(20000, 30000);
+    ASSERT_EQ(fast.get_rto(), 20000);
+    slow.set_bounds(20000, 30000);
+    ASSERT_EQ(slow.get_rto(), 30000);
+}
+
+TEST(RTT, BACKOFF) {
+    RttEstimator rtt;
+    rtt.sample(100000);
+    ASSERT_EQ(rtt.get_rto(), 300000);
+    rtt.on_timeout();
+    ASSERT_EQ(rtt.get_rto(), 600000);
+    rtt.on_timeout();
+    ASSERT_EQ(rtt.get_rto(), 1200000);
+    for (int i = 0; i < 100; i++) {
+        rtt.on_timeout();
+    }
+    ASSERT_EQ(rtt.get_rto(), RTP_RTO_MAX_US);
+    // progress without a sample (Karn) still ends the backoff
+    rtt.on_progress();
+    ASSERT_EQ(rtt.get_rto(), 300000);
+    rtt.on_timeout();
+    ASSERT_EQ(rtt.get_rto(), 600000);
+    // and so does a new sample
+    rtt.sample(100000);
+    ASSERT_EQ(rtt.get_rto(), rtt.get_srtt() + 4 * rtt.get_rttvar());
+    // before any sample the initial RTO backs off too
+    RttEstimator fresh;
+    fresh.on_timeout();
+    ASSERT_EQ(fresh.get_rto(), 2 * RTP_RTO_INIT_US);
+}
+
+TEST(RTT, KARN) {
+    // an ACK that covers a retransmitted packet gives no RTT sample
+    SlotRing<RtpTxMeta> meta;
+    ASSERT_EQ(meta.init(64), 0);
+    int64_t base = 1000;  // wraps the 64 slots
+    for (int64_t seq = base; seq < base + 64; seq++) {
+        meta.at(seq)->retransmitted = false;
+    }
+    ASSERT_TRUE(Rtp::karn_ok(meta, base, base + 64));
+    ASSERT_TRUE(Rtp::karn_ok(meta, base, base));
+    meta.at(base + 40)->retransmitted = true;
+    ASSERT_TRUE(Rtp::karn_ok(meta, base, base + 40));
+    ASSERT_FALSE(Rtp::karn_ok(meta, base, base + 41));
+    ASSERT_FALSE(Rtp::karn_ok(meta, base + 40, base + 41));
+    ASSERT_TRUE(Rtp::karn_ok(meta, base + 41, base + 64));
+}
+
+/* ------------------------- congestion control tests ------------------------ */
+static CcAck cc_ack_at(int64_t now_us, uint32_t acked, int64_t rtt_us,
+                       uint32_t inflight, double rate) {
+    CcAck ack;
+    ack.now_us = now_us;
+    ack.acked = acked;
+    ack.rtt_us = rtt_us;
+    ack.min_rtt_us = rtt_us;
+    ack.inflight = inflight;
+    ack.delivery_rate = rate;
+    ack.in_recovery = false;
+    return ack;
+}
+
+// one round trip: a window's worth of packets acked one at a time, each ACK
+// clocking out a new packet so the window stays full
+static void cc_round(CongestionControl* cc, int64_t& now, int64_t rtt_us,
+                     double rate) {
+    int n = std::max(1, (int)cc->get_cwnd());
+    for (int i = 0; i < n; i++) {
+        now += rtt_us / n;
+        cc->on_ack(cc_ack_at(now, 1, rtt_us, n, rate));
+    }
+}
+
+TEST(CC, CREATE) {
+    const char* names[] = {"reno", "cubic", "bbr"};
+    for (const char* name : names) {
+        CongestionControl* cc = cc_create(name);
+        ASSERT_NE(cc, nullptr) << name;
+        ASSERT_STREQ(cc->name(), name);
+        ASSERT_EQ(cc->get_cwnd(), RTP_CC_INIT_CWND);
+        delete cc;
+    }
+    CongestionControl* cc = cc_create(nullptr);
+    ASSERT_STREQ(cc->name(), "reno");
+    delete cc;
+    ASSERT_EQ(cc_create("vegas"), nullptr);
+    ASSERT_EQ(cc_create(""), nullptr);
+}
+
+TEST(CC, RENO) {
+    RenoCc cc;
+    int64_t now = 0;
+    // slow start doubles the window every round
+    for (int round = 0; round < 5; round++) {
+        cc_round(&cc, now, 10000, 0);
+    }
+    ASSERT_EQ(cc.get_cwnd(), 32);
+    // a delayed ACK covering two packets counts both
+    cc.on_ack(cc_ack_at(now, 2, 10000, 0, 0));
+    ASSERT_EQ(cc.get_cwnd(), 34);
+    // loss halves the window, then one packet per round
+    cc.on_loss(now);
+    ASSERT_EQ(cc.get_cwnd(), 17);
+    ASSERT_EQ(cc.get_ssthresh(), 17);
+    cc_round(&cc, now, 10000, 0);
+    ASSERT_NEAR(cc.get_cwnd(), 18, 0.1);
+    // the ACK that ends fast recovery leaves the window alone
+    CcAck ack = cc_ack_at(now, 5, 10000, 0, 0);
+    ack.in_recovery = true;
+    double before = cc.get_cwnd();
+    cc.on_ack(ack);
+    ASSERT_EQ(cc.get_cwnd(), before);
+    // timeout: back to one packet, slow start up to half the old window
+    cc.on_timeout(now);
+    ASSERT_EQ(cc.get_cwnd(), 1);
+    ASSERT_NEAR(cc.get_ssthresh(), before / 2, 0.01);
+    for (int i = 0; i < 5; i++) {
+        cc.on_loss(now);
+    }
+    ASSERT_EQ(cc.get_cwnd(), RTP_CC_MIN_CWND);
+}
+
+TEST(CC, CUBIC) {
+    CubicCc cc;
+    int64_t now = 0;
+    for (int round = 0; round < 7; round++) {
+        cc_round(&cc, now, 100000, 0);
+    }
+    ASSERT_EQ(cc.get_cwnd(), 128);
+    ASSERT_EQ(cc.get_ssthresh(), RTP_CC_INIT_SSTHRESH);
+    // multiplicative decrease by beta = 0.7
+    cc.on_loss(now);
+    ASSERT_NEAR(cc.get_cwnd(), 128 * 0.7, 0.01);
+    ASSERT_EQ(cc.get_ssthresh(), cc.get_cwnd());
+    // the cubic curve is back at the old window after K seconds,
+    // K = cbrt(W_max * (1 - beta) / C), below it before and above it after
+    double k = cbrt(128 * 0.3 / 0.4);
+    int64_t start = now;
+    while (now - start < k * 1e6 / 2) {
+        cc_round(&cc, now, 100000, 0);
+    }
+    ASSERT_GT(cc.get_cwnd(), 128 * 0.7 + 5);
+    ASSERT_LT(cc.get_cwnd(), 128);
+    while (now - start < (k + 1.5) * 1e6) {
+        cc_round(&cc, now, 100000, 0);
+    }
+    ASSERT_GT(cc.get_cwnd(), 128);
+    // fast convergence: a loss below the last W_max gives up more
+    cc.on_loss(now);
+    double w = cc.get_cwnd();
+    cc.on_loss(now);
+    ASSERT_NEAR(cc.get_cwnd(), w * 0.7, 0.01);
+    cc.on_timeout(now);
+    ASSERT_EQ(cc.get_cwnd(), 1);
+}
+
+TEST(CC, CUBIC_HYSTART) {
+    // slow start ends early when the RTT of a round grows by 1/8
+    CubicCc cc;
+    int64_t now = 0;
+    for (int round = 0; round < 5; round++) {
+        cc_round(&cc, now, 40000, 0);
+    }
+    ASSERT_EQ(cc.get_ssthresh(), RTP_CC_INIT_SSTHRESH);
+    for (int round = 0; round < 2; round++) {
+        cc_round(&cc, now, 60000, 0);
+    }
+    ASSERT_LT(cc.get_ssthresh(), RTP_CC_INIT_SSTHRESH);
+    double cwnd = cc.get_cwnd();
+    cc_round(&cc, now, 60000, 0);
+    ASSERT_LT(cc.get_cwnd(), cwnd * 1.5);  // no longer doubling
+}
+
+TEST(CC, BBR) {
+    // a 1000 packets/s bottleneck with a 10ms RTT, BDP = 10 packets
+    BbrCc cc;
+    int64_t now = 0;
+    ASSERT_EQ(cc.get_ssthresh(), 0);
+    for (int round = 0; round < 4; round++) {
+        cc_round(&cc, now, 10000, 1000 * (1 << round));
+    }
+    // still starting up: the window grows like slow start
+    ASSERT_GT(cc.get_cwnd(), 10);
+    for (int round = 0; round < 30; round++) {
+        cc_round(&cc, now, 10000, 1000);
+    }
+    // the pipe is full: DRAIN holds the window until the queue is gone
+    ASSERT_GT(cc.get_cwnd(), 2 * 10 + 1);
+    for (uint32_t inflight = 20; inflight > 5; inflight--) {
+        now += 1000;
+        cc.on_ack(cc_ack_at(now, 1, 10000, inflight, 1000));
+    }
+    for (int round = 0; round < 10; round++) {
+        cc_round(&cc, now, 10000, 1000);
+    }
+    // the bandwidth filter keeps the peak of the last 10 rounds, after that
+    // the window is capped at twice the BDP and pacing is near the bandwidth
+    ASSERT_LE(cc.get_cwnd(), 2 * 10 + 1);
+    ASSERT_GE(cc.get_cwnd(), RTP_BBR_MIN_CWND);
+    ASSERT_GE(cc.pacing_rate(), 0.75 * 1000);
+    ASSERT_LE(cc.pacing_rate(), 1.25 * 1000);
+    // losses are not a congestion signal, a timeout restarts from one packet
+    double cwnd = cc.get_cwnd();
+    cc.on_loss(now);
+    ASSERT_EQ(cc.get_cwnd(), cwnd);
+    cc.on_timeout(now);
+    ASSERT_EQ(cc.get_cwnd(), 1);
+}
+
+/* ------------------------------- sack tests -------------------------------- */
+// wraps an options buffer in an ACK the way queue_ack does
+static void sack_ack(RtpPacket* pkt, const char* options, int len) {
+    ASSERT_GE(len, 0);
+    Rtp::option_wrapper(pkt, 99, RTP_ACK, options, len);
+}
+
+TEST(SACK, ROUND_TRIP) {
+    SeqBitmap bitmap;
+    ASSERT_EQ(bitmap.init(256), 0);
+    int64_t base = 300;  // wraps the bitmap
+    // received: [302, 305) [310, 311) [320, 384) [400, 410)
+    for (int64_t seq = 302; seq < 305; seq++) bitmap.set(seq);
+    bitmap.set(310);
+    for (int64_t seq = 320; seq < 384; seq++) bitmap.set(seq);
+    for (int64_t seq = 400; seq < 410; seq++) bitmap.set(seq);
+    char options[RTP_CTRL_MAX];
+    int len = Rtp::build_sack(bitmap, base, 500, options);
+    ASSERT_EQ(len, 2 + 4 * (int)sizeof(RtpSackBlock));
+    // an RWND option after the SACK must not get in the way
+    uint32_t rwnd = 1234;
+    len = Rtp::opt_put(options, len, RTP_OPT_RWND, &rwnd, sizeof(rwnd));
+    RtpPacket pkt;
+    sack_ack(&pkt, options, len);
+    RtpSackBlock blocks[RTP_SACK_MAX];
+    ASSERT_EQ(Rtp::parse_sack(&pkt, blocks), 4);
+    uint32_t want[4][2] = {{302, 305}, {310, 311}, {320, 384}, {400, 410}};
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(blocks[i].start, want[i][0]) << i;
+        EXPECT_EQ(blocks[i].end, want[i][1]) << i;
+    }
+    // the range limit cuts the last block short
+    len = Rtp::build_sack(bitmap, base, 405, options);
+    sack_ack(&pkt, options, len);
+    ASSERT_EQ(Rtp::parse_sack(&pkt, blocks), 4);
+    ASSERT_EQ(blocks[3].end, 405u);
+    // nothing out of order: no option at all
+    ASSERT_EQ(Rtp::build_sack(bitmap, 305, 310, options), 0);
+    sack_ack(&pkt, options, 0);
+    ASSERT_EQ(Rtp::parse_sack(&pkt, blocks), 0);
+}
+
+TEST(SACK, MAX_BLOCKS) {
+    // every other packet missing: only the first RTP_SACK_MAX runs are sent
+    SeqBitmap bitmap;
+    ASSERT_EQ(bitmap.init(64), 0);
+    for (int64_t seq = 1; seq < 40; seq += 2) bitmap.set(seq);
+    char options[RTP_CTRL_MAX];
+    int len = Rtp::build_sack(bitmap, 0, 40, options);
+    ASSERT_EQ(len, 2 + RTP_SACK_MAX * (int)sizeof(RtpSackBlock));
+    RtpPacket pkt;
+    sack_ack(&pkt, options, len);
+    RtpSackBlock blocks[RTP_SACK_MAX];
+    ASSERT_EQ(Rtp::parse_sack(&pkt, blocks), RTP_SACK_MAX);
+    for (int i = 0; i < RTP_SACK_MAX; i++) {
+        EXPECT_EQ(blocks[i].start, 2u * i + 1);
+        EXPECT_EQ(blocks[i].end, 2u * i + 2);
+    }
+}
+
+TEST(SACK, MALFORMED) {
+    RtpSackBlock in[RTP_SACK_MAX + 1];
+    for (int i = 0; i <= RTP_SACK_MAX; i++) {
+        in[i].start = 10 * i;
+        in[i].end = 10 * i + 5;
+    }
+    char options[RTP_CTRL_MAX];
+    RtpPacket pkt;
+    RtpSackBlock blocks[RTP_SACK_MAX];
+    // the TLV claims two blocks but the packet ends after one
+    int len = Rtp::opt_put(options, 0, RTP_OPT_SACK, in, 2 * sizeof(RtpSackBlock));
+    sack_ack(&pkt, options, len - (int)sizeof(RtpSackBlock));
+    ASSERT_EQ(Rtp::parse_sack(&pkt, blocks), 0);
+    // a partial block
+    len = Rtp::opt_put(options, 0, RTP_OPT_SACK, in, sizeof(RtpSackBlock) + 4);
+    sack_ack(&pkt, options, len);
+    ASSERT_EQ(Rtp::parse_sack(&pkt, blocks), -1);
+    // more blocks than the receiver ever sends
+    len = Rtp::opt_put(options, 0, RTP_OPT_SACK, in, (RTP_SACK_MAX + 1) * sizeof(RtpSackBlock));
+    sack_ack(&pkt, options, len);
+    ASSERT_EQ(Rtp::parse_sack(&pkt, blocks), -1);
+    // an empty option is just no blocks
+    len = Rtp::opt_put(options, 0, RTP_OPT_SACK, nullptr, 0);
+    sack_ack(&pkt, options, len);
+    ASSERT_EQ(Rtp::parse_sack(&pkt, blocks), 0);
+}
+
+/* ------------------------------- stats tests ------------------------------- */
+// brackets and braces nest properly and nothing follows the outer object
+static bool json_balanced(const std::string& s) {
+    std::string stack;
+    bool in_str = false;
+    for (size_t i = 0; i < s.size(); i++) {
+        char c = s[i];
+        if (in_str) {
+            if (c == '\\') i++;
+            else if (c == '"') in_str = false;
+        } else if (c == '"') {
+            in_str = true;
+        } else if (c == '{' || c == '[') {
+            stack += c;
+        } else if (c == '}' || c == ']') {
+            if (stack.empty() || stack.back() != (c == '}' ? '{' : '[')) return false;
+            stack.pop_back();
+            if (stack.empty() && i != s.size() - 1) return false;
+        }
+    }
+    return !in_str && stack.empty();
+}
+
+// the text between `"key":` and the end of its value
+static std::string json_field(const std::string& s, const std::string& key) {
+    size_t pos = s.find("\"" + key + "\":");
+    if (pos == std::string::npos) return "";
+    pos += key.size() + 3;
+    int depth = 0;
+    size_t end = pos;
+    for (; end < s.size(); end++) {
+        char c = s[end];
+        if (c == '{' || c == '[') depth++;
+        else if (c == '}' || c == ']') {
+            if (depth == 0) break;
+            depth--;
+        } else if (c == ',' && depth == 0) break;
+    }
+    return s.substr(pos, end - pos);
+}
+
+TEST(STATS, HIST_EMPTY) {
+    LatencyHistogram hist;
+    ASSERT_EQ(hist.count(), 0u);
+    ASSERT_EQ(hist.min(), 0u);
+    ASSERT_EQ(hist.max(), 0u);
+    ASSERT_EQ(hist.mean(), 0);
+    ASSERT_EQ(hist.percentile(50), 0u);
+    std::string json;
+    hist.append_json(json);
+    ASSERT_TRUE(json_balanced(json)) << json;
+    ASSERT_EQ(json_field(json, "buckets"), "[]");
+}
+
+TEST(STATS, HIST_SMALL_EXACT) {
+    // below 2 * RTP_HIST_SUB every value has its own bucket
+    LatencyHistogram hist;
+    for (int v = 0; v < 2 * RTP_HIST_SUB; v++) {
+        hist.record(v);
+    }
+    hist.record(-5);  // counted as 0
+    ASSERT_EQ(hist.count(), 2u * RTP_HIST_SUB + 1);
+    ASSERT_EQ(hist.min(), 0u);
+    ASSERT_EQ(hist.max(), 2u * RTP_HIST_SUB - 1);
+    ASSERT_EQ(hist.percentile(0), 0u);
+    ASSERT_EQ(hist.percentile(50), 31u);
+    ASSERT_EQ(hist.percentile(100), 63u);
+}
+
+TEST(STATS, HIST_QUANTILES) {
+    // 1..100000us once each, quantiles come back no lower than the true
+    // value and at most one bucket (1/32 of the value) above it
+    LatencyHistogram hist;
+    const int n = 100000;
+    for (int v = 1; v <= n; v++) {
+        hist.record(v);
+    }
+    ASSERT_EQ(hist.count(), (uint64_t)n);
+    ASSERT_NEAR(hist.mean(), (n + 1) / 2.0, 1e-6);
+    double ps[] = {1, 10, 50, 90, 99, 99.9};
+    for (double p : ps) {
+        uint64_t truth = (uint64_t)(p / 100 * n + 0.5);
+        uint64_t got = hist.percentile(p);
+        EXPECT_GE(got, truth) << p;
+        EXPECT_LE(got, truth + truth / RTP_HIST_SUB) << p;
+    }
+    ASSERT_EQ(hist.percentile(100), (uint64_t)n);
+    // one sample far beyond the last bucket is still reported exactly
+    hist.record((int64_t)1 << 45);
+    ASSERT_EQ(hist.max(), (uint64_t)1 << 45);
+    ASSERT_EQ(hist.percentile(100), (uint64_t)1 << 45);
+    hist.reset();
+    ASSERT_EQ(hist.count(), 0u);
+    ASSERT_EQ(hist.max(), 0u);
+}
+
+TEST(STATS, HIST_BUCKET_EDGES) {
+    // from 64 on each power of two splits in RTP_HIST_SUB buckets,
+    // a bucket is reported by the largest value it can hold
+    LatencyHistogram hist;
+    hist.record(64);
+    hist.record(65);  // [64, 65]
+    hist.record(127);
+    hist.record(128);
+    hist.record(131);  // [128, 131]
+    hist.record(1000);
+    hist.record(1007);  // [992, 1007]
+    std::string json;
+    hist.append_json(json);
+    ASSERT_TRUE(json_balanced(json)) << json;
+    ASSERT_EQ(json_field(json, "buckets"), "[[65,2],[127,1],[131,2],[1007,2]]");
+    ASSERT_EQ(json_field(json, "count"), "7");
+    ASSERT_EQ(json_field(json, "min_us"), "64");
+    ASSERT_EQ(json_field(json, "max_us"), "1007");
+    ASSERT_EQ(json_field(json, "p50_us"), "131");
+    // the last bucket is open ended
+    hist.record((int64_t)1 << 45);
+    json.clear();
+    hist.append_json(json);
+    ASSERT_NE(json.find(",[35184372088832,1]]"), std::string::npos) << json;
+}
+
+TEST(STATS, TO_JSON) {
+    RtpStats stats;
+    stats.packets_sent = 10;
+    stats.bytes_sent = 14000;
+    stats.retransmits[RTP_RTX_TIMEOUT] = 1;
+    stats.retransmits[RTP_RTX_FAST] = 2;
+    stats.retransmits[RTP_RTX_SACK] = 4;
+    stats.rtt.record(500);
+    stats.rtt.record(700);
+    for (int i = 0; i < RTP_STATS_CC_SAMPLES + 3; i++) {
+        stats.sample_cc(i, 64, true);
+    }
+    stats.sample_cc(1, 1);  // within RTP_STATS_CC_INTERVAL_US of the last, skipped
+    std::string json = stats.to_json();
+    ASSERT_TRUE(json_balanced(json)) << json;
+    ASSERT_EQ(json.front(), '{');
+    const char* keys[] = {"packets_sent", "bytes_sent", "packets_received", "bytes_received",
+                          "checksum_failures", "data_packets_sent", "retransmits", "dup_acks",
+                          "timeouts", "acks_sent", "duplicate_data", "rtt", "ack_delay", "cc"};
+    size_t last = 0;
+    for (const char* key : keys) {
+        size_t pos = json.find(std::string("\"") + key + "\":");
+        ASSERT_NE(pos, std::string::npos) << key;
+        ASSERT_GE(pos, last) << key;
+        last = pos;
+    }
+    ASSERT_EQ(json_field(json, "packets_sent"), "10");
+    ASSERT_EQ(json_field(json, "retransmits"), "{\"total\":7,\"timeout\":1,\"fast\":2,\"sack\":4}");
+    std::string rtt = json_field(json, "rtt");
+    ASSERT_EQ(json_field(rtt, "count"), "2");
+    ASSERT_EQ(json_field(rtt, "mean_us"), "600.0");
+    ASSERT_EQ(json_field(json_field(json, "ack_delay"), "count"), "0");
+    // only the newest RTP_STATS_CC_SAMPLES samples, oldest first
+    std::string cc = json_field(json, "cc");
+    int samples = 0;
+    for (char c : cc) samples += c == '[';
+    ASSERT_EQ(samples, RTP_STATS_CC_SAMPLES + 1);
+    ASSERT_NE(cc.find(",3.0,64.0]"), std::string::npos);
+    ASSERT_EQ(cc.find(",2.0,64.0]"), std::string::npos);
+    std::string newest = ",1026.0,64.0]]";
+    ASSERT_EQ(cc.substr(cc.size() - newest.size()), newest);
+}
+
+/* ------------------------------- trace tests ------------------------------- */
+#define TRACE_FILE BINARY_DIR "/trace_test.bin"
+// trace_write directly rather than TRACE_*, which a higher TL compiles out
+
+// runs tracedump on path and returns what it printed
+static std::string tracedump(const char* flags, const char* path) {
+    std::string cmd = std::string(BINARY_DIR "/tracedump ") + flags + " " + path + " 2>&1";
+    FILE* fp = popen(cmd.c_str(), "r");
+    if (fp == nullptr) return "";
+    std::string out;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) out.append(buf, n);
+    pclose(fp);
+    return out;
+}
+
+TEST(TRACE, ROUND_TRIP) {
+    trace_enabled = true;
+    int64_t seq = -3;
+    uint32_t wnd = 4000000000u;
+    uint8_t small = 200;
+    short neg = -2;
+    trace_write(TRACE_LEVEL_EVENT, "trace_test: event %ld wnd %u\n", seq, wnd);
+    trace_write(TRACE_LEVEL_PACKET, "trace_test: packet %d/%hhu/%hd rtt %.3f ms %x\n", 42, small, neg, 1.25, 0xbeefu);
+    trace_write(TRACE_LEVEL_PACKET, "trace_test: no args 100%%\n");
+    uint32_t other_tid = 0;
+    std::thread other([&] {
+        trace_write(TRACE_LEVEL_EVENT, "trace_test: from another thread %lu\n", (uint64_t)1 << 40);
+        other_tid = trace_ring->tid;
+    });
+    other.join();
+    trace_enabled = false;
+    trace_write(TRACE_LEVEL_EVENT, "trace_test: not recorded\n");
+    ASSERT_EQ(trace_dump(TRACE_FILE), 0);
+
+    std::string out = tracedump("", TRACE_FILE);
+    EXPECT_NE(out.find("trace_test: event -3 wnd 4000000000\n"), std::string::npos) << out;
+    EXPECT_NE(out.find("trace_test: packet 42/200/-2 rtt 1.250 ms beef\n"), std::string::npos) << out;
+    EXPECT_NE(out.find("trace_test: no args 100%\n"), std::string::npos) << out;
+    std::string tid = std::to_string(other_tid);
+    EXPECT_NE(out.find(" " + tid + " trace_test: from another thread 1099511627776\n"), std::string::npos) << out;
+    EXPECT_NE(out.find("# thread " + tid + ": 1 records, 0 older ones overwritten\n"), std::string::npos) << out;
+    EXPECT_EQ(out.find("not recorded"), std::string::npos);
+    // records come out in time order
+    EXPECT_LT(out.find("trace_test: event"), out.find("trace_test: packet"));
+    EXPECT_LT(out.find("trace_test: no args"), out.find("trace_test: from another thread"));
+
+    // -e drops the per-packet records
+    out = tracedump("-e", TRACE_FILE);
+    EXPECT_NE(out.find("trace_test: event -3"), std::string::npos) << out;
+    EXPECT_NE(out.find("trace_test: from another thread"), std::string::npos) << out;
+    EXPECT_EQ(out.find("trace_test: packet"), std::string::npos) << out;
+    unlink(TRACE_FILE);
+}
+
+TEST(TRACE, OVERWRITE) {
+    // a full ring keeps the newest RTP_TRACE_RECORDS records
+    trace_enabled = true;
+    uint32_t tid = 0;
+    std::thread writer([&] {
+        for (int i = 0; i < RTP_TRACE_RECORDS + 10; i++) {
+            trace_write(TRACE_LEVEL_PACKET, "trace_test: record %d\n", i);
+        }
+        tid = trace_ring->tid;
+    });
+    writer.join();
+    trace_enabled = false;
+    ASSERT_EQ(trace_dump(TRACE_FILE), 0);
+    std::string out = tracedump("", TRACE_FILE);
+    std::string header = "# thread " + std::to_string(tid) + ": " + std::to_string(RTP_TRACE_RECORDS) +
+                         " records, 10 older ones overwritten\n";
+    EXPECT_NE(out.find(header), std::string::npos);
+    EXPECT_EQ(out.find("trace_test: record 9\n"), std::string::npos);
+    EXPECT_NE(out.find("trace_test: record 10\n"), std::string::npos);
+    EXPECT_NE(out.find("trace_test: record " + std::to_string(RTP_TRACE_RECORDS + 9) + "\n"), std::string::npos);
+    unlink(TRACE_FILE);
+}
+
+TEST(TRACE, BAD_FILE) {
+    FILE* fp = fopen(TRACE_FILE, "wb");
+    ASSERT_NE(fp, nullptr);
+    fputs("not a trace", fp);
+    fclose(fp);
+    EXPECT_NE(tracedump("", TRACE_FILE).find("is not a trace file"), std::string::npos);
+    // cut a real trace short
+    trace_enabled = true;
+    trace_write(TRACE_LEVEL_EVENT, "trace_test: truncated\n");
+    trace_enabled = false;
+    ASSERT_EQ(trace_dump(TRACE_FILE), 0);
+    struct stat st;
+    ASSERT_EQ(stat(TRACE_FILE, &st), 0);
+    ASSERT_EQ(truncate(TRACE_FILE, st.st_size - 1), 0);
+    EXPECT_NE(tracedump("", TRACE_FILE).find("truncated trace file"), std::string::npos);
+    unlink(TRACE_FILE);
+}
@@ -0,0 +1,113 @@
+#include "trace.h"
+#include <mutex>
+#include <set>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/syscall.h>
+using namespace std;
+
+atomic<bool> trace_enabled{false};
+thread_local TraceRing *trace_ring = nullptr;
+
+static mutex trace_lock;                // 只在创建缓冲区和导出时用
+static vector<TraceRing *> trace_rings; // 线程退出后缓冲区还留着，导出时要用
+static const char *trace_path = nullptr;
+
+static void trace_exit()
+{
+    if (trace_dump(trace_path) == -1)
+    {
+        fprintf(stderr, "failed to write trace to %s\n", trace_path);
+    }
+}
+
+static bool trace_init()
+{
+    const char *path = getenv(RTP_TRACE_ENV);
+    if (path == nullptr || path[0] == '\0')
+    {
+        return false;
+    }
+    trace_path = path;
+    atexit(trace_exit); // LOG_FATAL用exit退出，也会导出
+    trace_enabled.store(true, memory_order_relaxed);
+    return true;
+}
+
+static bool trace_initialized = trace_init();
+
+TraceRing *trace_attach()
+{
+    TraceRing *ring = new (nothrow) TraceRing;
+    if (ring == nullptr)
+    {
+        return nullptr;
+    }
+    ring->tid = syscall(SYS_gettid);
+    lock_guard<mutex> guard(trace_lock);
+    trace_rings.push_back(ring);
+    trace_ring = ring;
+    return ring;
+}
+
+/* 文件格式（本机字节序）：
+ * RTP_TRACE_MAGIC
+ * uint32 格式串个数，每个格式串：uint64 地址，uint32 长度，内容
+ * uint32 线程个数，每个线程：uint32 tid，uint64 写过的记录总数，uint64 保存的记录数，TraceRecord... */
+int trace_dump(const char *path)
+{
+    lock_guard<mutex> guard(trace_lock);
+    vector<vector<TraceRecord>> copies(trace_rings.size());
+    vector<uint64_t> heads(trace_rings.size());
+    set<uint64_t> fmts;
+    for (size_t i = 0; i < trace_rings.size(); i++)
+    {
+        TraceRing *ring = trace_rings[i];
+        uint64_t head = ring->head.load(memory_order_acquire);
+        uint64_t first = head > RTP_TRACE_RECORDS ? head - RTP_TRACE_RECORDS : 0;
+        // 线程还在写时，最旧的那些记录可能在拷贝期间被覆盖：拷贝前后各读一次stamp，和序号对不上就丢掉
+        for (uint64_t seq = first; seq < head; seq++)
+        {
+            TraceRecord &slot = ring->records[seq & (RTP_TRACE_RECORDS - 1)];
+            uint32_t stamp = __atomic_load_n(&slot.stamp, __ATOMIC_ACQUIRE);
+            TraceRecord copy = slot;
+            atomic_thread_fence(memory_order_acquire);
+            if (stamp == trace_stamp(seq) && __atomic_load_n(&slot.stamp, __ATOMIC_RELAXED) == stamp)
+            {
+                copies[i].push_back(copy);
+            }
+        }
+        heads[i] = head;
+        for (const TraceRecord &record : copies[i])
+        {
+            fmts.insert(record.fmt);
+        }
+    }
+    FILE *fp = fopen(path, "wb");
+    if (fp == nullptr)
+    {
+        return -1;
+    }
+    bool ok = fwrite(RTP_TRACE_MAGIC, 1, 8, fp) == 8;
+    uint32_t n = fmts.size();
+    ok = ok && fwrite(&n, sizeof(n), 1, fp) == 1;
+    for (uint64_t fmt : fmts)
+    {
+        const char *str = (const char *)(uintptr_t)fmt; // 字符串字面量，一直有效
+        uint32_t len = strlen(str);
+        ok = ok && fwrite(&fmt, sizeof(fmt), 1, fp) == 1 && fwrite(&len, sizeof(len), 1, fp) == 1 &&
+             fwrite(str, 1, len, fp) == len;
+    }
+    n = copies.size();
+    ok = ok && fwrite(&n, sizeof(n), 1, fp) == 1;
+    for (size_t i = 0; i < copies.size(); i++)
+    {
+        uint64_t count = copies[i].size();
+        ok = ok && fwrite(&trace_rings[i]->tid, sizeof(uint32_t), 1, fp) == 1 &&
+             fwrite(&heads[i], sizeof(uint64_t), 1, fp) == 1 && fwrite(&count, sizeof(count), 1, fp) == 1 &&
+             fwrite(copies[i].data(), sizeof(TraceRecord), count, fp) == count;
+    }
+    ok = fclose(fp) == 0 && ok;
+    return ok ? 0 : -1;
+}
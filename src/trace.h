@@ -0,0 +1,138 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+
+#define TRACE_LEVEL_PACKET 0  // 每个包都记录
+#define TRACE_LEVEL_EVENT 1   // 只记录连接、传输级别的事件（开始、结束、超时、快速恢复）
+#define TRACE_LEVEL_NONE 2    // 全部编译掉
+
+// 编译时的过滤级别，在CMakeLists.txt里设置，低于它的TRACE_*不会生成任何代码
+#ifndef RTP_TRACE_LEVEL
+#define RTP_TRACE_LEVEL TRACE_LEVEL_PACKET
+#endif
+
+#define RTP_TRACE_RECORDS (1 << 16)          // 每个线程的环形缓冲区里的记录数，必须是2的幂，写满后覆盖最旧的
+#define RTP_TRACE_ARGS 5                     // 每条记录最多的参数个数
+#define RTP_TRACE_ENV "RTP_TRACE"            // 设置了这个环境变量时才记录，值为退出时写入的文件名
+#define RTP_TRACE_MAGIC "RTPTRC02"
+
+/* 一条记录，64字节。只保存格式串的地址和参数的原始值，格式化留给tracedump离线做 */
+struct TraceRecord
+{
+    uint64_t ns;                     // steady_clock的时间
+    uint64_t fmt;                    // 格式串（字符串字面量）的地址
+    uint64_t args[RTP_TRACE_ARGS];   // 整数按64位符号扩展或零扩展，浮点数按double的位
+    uint16_t nargs;
+    uint16_t level;
+    uint32_t stamp;                  // 记录序号加一的低32位，最后写；正在写时为0。导出时靠它认出拷贝期间被覆盖的记录
+};
+static_assert(sizeof(TraceRecord) == 64, "trace record must stay one cache line");
+
+/* 序号为seq的记录写完后stamp应有的值 */
+inline uint32_t trace_stamp(uint64_t seq)
+{
+    uint32_t stamp = (uint32_t)(seq + 1);
+    return stamp != 0 ? stamp : 1;
+}
+
+/* 一个线程的环形缓冲区，只有这个线程写，导出时别的线程读 */
+struct TraceRing
+{
+    TraceRecord records[RTP_TRACE_RECORDS];
+    std::atomic<uint64_t> head{0}; // 写过的记录总数，写完一条后才加一
+    uint32_t tid;                  // 线程的tid
+};
+
+extern std::atomic<bool> trace_enabled;   // 启动时根据RTP_TRACE_ENV设置
+extern thread_local TraceRing *trace_ring; // 当前线程的缓冲区，第一次记录时创建
+
+TraceRing *trace_attach();                 // 为当前线程创建缓冲区，失败返回nullptr
+int trace_dump(const char *path);          // 把所有线程的记录写进path，成功返回0，失败返回-1
+
+template <typename T>
+inline uint64_t trace_arg(T value)
+{
+    static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value,
+                  "trace arguments must be numbers, strings are not kept until the trace is formatted");
+    if constexpr (std::is_floating_point<T>::value)
+    {
+        double d = value;
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        return bits;
+    }
+    else if constexpr (std::is_enum<T>::value)
+    {
+        return (uint64_t)(int64_t)value;
+    }
+    else if constexpr (std::is_signed<T>::value)
+    {
+        return (uint64_t)(int64_t)value;
+    }
+    else
+    {
+        return (uint64_t)value;
+    }
+}
+
+/* 无锁：写自己线程的缓冲区，用release发布head，不格式化、不做系统调用 */
+template <typename... Args>
+inline void trace_write(uint32_t level, const char *fmt, Args... args)
+{
+    static_assert(sizeof...(Args) <= RTP_TRACE_ARGS, "too many trace arguments");
+    if (!trace_enabled.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    TraceRing *ring = trace_ring != nullptr ? trace_ring : trace_attach();
+    if (ring == nullptr)
+    {
+        return;
+    }
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceRecord &record = ring->records[head & (RTP_TRACE_RECORDS - 1)];
+    // 先作废旧的stamp，导出线程拷贝到一半写的记录时两次读到的stamp对不上
+    __atomic_store_n(&record.stamp, 0, __ATOMIC_RELAXED);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    record.fmt = (uint64_t)(uintptr_t)fmt;
+    uint64_t values[] = {trace_arg(args)..., 0};
+    memcpy(record.args, values, sizeof(uint64_t) * sizeof...(Args));
+    record.nargs = sizeof...(Args);
+    record.level = level;
+    __atomic_store_n(&record.stamp, trace_stamp(head), __ATOMIC_RELEASE);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+/* 用法和LOG_DEBUG一样，但格式串必须是字面量，参数只能是数，不能用%s
+ * if (false) printf让编译器照常检查格式串和参数 */
+#if RTP_TRACE_LEVEL <= TRACE_LEVEL_PACKET
+#define TRACE_PKT(...)                                   \
+    do {                                                 \
+        if (false)                                       \
+            printf(__VA_ARGS__);                         \
+        trace_write(TRACE_LEVEL_PACKET, __VA_ARGS__);    \
+    } while (0)
+#else
+#define TRACE_PKT(...) do {} while (0)
+#endif
+
+#if RTP_TRACE_LEVEL <= TRACE_LEVEL_EVENT
+#define TRACE_EVT(...)                                   \
+    do {                                                 \
+        if (false)                                       \
+            printf(__VA_ARGS__);                         \
+        trace_write(TRACE_LEVEL_EVENT, __VA_ARGS__);     \
+    } while (0)
+#else
+#define TRACE_EVT(...) do {} while (0)
+#endif
+
+#endif // __TRACE_H
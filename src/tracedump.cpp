@@ -0,0 +1,195 @@
+#include "trace.h"
+#include "util.h"
+#include <algorithm>
+#include <getopt.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define TRACEDUMP_USAGE "Usage: ./tracedump [-e] [trace file]\n" \
+                        "       (-e: only connection and transfer events, skip per-packet records)\n"
+
+/* 带上tid，所有线程的记录合在一起按时间排序 */
+struct TraceEntry
+{
+    uint32_t tid;
+    TraceRecord record;
+};
+
+static bool read_exact(FILE *fp, void *buf, size_t len)
+{
+    return len == 0 || fread(buf, 1, len, fp) == len;
+}
+
+/* 用记录里的参数展开格式串。参数已经统一成64位，按转换说明和长度修饰符还原成原来的类型再交给snprintf */
+static std::string format_record(const std::string &fmt, const TraceRecord &record)
+{
+    std::string out;
+    char buf[256];
+    uint32_t arg = 0;
+    for (size_t i = 0; i < fmt.size(); i++)
+    {
+        if (fmt[i] != '%')
+        {
+            out += fmt[i];
+            continue;
+        }
+        if (i + 1 < fmt.size() && fmt[i + 1] == '%')
+        {
+            out += '%';
+            i++;
+            continue;
+        }
+        // %[flags][width][.precision][length]conversion
+        std::string spec = "%";
+        size_t j = i + 1;
+        while (j < fmt.size() && strchr("-+ #0123456789.", fmt[j]) != nullptr)
+        {
+            spec += fmt[j++];
+        }
+        std::string length;
+        while (j < fmt.size() && strchr("hlLqjzt", fmt[j]) != nullptr)
+        {
+            length += fmt[j++];
+        }
+        if (j >= fmt.size())
+        {
+            out += fmt.substr(i);
+            break;
+        }
+        char conv = fmt[j];
+        i = j;
+        if (arg >= record.nargs)
+        {
+            out += "<missing>";
+            continue;
+        }
+        uint64_t value = record.args[arg++];
+        bool wide = !length.empty() && length[0] != 'h'; // l、ll、j、z、t都是64位
+        if (conv == 'd' || conv == 'i')
+        {
+            int64_t v = wide ? (int64_t)value : length == "hh" ? (signed char)value : length == "h" ? (short)value : (int)value;
+            snprintf(buf, sizeof(buf), (spec + "lld").c_str(), (long long)v);
+        }
+        else if (conv == 'u' || conv == 'x' || conv == 'X' || conv == 'o')
+        {
+            uint64_t v = wide ? value : length == "hh" ? (unsigned char)value : length == "h" ? (unsigned short)value : (unsigned int)value;
+            snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(), (unsigned long long)v);
+        }
+        else if (conv == 'c')
+        {
+            snprintf(buf, sizeof(buf), (spec + "c").c_str(), (int)value);
+        }
+        else if (strchr("fFeEgGaA", conv) != nullptr)
+        {
+            double v;
+            memcpy(&v, &value, sizeof(v));
+            snprintf(buf, sizeof(buf), (spec + conv).c_str(), v);
+        }
+        else
+        {
+            snprintf(buf, sizeof(buf), "<%%%c?>", conv);
+        }
+        out += buf;
+    }
+    // 原来的格式串大多以换行结尾，每条记录单独一行
+    while (!out.empty() && (out.back() == '\n' || out.back() == ' '))
+    {
+        out.pop_back();
+    }
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    bool events_only = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "e")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            events_only = true;
+            break;
+        default:
+            LOG_FATAL(TRACEDUMP_USAGE);
+        }
+    }
+    if (argc - optind != 1)
+    {
+        LOG_FATAL(TRACEDUMP_USAGE);
+    }
+    FILE *fp = fopen(argv[optind], "rb");
+    if (fp == nullptr)
+    {
+        LOG_FATAL("tracedump failed to open %s\n", argv[optind]);
+    }
+    char magic[8];
+    if (!read_exact(fp, magic, sizeof(magic)) || memcmp(magic, RTP_TRACE_MAGIC, sizeof(magic)) != 0)
+    {
+        LOG_FATAL("tracedump %s is not a trace file\n", argv[optind]);
+    }
+    std::map<uint64_t, std::string> fmts;
+    uint32_t n;
+    if (!read_exact(fp, &n, sizeof(n)))
+    {
+        LOG_FATAL("tracedump truncated trace file\n");
+    }
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint64_t key;
+        uint32_t len;
+        if (!read_exact(fp, &key, sizeof(key)) || !read_exact(fp, &len, sizeof(len)))
+        {
+            LOG_FATAL("tracedump truncated trace file\n");
+        }
+        std::string str(len, '\0');
+        if (!read_exact(fp, &str[0], len))
+        {
+            LOG_FATAL("tracedump truncated trace file\n");
+        }
+        fmts[key] = str;
+    }
+    std::vector<TraceEntry> entries;
+    if (!read_exact(fp, &n, sizeof(n)))
+    {
+        LOG_FATAL("tracedump truncated trace file\n");
+    }
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t tid;
+        uint64_t written, count;
+        if (!read_exact(fp, &tid, sizeof(tid)) || !read_exact(fp, &written, sizeof(written)) ||
+            !read_exact(fp, &count, sizeof(count)))
+        {
+            LOG_FATAL("tracedump truncated trace file\n");
+        }
+        printf("# thread %u: %lu records, %lu older ones overwritten\n", tid, count, written - count);
+        for (uint64_t k = 0; k < count; k++)
+        {
+            TraceEntry entry;
+            entry.tid = tid;
+            if (!read_exact(fp, &entry.record, sizeof(entry.record)))
+            {
+                LOG_FATAL("tracedump truncated trace file\n");
+            }
+            if (events_only && entry.record.level < TRACE_LEVEL_EVENT)
+            {
+                continue;
+            }
+            entries.push_back(entry);
+        }
+    }
+    fclose(fp);
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const TraceEntry &a, const TraceEntry &b) { return a.record.ns < b.record.ns; });
+    uint64_t start = entries.empty() ? 0 : entries[0].record.ns;
+    for (const TraceEntry &entry : entries)
+    {
+        auto it = fmts.find(entry.record.fmt);
+        std::string line = it == fmts.end() ? "<unknown format>" : format_record(it->second, entry.record);
+        // 相对第一条记录的时间(秒)、线程、内容
+        printf("%12.6f %7u %s\n", (entry.record.ns - start) / 1e9, entry.tid, line.c_str());
+    }
+    return 0;
+}